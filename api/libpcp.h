@@ -67,6 +67,8 @@ struct pcp_mapping_s
     u_int32_t end_of_life;      // call time (NULL) + lifetime at start and update
     u_int8_t opcode;            // MAP or PEER opcode
     u_int8_t protocol;
+    struct in6_addr remote_peer_ip;     // PEER mappings only
+    u_int16_t remote_peer_port;         // PEER mappings only
 };
 
 typedef struct pcp_mapping_s *pcp_mapping;
@@ -87,6 +89,10 @@ struct in6_addr apteryx_get_ipv6_addr (const char *path, const char *key);
 
 int next_mapping_id (void);
 
+bool mapping_id_high_water_set (int index);
+
+int mapping_id_high_water_get (void);
+
 bool // TODO: Decide if bool or enum of error types
 pcp_mapping_add (int index,
                  u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
@@ -98,6 +104,20 @@ pcp_mapping_add (int index,
                  u_int8_t opcode,
                  u_int8_t protocol);
 
+bool
+pcp_mapping_add_peer (int index,
+                      u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                      struct in6_addr *internal_ip,
+                      u_int16_t internal_port,
+                      struct in6_addr *external_ip,
+                      u_int16_t external_port,
+                      struct in6_addr *remote_peer_ip,
+                      u_int16_t remote_peer_port,
+                      u_int32_t lifetime,
+                      u_int8_t protocol);
+
+bool pcp_mapping_add_bulk (GList *mappings);
+
 bool pcp_mapping_refresh_lifetime (int index, u_int32_t new_lifetime, u_int32_t new_end_of_life);
 
 bool pcp_mapping_delete (int index);
@@ -108,6 +128,15 @@ pcp_mapping pcp_mapping_find (int mapping_id);
 
 GList *pcp_mapping_getall (void);
 
+/* Called for each mapping by the iterators. Return false to stop. */
+typedef bool (*pcp_mapping_func) (pcp_mapping mapping, void *data);
+
+int pcp_mapping_foreach (pcp_mapping_func func, void *data);
+
+GList *pcp_mapping_indexes (int start_index);
+
+GList *pcp_mapping_foreach_page (GList *indexes, int count, pcp_mapping_func func, void *data);
+
 u_int32_t pcp_mapping_remaining_lifetime_get (pcp_mapping mapping);
 
 void pcp_mapping_destroy (pcp_mapping mapping);
@@ -216,6 +245,21 @@ typedef struct _pcp_callbacks
                              u_int8_t opcode,
                              u_int8_t protocol);
 
+    /** New PEER mapping has been added. PEER mappings are passed to
+     *  new_pcp_mapping instead when this is not set. */
+    void (*new_pcp_peer_mapping) (int index,
+                                  u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                                  struct in6_addr internal_ip,
+                                  u_int16_t internal_port,
+                                  struct in6_addr external_ip,
+                                  u_int16_t external_port,
+                                  struct in6_addr remote_peer_ip,
+                                  u_int16_t remote_peer_port,
+                                  u_int32_t lifetime,
+                                  u_int32_t start_of_life,
+                                  u_int32_t end_of_life,
+                                  u_int8_t protocol);
+
     /** A mapping has been deleted */
     void (*delete_pcp_mapping) (int index);
 } pcp_callbacks;
@@ -59,6 +59,8 @@
 #define END_OF_LIFE_KEY "end_of_life"
 #define OPCODE_KEY "opcode"
 #define PROTOCOL_KEY "protocol"
+#define REMOTE_PEER_IP_KEY "remote_peer_ip"
+#define REMOTE_PEER_PORT_KEY "remote_peer_port"
 
 /* config keys */
 #define CONFIG_PATH ROOT_PATH "/config"
@@ -74,6 +76,10 @@
 #define PREFER_FAILURE_REQ_RATE_LIMIT_KEY "prefer_failure_req_rate_limit"
 #define STARTUP_EPOCH_TIME_KEY "startup_epoch_time"
 
+/* state keys */
+#define STATE_PATH ROOT_PATH "/state"
+#define MAPPING_ID_HIGH_WATER_KEY "mapping_id_high_water"
+
 static pcp_callbacks *saved_cbs = NULL;
 static pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -183,10 +189,189 @@ next_highest_id (const char *path)
     return index;
 }
 
+/**
+ * @brief next_mapping_id - Get an unused mapping ID by scanning every mapping.
+ *          IDs at or below the saved high-water mark are skipped as pcpd may
+ *          have handed them out already.
+ * @return - The ID or -1 if none are available
+ */
 int
 next_mapping_id (void)
 {
-    return next_highest_id (MAPPING_PATH "/");
+    int index = next_highest_id (MAPPING_PATH "/");
+    int high_water = mapping_id_high_water_get ();
+
+    if (index >= 0 && index <= high_water)
+    {
+        index = high_water < MAXIMUM_MAPPING_ID - 10 ? high_water + 10 : -1;
+    }
+    return index;
+}
+
+/**
+ * @brief mapping_id_high_water_set - Save the highest mapping ID pcpd may have
+ *          handed out, so it is not reused by a restarted pcpd or other writers
+ * @param index - The high-water mark
+ * @return - True on success
+ */
+bool
+mapping_id_high_water_set (int index)
+{
+    return apteryx_set_int (STATE_PATH, MAPPING_ID_HIGH_WATER_KEY, index);
+}
+
+/**
+ * @brief mapping_id_high_water_get - Get the saved mapping ID high-water mark
+ * @return - The high-water mark or 0 if none has been saved
+ */
+int
+mapping_id_high_water_get (void)
+{
+    int index = apteryx_get_int (STATE_PATH, MAPPING_ID_HIGH_WATER_KEY);
+
+    return index > 0 ? index : 0;
+}
+
+/**
+ * @brief mapping_exists - Check if a mapping index is in use without reading
+ *          all of its fields
+ * @param index - Index of the mapping
+ * @return - True if the mapping exists
+ */
+static bool
+mapping_exists (int index)
+{
+    char *path = NULL;
+    char *value = NULL;
+
+    if (asprintf (&path, MAPPING_PATH "/%d", index) <= 0)
+    {
+        return false;
+    }
+    value = apteryx_get (path);
+    free (path);
+    if (value)
+    {
+        free (value);
+        return true;
+    }
+    return false;
+}
+
+/* Add an integer field to a mapping node */
+static void
+tree_add_int (GNode *node, const char *key, int32_t value)
+{
+    APTERYX_LEAF (node, strdup (key), g_strdup_printf ("%d", value));
+}
+
+/* Add an IPv6 address field to a mapping node */
+static void
+tree_add_ipv6_addr (GNode *node, const char *key, struct in6_addr *value)
+{
+    char addr_string[INET6_ADDRSTRLEN];
+
+    inet_ntop (AF_INET6, value->s6_addr, addr_string, INET6_ADDRSTRLEN);
+    APTERYX_LEAF (node, strdup (key), strdup (addr_string));
+}
+
+/**
+ * @brief mapping_to_tree - Add the fields of a mapping under a tree rooted at
+ *          MAPPING_PATH, so they can all be written in one transaction
+ * @param root - The root node
+ * @param mapping - The mapping
+ */
+static void
+mapping_to_tree (GNode *root, pcp_mapping mapping)
+{
+    GNode *node = APTERYX_NODE (root, g_strdup_printf ("%d", mapping->index));
+
+    tree_add_int (node, INDEX_KEY, mapping->index);
+    tree_add_int (node, MAPPING_NONCE_1_KEY, mapping->mapping_nonce[0]);
+    tree_add_int (node, MAPPING_NONCE_2_KEY, mapping->mapping_nonce[1]);
+    tree_add_int (node, MAPPING_NONCE_3_KEY, mapping->mapping_nonce[2]);
+    tree_add_ipv6_addr (node, INTERNAL_IP_KEY, &mapping->internal_ip);
+    tree_add_int (node, INTERNAL_PORT_KEY, mapping->internal_port);
+    tree_add_ipv6_addr (node, EXTERNAL_IP_KEY, &mapping->external_ip);
+    tree_add_int (node, EXTERNAL_PORT_KEY, mapping->external_port);
+    tree_add_int (node, LIFETIME_KEY, mapping->lifetime);
+    tree_add_int (node, START_OF_LIFE_KEY, mapping->start_of_life);
+    tree_add_int (node, END_OF_LIFE_KEY, mapping->end_of_life);
+    tree_add_int (node, OPCODE_KEY, mapping->opcode);
+    tree_add_int (node, PROTOCOL_KEY, mapping->protocol);
+    if (mapping->opcode == PEER_OPCODE)
+    {
+        tree_add_ipv6_addr (node, REMOTE_PEER_IP_KEY, &mapping->remote_peer_ip);
+        tree_add_int (node, REMOTE_PEER_PORT_KEY, mapping->remote_peer_port);
+    }
+}
+
+/**
+ * @brief mappings_commit - Write the fields of the mappings in one transaction,
+ *          then mark each mapping as present in a second. The watch is on the
+ *          marker, so it fires once per mapping after all its fields are stored.
+ * @param mappings - List of pcp_mapping
+ * @return - True on success
+ */
+static bool
+mappings_commit (GList *mappings)
+{
+    GNode *fields = g_node_new (strdup (MAPPING_PATH));
+    GNode *markers = g_node_new (strdup (MAPPING_PATH));
+    GList *iter;
+    pcp_mapping mapping;
+    bool ret;
+
+    for (iter = mappings; iter; iter = g_list_next (iter))
+    {
+        mapping = (pcp_mapping) iter->data;
+        mapping_to_tree (fields, mapping);
+        APTERYX_LEAF (markers, g_strdup_printf ("%d", mapping->index), strdup ("-"));
+    }
+
+    ret = apteryx_set_tree (fields) && apteryx_set_tree (markers);
+
+    apteryx_free_tree (fields);
+    apteryx_free_tree (markers);
+    return ret;
+}
+
+/**
+ * @brief mapping_add - Store a mapping. The start and end of life are set from
+ *          its lifetime.
+ * @param mapping - The mapping. An index of -1 means use the next free ID.
+ * @return - True on success
+ */
+static bool
+mapping_add (pcp_mapping mapping)
+{
+    GList *mappings;
+    bool ret;
+
+    if (mapping->index == -1)
+    {
+        mapping->index = next_mapping_id ();
+        if (mapping->index < 0)
+        {
+            return false;   // Invalid index
+        }
+    }
+
+    /* Make sure the specified mapping index is not in use */
+    if (mapping_exists (mapping->index))
+    {
+        /* already exists */
+        return false;
+    }
+
+    mapping->start_of_life = time (NULL);
+    mapping->end_of_life = mapping->start_of_life + mapping->lifetime;
+
+    mappings = g_list_prepend (NULL, mapping);
+    ret = mappings_commit (mappings);
+    g_list_free (mappings);
+
+    return ret;
 }
 
 bool // TODO: Decide if bool or enum of error types
@@ -200,51 +385,120 @@ pcp_mapping_add (int index,
                  u_int8_t opcode,
                  u_int8_t protocol)
 {
-    char *path = NULL;
+    struct pcp_mapping_s mapping;
 
     /* TODO: Verify valid arguments */
 
-    if (index == -1)
+    memset (&mapping, 0, sizeof (mapping));
+    mapping.index = index;
+    memcpy (mapping.mapping_nonce, mapping_nonce, sizeof (mapping.mapping_nonce));
+    mapping.internal_ip = *internal_ip;
+    mapping.internal_port = internal_port;
+    mapping.external_ip = *external_ip;
+    mapping.external_port = external_port;
+    mapping.lifetime = lifetime;
+    mapping.opcode = opcode;
+    mapping.protocol = protocol;
+
+    return mapping_add (&mapping);
+}
+
+/**
+ * @brief pcp_mapping_add_peer - Add a mapping created by a PEER request
+ * @param index - Index of the mapping, or -1 to use the next free ID
+ * @param mapping_nonce - Mapping nonce of the request
+ * @param internal_ip - Internal IP address
+ * @param internal_port - Internal port
+ * @param external_ip - Assigned external IP address
+ * @param external_port - Assigned external port
+ * @param remote_peer_ip - IP address of the remote peer
+ * @param remote_peer_port - Port of the remote peer
+ * @param lifetime - Assigned lifetime
+ * @param protocol - Protocol
+ * @return - True on success
+ */
+bool
+pcp_mapping_add_peer (int index,
+                      u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                      struct in6_addr *internal_ip,
+                      u_int16_t internal_port,
+                      struct in6_addr *external_ip,
+                      u_int16_t external_port,
+                      struct in6_addr *remote_peer_ip,
+                      u_int16_t remote_peer_port,
+                      u_int32_t lifetime,
+                      u_int8_t protocol)
+{
+    struct pcp_mapping_s mapping;
+
+    memset (&mapping, 0, sizeof (mapping));
+    mapping.index = index;
+    memcpy (mapping.mapping_nonce, mapping_nonce, sizeof (mapping.mapping_nonce));
+    mapping.internal_ip = *internal_ip;
+    mapping.internal_port = internal_port;
+    mapping.external_ip = *external_ip;
+    mapping.external_port = external_port;
+    mapping.remote_peer_ip = *remote_peer_ip;
+    mapping.remote_peer_port = remote_peer_port;
+    mapping.lifetime = lifetime;
+    mapping.opcode = PEER_OPCODE;
+    mapping.protocol = protocol;
+
+    return mapping_add (&mapping);
+}
+
+/**
+ * @brief pcp_mapping_add_bulk - Add many mappings in two Apteryx transactions.
+ *          The start and end of life of each mapping are set from its lifetime.
+ * @param mappings - List of pcp_mapping, each with a unique index
+ * @return - True on success. False without adding anything if an index is
+ *          invalid or already in use.
+ */
+bool
+pcp_mapping_add_bulk (GList *mappings)
+{
+    GHashTable *existing;
+    GList *paths;
+    GList *iter;
+    pcp_mapping mapping;
+    char *tmp;
+    u_int32_t now = time (NULL);
+    bool ret = true;
+
+    if (mappings == NULL)
     {
-        index = next_mapping_id ();
-        if (index < 0)
-        {
-            return false;   // Invalid index
-        }
+        return true;
     }
 
-    /* Make sure the specified mapping index is not in use */
-    pcp_mapping mapping = pcp_mapping_find (index);
-    if (mapping)
+    /* Collect the indexes in use with one search */
+    existing = g_hash_table_new (g_direct_hash, g_direct_equal);
+    paths = apteryx_search (MAPPING_PATH "/");
+    for (iter = paths; iter; iter = g_list_next (iter))
     {
-        /* already exists */
-        pcp_mapping_destroy (mapping);
-        return false;
+        tmp = strrchr ((char *) iter->data, '/');
+        if (tmp)
+        {
+            g_hash_table_add (existing, GINT_TO_POINTER (atoi (tmp + 1)));
+        }
     }
+    g_list_free_full (paths, free);
 
-    if (asprintf (&path, MAPPING_PATH "/%d", index) == 0)
+    for (iter = mappings; iter; iter = g_list_next (iter))
     {
-        return false;       // Out of memory
+        mapping = (pcp_mapping) iter->data;
+        if (mapping->index < 0 || mapping->index > MAXIMUM_MAPPING_ID ||
+            g_hash_table_contains (existing, GINT_TO_POINTER (mapping->index)))
+        {
+            ret = false;
+            break;
+        }
+        g_hash_table_add (existing, GINT_TO_POINTER (mapping->index));
+        mapping->start_of_life = now;
+        mapping->end_of_life = now + mapping->lifetime;
     }
+    g_hash_table_destroy (existing);
 
-    apteryx_set_int (path, INDEX_KEY, index);
-    apteryx_set_int (path, MAPPING_NONCE_1_KEY, mapping_nonce[0]);
-    apteryx_set_int (path, MAPPING_NONCE_2_KEY, mapping_nonce[1]);
-    apteryx_set_int (path, MAPPING_NONCE_3_KEY, mapping_nonce[2]);
-    apteryx_set_ipv6_addr (path, INTERNAL_IP_KEY, *internal_ip);
-    apteryx_set_int (path, INTERNAL_PORT_KEY, internal_port);
-    apteryx_set_ipv6_addr (path, EXTERNAL_IP_KEY, *external_ip);
-    apteryx_set_int (path, EXTERNAL_PORT_KEY, external_port);
-    apteryx_set_int (path, LIFETIME_KEY, lifetime);
-    apteryx_set_int (path, START_OF_LIFE_KEY, time (NULL));
-    apteryx_set_int (path, END_OF_LIFE_KEY, time (NULL) + lifetime);
-    apteryx_set_int (path, OPCODE_KEY, opcode);
-    apteryx_set_int (path, PROTOCOL_KEY, protocol);
-    apteryx_set (path, "-");
-
-    free (path);
-
-    return true;            // Success
+    return ret && mappings_commit (mappings);
 }
 
 /**
@@ -259,6 +513,7 @@ bool
 pcp_mapping_refresh_lifetime (int index, u_int32_t new_lifetime, u_int32_t new_end_of_life)
 {
     char *path = NULL;
+    GNode *root;
     bool ret;
     u_int32_t expected = time (NULL) + new_lifetime;
 
@@ -272,21 +527,23 @@ pcp_mapping_refresh_lifetime (int index, u_int32_t new_lifetime, u_int32_t new_e
     }
 
     /* Make sure the mapping exists */
-    pcp_mapping mapping = pcp_mapping_find (index);
-    if (!mapping)
+    if (!mapping_exists (index))
     {
         return false;
     }
-    pcp_mapping_destroy (mapping);
 
-    if (asprintf (&path, MAPPING_PATH "/%d", index) == 0)
+    if (asprintf (&path, MAPPING_PATH "/%d", index) <= 0)
     {
         return false;       // Out of memory
     }
 
-    ret = apteryx_set_int (path, LIFETIME_KEY, new_lifetime) &&
-            apteryx_set_int (path, END_OF_LIFE_KEY, new_end_of_life);
-    free (path);
+    /* Both fields change in one transaction. The marker is rewritten after
+     * them, so the mapping watch reports the new lifetime. */
+    root = g_node_new (path);
+    tree_add_int (root, LIFETIME_KEY, new_lifetime);
+    tree_add_int (root, END_OF_LIFE_KEY, new_end_of_life);
+    ret = apteryx_set_tree (root) && apteryx_set (path, "-");
+    apteryx_free_tree (root);
     return ret;
 }
 
@@ -319,34 +576,98 @@ pcp_mapping_deleteall (void)
     return status;
 }
 
+/**
+ * @brief mapping_from_tree - Decode a mapping from the tree fetched for it
+ * @param node - Node named by the mapping index, with a child per field
+ * @param mapping - Mapping to fill in. The path is not set.
+ * @return - True if the node held a mapping
+ */
+static bool
+mapping_from_tree (GNode *node, pcp_mapping mapping)
+{
+    GNode *child;
+    const char *key;
+    const char *value;
+    bool found = false;
+
+    /* The root of a tree is named by its full path */
+    key = strrchr (APTERYX_NAME (node), '/');
+    key = key ? key + 1 : APTERYX_NAME (node);
+
+    memset (mapping, 0, sizeof (*mapping));
+    if (sscanf (key, "%d", &mapping->index) != 1)
+    {
+        return false;
+    }
+
+    for (child = node->children; child; child = child->next)
+    {
+        if (!APTERYX_HAS_VALUE (child))
+        {
+            continue;
+        }
+        key = APTERYX_NAME (child);
+        value = APTERYX_VALUE (child);
+
+        if (strcmp (key, INDEX_KEY) == 0)
+            found = true;
+        else if (strcmp (key, MAPPING_NONCE_1_KEY) == 0)
+            mapping->mapping_nonce[0] = strtol (value, NULL, 10);
+        else if (strcmp (key, MAPPING_NONCE_2_KEY) == 0)
+            mapping->mapping_nonce[1] = strtol (value, NULL, 10);
+        else if (strcmp (key, MAPPING_NONCE_3_KEY) == 0)
+            mapping->mapping_nonce[2] = strtol (value, NULL, 10);
+        else if (strcmp (key, INTERNAL_IP_KEY) == 0)
+            inet_pton (AF_INET6, value, &mapping->internal_ip.s6_addr);
+        else if (strcmp (key, INTERNAL_PORT_KEY) == 0)
+            mapping->internal_port = strtol (value, NULL, 10);
+        else if (strcmp (key, EXTERNAL_IP_KEY) == 0)
+            inet_pton (AF_INET6, value, &mapping->external_ip.s6_addr);
+        else if (strcmp (key, EXTERNAL_PORT_KEY) == 0)
+            mapping->external_port = strtol (value, NULL, 10);
+        else if (strcmp (key, LIFETIME_KEY) == 0)
+            mapping->lifetime = strtol (value, NULL, 10);
+        else if (strcmp (key, START_OF_LIFE_KEY) == 0)
+            mapping->start_of_life = strtol (value, NULL, 10);
+        else if (strcmp (key, END_OF_LIFE_KEY) == 0)
+            mapping->end_of_life = strtol (value, NULL, 10);
+        else if (strcmp (key, OPCODE_KEY) == 0)
+            mapping->opcode = strtol (value, NULL, 10);
+        else if (strcmp (key, PROTOCOL_KEY) == 0)
+            mapping->protocol = strtol (value, NULL, 10);
+        else if (strcmp (key, REMOTE_PEER_IP_KEY) == 0)
+            inet_pton (AF_INET6, value, &mapping->remote_peer_ip.s6_addr);
+        else if (strcmp (key, REMOTE_PEER_PORT_KEY) == 0)
+            mapping->remote_peer_port = strtol (value, NULL, 10);
+    }
+    return found;
+}
+
 pcp_mapping
 pcp_mapping_find (int mapping_id)
 {
-    char *tmp;
+    GNode *root;
     pcp_mapping mapping;
-    mapping = malloc (sizeof (*mapping));
+    char *path;
 
-    if (asprintf (&mapping->path, MAPPING_PATH "/%d", mapping_id) == 0 ||
-        (tmp = apteryx_get_string (mapping->path, NULL)) == NULL)
+    if (asprintf (&path, MAPPING_PATH "/%d", mapping_id) <= 0)
     {
-        pcp_mapping_destroy (mapping);
         return NULL;
     }
-    free (tmp);
 
-    mapping->index = mapping_id;
-    mapping->mapping_nonce[0] = apteryx_get_int (mapping->path, MAPPING_NONCE_1_KEY);
-    mapping->mapping_nonce[1] = apteryx_get_int (mapping->path, MAPPING_NONCE_2_KEY);
-    mapping->mapping_nonce[2] = apteryx_get_int (mapping->path, MAPPING_NONCE_3_KEY);
-    mapping->internal_ip = apteryx_get_ipv6_addr (mapping->path, INTERNAL_IP_KEY);
-    mapping->internal_port = apteryx_get_int (mapping->path, INTERNAL_PORT_KEY);
-    mapping->external_ip = apteryx_get_ipv6_addr (mapping->path, EXTERNAL_IP_KEY);
-    mapping->external_port = apteryx_get_int (mapping->path, EXTERNAL_PORT_KEY);
-    mapping->lifetime = apteryx_get_int (mapping->path, LIFETIME_KEY);
-    mapping->start_of_life = apteryx_get_int (mapping->path, START_OF_LIFE_KEY);
-    mapping->end_of_life = apteryx_get_int (mapping->path, END_OF_LIFE_KEY);
-    mapping->opcode = apteryx_get_int (mapping->path, OPCODE_KEY);
-    mapping->protocol = apteryx_get_int (mapping->path, PROTOCOL_KEY);
+    /* All the fields are fetched in one call */
+    root = apteryx_get_tree (path);
+    mapping = malloc (sizeof (*mapping));
+    if (root == NULL || mapping == NULL || !mapping_from_tree (root, mapping) ||
+        mapping->index != mapping_id)
+    {
+        apteryx_free_tree (root);
+        free (mapping);
+        free (path);
+        return NULL;
+    }
+    apteryx_free_tree (root);
+    mapping->path = path;
 
     return mapping;
 }
@@ -357,27 +678,145 @@ mapping_index_cmp (gconstpointer _a, gconstpointer _b)
     return ((pcp_mapping) _a)->index - ((pcp_mapping) _b)->index;
 }
 
+/**
+ * @brief pcp_mapping_foreach - Call a function for every mapping. All mappings
+ *          are fetched in one call and decoded one at a time, so no list of
+ *          mappings is built. The order is not defined.
+ * @param func - Function to call. The mapping is only valid during the call.
+ *          Iteration stops when it returns false.
+ * @param data - User data passed to the function
+ * @return - The number of mappings visited
+ */
+int
+pcp_mapping_foreach (pcp_mapping_func func, void *data)
+{
+    struct pcp_mapping_s mapping;
+    char path[sizeof (MAPPING_PATH "/") + 11];
+    GNode *root;
+    GNode *node;
+    int count = 0;
+
+    root = apteryx_get_tree (MAPPING_PATH);
+    if (root == NULL)
+    {
+        return 0;
+    }
+    for (node = root->children; node; node = node->next)
+    {
+        if (mapping_from_tree (node, &mapping))
+        {
+            snprintf (path, sizeof (path), MAPPING_PATH "/%d", mapping.index);
+            mapping.path = path;
+            count++;
+            if (!func (&mapping, data))
+            {
+                break;
+            }
+        }
+    }
+    apteryx_free_tree (root);
+    return count;
+}
+
+static gint
+index_cmp (gconstpointer _a, gconstpointer _b)
+{
+    return GPOINTER_TO_INT (_a) - GPOINTER_TO_INT (_b);
+}
+
+/**
+ * @brief pcp_mapping_indexes - List the indexes of the mappings, for paging
+ *          through them with pcp_mapping_foreach_page. The indexes are listed
+ *          in one call without fetching any fields.
+ * @param start_index - Smallest index to list
+ * @return - The indexes in ascending order, stored with GINT_TO_POINTER. The
+ *          caller frees the list with g_list_free.
+ */
 GList *
-pcp_mapping_getall (void)
+pcp_mapping_indexes (int start_index)
 {
-    GList *mappings = NULL;
-    GList *paths = apteryx_search (MAPPING_PATH "/");
+    GList *paths;
+    GList *indexes = NULL;
     GList *iter;
+    char *tmp;
+    int index;
+
+    paths = apteryx_search (MAPPING_PATH "/");
     for (iter = paths; iter; iter = g_list_next (iter))
     {
-        pcp_mapping mapping;
-        int id;
-        char *tmp = strrchr ((char *) iter->data, '/');
-        if (!tmp)
-            continue;
-        /* read the ID */
-        id = atoi (++tmp);
-        mapping = pcp_mapping_find (id);
-        if (mapping)
-            mappings = g_list_insert_sorted (mappings, mapping, mapping_index_cmp);
+        tmp = strrchr ((char *) iter->data, '/');
+        if (tmp && sscanf (tmp + 1, "%d", &index) == 1 && index >= start_index)
+        {
+            indexes = g_list_prepend (indexes, GINT_TO_POINTER (index));
+        }
     }
     g_list_free_full (paths, free);
-    return mappings;
+    return g_list_sort (indexes, index_cmp);
+}
+
+/**
+ * @brief pcp_mapping_foreach_page - Call a function for the mappings of up to
+ *          count indexes from the front of a list made by pcp_mapping_indexes.
+ *          Each mapping costs one call to fetch its fields, so only the index
+ *          list and one mapping are held at a time. Mappings deleted since the
+ *          list was made are skipped and mappings added since are not visited.
+ * @param indexes - The indexes still to visit
+ * @param count - Largest number of indexes to take from the list
+ * @param func - Function to call. The mapping is only valid during the call.
+ *          Iteration stops when it returns false.
+ * @param data - User data passed to the function
+ * @return - The indexes not yet visited, to pass in for the next page. NULL
+ *          when the list is done.
+ */
+GList *
+pcp_mapping_foreach_page (GList *indexes, int count, pcp_mapping_func func, void *data)
+{
+    struct pcp_mapping_s mapping;
+    char path[sizeof (MAPPING_PATH "/") + 11];
+    GNode *root;
+    bool more = true;
+
+    while (indexes && count-- > 0 && more)
+    {
+        snprintf (path, sizeof (path), MAPPING_PATH "/%d", GPOINTER_TO_INT (indexes->data));
+        indexes = g_list_delete_link (indexes, indexes);
+
+        root = apteryx_get_tree (path);
+        if (root && mapping_from_tree (root, &mapping))
+        {
+            mapping.path = path;
+            more = func (&mapping, data);
+        }
+        apteryx_free_tree (root);
+    }
+    return indexes;
+}
+
+static bool
+mapping_to_list (pcp_mapping mapping, void *data)
+{
+    GList **mappings = (GList **) data;
+    pcp_mapping copy = malloc (sizeof (*copy));
+
+    if (copy)
+    {
+        *copy = *mapping;
+        if (asprintf (&copy->path, MAPPING_PATH "/%d", mapping->index) <= 0)
+        {
+            copy->path = NULL;
+        }
+        *mappings = g_list_prepend (*mappings, copy);
+    }
+    return true;
+}
+
+GList *
+pcp_mapping_getall (void)
+{
+    GList *mappings = NULL;
+
+    pcp_mapping_foreach (mapping_to_list, &mappings);
+    return g_list_sort (mappings, mapping_index_cmp);
 }
 
 u_int32_t
@@ -770,7 +1209,14 @@ pcp_mapping_changed (const char *path, const char *value)
 
     if (strchr (tmp, '/'))
     {
-        *strrchr (tmp, '/') = '\0';
+        /* Only the mapping marker is of interest. Its fields are written
+         * before it, so a change to a single field is not reported. */
+        if (*(strchr (tmp, '/') + 1) != '\0')
+        {
+            free (tmp);
+            return true;
+        }
+        *strchr (tmp, '/') = '\0';
     }
     if (sscanf (tmp, "%d", &mapping_id) != 1)
     {
@@ -786,6 +1232,15 @@ pcp_mapping_changed (const char *path, const char *value)
             saved_cbs->delete_pcp_mapping (mapping_id);
         }
     }
+    else if (mapping->opcode == PEER_OPCODE && saved_cbs && saved_cbs->new_pcp_peer_mapping)
+    {
+        saved_cbs->new_pcp_peer_mapping (mapping->index, mapping->mapping_nonce,
+                                         mapping->internal_ip, mapping->internal_port,
+                                         mapping->external_ip, mapping->external_port,
+                                         mapping->remote_peer_ip, mapping->remote_peer_port,
+                                         mapping->lifetime, mapping->start_of_life,
+                                         mapping->end_of_life, mapping->protocol);
+    }
     else
     {
         if (saved_cbs && saved_cbs->new_pcp_mapping)
@@ -0,0 +1,292 @@
+/**
+ * @file fake_libpcp.c
+ *
+ * In-memory fake of the parts of libpcp used by pcpd, for benchmarks.
+ * Mappings are kept in a hash table instead of Apteryx, with the same
+ * checks that libpcp makes, so the request path behaves as it does against
+ * Apteryx without the round trips. No callbacks are made, as pcpd updates
+ * its own state when it changes a mapping.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libpcp.h"
+#include "fake_libpcp.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *mappings = NULL;
+static int high_water = 0;
+
+static GHashTable *
+mappings_get (void)
+{
+    if (mappings == NULL)
+    {
+        mappings = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+    }
+    return mappings;
+}
+
+void
+pcp_deinit (void)
+{
+}
+
+bool
+pcp_register_cb (pcp_callbacks *cb)
+{
+    return true;
+}
+
+bool
+mapping_id_high_water_set (int index)
+{
+    pthread_mutex_lock (&lock);
+    high_water = index;
+    pthread_mutex_unlock (&lock);
+    return true;
+}
+
+int
+mapping_id_high_water_get (void)
+{
+    int ret;
+
+    pthread_mutex_lock (&lock);
+    ret = high_water;
+    pthread_mutex_unlock (&lock);
+    return ret;
+}
+
+/* Takes ownership of mapping */
+static bool
+store_mapping (pcp_mapping mapping)
+{
+    bool ret = false;
+
+    mapping->start_of_life = time (NULL);
+    mapping->end_of_life = mapping->start_of_life + mapping->lifetime;
+
+    pthread_mutex_lock (&lock);
+    if (!g_hash_table_contains (mappings_get (), GINT_TO_POINTER (mapping->index)))
+    {
+        g_hash_table_insert (mappings_get (), GINT_TO_POINTER (mapping->index), mapping);
+        ret = true;
+    }
+    pthread_mutex_unlock (&lock);
+
+    if (!ret)
+    {
+        free (mapping);
+    }
+    return ret;
+}
+
+bool
+pcp_mapping_add (int index,
+                 u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                 struct in6_addr *internal_ip,
+                 u_int16_t internal_port,
+                 struct in6_addr *external_ip,
+                 u_int16_t external_port,
+                 u_int32_t lifetime,
+                 u_int8_t opcode,
+                 u_int8_t protocol)
+{
+    pcp_mapping mapping;
+
+    if (index < 0)
+    {
+        return false;
+    }
+
+    mapping = calloc (1, sizeof (*mapping));
+    if (mapping == NULL)
+    {
+        return false;
+    }
+    mapping->index = index;
+    memcpy (mapping->mapping_nonce, mapping_nonce, sizeof (mapping->mapping_nonce));
+    mapping->internal_ip = *internal_ip;
+    mapping->internal_port = internal_port;
+    mapping->external_ip = *external_ip;
+    mapping->external_port = external_port;
+    mapping->lifetime = lifetime;
+    mapping->opcode = opcode;
+    mapping->protocol = protocol;
+
+    return store_mapping (mapping);
+}
+
+bool
+pcp_mapping_add_peer (int index,
+                      u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                      struct in6_addr *internal_ip,
+                      u_int16_t internal_port,
+                      struct in6_addr *external_ip,
+                      u_int16_t external_port,
+                      struct in6_addr *remote_peer_ip,
+                      u_int16_t remote_peer_port,
+                      u_int32_t lifetime,
+                      u_int8_t protocol)
+{
+    pcp_mapping mapping;
+
+    if (index < 0)
+    {
+        return false;
+    }
+
+    mapping = calloc (1, sizeof (*mapping));
+    if (mapping == NULL)
+    {
+        return false;
+    }
+    mapping->index = index;
+    memcpy (mapping->mapping_nonce, mapping_nonce, sizeof (mapping->mapping_nonce));
+    mapping->internal_ip = *internal_ip;
+    mapping->internal_port = internal_port;
+    mapping->external_ip = *external_ip;
+    mapping->external_port = external_port;
+    mapping->remote_peer_ip = *remote_peer_ip;
+    mapping->remote_peer_port = remote_peer_port;
+    mapping->lifetime = lifetime;
+    mapping->opcode = PEER_OPCODE;
+    mapping->protocol = protocol;
+
+    return store_mapping (mapping);
+}
+
+bool
+pcp_mapping_refresh_lifetime (int index, u_int32_t new_lifetime, u_int32_t new_end_of_life)
+{
+    u_int32_t expected = time (NULL) + new_lifetime;
+    pcp_mapping mapping;
+
+    if (new_end_of_life < expected - 3 || new_end_of_life > expected + 3)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock (&lock);
+    mapping = g_hash_table_lookup (mappings_get (), GINT_TO_POINTER (index));
+    if (mapping)
+    {
+        mapping->lifetime = new_lifetime;
+        mapping->end_of_life = new_end_of_life;
+    }
+    pthread_mutex_unlock (&lock);
+
+    return mapping != NULL;
+}
+
+bool
+pcp_mapping_delete (int index)
+{
+    bool ret;
+
+    pthread_mutex_lock (&lock);
+    ret = g_hash_table_remove (mappings_get (), GINT_TO_POINTER (index));
+    pthread_mutex_unlock (&lock);
+    return ret;
+}
+
+int
+pcp_mapping_foreach (pcp_mapping_func func, void *data)
+{
+    struct pcp_mapping_s *copies;
+    GHashTableIter iter;
+    gpointer value;
+    int count = 0;
+    int i;
+
+    /* As with Apteryx, all the mappings are fetched at once and func is
+     * called without the lock held */
+    pthread_mutex_lock (&lock);
+    copies = malloc ((g_hash_table_size (mappings_get ()) + 1) * sizeof (*copies));
+    if (copies)
+    {
+        g_hash_table_iter_init (&iter, mappings_get ());
+        while (g_hash_table_iter_next (&iter, NULL, &value))
+        {
+            copies[count++] = *(pcp_mapping) value;
+        }
+    }
+    pthread_mutex_unlock (&lock);
+
+    for (i = 0; i < count; i++)
+    {
+        if (!func (&copies[i], data))
+        {
+            count = i + 1;
+            break;
+        }
+    }
+    free (copies);
+    return count;
+}
+
+u_int32_t
+pcp_mapping_remaining_lifetime_get (pcp_mapping mapping)
+{
+    u_int32_t now = time (NULL);
+
+    return mapping->end_of_life > now ? mapping->end_of_life - now : 0;
+}
+
+void
+pcp_mapping_destroy (pcp_mapping mapping)
+{
+    if (mapping)
+    {
+        free (mapping->path);
+        free (mapping);
+    }
+}
+
+void
+pcp_mapping_print (pcp_mapping mapping)
+{
+}
+
+char *
+get_uptime_string (void)
+{
+    return strdup ("0");
+}
+
+/**
+ * @brief fake_libpcp_count - Get the number of mappings stored
+ * @return - The number of mappings
+ */
+int
+fake_libpcp_count (void)
+{
+    int ret;
+
+    pthread_mutex_lock (&lock);
+    ret = g_hash_table_size (mappings_get ());
+    pthread_mutex_unlock (&lock);
+    return ret;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file fake_libpcp.h
+ *
+ * In-memory fake of libpcp for benchmarks.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FAKE_LIBPCP_H
+#define FAKE_LIBPCP_H
+
+int fake_libpcp_count (void);
+
+#endif /* FAKE_LIBPCP_H */
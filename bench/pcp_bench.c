@@ -0,0 +1,309 @@
+/**
+ * @file pcp_bench.c
+ *
+ * Microbenchmarks for the packet codec, the validator and the MAP request
+ * path. The request path runs against an in-memory mapping store and a
+ * forwarding backend that only records mappings, so only pcpd's own work is
+ * measured.
+ *
+ * usage: pcp_bench [ITERATIONS]
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include "libpcp.h"
+#include "packets_pcp.h"
+#include "packets_pcp_codec.h"
+#include "packets_pcp_serialization.h"
+#include "pcp_iptables.h"
+#include "pcpd.h"
+#include "recording_backend.h"
+
+#define DEFAULT_ITERATIONS 1000000
+/* Each new mapping stays in the mapping table, so bound the memory used */
+#define MAX_NEW_MAPPINGS 200000
+
+typedef void (*bench_func) (u_int64_t iterations);
+
+/* Results are accumulated here so the compiler cannot drop the work */
+static volatile u_int64_t sink;
+
+/* A valid MAP request and a MAP response in wire format */
+static unsigned char request_pkt[MAX_PAYLOAD_LEN];
+static int request_len;
+static map_response response;
+static unsigned char buffer[MAX_PAYLOAD_LEN];
+
+/**
+ * @brief build_packets - Build the packets used by the benchmarks
+ */
+static void
+build_packets (void)
+{
+    map_request map_req;
+
+    memset (&map_req, 0, sizeof (map_req));
+    new_pcp_request_header (&map_req.header, MAP_OPCODE, 3600, "::ffff:192.168.1.2");
+    map_req.mapping_nonce[0] = 2058005162;
+    map_req.mapping_nonce[1] = 2058005161;
+    map_req.mapping_nonce[2] = 2058005160;
+    map_req.protocol = 6;
+    map_req.internal_port = 51717;
+    map_req.suggested_external_port = 51717;
+    inet_pton (AF_INET6, "::ffff:203.0.113.1", &map_req.suggested_external_ip);
+
+    request_len = serialize_map_request (request_pkt, &map_req) - request_pkt;
+    init_pcp_map_response (&response, &map_req);
+}
+
+static void
+bench_validate_packet_buffer (u_int64_t iterations)
+{
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += validate_packet_buffer (request_pkt, request_len);
+    }
+}
+
+static void
+bench_get_packet_type (u_int64_t iterations)
+{
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += get_packet_type (request_pkt);
+    }
+}
+
+static void
+bench_deserialize_map_request (u_int64_t iterations)
+{
+    map_request *map_req;
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        map_req = deserialize_map_request (request_pkt);
+        sink += map_req->internal_port;
+        free (map_req);
+    }
+}
+
+static void
+bench_deserialize_map_request_into (u_int64_t iterations)
+{
+    map_request map_req;
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        deserialize_map_request_into (&map_req, request_pkt);
+        sink += map_req.internal_port;
+    }
+}
+
+static void
+bench_codec_decode_map_request (u_int64_t iterations)
+{
+    map_request map_req;
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        pcp_codec_decode_map_request (&map_req, request_pkt);
+        sink += map_req.internal_port;
+    }
+}
+
+static void
+bench_serialize_map_response (u_int64_t iterations)
+{
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        response.header.epoch_time = i;
+        sink += serialize_map_response (buffer, &response) - buffer;
+    }
+}
+
+static void
+bench_codec_encode_map_response (u_int64_t iterations)
+{
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        response.header.epoch_time = i;
+        sink += pcp_codec_encode_map_response (buffer, &response) - buffer;
+    }
+}
+
+static void
+bench_add_zero_padding (u_int64_t iterations)
+{
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        sink += add_zero_padding (buffer, buffer + 57 + (i & 3)) - buffer;
+    }
+}
+
+/* The same request every time, so all but the first renew one mapping */
+static void
+bench_process_map_request_renew (u_int64_t iterations)
+{
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        memcpy (buffer, request_pkt, request_len);
+        sink += process_map_request (buffer, request_len) - buffer;
+    }
+}
+
+/* A different mapping nonce every time, so every request creates a mapping */
+static void
+bench_process_map_request_new (u_int64_t iterations)
+{
+    static u_int32_t nonce = 0;
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        memcpy (buffer, request_pkt, request_len);
+        serialize_u_int32_t (buffer + sizeof (pcp_request_header), ++nonce);
+        sink += process_map_request (buffer, request_len) - buffer;
+    }
+}
+
+static void
+bench_process_packet_renew (u_int64_t iterations)
+{
+    u_int64_t i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        memcpy (buffer, request_pkt, request_len);
+        sink += process_packet (buffer, request_len);
+    }
+}
+
+/**
+ * @brief run_bench - Run a benchmark and print its cost per packet
+ * @param name - Name to print
+ * @param func - The benchmark
+ * @param iterations - Number of packets to process
+ */
+static void
+run_bench (const char *name, bench_func func, u_int64_t iterations)
+{
+    struct timespec start, end;
+    double ns;
+
+    /* Warm the caches and branch predictors first */
+    func (iterations / 100 + 1);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    func (iterations);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+    printf ("%-44s %10.1f ns/op %14.0f packets/sec\n", name, ns, ns > 0 ? 1e9 / ns : 0);
+}
+
+/**
+ * @brief run_codec_benches - Run the codec benchmarks with one implementation
+ * @param impl - The codec implementation
+ * @param iterations - Number of packets to process
+ */
+static void
+run_codec_benches (pcp_codec_impl impl, u_int64_t iterations)
+{
+    char name[64];
+
+    if (!pcp_codec_set (impl))
+    {
+        return;
+    }
+    snprintf (name, sizeof (name), "pcp_codec_decode_map_request (%s)", pcp_codec_name ());
+    run_bench (name, bench_codec_decode_map_request, iterations);
+    snprintf (name, sizeof (name), "pcp_codec_encode_map_response (%s)", pcp_codec_name ());
+    run_bench (name, bench_codec_encode_map_response, iterations);
+}
+
+int
+main (int argc, char *argv[])
+{
+    u_int64_t iterations = DEFAULT_ITERATIONS;
+    u_int64_t new_mappings;
+
+    if (argc > 1)
+    {
+        iterations = strtoull (argv[1], NULL, 10);
+        if (iterations == 0)
+        {
+            fprintf (stderr, "usage: %s [ITERATIONS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    new_mappings = iterations < MAX_NEW_MAPPINGS ? iterations : MAX_NEW_MAPPINGS;
+
+    build_packets ();
+
+    pcp_fw_backend_set (&recording_backend);
+    pcp_iptables_init ();
+    init_pcpd_state ();
+    init_mapping_ids ();
+    pcp_enabled (true);
+    map_support (true);
+    min_mapping_lifetime (DEFAULT_MIN_MAPPING_LIFETIME);
+    max_mapping_lifetime (DEFAULT_MAX_MAPPING_LIFETIME);
+
+    printf ("%llu iterations\n", (unsigned long long) iterations);
+
+    run_bench ("validate_packet_buffer", bench_validate_packet_buffer, iterations);
+    run_bench ("get_packet_type", bench_get_packet_type, iterations);
+    run_bench ("deserialize_map_request", bench_deserialize_map_request, iterations);
+    run_bench ("deserialize_map_request_into", bench_deserialize_map_request_into, iterations);
+    run_bench ("serialize_map_response", bench_serialize_map_response, iterations);
+    run_codec_benches (PCP_CODEC_SCALAR, iterations);
+    run_codec_benches (PCP_CODEC_SIMD, iterations);
+    run_bench ("add_zero_padding", bench_add_zero_padding, iterations);
+
+    pcp_codec_init ();
+    run_bench ("process_map_request (renewal)", bench_process_map_request_renew, iterations);
+    run_bench ("process_map_request (new mapping)", bench_process_map_request_new,
+               new_mappings);
+    run_bench ("process_packet (renewal)", bench_process_packet_renew, iterations);
+
+    return EXIT_SUCCESS;
+}
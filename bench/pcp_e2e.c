@@ -0,0 +1,614 @@
+/**
+ * @file pcp_e2e.c
+ *
+ * End-to-end throughput harness for pcpd's request path. Worker threads
+ * pass synthetic MAP requests to process_packet, as pcpd's own workers do,
+ * with the mappings stored in an in-memory fake of libpcp and forwarding
+ * recorded by a backend that does not touch the firewall. So only pcpd's own
+ * overhead is measured, and no Apteryx or root access is needed.
+ *
+ * Each worker owns a set of simulated mappings, spread over many client
+ * addresses, and sends a mix of requests that create, renew and delete
+ * them. At the end the mappings pcpd reported are checked against the fake
+ * store and the recorded forwarding.
+ *
+ * usage: pcp_e2e [-w WORKERS] [-d SECONDS] [-c CLIENTS] [-m MAPPINGS] [-x MIX] [-6 PERCENT]
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include "fake_libpcp.h"
+#include "libpcp.h"
+#include "packets_pcp.h"
+#include "packets_pcp_serialization.h"
+#include "pcp_iptables.h"
+#include "pcp_metrics.h"
+#include "pcpd.h"
+#include "recording_backend.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+#define DEFAULT_WORKERS 1
+#define DEFAULT_DURATION 5
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_MAPPINGS 10
+#define DEFAULT_MIX "20:70:10"
+#define MAX_WORKERS 64
+#define LIFETIME 3600
+#define FIRST_INTERNAL_PORT 1024
+
+/* Latencies are kept in a log-linear histogram: a row per power of two,
+ * split into LATENCY_SUB_BUCKETS columns, so each bucket is within about
+ * 6% of the latencies it holds */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+/* Request types */
+typedef enum
+{
+    OP_CREATE,
+    OP_RENEW,
+    OP_DELETE,
+    OP_MAX
+} e2e_op;
+
+static const char *op_names[OP_MAX] = { "create", "renew", "delete" };
+
+/* One worker thread and the mappings it owns */
+typedef struct _e2e_worker
+{
+    pthread_t thread;
+    int id;
+    peer_request *slots;        // MAP or PEER requests in host order, one per mapping
+    int *order;                 // The first num_mapped slots are mapped
+    int *position;              // Position of each slot in order
+    int num_slots;
+    int num_mapped;
+    u_int32_t rand_state;
+    u_int64_t sent[OP_MAX];
+    u_int64_t results[RESULT_CODE_MAX + 1];
+    u_int64_t no_response;
+    u_int64_t latency[LATENCY_BUCKETS];
+    u_int64_t max_latency_ns;
+} e2e_worker;
+
+static int num_workers = DEFAULT_WORKERS;
+static unsigned int duration = DEFAULT_DURATION;
+static unsigned int num_clients = DEFAULT_CLIENTS;
+static unsigned int num_mappings = DEFAULT_MAPPINGS;
+static unsigned int ipv6_percent = 0;
+static unsigned int peer_percent = 0;
+static unsigned int weights[OP_MAX];
+
+static e2e_worker workers[MAX_WORKERS];
+static volatile bool running = false;
+static pthread_barrier_t start_barrier;
+
+static struct option long_options[] = {
+    { "workers", required_argument, NULL, 'w' },
+    { "duration", required_argument, NULL, 'd' },
+    { "clients", required_argument, NULL, 'c' },
+    { "mappings", required_argument, NULL, 'm' },
+    { "mix", required_argument, NULL, 'x' },
+    { "ipv6", required_argument, NULL, '6' },
+    { "peer", required_argument, NULL, 'p' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void
+usage (void)
+{
+    fprintf (stdout, "pcp_e2e, an end-to-end throughput harness for pcpd\n\n"
+             "usage:\tpcp_e2e [-w WORKERS] [-d SECONDS] [-c CLIENTS] [-m MAPPINGS]\n"
+             "\t\t[-x CREATE:RENEW:DELETE] [-6 PERCENT] [-p PERCENT]\n\n"
+             "WORKERS threads (1-%d, default %d) process requests for SECONDS\n"
+             "(default %d). CLIENTS simulated clients (default %d) are shared\n"
+             "between the workers and each has MAPPINGS mappings (default %d).\n"
+             "The mix gives the relative weight of requests that create, renew\n"
+             "and delete a mapping (default %s). PERCENT of the clients\n"
+             "(default 0) use IPv6 and ask for a pinhole to their own address.\n"
+             "The -p PERCENT of the mappings (default 0) are PEER mappings for a\n"
+             "connection to a remote peer rather than MAP mappings.\n\n",
+             MAX_WORKERS, DEFAULT_WORKERS, DEFAULT_DURATION, DEFAULT_CLIENTS,
+             DEFAULT_MAPPINGS, DEFAULT_MIX);
+}
+
+static u_int64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* xorshift32, so workers do not share rand () state */
+static u_int32_t
+worker_rand (e2e_worker *w)
+{
+    u_int32_t x = w->rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    w->rand_state = x;
+    return x;
+}
+
+static int
+latency_bucket (u_int64_t ns)
+{
+    int msb;
+
+    if (ns < LATENCY_SUB_BUCKETS)
+    {
+        return ns;
+    }
+    msb = 63 - __builtin_clzll (ns);
+    return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+           ((ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* The smallest latency that falls in a bucket */
+static u_int64_t
+latency_bucket_value (int bucket)
+{
+    int row = bucket / LATENCY_SUB_BUCKETS;
+    int col = bucket % LATENCY_SUB_BUCKETS;
+
+    if (row == 0)
+    {
+        return col;
+    }
+    return (u_int64_t) (LATENCY_SUB_BUCKETS + col) << (row - 1);
+}
+
+/**
+ * @brief init_worker - Create the simulated mappings of a worker
+ * @param w - The worker
+ * @param first_client - Index of the worker's first client
+ * @param clients - Number of clients the worker owns
+ * @return - True if successful
+ */
+static bool
+init_worker (e2e_worker *w, unsigned int first_client, unsigned int clients)
+{
+    char client_str[INET6_ADDRSTRLEN];
+    char peer_str[INET6_ADDRSTRLEN];
+    map_request *map_req;
+    unsigned int c, m;
+    bool ipv6;
+    int i = 0;
+
+    w->num_slots = clients * num_mappings;
+    w->slots = calloc (w->num_slots + 1, sizeof (*w->slots));
+    w->order = calloc (w->num_slots + 1, sizeof (*w->order));
+    w->position = calloc (w->num_slots + 1, sizeof (*w->position));
+    if (!w->slots || !w->order || !w->position)
+    {
+        return false;
+    }
+    w->rand_state = 2463534242U + w->id;
+
+    for (c = first_client; c < first_client + clients; c++)
+    {
+        /* Clients are 10.0.0.0/8 or 2001:db8::/96 addresses */
+        ipv6 = c % 100 < ipv6_percent;
+        if (ipv6)
+        {
+            snprintf (client_str, sizeof (client_str), "2001:db8::%x:%x",
+                      (c >> 16) & 0xFFFF, c & 0xFFFF);
+        }
+        else
+        {
+            snprintf (client_str, sizeof (client_str), "::ffff:10.%u.%u.%u",
+                      (c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF);
+        }
+        for (m = 0; m < num_mappings; m++, i++)
+        {
+            map_req = new_pcp_map_request (LIFETIME, client_str);
+            if (!map_req)
+            {
+                return false;
+            }
+            map_req->mapping_nonce[0] = w->id;
+            map_req->mapping_nonce[1] = i;
+            map_req->mapping_nonce[2] = c;
+            map_req->internal_port = FIRST_INTERNAL_PORT + m;
+            map_req->suggested_external_port = FIRST_INTERNAL_PORT + m;
+            inet_pton (AF_INET6, ipv6 ? "::" : "::ffff:203.0.113.1",
+                       &map_req->suggested_external_ip);
+            memcpy (&w->slots[i], map_req, sizeof (*map_req));
+            free (map_req);
+
+            /* PEER mappings are for connections to 198.51.100.0/24 or
+             * 2001:db8:ffff::/112 on port 443 */
+            if (i % 100 < peer_percent)
+            {
+                snprintf (peer_str, sizeof (peer_str),
+                          ipv6 ? "2001:db8:ffff::%x" : "::ffff:198.51.100.%u", m % 256);
+                w->slots[i].header.r_opcode = R_REQUEST (PEER_OPCODE);
+                w->slots[i].remote_peer_port = 443;
+                inet_pton (AF_INET6, peer_str, &w->slots[i].remote_peer_ip);
+            }
+            w->order[i] = i;
+            w->position[i] = i;
+        }
+    }
+    return true;
+}
+
+static void
+set_mapped (e2e_worker *w, int slot, bool mapped)
+{
+    int pos = w->position[slot];
+    int swap_pos, other;
+
+    if (mapped == (pos < w->num_mapped))
+    {
+        return;
+    }
+    swap_pos = mapped ? w->num_mapped : w->num_mapped - 1;
+    other = w->order[swap_pos];
+    w->order[swap_pos] = slot;
+    w->position[slot] = swap_pos;
+    w->order[pos] = other;
+    w->position[other] = pos;
+    w->num_mapped += mapped ? 1 : -1;
+}
+
+/**
+ * @brief pick_request - Pick the next request from the mix
+ * @param w - The worker
+ * @param slot - Where to place the slot to send it for
+ * @return - The request type
+ */
+static e2e_op
+pick_request (e2e_worker *w, int *slot)
+{
+    unsigned int r = worker_rand (w) % (weights[OP_CREATE] + weights[OP_RENEW] +
+                                        weights[OP_DELETE]);
+    e2e_op op = r < weights[OP_CREATE] ? OP_CREATE :
+                r < weights[OP_CREATE] + weights[OP_RENEW] ? OP_RENEW : OP_DELETE;
+    int unmapped = w->num_slots - w->num_mapped;
+
+    /* Create when nothing is mapped, and renew when everything is */
+    if (op != OP_CREATE && w->num_mapped == 0)
+    {
+        op = OP_CREATE;
+    }
+    else if (op == OP_CREATE && unmapped == 0)
+    {
+        op = OP_RENEW;
+    }
+
+    if (op == OP_CREATE)
+    {
+        *slot = w->order[w->num_mapped + worker_rand (w) % unmapped];
+    }
+    else
+    {
+        *slot = w->order[worker_rand (w) % w->num_mapped];
+    }
+    return op;
+}
+
+static void *
+worker_loop (void *arg)
+{
+    e2e_worker *w = arg;
+    unsigned char buf[MAX_PAYLOAD_LEN + 1];
+    pcp_response_header header;
+    map_response map_resp;
+    u_int64_t start, end, ns;
+    e2e_op op;
+    int slot, len, n;
+
+    pcp_metrics_thread_init (w->id + 1);
+    pthread_barrier_wait (&start_barrier);
+
+    while (running)
+    {
+        op = pick_request (w, &slot);
+        w->slots[slot].header.requested_lifetime = op == OP_DELETE ? 0 : LIFETIME;
+        if (OPCODE (w->slots[slot].header.r_opcode) == PEER_OPCODE)
+        {
+            len = serialize_peer_request (buf, &w->slots[slot]) - buf;
+        }
+        else
+        {
+            len = serialize_map_request (buf, (map_request *) &w->slots[slot]) - buf;
+        }
+
+        start = now_ns ();
+        n = process_packet (buf, len);
+        end = now_ns ();
+
+        ns = end - start;
+        w->latency[latency_bucket (ns)]++;
+        if (ns > w->max_latency_ns)
+        {
+            w->max_latency_ns = ns;
+        }
+        w->sent[op]++;
+
+        if (n < MIN_MAP_PKT_LEN)
+        {
+            w->no_response++;
+            continue;
+        }
+        deserialize_response_header (&header, buf);
+        w->results[header.result_code < RESULT_CODE_MAX ?
+                   header.result_code : RESULT_CODE_MAX]++;
+        /* The start of a PEER response is the same as a MAP response */
+        deserialize_map_response_into (&map_resp, buf);
+        if (header.result_code == SUCCESS && map_resp.mapping_nonce[1] == slot)
+        {
+            set_mapped (w, slot, op != OP_DELETE);
+        }
+    }
+    return NULL;
+}
+
+static bool
+parse_arguments (int argc, char *argv[])
+{
+    const char *mix = DEFAULT_MIX;
+    int opt;
+
+    while ((opt = getopt_long (argc, argv, "w:d:c:m:x:6:p:h", long_options, NULL)) != EOF)
+    {
+        switch (opt)
+        {
+        case 'w':
+            num_workers = atoi (optarg);
+            if (num_workers < 1 || num_workers > MAX_WORKERS)
+            {
+                fprintf (stderr, "Workers must be between 1 and %d\n", MAX_WORKERS);
+                return false;
+            }
+            break;
+        case 'd':
+            duration = atoi (optarg);
+            break;
+        case 'c':
+            num_clients = atoi (optarg);
+            break;
+        case 'm':
+            num_mappings = atoi (optarg);
+            if (num_mappings > 65536 - FIRST_INTERNAL_PORT)
+            {
+                fprintf (stderr, "Mappings must be at most %d\n",
+                         65536 - FIRST_INTERNAL_PORT);
+                return false;
+            }
+            break;
+        case 'x':
+            mix = optarg;
+            break;
+        case '6':
+            ipv6_percent = atoi (optarg);
+            if (ipv6_percent > 100)
+            {
+                fprintf (stderr, "IPv6 clients must be at most 100 percent\n");
+                return false;
+            }
+            break;
+        case 'p':
+            peer_percent = atoi (optarg);
+            if (peer_percent > 100)
+            {
+                fprintf (stderr, "PEER mappings must be at most 100 percent\n");
+                return false;
+            }
+            break;
+        case 'h':
+            usage ();
+            exit (EXIT_SUCCESS);
+        default:   /* '?' */
+            return false;
+        }
+    }
+
+    if (sscanf (mix, "%u:%u:%u", &weights[OP_CREATE], &weights[OP_RENEW],
+                &weights[OP_DELETE]) != OP_MAX ||
+        weights[OP_CREATE] + weights[OP_RENEW] + weights[OP_DELETE] == 0)
+    {
+        fprintf (stderr, "Mix must be CREATE:RENEW:DELETE weights, e.g. %s\n", DEFAULT_MIX);
+        return false;
+    }
+    if (duration < 1 || num_mappings < 1 || num_clients < num_workers ||
+        num_clients > (1 << 24))
+    {
+        fprintf (stderr, "Duration and mappings must be at least 1, and clients between "
+                 "the number of workers and %d\n", 1 << 24);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief print_report - Combine the workers' results and print them
+ * @param elapsed_ns - How long the workers ran for
+ * @return - True if pcpd, the fake store, the backend and the metrics agree
+ */
+static bool
+print_report (u_int64_t elapsed_ns)
+{
+    static u_int64_t latency[LATENCY_BUCKETS];
+    u_int64_t sent[OP_MAX] = { 0 };
+    u_int64_t results[RESULT_CODE_MAX + 1] = { 0 };
+    u_int64_t total = 0, no_response = 0, max_latency = 0, seen;
+    double percentiles[] = { 50, 90, 99, 99.9 };
+    recording_backend_stats backend;
+    pcp_metrics_totals metrics;
+    int mapped = 0;
+    int i, j, b;
+
+    for (i = 0; i < num_workers; i++)
+    {
+        for (j = 0; j < OP_MAX; j++)
+        {
+            sent[j] += workers[i].sent[j];
+            total += workers[i].sent[j];
+        }
+        for (j = 0; j <= RESULT_CODE_MAX; j++)
+        {
+            results[j] += workers[i].results[j];
+        }
+        for (b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            latency[b] += workers[i].latency[b];
+        }
+        no_response += workers[i].no_response;
+        mapped += workers[i].num_mapped;
+        if (workers[i].max_latency_ns > max_latency)
+        {
+            max_latency = workers[i].max_latency_ns;
+        }
+    }
+
+    printf ("Workers:         %d\n", num_workers);
+    printf ("Requests:        %llu (", (unsigned long long) total);
+    for (j = 0; j < OP_MAX; j++)
+    {
+        printf ("%s%s %llu", j ? ", " : "", op_names[j], (unsigned long long) sent[j]);
+    }
+    printf (")\n");
+    printf ("Throughput:      %.0f requests/sec\n", total * (double) NSEC_PER_SEC / elapsed_ns);
+    printf ("Latency (ns):   ");
+    for (j = 0; j < sizeof (percentiles) / sizeof (percentiles[0]); j++)
+    {
+        seen = 0;
+        for (b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            seen += latency[b];
+            if (seen > percentiles[j] / 100.0 * (total - 1))
+            {
+                break;
+            }
+        }
+        printf (" p%g %llu ", percentiles[j],
+                (unsigned long long) latency_bucket_value (b < LATENCY_BUCKETS ? b : 0));
+    }
+    printf (" max %llu\n", (unsigned long long) max_latency);
+    printf ("No response:     %llu\n", (unsigned long long) no_response);
+    printf ("Result codes:   ");
+    for (j = 0; j <= RESULT_CODE_MAX; j++)
+    {
+        if (results[j])
+        {
+            printf (" %d: %llu ", j, (unsigned long long) results[j]);
+        }
+    }
+    printf ("\n");
+
+    recording_backend_stats_get (&backend);
+    printf ("Mappings:        %d reported, %d stored, %d forwarded\n",
+            mapped, fake_libpcp_count (), backend.rules);
+    printf ("Forwarding:      %llu writes, %llu removes, %llu errors\n",
+            (unsigned long long) backend.writes, (unsigned long long) backend.removes,
+            (unsigned long long) backend.errors);
+
+    pcp_metrics_snapshot (NULL, &metrics);
+    pcp_metrics_print (stdout, &metrics);
+
+    return mapped == fake_libpcp_count () && mapped == backend.rules && backend.errors == 0 &&
+        metrics.counters[PCP_METRIC_PACKETS_RECEIVED] == total &&
+        metrics.counters[PCP_METRIC_MAPPINGS_CREATED] == backend.writes;
+}
+
+int
+main (int argc, char *argv[])
+{
+    unsigned int first_client = 0;
+    unsigned int clients;
+    u_int64_t start, end;
+    int i;
+
+    if (!parse_arguments (argc, argv))
+    {
+        fprintf (stderr, "Try `pcp_e2e --help' for more information.\n");
+        return EXIT_FAILURE;
+    }
+
+    pcp_metrics_init (false);
+    pcp_fw_backend_set (&recording_backend);
+    pcp_iptables_init ();
+    init_pcpd_state ();
+    init_mapping_ids ();
+    pcp_enabled (true);
+    map_support (true);
+    peer_support (true);
+    min_mapping_lifetime (DEFAULT_MIN_MAPPING_LIFETIME);
+    max_mapping_lifetime (DEFAULT_MAX_MAPPING_LIFETIME);
+
+    for (i = 0; i < num_workers; i++)
+    {
+        clients = num_clients / num_workers + (i < num_clients % num_workers);
+        workers[i].id = i;
+        if (!init_worker (&workers[i], first_client, clients))
+        {
+            fprintf (stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        first_client += clients;
+    }
+
+    running = true;
+    pthread_barrier_init (&start_barrier, NULL, num_workers + 1);
+    for (i = 0; i < num_workers; i++)
+    {
+        if (pthread_create (&workers[i].thread, NULL, worker_loop, &workers[i]) != 0)
+        {
+            fprintf (stderr, "Failed to create worker thread %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_barrier_wait (&start_barrier);
+    start = now_ns ();
+    sleep (duration);
+    running = false;
+    for (i = 0; i < num_workers; i++)
+    {
+        pthread_join (workers[i].thread, NULL);
+    }
+    end = now_ns ();
+
+    if (!print_report (end - start))
+    {
+        fprintf (stderr, "pcpd, the mapping store, the forwarding backend and the metrics disagree\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file recording_backend.c
+ *
+ * Forwarding backend for benchmarks. Each mapping that pcpd would install
+ * is recorded in memory, so the cost of the firewall is left out of the
+ * measurements and the calls can be checked against the mappings stored.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <glib.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recording_backend.h"
+
+/* A recorded mapping. IPv4 addresses are kept IPv4-mapped. */
+typedef struct _recorded_rule
+{
+    struct in6_addr internal_ip;
+    struct in6_addr external_ip;
+    u_int16_t internal_port;
+    u_int16_t external_port;
+    u_int16_t protocol;
+} recorded_rule;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *rules = NULL;
+static recording_backend_stats stats;
+
+static bool
+recording_init (void)
+{
+    pthread_mutex_lock (&lock);
+    if (rules == NULL)
+    {
+        rules = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+    }
+    pthread_mutex_unlock (&lock);
+    return true;
+}
+
+static void
+recording_deinit (void)
+{
+    pthread_mutex_lock (&lock);
+    if (rules)
+    {
+        g_hash_table_destroy (rules);
+        rules = NULL;
+    }
+    pthread_mutex_unlock (&lock);
+}
+
+static bool
+record_rule (int index, struct in6_addr *internal_ip, struct in6_addr *external_ip,
+             u_int16_t internal_port, u_int16_t external_port, u_int16_t protocol)
+{
+    recorded_rule *rule = malloc (sizeof (*rule));
+
+    if (rule == NULL)
+    {
+        return false;
+    }
+    rule->internal_ip = *internal_ip;
+    rule->external_ip = *external_ip;
+    rule->internal_port = internal_port;
+    rule->external_port = external_port;
+    rule->protocol = protocol;
+
+    pthread_mutex_lock (&lock);
+    stats.writes++;
+    if (!g_hash_table_insert (rules, GINT_TO_POINTER (index), rule))
+    {
+        stats.errors++;
+    }
+    pthread_mutex_unlock (&lock);
+    return true;
+}
+
+static void
+ipv4_to_mapped (struct in6_addr *ip6, struct in_addr *ip)
+{
+    memset (ip6, 0, sizeof (*ip6));
+    ip6->s6_addr[10] = 0xff;
+    ip6->s6_addr[11] = 0xff;
+    memcpy (&ip6->s6_addr[12], &ip->s_addr, sizeof (ip->s_addr));
+}
+
+static bool
+recording_write (int index, struct in_addr *internal_ip, struct in_addr *external_ip,
+                 u_int16_t internal_port, u_int16_t external_port, u_int16_t protocol)
+{
+    struct in6_addr internal_ip6;
+    struct in6_addr external_ip6;
+
+    ipv4_to_mapped (&internal_ip6, internal_ip);
+    ipv4_to_mapped (&external_ip6, external_ip);
+    return record_rule (index, &internal_ip6, &external_ip6,
+                        internal_port, external_port, protocol);
+}
+
+static bool
+recording_remove (int index)
+{
+    pthread_mutex_lock (&lock);
+    stats.removes++;
+    if (!g_hash_table_remove (rules, GINT_TO_POINTER (index)))
+    {
+        stats.errors++;
+    }
+    pthread_mutex_unlock (&lock);
+    return true;
+}
+
+const pcp_fw_backend recording_backend = {
+    .name = "recording",
+    .init = recording_init,
+    .deinit = recording_deinit,
+    .write = recording_write,
+    .remove = recording_remove,
+    .write6 = record_rule,
+    .remove6 = recording_remove,
+};
+
+/**
+ * @brief recording_backend_stats_get - Get the calls made to the backend
+ * @param s - Where to place the counts
+ */
+void
+recording_backend_stats_get (recording_backend_stats *s)
+{
+    pthread_mutex_lock (&lock);
+    *s = stats;
+    s->rules = rules ? g_hash_table_size (rules) : 0;
+    pthread_mutex_unlock (&lock);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file recording_backend.h
+ *
+ * Forwarding backend for benchmarks that records mappings instead of
+ * programming the firewall.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RECORDING_BACKEND_H
+#define RECORDING_BACKEND_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#include "pcp_iptables.h"
+
+/* Counts of the calls made to the recording backend */
+typedef struct _recording_backend_stats
+{
+    u_int64_t writes;
+    u_int64_t removes;
+    u_int64_t errors;           // Writes of an installed mapping or removes of a missing one
+    int rules;                  // Mappings installed now
+} recording_backend_stats;
+
+extern const pcp_fw_backend recording_backend;
+
+void recording_backend_stats_get (recording_backend_stats *stats);
+
+#endif /* RECORDING_BACKEND_H */
@@ -0,0 +1,276 @@
+/**
+ * @file expiry_heap.c
+ *
+ * Min-heap of mapping expiry times, keyed on end of life. A hash table from
+ * mapping index to heap position lets an entry be rescheduled or cancelled
+ * in O(log n) without searching the heap.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "expiry_heap.h"
+
+#define INITIAL_CAPACITY 64
+
+typedef struct _expiry_entry
+{
+    int index;
+    u_int32_t end_of_life;
+} expiry_entry;
+
+struct _expiry_heap
+{
+    expiry_entry *entries;
+    int size;
+    int capacity;
+    GHashTable *positions;      // mapping index -> heap position + 1
+};
+
+/**
+ * @brief expiry_heap_new - Create an empty expiry heap
+ * @return - The new heap or NULL on failure
+ */
+expiry_heap *
+expiry_heap_new (void)
+{
+    expiry_heap *heap = malloc (sizeof (expiry_heap));
+
+    if (heap == NULL)
+    {
+        return NULL;
+    }
+    heap->entries = malloc (INITIAL_CAPACITY * sizeof (expiry_entry));
+    if (heap->entries == NULL)
+    {
+        free (heap);
+        return NULL;
+    }
+    heap->size = 0;
+    heap->capacity = INITIAL_CAPACITY;
+    heap->positions = g_hash_table_new (g_direct_hash, g_direct_equal);
+    return heap;
+}
+
+/**
+ * @brief expiry_heap_free - Free the heap
+ * @param heap - The heap
+ */
+void
+expiry_heap_free (expiry_heap *heap)
+{
+    if (heap == NULL)
+    {
+        return;
+    }
+    g_hash_table_destroy (heap->positions);
+    free (heap->entries);
+    free (heap);
+}
+
+/* Position of an index in the heap, or -1 if it is not scheduled */
+static int
+position_get (expiry_heap *heap, int index)
+{
+    return GPOINTER_TO_INT (g_hash_table_lookup (heap->positions,
+                                                 GINT_TO_POINTER (index))) - 1;
+}
+
+static void
+entry_set (expiry_heap *heap, int pos, expiry_entry entry)
+{
+    heap->entries[pos] = entry;
+    g_hash_table_insert (heap->positions, GINT_TO_POINTER (entry.index),
+                         GINT_TO_POINTER (pos + 1));
+}
+
+static void
+sift_up (expiry_heap *heap, int pos)
+{
+    expiry_entry entry = heap->entries[pos];
+    int parent;
+
+    while (pos > 0)
+    {
+        parent = (pos - 1) / 2;
+        if (heap->entries[parent].end_of_life <= entry.end_of_life)
+        {
+            break;
+        }
+        entry_set (heap, pos, heap->entries[parent]);
+        pos = parent;
+    }
+    entry_set (heap, pos, entry);
+}
+
+static void
+sift_down (expiry_heap *heap, int pos)
+{
+    expiry_entry entry = heap->entries[pos];
+    int child;
+
+    while ((child = 2 * pos + 1) < heap->size)
+    {
+        if (child + 1 < heap->size &&
+            heap->entries[child + 1].end_of_life < heap->entries[child].end_of_life)
+        {
+            child++;
+        }
+        if (entry.end_of_life <= heap->entries[child].end_of_life)
+        {
+            break;
+        }
+        entry_set (heap, pos, heap->entries[child]);
+        pos = child;
+    }
+    entry_set (heap, pos, entry);
+}
+
+/* Remove the entry at pos, filling the hole with the last entry */
+static void
+remove_at (expiry_heap *heap, int pos)
+{
+    int moved;
+
+    g_hash_table_remove (heap->positions, GINT_TO_POINTER (heap->entries[pos].index));
+    heap->size--;
+    if (pos == heap->size)
+    {
+        return;
+    }
+    moved = heap->entries[heap->size].index;
+    heap->entries[pos] = heap->entries[heap->size];
+    sift_down (heap, pos);
+    sift_up (heap, position_get (heap, moved));
+}
+
+/**
+ * @brief expiry_heap_schedule - Schedule a mapping to expire, or move the
+ *          expiry time of a mapping that is already scheduled
+ * @param heap - The heap
+ * @param index - Index of the mapping
+ * @param end_of_life - Time the mapping expires
+ * @return - True on success, false if memory could not be allocated
+ */
+bool
+expiry_heap_schedule (expiry_heap *heap, int index, u_int32_t end_of_life)
+{
+    int pos = position_get (heap, index);
+    expiry_entry *entries;
+
+    if (pos >= 0)
+    {
+        heap->entries[pos].end_of_life = end_of_life;
+        sift_up (heap, pos);
+        sift_down (heap, position_get (heap, index));
+        return true;
+    }
+
+    if (heap->size == heap->capacity)
+    {
+        entries = realloc (heap->entries, 2 * heap->capacity * sizeof (expiry_entry));
+        if (entries == NULL)
+        {
+            return false;
+        }
+        heap->entries = entries;
+        heap->capacity *= 2;
+    }
+    heap->entries[heap->size].index = index;
+    heap->entries[heap->size].end_of_life = end_of_life;
+    heap->size++;
+    sift_up (heap, heap->size - 1);
+    return true;
+}
+
+/**
+ * @brief expiry_heap_cancel - Remove a mapping from the heap
+ * @param heap - The heap
+ * @param index - Index of the mapping
+ * @return - True if the mapping was scheduled
+ */
+bool
+expiry_heap_cancel (expiry_heap *heap, int index)
+{
+    int pos = position_get (heap, index);
+
+    if (pos < 0)
+    {
+        return false;
+    }
+    remove_at (heap, pos);
+    return true;
+}
+
+/**
+ * @brief expiry_heap_peek - Get the mapping that expires first
+ * @param heap - The heap
+ * @param index - Set to the index of the mapping, may be NULL
+ * @param end_of_life - Set to the time the mapping expires, may be NULL
+ * @return - False if the heap is empty
+ */
+bool
+expiry_heap_peek (expiry_heap *heap, int *index, u_int32_t *end_of_life)
+{
+    if (heap->size == 0)
+    {
+        return false;
+    }
+    if (index)
+    {
+        *index = heap->entries[0].index;
+    }
+    if (end_of_life)
+    {
+        *end_of_life = heap->entries[0].end_of_life;
+    }
+    return true;
+}
+
+/**
+ * @brief expiry_heap_pop_due - Remove the first mapping if it has expired
+ * @param heap - The heap
+ * @param now - The current time
+ * @param index - Set to the index of the expired mapping
+ * @return - True if a mapping had expired and was removed
+ */
+bool
+expiry_heap_pop_due (expiry_heap *heap, u_int32_t now, int *index)
+{
+    if (heap->size == 0 || heap->entries[0].end_of_life > now)
+    {
+        return false;
+    }
+    *index = heap->entries[0].index;
+    remove_at (heap, 0);
+    return true;
+}
+
+/**
+ * @brief expiry_heap_size - Get the number of scheduled mappings
+ * @param heap - The heap
+ * @return - The number of scheduled mappings
+ */
+int
+expiry_heap_size (expiry_heap *heap)
+{
+    return heap->size;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file expiry_heap.h
+ *
+ * Min-heap of mapping expiry times.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EXPIRY_HEAP_H
+#define EXPIRY_HEAP_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* The heap does no locking of its own. Callers serialize access. */
+typedef struct _expiry_heap expiry_heap;
+
+expiry_heap *expiry_heap_new (void);
+
+void expiry_heap_free (expiry_heap *heap);
+
+bool expiry_heap_schedule (expiry_heap *heap, int index, u_int32_t end_of_life);
+
+bool expiry_heap_cancel (expiry_heap *heap, int index);
+
+bool expiry_heap_peek (expiry_heap *heap, int *index, u_int32_t *end_of_life);
+
+bool expiry_heap_pop_due (expiry_heap *heap, u_int32_t now, int *index);
+
+int expiry_heap_size (expiry_heap *heap);
+
+#endif /* EXPIRY_HEAP_H */
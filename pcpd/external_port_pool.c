@@ -0,0 +1,464 @@
+/**
+ * @file external_port_pool.c
+ *
+ * Allocator of external ports. Each external IP address and protocol has a
+ * bitmap of the ports in use, made of 4096-port blocks that are only
+ * allocated once one of their ports is used. Every block keeps a word with a
+ * bit for each of its 64-bit words that is full, and every bitmap a word with
+ * a bit for each full block, so finding the next free port takes a few bit
+ * scans even when nearly all ports are in use.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "external_port_pool.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+#define BITS_PER_WORD 64
+#define WORDS_PER_BLOCK 64
+#define PORTS_PER_BLOCK (BITS_PER_WORD * WORDS_PER_BLOCK)
+#define NUM_BLOCKS (65536 / PORTS_PER_BLOCK)
+#define ALL_USED UINT64_MAX
+
+/* 4096 consecutive ports. Ports outside the pool's range are marked used. */
+typedef struct _port_block
+{
+    uint64_t full;                      // Bit w set when used[w] has no free port
+    uint64_t used[WORDS_PER_BLOCK];     // Bit set when the port is in use
+} port_block;
+
+/* The ports of one external address and protocol */
+typedef struct _port_bitmap
+{
+    struct in6_addr ip;
+    u_int8_t protocol;
+    int in_use;                         // Number of ports in use
+    int next;                           // Where to search from without a suggestion
+    u_int16_t full_blocks;              // Bit b set when block b has no free port
+    port_block *blocks[NUM_BLOCKS];     // NULL until a port in the block is used
+} port_bitmap;
+
+struct _external_port_pool
+{
+    int min_port;
+    int max_port;
+    u_int16_t empty_blocks;             // Bit b set when block b has no port in range
+    GHashTable *bitmaps;                // Set of port_bitmap, hashed on address and protocol
+};
+
+static guint
+bitmap_hash (gconstpointer key)
+{
+    const port_bitmap *bitmap = key;
+    const unsigned char *p = (const unsigned char *) &bitmap->ip;
+    guint hash = FNV_OFFSET_BASIS;
+    size_t i;
+
+    for (i = 0; i < sizeof (struct in6_addr); i++)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    hash ^= bitmap->protocol;
+    hash *= FNV_PRIME;
+    return hash;
+}
+
+static gboolean
+bitmap_equal (gconstpointer _a, gconstpointer _b)
+{
+    const port_bitmap *a = _a;
+    const port_bitmap *b = _b;
+
+    return memcmp (&a->ip, &b->ip, sizeof (struct in6_addr)) == 0 &&
+           a->protocol == b->protocol;
+}
+
+static void
+bitmap_destroy (gpointer data)
+{
+    port_bitmap *bitmap = data;
+    int b;
+
+    for (b = 0; b < NUM_BLOCKS; b++)
+    {
+        free (bitmap->blocks[b]);
+    }
+    free (bitmap);
+}
+
+/**
+ * @brief external_port_pool_new - Create a pool with every port free
+ * @param min_port - Lowest port the pool may hand out, at least 1
+ * @param max_port - Highest port the pool may hand out
+ * @return - The new pool or NULL on failure
+ */
+external_port_pool *
+external_port_pool_new (u_int16_t min_port, u_int16_t max_port)
+{
+    external_port_pool *pool;
+    int b;
+
+    if (min_port == 0 || min_port > max_port)
+    {
+        return NULL;
+    }
+    pool = calloc (1, sizeof (external_port_pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->min_port = min_port;
+    pool->max_port = max_port;
+    for (b = 0; b < NUM_BLOCKS; b++)
+    {
+        if ((b + 1) * PORTS_PER_BLOCK <= pool->min_port || b * PORTS_PER_BLOCK > pool->max_port)
+        {
+            pool->empty_blocks |= 1 << b;
+        }
+    }
+    pool->bitmaps = g_hash_table_new_full (bitmap_hash, bitmap_equal, bitmap_destroy, NULL);
+    return pool;
+}
+
+/**
+ * @brief external_port_pool_free - Free the pool
+ * @param pool - The pool
+ */
+void
+external_port_pool_free (external_port_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    g_hash_table_destroy (pool->bitmaps);
+    free (pool);
+}
+
+static bool
+in_range (external_port_pool *pool, int port)
+{
+    return port >= pool->min_port && port <= pool->max_port;
+}
+
+/* Bits of the 64 ports from base that are outside the pool's range */
+static uint64_t
+out_of_range_bits (external_port_pool *pool, int base)
+{
+    uint64_t bits = 0;
+
+    if (base + BITS_PER_WORD <= pool->min_port || base > pool->max_port)
+    {
+        return ALL_USED;
+    }
+    if (pool->min_port > base)
+    {
+        bits |= (1ULL << (pool->min_port - base)) - 1;
+    }
+    if (pool->max_port < base + BITS_PER_WORD - 1)
+    {
+        bits |= ALL_USED << (pool->max_port - base + 1);
+    }
+    return bits;
+}
+
+static port_bitmap *
+bitmap_get (external_port_pool *pool, struct in6_addr *ip, u_int8_t protocol, bool create)
+{
+    port_bitmap key;
+    port_bitmap *bitmap;
+
+    key.ip = *ip;
+    key.protocol = protocol;
+    bitmap = g_hash_table_lookup (pool->bitmaps, &key);
+    if (bitmap == NULL && create && (bitmap = calloc (1, sizeof (port_bitmap))) != NULL)
+    {
+        bitmap->ip = *ip;
+        bitmap->protocol = protocol;
+        bitmap->next = pool->min_port;
+        bitmap->full_blocks = pool->empty_blocks;
+        g_hash_table_add (pool->bitmaps, bitmap);
+    }
+    return bitmap;
+}
+
+/* Free the bitmap once none of its ports are in use */
+static void
+bitmap_put (external_port_pool *pool, port_bitmap *bitmap)
+{
+    if (bitmap->in_use == 0)
+    {
+        g_hash_table_remove (pool->bitmaps, bitmap);
+    }
+}
+
+static bool
+port_used (port_bitmap *bitmap, int port)
+{
+    port_block *block = bitmap->blocks[port / PORTS_PER_BLOCK];
+    int bit = port % PORTS_PER_BLOCK;
+
+    return block && (block->used[bit / BITS_PER_WORD] & (1ULL << (bit % BITS_PER_WORD)));
+}
+
+static bool
+port_set (external_port_pool *pool, port_bitmap *bitmap, int port)
+{
+    int b = port / PORTS_PER_BLOCK;
+    int w = (port % PORTS_PER_BLOCK) / BITS_PER_WORD;
+    port_block *block = bitmap->blocks[b];
+    int i;
+
+    if (block == NULL)
+    {
+        block = calloc (1, sizeof (port_block));
+        if (block == NULL)
+        {
+            return false;
+        }
+        for (i = 0; i < WORDS_PER_BLOCK; i++)
+        {
+            block->used[i] = out_of_range_bits (pool, b * PORTS_PER_BLOCK + i * BITS_PER_WORD);
+            if (block->used[i] == ALL_USED)
+            {
+                block->full |= 1ULL << i;
+            }
+        }
+        bitmap->blocks[b] = block;
+    }
+
+    block->used[w] |= 1ULL << (port % BITS_PER_WORD);
+    if (block->used[w] == ALL_USED)
+    {
+        block->full |= 1ULL << w;
+        if (block->full == ALL_USED)
+        {
+            bitmap->full_blocks |= 1 << b;
+        }
+    }
+    bitmap->in_use++;
+    return true;
+}
+
+static void
+port_clear (port_bitmap *bitmap, int port)
+{
+    int b = port / PORTS_PER_BLOCK;
+    int w = (port % PORTS_PER_BLOCK) / BITS_PER_WORD;
+    port_block *block = bitmap->blocks[b];
+
+    block->used[w] &= ~(1ULL << (port % BITS_PER_WORD));
+    block->full &= ~(1ULL << w);
+    bitmap->full_blocks &= ~(1 << b);
+    bitmap->in_use--;
+}
+
+/* Find the lowest free port from start to end, both in range */
+static int
+find_free (port_bitmap *bitmap, int start, int end)
+{
+    port_block *block;
+    uint64_t bits;
+    int port = start;
+    int b, w;
+
+    while (port <= end)
+    {
+        b = port / PORTS_PER_BLOCK;
+        block = bitmap->blocks[b];
+        if (bitmap->full_blocks & (1 << b))
+        {
+            port = (b + 1) * PORTS_PER_BLOCK;
+            continue;
+        }
+        if (block == NULL)
+        {
+            return port;
+        }
+
+        w = (port % PORTS_PER_BLOCK) / BITS_PER_WORD;
+        bits = ~block->used[w] & (ALL_USED << (port % BITS_PER_WORD));
+        if (bits == 0)
+        {
+            /* The next word of the block with a free port */
+            bits = w + 1 < WORDS_PER_BLOCK ? ~block->full & (ALL_USED << (w + 1)) : 0;
+            if (bits == 0)
+            {
+                port = (b + 1) * PORTS_PER_BLOCK;
+                continue;
+            }
+            w = __builtin_ctzll (bits);
+            bits = ~block->used[w];
+        }
+        port = b * PORTS_PER_BLOCK + w * BITS_PER_WORD + __builtin_ctzll (bits);
+        return port <= end ? port : -1;
+    }
+    return -1;
+}
+
+/**
+ * @brief external_port_pool_alloc - Hand out an external port. The suggested
+ *          port is used if it is free. Otherwise the next free port after it
+ *          is used, or after the last port handed out if the suggestion is
+ *          outside the range, wrapping around to the start of the range.
+ * @param pool - The pool
+ * @param ip - External IP address
+ * @param protocol - Protocol
+ * @param suggested - Port the client suggested, or 0
+ * @param exact - Fail rather than hand out a port other than suggested
+ * @return - The port or -1 if none is available
+ */
+int
+external_port_pool_alloc (external_port_pool *pool, struct in6_addr *ip,
+                          u_int8_t protocol, u_int16_t suggested, bool exact)
+{
+    port_bitmap *bitmap = bitmap_get (pool, ip, protocol, true);
+    int start;
+    int port;
+
+    if (bitmap == NULL)
+    {
+        return -1;
+    }
+
+    if (in_range (pool, suggested) && !port_used (bitmap, suggested))
+    {
+        port = suggested;
+    }
+    else if (exact)
+    {
+        port = -1;
+    }
+    else
+    {
+        start = in_range (pool, suggested) ? suggested : bitmap->next;
+        port = find_free (bitmap, start, pool->max_port);
+        if (port < 0 && start > pool->min_port)
+        {
+            port = find_free (bitmap, pool->min_port, start - 1);
+        }
+    }
+
+    if (port < 0 || !port_set (pool, bitmap, port))
+    {
+        bitmap_put (pool, bitmap);
+        return -1;
+    }
+    if (!in_range (pool, suggested))
+    {
+        bitmap->next = port < pool->max_port ? port + 1 : pool->min_port;
+    }
+    return port;
+}
+
+/**
+ * @brief external_port_pool_claim - Mark a port assigned elsewhere as in use,
+ *          so the pool never hands it out
+ * @param pool - The pool
+ * @param ip - External IP address
+ * @param protocol - Protocol
+ * @param port - The port
+ * @return - True if the port is in range and was free
+ */
+bool
+external_port_pool_claim (external_port_pool *pool, struct in6_addr *ip,
+                          u_int8_t protocol, u_int16_t port)
+{
+    port_bitmap *bitmap;
+
+    if (!in_range (pool, port) || (bitmap = bitmap_get (pool, ip, protocol, true)) == NULL)
+    {
+        return false;
+    }
+    if (port_used (bitmap, port) || !port_set (pool, bitmap, port))
+    {
+        bitmap_put (pool, bitmap);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief external_port_pool_release - Return a port to the pool
+ * @param pool - The pool
+ * @param ip - External IP address
+ * @param protocol - Protocol
+ * @param port - The port
+ * @return - True if the port was in use
+ */
+bool
+external_port_pool_release (external_port_pool *pool, struct in6_addr *ip,
+                            u_int8_t protocol, u_int16_t port)
+{
+    port_bitmap *bitmap;
+
+    if (!in_range (pool, port) || (bitmap = bitmap_get (pool, ip, protocol, false)) == NULL ||
+        !port_used (bitmap, port))
+    {
+        return false;
+    }
+    port_clear (bitmap, port);
+    bitmap_put (pool, bitmap);
+    return true;
+}
+
+/**
+ * @brief external_port_pool_in_use - Check if a port is in use
+ * @param pool - The pool
+ * @param ip - External IP address
+ * @param protocol - Protocol
+ * @param port - The port
+ * @return - True if the port is in range and in use
+ */
+bool
+external_port_pool_in_use (external_port_pool *pool, struct in6_addr *ip,
+                           u_int8_t protocol, u_int16_t port)
+{
+    port_bitmap *bitmap;
+
+    if (!in_range (pool, port) || (bitmap = bitmap_get (pool, ip, protocol, false)) == NULL)
+    {
+        return false;
+    }
+    return port_used (bitmap, port);
+}
+
+/**
+ * @brief external_port_pool_available - Count the free ports of an address
+ * @param pool - The pool
+ * @param ip - External IP address
+ * @param protocol - Protocol
+ * @return - Number of ports in range that are free
+ */
+int
+external_port_pool_available (external_port_pool *pool, struct in6_addr *ip,
+                              u_int8_t protocol)
+{
+    port_bitmap *bitmap = bitmap_get (pool, ip, protocol, false);
+
+    return pool->max_port - pool->min_port + 1 - (bitmap ? bitmap->in_use : 0);
+}
@@ -0,0 +1,58 @@
+/**
+ * @file external_port_pool.h
+ *
+ * Allocator of external ports, with a port bitmap for each external IP
+ * address and protocol.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EXTERNAL_PORT_POOL_H
+#define EXTERNAL_PORT_POOL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define DEFAULT_MIN_EXTERNAL_PORT 1
+#define DEFAULT_MAX_EXTERNAL_PORT 65535
+
+/* The pool does no locking of its own. Callers serialize access. */
+typedef struct _external_port_pool external_port_pool;
+
+external_port_pool *external_port_pool_new (u_int16_t min_port, u_int16_t max_port);
+
+void external_port_pool_free (external_port_pool *pool);
+
+int external_port_pool_alloc (external_port_pool *pool, struct in6_addr *ip,
+                              u_int8_t protocol, u_int16_t suggested, bool exact);
+
+bool external_port_pool_claim (external_port_pool *pool, struct in6_addr *ip,
+                               u_int8_t protocol, u_int16_t port);
+
+bool external_port_pool_release (external_port_pool *pool, struct in6_addr *ip,
+                                 u_int8_t protocol, u_int16_t port);
+
+bool external_port_pool_in_use (external_port_pool *pool, struct in6_addr *ip,
+                                u_int8_t protocol, u_int16_t port);
+
+int external_port_pool_available (external_port_pool *pool, struct in6_addr *ip,
+                                  u_int8_t protocol);
+
+#endif /* EXTERNAL_PORT_POOL_H */
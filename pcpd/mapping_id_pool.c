@@ -0,0 +1,340 @@
+/**
+ * @file mapping_id_pool.c
+ *
+ * Constant time allocator for mapping IDs. IDs are multiples of a fixed step.
+ * A bitmap records which IDs are in use and released IDs are kept on a free
+ * stack so they are handed out again before the high-water mark is raised.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapping_id_pool.h"
+
+#define BITS_PER_WORD 64
+#define INITIAL_SIZE 64
+
+/* IDs are stored as slot numbers, ID / step. Slot 0 is never used. */
+struct _mapping_id_pool
+{
+    int step;
+    int max_slot;
+    int high;                   // Highest slot handed out, claimed or restored
+    int gap;                    // Free slots up to high below this are on the stack
+    uint64_t *used;             // Bitmap of slots in use
+    int used_words;
+    int *free_slots;            // Stack of released slots, may hold stale entries
+    int free_count;
+    int free_size;
+};
+
+/**
+ * @brief mapping_id_pool_new - Create an empty pool
+ * @param step - Difference between consecutive IDs
+ * @param max_id - Largest ID the pool may hand out
+ * @return - The new pool or NULL on failure
+ */
+mapping_id_pool *
+mapping_id_pool_new (int step, int max_id)
+{
+    mapping_id_pool *pool;
+
+    if (step <= 0 || max_id < step)
+    {
+        return NULL;
+    }
+    pool = calloc (1, sizeof (mapping_id_pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->step = step;
+    pool->max_slot = max_id / step;
+    pool->gap = 1;
+    return pool;
+}
+
+/**
+ * @brief mapping_id_pool_free - Free the pool
+ * @param pool - The pool
+ */
+void
+mapping_id_pool_free (mapping_id_pool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    free (pool->used);
+    free (pool->free_slots);
+    free (pool);
+}
+
+/* Convert an ID to its slot, or return 0 if the ID is not one of ours */
+static int
+id_to_slot (mapping_id_pool *pool, int id)
+{
+    if (id <= 0 || id % pool->step != 0 || id / pool->step > pool->max_slot)
+    {
+        return 0;
+    }
+    return id / pool->step;
+}
+
+static bool
+slot_used (mapping_id_pool *pool, int slot)
+{
+    int word = slot / BITS_PER_WORD;
+
+    return word < pool->used_words &&
+           (pool->used[word] & (1ULL << (slot % BITS_PER_WORD))) != 0;
+}
+
+/* Grow the bitmap so it covers slot */
+static bool
+bitmap_reserve (mapping_id_pool *pool, int slot)
+{
+    int words = pool->used_words ? pool->used_words : INITIAL_SIZE / BITS_PER_WORD;
+    uint64_t *used;
+
+    if (slot / BITS_PER_WORD < pool->used_words)
+    {
+        return true;
+    }
+    while (slot / BITS_PER_WORD >= words)
+    {
+        words *= 2;
+    }
+    used = realloc (pool->used, words * sizeof (uint64_t));
+    if (used == NULL)
+    {
+        return false;
+    }
+    memset (used + pool->used_words, 0, (words - pool->used_words) * sizeof (uint64_t));
+    pool->used = used;
+    pool->used_words = words;
+    return true;
+}
+
+static void
+slot_set (mapping_id_pool *pool, int slot, bool in_use)
+{
+    if (in_use)
+    {
+        pool->used[slot / BITS_PER_WORD] |= 1ULL << (slot % BITS_PER_WORD);
+    }
+    else
+    {
+        pool->used[slot / BITS_PER_WORD] &= ~(1ULL << (slot % BITS_PER_WORD));
+    }
+}
+
+static bool
+free_push (mapping_id_pool *pool, int slot)
+{
+    int *free_slots;
+    int size;
+
+    if (pool->free_count == pool->free_size)
+    {
+        size = pool->free_size ? pool->free_size * 2 : INITIAL_SIZE;
+        free_slots = realloc (pool->free_slots, size * sizeof (int));
+        if (free_slots == NULL)
+        {
+            return false;
+        }
+        pool->free_slots = free_slots;
+        pool->free_size = size;
+    }
+    pool->free_slots[pool->free_count++] = slot;
+    return true;
+}
+
+/* Raise the high-water mark to slot. The slots skipped over are free. They
+ * are not pushed on the stack, but found in the bitmap when the stack is
+ * empty, so a large claimed or restored ID costs no more than a small one. */
+static bool
+raise_high_water (mapping_id_pool *pool, int slot)
+{
+    if (!bitmap_reserve (pool, slot))
+    {
+        return false;
+    }
+    if (pool->gap > pool->high + 1)
+    {
+        pool->gap = pool->high + 1;
+    }
+    pool->high = slot;
+    return true;
+}
+
+/* Find the lowest free slot from the gap up to the high-water mark, or 0 if
+ * there is none */
+static int
+gap_take (mapping_id_pool *pool)
+{
+    int slot = pool->gap;
+    uint64_t free_bits;
+
+    while (slot <= pool->high)
+    {
+        free_bits = ~pool->used[slot / BITS_PER_WORD] >> (slot % BITS_PER_WORD);
+        if (free_bits != 0)
+        {
+            slot += __builtin_ctzll (free_bits);
+            if (slot > pool->high)
+            {
+                break;
+            }
+            pool->gap = slot + 1;
+            return slot;
+        }
+        slot = (slot / BITS_PER_WORD + 1) * BITS_PER_WORD;
+    }
+    pool->gap = pool->high + 1;
+    return 0;
+}
+
+/**
+ * @brief mapping_id_pool_alloc - Hand out the most recently released ID, the
+ *          lowest skipped ID below the high-water mark, or the ID after it
+ * @param pool - The pool
+ * @return - The ID or -1 if the pool is exhausted
+ */
+int
+mapping_id_pool_alloc (mapping_id_pool *pool)
+{
+    int slot;
+
+    /* Slots claimed since they were released are skipped */
+    while (pool->free_count > 0)
+    {
+        slot = pool->free_slots[--pool->free_count];
+        if (!slot_used (pool, slot))
+        {
+            slot_set (pool, slot, true);
+            return slot * pool->step;
+        }
+    }
+
+    slot = gap_take (pool);
+    if (slot != 0)
+    {
+        slot_set (pool, slot, true);
+        return slot * pool->step;
+    }
+
+    if (pool->high >= pool->max_slot || !raise_high_water (pool, pool->high + 1))
+    {
+        return -1;
+    }
+    slot_set (pool, pool->high, true);
+    return pool->high * pool->step;
+}
+
+/**
+ * @brief mapping_id_pool_release - Return an ID to the pool
+ * @param pool - The pool
+ * @param id - The ID
+ * @return - True if the ID was in use
+ */
+bool
+mapping_id_pool_release (mapping_id_pool *pool, int id)
+{
+    int slot = id_to_slot (pool, id);
+
+    if (slot == 0 || !slot_used (pool, slot) || !free_push (pool, slot))
+    {
+        return false;
+    }
+    slot_set (pool, slot, false);
+    return true;
+}
+
+/**
+ * @brief mapping_id_pool_claim - Mark an ID allocated elsewhere as in use, so
+ *          the pool never hands it out
+ * @param pool - The pool
+ * @param id - The ID
+ * @return - True if the ID was free and is now in use
+ */
+bool
+mapping_id_pool_claim (mapping_id_pool *pool, int id)
+{
+    int slot = id_to_slot (pool, id);
+
+    if (slot == 0 || slot_used (pool, slot))
+    {
+        return false;
+    }
+    if (slot > pool->high && !raise_high_water (pool, slot))
+    {
+        return false;
+    }
+    slot_set (pool, slot, true);
+    return true;
+}
+
+/**
+ * @brief mapping_id_pool_restore - Restore a high-water mark saved by a
+ *          previous run. IDs up to it that are not claimed are free.
+ * @param pool - The pool
+ * @param high_water - The saved high-water mark
+ * @return - False if the high-water mark is not a valid ID
+ */
+bool
+mapping_id_pool_restore (mapping_id_pool *pool, int high_water)
+{
+    int slot = id_to_slot (pool, high_water);
+
+    if (slot == 0)
+    {
+        return false;
+    }
+    return slot <= pool->high || raise_high_water (pool, slot);
+}
+
+/**
+ * @brief mapping_id_pool_in_use - Check if an ID is in use
+ * @param pool - The pool
+ * @param id - The ID
+ * @return - True if the ID is in use
+ */
+bool
+mapping_id_pool_in_use (mapping_id_pool *pool, int id)
+{
+    int slot = id_to_slot (pool, id);
+
+    return slot != 0 && slot_used (pool, slot);
+}
+
+/**
+ * @brief mapping_id_pool_high_water - Get the highest ID the pool has handed
+ *          out, been told about or restored
+ * @param pool - The pool
+ * @return - The high-water mark, or 0 if the pool has never been used
+ */
+int
+mapping_id_pool_high_water (mapping_id_pool *pool)
+{
+    return pool->high * pool->step;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file mapping_id_pool.h
+ *
+ * Allocator for mapping IDs.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MAPPING_ID_POOL_H
+#define MAPPING_ID_POOL_H
+
+#include <stdbool.h>
+
+/* The pool does no locking of its own. Callers serialize access. */
+typedef struct _mapping_id_pool mapping_id_pool;
+
+mapping_id_pool *mapping_id_pool_new (int step, int max_id);
+
+void mapping_id_pool_free (mapping_id_pool *pool);
+
+int mapping_id_pool_alloc (mapping_id_pool *pool);
+
+bool mapping_id_pool_release (mapping_id_pool *pool, int id);
+
+bool mapping_id_pool_claim (mapping_id_pool *pool, int id);
+
+bool mapping_id_pool_restore (mapping_id_pool *pool, int high_water);
+
+bool mapping_id_pool_in_use (mapping_id_pool *pool, int id);
+
+int mapping_id_pool_high_water (mapping_id_pool *pool);
+
+#endif /* MAPPING_ID_POOL_H */
@@ -0,0 +1,591 @@
+/**
+ * @file mapping_table.c
+ *
+ * Hash-indexed table of the current PCP mappings. Mappings can be found in
+ * constant time by index, by the (nonce, internal IP, internal port, protocol)
+ * of the MAP request that created them, and by their (external IP, external
+ * port, protocol) or internal endpoint. An index-ordered tree is kept
+ * alongside for iteration. A PEER mapping may share its endpoints with a MAP
+ * mapping, so the endpoint indexes hold every mapping with the endpoint.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "mapping_table.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+struct _mapping_table
+{
+    GHashTable *by_index;       // &mapping->index -> mapping
+    GHashTable *by_request;     // mapping -> mapping, hashed on the MAP request fields
+    GHashTable *by_peer;        // mapping -> mapping, hashed on the PEER 5-tuple
+    GHashTable *by_external;    // Set of mapping_bucket, hashed on the external fields
+    GHashTable *by_internal;    // Set of mapping_bucket, hashed on the internal fields
+    GTree *ordered;             // &mapping->index -> mapping, sorted by index
+    GDestroyNotify destroy;
+};
+
+/* The mappings sharing an endpoint. The key comes first so the endpoint hash
+ * and compare functions work on the bucket. */
+typedef struct _mapping_bucket
+{
+    struct pcp_mapping_s key;
+    GList *mappings;            // Most recently inserted first
+} mapping_bucket;
+
+/* FNV-1a over a run of bytes, continuing from hash */
+static guint
+hash_bytes (guint hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static guint
+request_hash (gconstpointer key)
+{
+    const struct pcp_mapping_s *mapping = key;
+    guint hash = FNV_OFFSET_BASIS;
+
+    hash = hash_bytes (hash, mapping->mapping_nonce, sizeof (mapping->mapping_nonce));
+    hash = hash_bytes (hash, &mapping->internal_ip, sizeof (struct in6_addr));
+    hash = hash_bytes (hash, &mapping->internal_port, sizeof (u_int16_t));
+    hash = hash_bytes (hash, &mapping->protocol, sizeof (u_int8_t));
+    return hash;
+}
+
+static gboolean
+request_equal (gconstpointer _a, gconstpointer _b)
+{
+    const struct pcp_mapping_s *a = _a;
+    const struct pcp_mapping_s *b = _b;
+
+    return memcmp (a->mapping_nonce, b->mapping_nonce, sizeof (a->mapping_nonce)) == 0 &&
+           memcmp (&a->internal_ip, &b->internal_ip, sizeof (struct in6_addr)) == 0 &&
+           a->internal_port == b->internal_port &&
+           a->protocol == b->protocol;
+}
+
+static guint
+peer_hash (gconstpointer key)
+{
+    const struct pcp_mapping_s *mapping = key;
+    guint hash = FNV_OFFSET_BASIS;
+
+    hash = hash_bytes (hash, &mapping->internal_ip, sizeof (struct in6_addr));
+    hash = hash_bytes (hash, &mapping->internal_port, sizeof (u_int16_t));
+    hash = hash_bytes (hash, &mapping->remote_peer_ip, sizeof (struct in6_addr));
+    hash = hash_bytes (hash, &mapping->remote_peer_port, sizeof (u_int16_t));
+    hash = hash_bytes (hash, &mapping->protocol, sizeof (u_int8_t));
+    return hash;
+}
+
+static gboolean
+peer_equal (gconstpointer _a, gconstpointer _b)
+{
+    const struct pcp_mapping_s *a = _a;
+    const struct pcp_mapping_s *b = _b;
+
+    return memcmp (&a->internal_ip, &b->internal_ip, sizeof (struct in6_addr)) == 0 &&
+           a->internal_port == b->internal_port &&
+           memcmp (&a->remote_peer_ip, &b->remote_peer_ip, sizeof (struct in6_addr)) == 0 &&
+           a->remote_peer_port == b->remote_peer_port &&
+           a->protocol == b->protocol;
+}
+
+static guint
+external_hash (gconstpointer key)
+{
+    const struct pcp_mapping_s *mapping = key;
+    guint hash = FNV_OFFSET_BASIS;
+
+    hash = hash_bytes (hash, &mapping->external_ip, sizeof (struct in6_addr));
+    hash = hash_bytes (hash, &mapping->external_port, sizeof (u_int16_t));
+    hash = hash_bytes (hash, &mapping->protocol, sizeof (u_int8_t));
+    return hash;
+}
+
+static gboolean
+external_equal (gconstpointer _a, gconstpointer _b)
+{
+    const struct pcp_mapping_s *a = _a;
+    const struct pcp_mapping_s *b = _b;
+
+    return memcmp (&a->external_ip, &b->external_ip, sizeof (struct in6_addr)) == 0 &&
+           a->external_port == b->external_port &&
+           a->protocol == b->protocol;
+}
+
+static guint
+internal_hash (gconstpointer key)
+{
+    const struct pcp_mapping_s *mapping = key;
+    guint hash = FNV_OFFSET_BASIS;
+
+    hash = hash_bytes (hash, &mapping->internal_ip, sizeof (struct in6_addr));
+    hash = hash_bytes (hash, &mapping->internal_port, sizeof (u_int16_t));
+    hash = hash_bytes (hash, &mapping->protocol, sizeof (u_int8_t));
+    return hash;
+}
+
+static gboolean
+internal_equal (gconstpointer _a, gconstpointer _b)
+{
+    const struct pcp_mapping_s *a = _a;
+    const struct pcp_mapping_s *b = _b;
+
+    return memcmp (&a->internal_ip, &b->internal_ip, sizeof (struct in6_addr)) == 0 &&
+           a->internal_port == b->internal_port &&
+           a->protocol == b->protocol;
+}
+
+static void
+bucket_destroy (gpointer data)
+{
+    mapping_bucket *bucket = data;
+
+    g_list_free (bucket->mappings);
+    free (bucket);
+}
+
+static gint
+index_cmp (gconstpointer _a, gconstpointer _b)
+{
+    int a = *(const int *) _a;
+    int b = *(const int *) _b;
+
+    return (a > b) - (a < b);
+}
+
+/**
+ * @brief mapping_table_new - Create an empty mapping table
+ * @param destroy - Function used to free mappings removed from the table, or NULL
+ * @return - The new table
+ */
+mapping_table *
+mapping_table_new (GDestroyNotify destroy)
+{
+    mapping_table *table = malloc (sizeof (mapping_table));
+
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    table->by_index = g_hash_table_new (g_int_hash, g_int_equal);
+    table->by_request = g_hash_table_new (request_hash, request_equal);
+    table->by_peer = g_hash_table_new (peer_hash, peer_equal);
+    table->by_external = g_hash_table_new_full (external_hash, external_equal,
+                                                bucket_destroy, NULL);
+    table->by_internal = g_hash_table_new_full (internal_hash, internal_equal,
+                                                bucket_destroy, NULL);
+    table->ordered = g_tree_new (index_cmp);
+    table->destroy = destroy;
+    return table;
+}
+
+static gboolean
+destroy_mapping (gpointer key, gpointer value, gpointer data)
+{
+    mapping_table *table = (mapping_table *) data;
+
+    if (table->destroy)
+    {
+        table->destroy (value);
+    }
+    return FALSE;
+}
+
+/**
+ * @brief mapping_table_free - Free the table and every mapping in it
+ * @param table - The table
+ */
+void
+mapping_table_free (mapping_table *table)
+{
+    if (table == NULL)
+    {
+        return;
+    }
+    g_tree_foreach (table->ordered, destroy_mapping, table);
+    g_tree_destroy (table->ordered);
+    g_hash_table_destroy (table->by_index);
+    g_hash_table_destroy (table->by_request);
+    g_hash_table_destroy (table->by_peer);
+    g_hash_table_destroy (table->by_external);
+    g_hash_table_destroy (table->by_internal);
+    free (table);
+}
+
+/* Add a mapping to the bucket for its endpoint in an endpoint index */
+static void
+bucket_add (GHashTable *index, pcp_mapping mapping)
+{
+    mapping_bucket *bucket = g_hash_table_lookup (index, mapping);
+
+    if (bucket == NULL)
+    {
+        bucket = malloc (sizeof (*bucket));
+        if (bucket == NULL)
+        {
+            return;
+        }
+        bucket->key = *mapping;
+        bucket->key.path = NULL;
+        bucket->mappings = NULL;
+        g_hash_table_add (index, bucket);
+    }
+    bucket->mappings = g_list_prepend (bucket->mappings, mapping);
+}
+
+/* Remove a mapping from an endpoint index, and its bucket once empty */
+static void
+bucket_remove (GHashTable *index, pcp_mapping mapping)
+{
+    mapping_bucket *bucket = g_hash_table_lookup (index, mapping);
+
+    if (bucket == NULL)
+    {
+        return;
+    }
+    bucket->mappings = g_list_remove (bucket->mappings, mapping);
+    if (bucket->mappings == NULL)
+    {
+        g_hash_table_remove (index, bucket);
+    }
+}
+
+/* Remove a mapping from a secondary index, but only if it is the entry stored
+ * there. Another mapping may share the same key. */
+static void
+remove_if_same (GHashTable *index, pcp_mapping mapping)
+{
+    if (g_hash_table_lookup (index, mapping) == mapping)
+    {
+        g_hash_table_remove (index, mapping);
+    }
+}
+
+/**
+ * @brief mapping_table_steal - Remove a mapping from the table without freeing it
+ * @param table - The table
+ * @param index - Index of the mapping
+ * @return - The removed mapping, or NULL if there is no mapping with that index
+ */
+pcp_mapping
+mapping_table_steal (mapping_table *table, int index)
+{
+    pcp_mapping mapping = g_hash_table_lookup (table->by_index, &index);
+
+    if (mapping == NULL)
+    {
+        return NULL;
+    }
+    g_hash_table_remove (table->by_index, &index);
+    g_tree_remove (table->ordered, &index);
+    remove_if_same (table->by_request, mapping);
+    remove_if_same (table->by_peer, mapping);
+    bucket_remove (table->by_external, mapping);
+    bucket_remove (table->by_internal, mapping);
+    return mapping;
+}
+
+/**
+ * @brief mapping_table_remove - Remove a mapping from the table and free it
+ * @param table - The table
+ * @param index - Index of the mapping
+ * @return - True if a mapping was removed
+ */
+bool
+mapping_table_remove (mapping_table *table, int index)
+{
+    pcp_mapping mapping = mapping_table_steal (table, index);
+
+    if (mapping == NULL)
+    {
+        return false;
+    }
+    if (table->destroy)
+    {
+        table->destroy (mapping);
+    }
+    return true;
+}
+
+/* The index a mapping's request is found with. MAP and PEER requests may
+ * share a nonce and internal endpoint, so PEER mappings are kept apart. */
+static GHashTable *
+request_index (mapping_table *table, pcp_mapping mapping)
+{
+    return mapping->opcode == PEER_OPCODE ? table->by_peer : table->by_request;
+}
+
+/**
+ * @brief mapping_table_insert - Add a mapping to the table. The table takes
+ *          ownership of the mapping. An existing mapping with the same index
+ *          is replaced and freed.
+ * @param table - The table
+ * @param mapping - The mapping
+ */
+void
+mapping_table_insert (mapping_table *table, pcp_mapping mapping)
+{
+    if (mapping_table_find_index (table, mapping->index) == mapping)
+    {
+        return;
+    }
+    mapping_table_remove (table, mapping->index);
+
+    /* Replace rather than insert so the stored keys point at the new mapping */
+    g_hash_table_replace (table->by_index, &mapping->index, mapping);
+    g_tree_replace (table->ordered, &mapping->index, mapping);
+    g_hash_table_replace (request_index (table, mapping), mapping, mapping);
+    bucket_add (table->by_external, mapping);
+    bucket_add (table->by_internal, mapping);
+}
+
+/**
+ * @brief mapping_table_find_index - Find a mapping by its index
+ * @param table - The table
+ * @param index - Index of the mapping
+ * @return - The mapping or NULL if not found
+ */
+pcp_mapping
+mapping_table_find_index (mapping_table *table, int index)
+{
+    return g_hash_table_lookup (table->by_index, &index);
+}
+
+/**
+ * @brief mapping_table_find_request - Find the mapping created by a MAP request
+ * @param table - The table
+ * @param mapping_nonce - Mapping nonce of the request
+ * @param internal_ip - Client IP address of the request
+ * @param internal_port - Internal port of the request
+ * @param protocol - Protocol of the request
+ * @return - The mapping or NULL if not found
+ */
+pcp_mapping
+mapping_table_find_request (mapping_table *table,
+                            u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                            struct in6_addr *internal_ip,
+                            u_int16_t internal_port,
+                            u_int8_t protocol)
+{
+    struct pcp_mapping_s key;
+
+    memcpy (key.mapping_nonce, mapping_nonce, sizeof (key.mapping_nonce));
+    key.internal_ip = *internal_ip;
+    key.internal_port = internal_port;
+    key.protocol = protocol;
+    return g_hash_table_lookup (table->by_request, &key);
+}
+
+/**
+ * @brief mapping_table_find_peer - Find the mapping created by a PEER request
+ *          for a connection
+ * @param table - The table
+ * @param internal_ip - Client IP address of the request
+ * @param internal_port - Internal port of the request
+ * @param remote_peer_ip - Remote peer IP address
+ * @param remote_peer_port - Remote peer port
+ * @param protocol - Protocol of the request
+ * @return - The mapping or NULL if not found
+ */
+pcp_mapping
+mapping_table_find_peer (mapping_table *table,
+                         struct in6_addr *internal_ip,
+                         u_int16_t internal_port,
+                         struct in6_addr *remote_peer_ip,
+                         u_int16_t remote_peer_port,
+                         u_int8_t protocol)
+{
+    struct pcp_mapping_s key;
+
+    key.internal_ip = *internal_ip;
+    key.internal_port = internal_port;
+    key.remote_peer_ip = *remote_peer_ip;
+    key.remote_peer_port = remote_peer_port;
+    key.protocol = protocol;
+    return g_hash_table_lookup (table->by_peer, &key);
+}
+
+/**
+ * @brief mapping_table_find_external - Find the mapping using an external endpoint
+ * @param table - The table
+ * @param external_ip - External IP address
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - The mapping or NULL if not found. If several mappings share the
+ *           endpoint, the most recently inserted one.
+ */
+pcp_mapping
+mapping_table_find_external (mapping_table *table,
+                             struct in6_addr *external_ip,
+                             u_int16_t external_port,
+                             u_int8_t protocol)
+{
+    struct pcp_mapping_s key;
+    mapping_bucket *bucket;
+
+    key.external_ip = *external_ip;
+    key.external_port = external_port;
+    key.protocol = protocol;
+    bucket = g_hash_table_lookup (table->by_external, &key);
+    return bucket ? bucket->mappings->data : NULL;
+}
+
+/**
+ * @brief mapping_table_external_users - Count the mappings using an external endpoint
+ * @param table - The table
+ * @param external_ip - External IP address
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - Number of mappings with that external endpoint
+ */
+int
+mapping_table_external_users (mapping_table *table,
+                              struct in6_addr *external_ip,
+                              u_int16_t external_port,
+                              u_int8_t protocol)
+{
+    struct pcp_mapping_s key;
+    mapping_bucket *bucket;
+
+    key.external_ip = *external_ip;
+    key.external_port = external_port;
+    key.protocol = protocol;
+    bucket = g_hash_table_lookup (table->by_external, &key);
+    return bucket ? g_list_length (bucket->mappings) : 0;
+}
+
+/**
+ * @brief mapping_table_find_internal - Find the mapping for an internal endpoint
+ * @param table - The table
+ * @param internal_ip - Internal IP address
+ * @param internal_port - Internal port
+ * @param protocol - Protocol
+ * @return - The mapping or NULL if not found. If several mappings share the
+ *           endpoint, the most recently inserted one.
+ */
+pcp_mapping
+mapping_table_find_internal (mapping_table *table,
+                             struct in6_addr *internal_ip,
+                             u_int16_t internal_port,
+                             u_int8_t protocol)
+{
+    struct pcp_mapping_s key;
+    mapping_bucket *bucket;
+
+    key.internal_ip = *internal_ip;
+    key.internal_port = internal_port;
+    key.protocol = protocol;
+    bucket = g_hash_table_lookup (table->by_internal, &key);
+    return bucket ? bucket->mappings->data : NULL;
+}
+
+#if !GLIB_CHECK_VERSION(2, 68, 0)
+struct foreach_data
+{
+    mapping_table_func func;
+    void *data;
+    int from_index;
+};
+
+static gboolean
+foreach_mapping (gpointer key, gpointer value, gpointer data)
+{
+    struct foreach_data *foreach_data = (struct foreach_data *) data;
+
+    if (*(int *) key < foreach_data->from_index)
+    {
+        return FALSE;
+    }
+    return !foreach_data->func ((pcp_mapping) value, foreach_data->data);
+}
+#endif
+
+/**
+ * @brief mapping_table_foreach - Call a function for every mapping in index order.
+ *          The table must not be modified by the function.
+ * @param table - The table
+ * @param func - Function to call. Iteration stops when it returns false.
+ * @param data - User data passed to the function
+ */
+void
+mapping_table_foreach (mapping_table *table, mapping_table_func func, void *data)
+{
+    mapping_table_foreach_from (table, INT_MIN, func, data);
+}
+
+/**
+ * @brief mapping_table_foreach_from - Call a function for every mapping with an
+ *          index of at least from_index, in index order. Used to page through
+ *          the table. The table must not be modified by the function.
+ * @param table - The table
+ * @param from_index - Lowest index to visit
+ * @param func - Function to call. Iteration stops when it returns false.
+ * @param data - User data passed to the function
+ */
+void
+mapping_table_foreach_from (mapping_table *table, int from_index,
+                            mapping_table_func func, void *data)
+{
+#if GLIB_CHECK_VERSION(2, 68, 0)
+    GTreeNode *node;
+
+    /* Seek to the first index of the page rather than walking up to it */
+    for (node = g_tree_lower_bound (table->ordered, &from_index); node;
+         node = g_tree_node_next (node))
+    {
+        if (!func ((pcp_mapping) g_tree_node_value (node), data))
+        {
+            break;
+        }
+    }
+#else
+    struct foreach_data foreach_data = { func, data, from_index };
+
+    g_tree_foreach (table->ordered, foreach_mapping, &foreach_data);
+#endif
+}
+
+/**
+ * @brief mapping_table_size - Get the number of mappings in the table
+ * @param table - The table
+ * @return - The number of mappings
+ */
+int
+mapping_table_size (mapping_table *table)
+{
+    return g_hash_table_size (table->by_index);
+}
@@ -0,0 +1,86 @@
+/**
+ * @file mapping_table.h
+ *
+ * Hash-indexed table of the current PCP mappings.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MAPPING_TABLE_H
+#define MAPPING_TABLE_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+#include "libpcp.h"
+
+/* The table does no locking of its own. Callers serialize access. */
+typedef struct _mapping_table mapping_table;
+
+/* Called for each mapping by mapping_table_foreach. Return false to stop. */
+typedef bool (*mapping_table_func) (pcp_mapping mapping, void *data);
+
+mapping_table *mapping_table_new (GDestroyNotify destroy);
+
+void mapping_table_free (mapping_table *table);
+
+void mapping_table_insert (mapping_table *table, pcp_mapping mapping);
+
+pcp_mapping mapping_table_steal (mapping_table *table, int index);
+
+bool mapping_table_remove (mapping_table *table, int index);
+
+pcp_mapping mapping_table_find_index (mapping_table *table, int index);
+
+pcp_mapping mapping_table_find_request (mapping_table *table,
+                                        u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                                        struct in6_addr *internal_ip,
+                                        u_int16_t internal_port,
+                                        u_int8_t protocol);
+
+pcp_mapping mapping_table_find_peer (mapping_table *table,
+                                     struct in6_addr *internal_ip,
+                                     u_int16_t internal_port,
+                                     struct in6_addr *remote_peer_ip,
+                                     u_int16_t remote_peer_port,
+                                     u_int8_t protocol);
+
+pcp_mapping mapping_table_find_external (mapping_table *table,
+                                         struct in6_addr *external_ip,
+                                         u_int16_t external_port,
+                                         u_int8_t protocol);
+
+int mapping_table_external_users (mapping_table *table,
+                                  struct in6_addr *external_ip,
+                                  u_int16_t external_port,
+                                  u_int8_t protocol);
+
+pcp_mapping mapping_table_find_internal (mapping_table *table,
+                                         struct in6_addr *internal_ip,
+                                         u_int16_t internal_port,
+                                         u_int8_t protocol);
+
+void mapping_table_foreach (mapping_table *table, mapping_table_func func, void *data);
+
+void mapping_table_foreach_from (mapping_table *table, int from_index,
+                                 mapping_table_func func, void *data);
+
+int mapping_table_size (mapping_table *table);
+
+#endif /* MAPPING_TABLE_H */
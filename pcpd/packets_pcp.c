@@ -97,14 +97,13 @@ new_pcp_map_request (u_int32_t requested_lifetime, const char *ip6str)
 }
 
 /**
- * @brief new_pcp_map_response - Create a new initial PCP MAP response
+ * @brief init_pcp_map_response - Fill in an initial PCP MAP response
+ * @param map_resp - Where to place the response
  * @param map_req - MAP request to copy values from
- * @return - The MAP response packet
  */
-map_response *
-new_pcp_map_response (map_request *map_req)
+void
+init_pcp_map_response (map_response *map_resp, map_request *map_req)
 {
-    map_response *map_resp = malloc (sizeof (map_response));
     new_pcp_response_header (&map_resp->header, &map_req->header);
     map_resp->mapping_nonce[0] = map_req->mapping_nonce[0];
     map_resp->mapping_nonce[1] = map_req->mapping_nonce[1];
@@ -115,6 +114,21 @@ new_pcp_map_response (map_request *map_req)
     map_resp->internal_port = map_req->internal_port;
     map_resp->assigned_external_port = map_req->suggested_external_port;
     map_resp->assigned_external_ip = map_req->suggested_external_ip;
+}
+
+/**
+ * @brief new_pcp_map_response - Create a new initial PCP MAP response
+ * @param map_req - MAP request to copy values from
+ * @return - The MAP response packet or NULL if out of memory
+ */
+map_response *
+new_pcp_map_response (map_request *map_req)
+{
+    map_response *map_resp = malloc (sizeof (map_response));
+    if (map_resp)
+    {
+        init_pcp_map_response (map_resp, map_req);
+    }
     return map_resp;
 }
 
@@ -130,16 +144,55 @@ new_pcp_peer_request (u_int32_t requested_lifetime, const char *ip6str)
 }
 
 /**
- * @brief new_pcp_error_response - Create a new error PCP response
+ * @brief init_pcp_peer_response - Fill in an initial PCP PEER response
+ * @param peer_resp - Where to place the response
+ * @param peer_req - PEER request to copy values from
+ */
+void
+init_pcp_peer_response (peer_response *peer_resp, peer_request *peer_req)
+{
+    new_pcp_response_header (&peer_resp->header, &peer_req->header);
+    peer_resp->mapping_nonce[0] = peer_req->mapping_nonce[0];
+    peer_resp->mapping_nonce[1] = peer_req->mapping_nonce[1];
+    peer_resp->mapping_nonce[2] = peer_req->mapping_nonce[2];
+    peer_resp->protocol = peer_req->protocol;
+    peer_resp->reserved_1 = 0;
+    peer_resp->reserved_2 = 0;
+    peer_resp->internal_port = peer_req->internal_port;
+    peer_resp->assigned_external_port = peer_req->suggested_external_port;
+    peer_resp->assigned_external_ip = peer_req->suggested_external_ip;
+    peer_resp->remote_peer_port = peer_req->remote_peer_port;
+    peer_resp->reserved_3 = 0;
+    peer_resp->remote_peer_ip = peer_req->remote_peer_ip;
+}
+
+/**
+ * @brief new_pcp_peer_response - Create a new initial PCP PEER response
+ * @param peer_req - PEER request to copy values from
+ * @return - The PEER response packet or NULL if out of memory
+ */
+peer_response *
+new_pcp_peer_response (peer_request *peer_req)
+{
+    peer_response *peer_resp = malloc (sizeof (peer_response));
+    if (peer_resp)
+    {
+        init_pcp_peer_response (peer_resp, peer_req);
+    }
+    return peer_resp;
+}
+
+/**
+ * @brief init_pcp_error_response - Fill in an error PCP response
+ * @param error_resp - Where to place the response
  * @param r_opcode - The r_opcode value in the original packet
  * @param result - The error result
  * @param lifetime - The lifetime of the error
- * @return - The error response
  */
-pcp_response_header *
-new_pcp_error_response (u_int8_t r_opcode, result_code result, u_int32_t lifetime)
+void
+init_pcp_error_response (pcp_response_header *error_resp,
+                         u_int8_t r_opcode, result_code result, u_int32_t lifetime)
 {
-    pcp_response_header *error_resp = malloc (sizeof (pcp_response_header));
     error_resp->version = PCP_VERSION;
     error_resp->r_opcode = R_RESPONSE (r_opcode);
     error_resp->reserved = 0;
@@ -149,9 +202,40 @@ new_pcp_error_response (u_int8_t r_opcode, result_code result, u_int32_t lifetim
     error_resp->reserved_array[0] = 0;
     error_resp->reserved_array[1] = 0;
     error_resp->reserved_array[2] = 0;
+}
+
+/**
+ * @brief new_pcp_error_response - Create a new error PCP response
+ * @param r_opcode - The r_opcode value in the original packet
+ * @param result - The error result
+ * @param lifetime - The lifetime of the error
+ * @return - The error response or NULL if out of memory
+ */
+pcp_response_header *
+new_pcp_error_response (u_int8_t r_opcode, result_code result, u_int32_t lifetime)
+{
+    pcp_response_header *error_resp = malloc (sizeof (pcp_response_header));
+    if (error_resp)
+    {
+        init_pcp_error_response (error_resp, r_opcode, result, lifetime);
+    }
     return error_resp;
 }
 
+/**
+ * @brief init_pcp_announce_response - Fill in an ANNOUNCE response. The same
+ *          packet answers an ANNOUNCE request and is sent unsolicited after a
+ *          restart.
+ * @param announce_resp - Where to place the response
+ * @param epoch_time - The server's epoch time
+ */
+void
+init_pcp_announce_response (pcp_response_header *announce_resp, u_int32_t epoch_time)
+{
+    init_pcp_error_response (announce_resp, ANNOUNCE_OPCODE, SUCCESS, 0);
+    announce_resp->epoch_time = epoch_time;
+}
+
 u_int8_t
 get_version (unsigned char *pkt_buf)
 {
@@ -259,6 +259,47 @@ typedef struct _peer_request
 } PACKED peer_request;
 
 
+/* Define a PEER response packet
+      0                   1                   2                   3
+      0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |                                                               |
+     |                 Mapping Nonce (96 bits)                       |
+     |                                                               |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |   Protocol    |          Reserved (24 bits)                   |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |        Internal Port          |    Assigned External Port     |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |                                                               |
+     |            Assigned External IP Address (128 bits)            |
+     |                                                               |
+     |                                                               |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |       Remote Peer Port        |     Reserved (16 bits)        |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |                                                               |
+     |               Remote Peer IP Address (128 bits)               |
+     |                                                               |
+     |                                                               |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+*/
+typedef struct _peer_response
+{
+    pcp_response_header header;
+    u_int32_t mapping_nonce[MAPPING_NONCE_SIZE];
+    u_int8_t protocol;
+    u_int8_t reserved_1;
+    u_int16_t reserved_2;
+    u_int16_t internal_port;
+    u_int16_t assigned_external_port;
+    struct in6_addr assigned_external_ip;
+    u_int16_t remote_peer_port;
+    u_int16_t reserved_3;
+    struct in6_addr remote_peer_ip;
+} PACKED peer_response;
+
+
 // Create a new PCP headers
 bool new_pcp_request_header (pcp_request_header *hdr,
                              u_int8_t opcode, u_int32_t requested_lifetime,
@@ -271,12 +312,24 @@ map_request *new_pcp_map_request (u_int32_t requested_lifetime, const char *ip6s
 
 map_response *new_pcp_map_response (map_request *map_req);
 
+void init_pcp_map_response (map_response *map_resp, map_request *map_req);
+
 // Create new PCP PEER packets
 peer_request *new_pcp_peer_request (u_int32_t requested_lifetime, const char *ip6str);
 
+peer_response *new_pcp_peer_response (peer_request *peer_req);
+
+void init_pcp_peer_response (peer_response *peer_resp, peer_request *peer_req);
+
 // Create a new PCP error response
 pcp_response_header *new_pcp_error_response (u_int8_t r_opcode, result_code result, u_int32_t lifetime);
 
+void init_pcp_error_response (pcp_response_header *error_resp,
+                              u_int8_t r_opcode, result_code result, u_int32_t lifetime);
+
+// Create a PCP ANNOUNCE response, solicited or not
+void init_pcp_announce_response (pcp_response_header *announce_resp, u_int32_t epoch_time);
+
 // Getting PCP variables by parsing a byte array.
 u_int8_t get_version (unsigned char *pkt_buf);
 
@@ -0,0 +1,359 @@
+/**
+ * @file packets_pcp_codec.c
+ *
+ * Encoding and decoding of fixed size PCP packets. The packed packet
+ * structs have the same layout as the wire format, so converting between
+ * them only swaps the bytes of each multi-byte field. That is the same
+ * operation in both directions and is done either a word at a time or, on
+ * CPUs that have them, with one byte shuffle per 16 bytes.
+ *
+ * The functions in packets_pcp_serialization.c are the reference and the
+ * results here are identical to theirs. pcp_bench measures both. The
+ * serializers are the faster, so pcpd uses them and this codec is only
+ * built into pcp_bench and its unit tests.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <endian.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "packets_pcp.h"
+#include "packets_pcp_codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_CODEC
+#elif defined(__aarch64__) && defined(__ARM_NEON) && \
+      __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define HAVE_NEON_CODEC
+#endif
+
+#define MAP_PKT_LEN 60
+#define PEER_PKT_LEN 80
+#define SHUFFLE_LANES 3
+#define SHUFFLE_LEN (SHUFFLE_LANES * 16)
+
+/* Converts a packet between host order and wire order, in either direction */
+typedef void (*convert_func) (void *dst, const void *src);
+
+typedef struct _codec_ops
+{
+    const char *name;
+    convert_func map_request;
+    convert_func map_response;
+} codec_ops;
+
+/* Scalar conversion, which is a copy on big-endian hosts */
+
+static void
+scalar_request_header (pcp_request_header *hdr)
+{
+    hdr->reserved = be16toh (hdr->reserved);
+    hdr->requested_lifetime = be32toh (hdr->requested_lifetime);
+}
+
+static void
+scalar_response_header (pcp_response_header *hdr)
+{
+    hdr->lifetime = be32toh (hdr->lifetime);
+    hdr->epoch_time = be32toh (hdr->epoch_time);
+    hdr->reserved_array[0] = be32toh (hdr->reserved_array[0]);
+    hdr->reserved_array[1] = be32toh (hdr->reserved_array[1]);
+    hdr->reserved_array[2] = be32toh (hdr->reserved_array[2]);
+}
+
+static void
+scalar_map_request (void *dst, const void *src)
+{
+    map_request map_req;
+
+    memcpy (&map_req, src, MAP_PKT_LEN);
+    scalar_request_header (&map_req.header);
+    map_req.mapping_nonce[0] = be32toh (map_req.mapping_nonce[0]);
+    map_req.mapping_nonce[1] = be32toh (map_req.mapping_nonce[1]);
+    map_req.mapping_nonce[2] = be32toh (map_req.mapping_nonce[2]);
+    map_req.reserved_2 = be16toh (map_req.reserved_2);
+    map_req.internal_port = be16toh (map_req.internal_port);
+    map_req.suggested_external_port = be16toh (map_req.suggested_external_port);
+    memcpy (dst, &map_req, MAP_PKT_LEN);
+}
+
+static void
+scalar_map_response (void *dst, const void *src)
+{
+    map_response map_resp;
+
+    memcpy (&map_resp, src, MAP_PKT_LEN);
+    scalar_response_header (&map_resp.header);
+    map_resp.mapping_nonce[0] = be32toh (map_resp.mapping_nonce[0]);
+    map_resp.mapping_nonce[1] = be32toh (map_resp.mapping_nonce[1]);
+    map_resp.mapping_nonce[2] = be32toh (map_resp.mapping_nonce[2]);
+    map_resp.reserved_2 = be16toh (map_resp.reserved_2);
+    map_resp.internal_port = be16toh (map_resp.internal_port);
+    map_resp.assigned_external_port = be16toh (map_resp.assigned_external_port);
+    memcpy (dst, &map_resp, MAP_PKT_LEN);
+}
+
+/* A PEER packet is a MAP packet followed by the remote peer, so only the
+ * remote peer port and the reserved field after it need converting here */
+static void
+convert_peer_tail (void *dst, const void *src)
+{
+    u_int16_t words[2];
+
+    memcpy (words, (const unsigned char *) src + MAP_PKT_LEN, sizeof (words));
+    words[0] = be16toh (words[0]);
+    words[1] = be16toh (words[1]);
+    memmove ((unsigned char *) dst + MAP_PKT_LEN + sizeof (words),
+             (const unsigned char *) src + MAP_PKT_LEN + sizeof (words),
+             PEER_PKT_LEN - MAP_PKT_LEN - sizeof (words));
+    memcpy ((unsigned char *) dst + MAP_PKT_LEN, words, sizeof (words));
+}
+
+static const codec_ops scalar_ops = {
+    .name = "scalar",
+    .map_request = scalar_map_request,
+    .map_response = scalar_map_response,
+};
+
+#if defined(HAVE_SSSE3_CODEC) || defined(HAVE_NEON_CODEC)
+
+/* Byte shuffles for little-endian hosts. Entry i of a lane is the source byte
+ * for destination byte i. No multi-byte field crosses a 16-byte boundary and
+ * the last 12 bytes of a MAP packet are part of an address, so the first 48
+ * bytes are shuffled and the rest are copied. */
+static const unsigned char map_request_shuffle[SHUFFLE_LANES][16] = {
+    /* version, r_opcode, reserved, requested_lifetime, client_ip[0-7] */
+    { 0, 1, 3, 2, 7, 6, 5, 4, 8, 9, 10, 11, 12, 13, 14, 15 },
+    /* client_ip[8-15], mapping_nonce[0-1] */
+    { 0, 1, 2, 3, 4, 5, 6, 7, 11, 10, 9, 8, 15, 14, 13, 12 },
+    /* mapping_nonce[2], protocol, reserved_1, reserved_2, ports, address[0-3] */
+    { 3, 2, 1, 0, 4, 5, 7, 6, 9, 8, 11, 10, 12, 13, 14, 15 },
+};
+
+static const unsigned char map_response_shuffle[SHUFFLE_LANES][16] = {
+    /* version, r_opcode, reserved, result_code, lifetime, epoch_time, reserved_array[0] */
+    { 0, 1, 2, 3, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+    /* reserved_array[1-2], mapping_nonce[0-1] */
+    { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+    /* mapping_nonce[2], protocol, reserved_1, reserved_2, ports, address[0-3] */
+    { 3, 2, 1, 0, 4, 5, 7, 6, 9, 8, 11, 10, 12, 13, 14, 15 },
+};
+
+#ifdef HAVE_SSSE3_CODEC
+
+__attribute__ ((target ("ssse3")))
+static void
+shuffle_map_packet (void *dst, const void *src, const unsigned char shuffle[SHUFFLE_LANES][16])
+{
+    __m128i lanes[SHUFFLE_LANES];
+    int i;
+
+    /* Load everything first so dst and src may be the same */
+    for (i = 0; i < SHUFFLE_LANES; i++)
+    {
+        lanes[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) src + i),
+                                     _mm_loadu_si128 ((const __m128i *) shuffle[i]));
+    }
+    memmove ((unsigned char *) dst + SHUFFLE_LEN, (const unsigned char *) src + SHUFFLE_LEN,
+             MAP_PKT_LEN - SHUFFLE_LEN);
+    for (i = 0; i < SHUFFLE_LANES; i++)
+    {
+        _mm_storeu_si128 ((__m128i *) dst + i, lanes[i]);
+    }
+}
+
+#define SIMD_CODEC_NAME "ssse3"
+
+#else /* HAVE_NEON_CODEC */
+
+static void
+shuffle_map_packet (void *dst, const void *src, const unsigned char shuffle[SHUFFLE_LANES][16])
+{
+    uint8x16_t lanes[SHUFFLE_LANES];
+    int i;
+
+    /* Load everything first so dst and src may be the same */
+    for (i = 0; i < SHUFFLE_LANES; i++)
+    {
+        lanes[i] = vqtbl1q_u8 (vld1q_u8 ((const uint8_t *) src + 16 * i),
+                               vld1q_u8 (shuffle[i]));
+    }
+    memmove ((unsigned char *) dst + SHUFFLE_LEN, (const unsigned char *) src + SHUFFLE_LEN,
+             MAP_PKT_LEN - SHUFFLE_LEN);
+    for (i = 0; i < SHUFFLE_LANES; i++)
+    {
+        vst1q_u8 ((uint8_t *) dst + 16 * i, lanes[i]);
+    }
+}
+
+#define SIMD_CODEC_NAME "neon"
+
+#endif
+
+static void
+simd_map_request (void *dst, const void *src)
+{
+    shuffle_map_packet (dst, src, map_request_shuffle);
+}
+
+static void
+simd_map_response (void *dst, const void *src)
+{
+    shuffle_map_packet (dst, src, map_response_shuffle);
+}
+
+static const codec_ops simd_ops = {
+    .name = SIMD_CODEC_NAME,
+    .map_request = simd_map_request,
+    .map_response = simd_map_response,
+};
+
+/**
+ * @brief simd_supported - Check if the CPU can run the SIMD codec
+ * @return - True if it can
+ */
+static bool
+simd_supported (void)
+{
+#ifdef HAVE_SSSE3_CODEC
+    __builtin_cpu_init ();
+    return __builtin_cpu_supports ("ssse3");
+#else
+    return true;
+#endif
+}
+
+#endif /* HAVE_SSSE3_CODEC || HAVE_NEON_CODEC */
+
+/* Set once by pcp_codec_init before any worker starts */
+static const codec_ops *codec = &scalar_ops;
+
+/**
+ * @brief pcp_codec_init - Use the fastest codec this CPU supports
+ */
+void
+pcp_codec_init (void)
+{
+    if (!pcp_codec_set (PCP_CODEC_SIMD))
+    {
+        pcp_codec_set (PCP_CODEC_SCALAR);
+    }
+}
+
+/**
+ * @brief pcp_codec_set - Choose how packets are converted
+ * @param impl - The implementation
+ * @return - False if the implementation is not available on this build or CPU
+ */
+bool
+pcp_codec_set (pcp_codec_impl impl)
+{
+    switch (impl)
+    {
+    case PCP_CODEC_SCALAR:
+        codec = &scalar_ops;
+        return true;
+    case PCP_CODEC_SIMD:
+#if defined(HAVE_SSSE3_CODEC) || defined(HAVE_NEON_CODEC)
+        if (simd_supported ())
+        {
+            codec = &simd_ops;
+            return true;
+        }
+#endif
+        return false;
+    }
+    return false;
+}
+
+/**
+ * @brief pcp_codec_name - Get the name of the codec in use
+ * @return - The name
+ */
+const char *
+pcp_codec_name (void)
+{
+    return codec->name;
+}
+
+/**
+ * @brief pcp_codec_encode_response_header - Encode a response header, such as an
+ *          error response
+ * @param buffer - Where to place the encoded header
+ * @param header - The header
+ * @return - Pointer to the end of the encoded header
+ */
+unsigned char *
+pcp_codec_encode_response_header (unsigned char *buffer, pcp_response_header *header)
+{
+    pcp_response_header hdr = *header;
+
+    scalar_response_header (&hdr);
+    memcpy (buffer, &hdr, sizeof (pcp_response_header));
+    return buffer + sizeof (pcp_response_header);
+}
+
+unsigned char *
+pcp_codec_encode_map_request (unsigned char *buffer, map_request *map_req)
+{
+    codec->map_request (buffer, map_req);
+    return buffer + MAP_PKT_LEN;
+}
+
+unsigned char *
+pcp_codec_encode_map_response (unsigned char *buffer, map_response *map_resp)
+{
+    codec->map_response (buffer, map_resp);
+    return buffer + MAP_PKT_LEN;
+}
+
+unsigned char *
+pcp_codec_decode_map_request (map_request *map_req, unsigned char *data)
+{
+    codec->map_request (map_req, data);
+    return data + MAP_PKT_LEN;
+}
+
+unsigned char *
+pcp_codec_decode_map_response (map_response *map_resp, unsigned char *data)
+{
+    codec->map_response (map_resp, data);
+    return data + MAP_PKT_LEN;
+}
+
+unsigned char *
+pcp_codec_encode_peer_response (unsigned char *buffer, peer_response *peer_resp)
+{
+    codec->map_response (buffer, peer_resp);
+    convert_peer_tail (buffer, peer_resp);
+    return buffer + PEER_PKT_LEN;
+}
+
+unsigned char *
+pcp_codec_decode_peer_request (peer_request *peer_req, unsigned char *data)
+{
+    codec->map_request (peer_req, data);
+    convert_peer_tail (peer_req, data);
+    return data + PEER_PKT_LEN;
+}
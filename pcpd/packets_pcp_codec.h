@@ -0,0 +1,63 @@
+/**
+ * @file packets_pcp_codec.h
+ *
+ * Word-at-a-time and SIMD encoding and decoding of fixed size PCP packets,
+ * benchmarked against the serializers in pcp_bench.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACKETS_PCP_CODEC_H
+#define PACKETS_PCP_CODEC_H
+
+#include <stdbool.h>
+
+#include "packets_pcp.h"
+
+/* Ways of converting between packets and their wire format */
+typedef enum
+{
+    PCP_CODEC_SCALAR,           // Word-wise big-endian loads and stores
+    PCP_CODEC_SIMD,             // SSSE3 or NEON byte shuffles
+} pcp_codec_impl;
+
+void pcp_codec_init (void);
+
+bool pcp_codec_set (pcp_codec_impl impl);
+
+const char *pcp_codec_name (void);
+
+// Encode a packet into a buffer. Returns a pointer to the end of the encoded data.
+unsigned char *pcp_codec_encode_response_header (unsigned char *buffer,
+                                                 pcp_response_header *header);
+
+unsigned char *pcp_codec_encode_map_request (unsigned char *buffer, map_request *map_req);
+
+unsigned char *pcp_codec_encode_map_response (unsigned char *buffer, map_response *map_resp);
+
+unsigned char *pcp_codec_encode_peer_response (unsigned char *buffer, peer_response *peer_resp);
+
+// Decode a packet into caller storage. Returns a pointer to the end of the decoded data.
+unsigned char *pcp_codec_decode_map_request (map_request *map_req, unsigned char *data);
+
+unsigned char *pcp_codec_decode_map_response (map_response *map_resp, unsigned char *data);
+
+unsigned char *pcp_codec_decode_peer_request (peer_request *peer_req, unsigned char *data);
+
+#endif /* PACKETS_PCP_CODEC_H */
@@ -0,0 +1,252 @@
+/**
+ * @file packets_pcp_options.c
+ *
+ * Parsing and encoding of the options that follow the opcode-specific
+ * information of PCP packets.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "packets_pcp.h"
+#include "packets_pcp_options.h"
+#include "packets_pcp_serialization.h"
+
+#define OPCODE_BIT(opcode) (1 << (opcode))
+
+/* How an option is checked and converted. Both functions are given the
+ * option's data, after the option header. */
+typedef struct _option_type
+{
+    const char *name;
+    u_int16_t length;           // Length of the data
+    u_int8_t opcodes;           // OPCODE_BIT of each opcode the option is valid for
+    bool repeatable;
+    result_code (*parse) (pcp_options *options, pcp_option *option, unsigned char *data);
+    unsigned char *(*encode) (unsigned char *buffer, const pcp_option *option);
+} option_type;
+
+static result_code
+parse_third_party (pcp_options *options, pcp_option *option, unsigned char *data)
+{
+    deserialize_ip_address (&option->ip, data);
+    options->third_party = true;
+    options->third_party_ip = option->ip;
+    return SUCCESS;
+}
+
+static unsigned char *
+encode_third_party (unsigned char *buffer, const pcp_option *option)
+{
+    return serialize_ip_address (buffer, (struct in6_addr *) &option->ip);
+}
+
+static result_code
+parse_prefer_failure (pcp_options *options, pcp_option *option, unsigned char *data)
+{
+    options->prefer_failure = true;
+    return SUCCESS;
+}
+
+static unsigned char *
+encode_prefer_failure (unsigned char *buffer, const pcp_option *option)
+{
+    return buffer;
+}
+
+static result_code
+parse_filter (pcp_options *options, pcp_option *option, unsigned char *data)
+{
+    option->prefix_length = data[1];
+    deserialize_u_int16_t (&option->port, data + 2);
+    deserialize_ip_address (&option->ip, data + 4);
+
+    /* An IPv4 prefix is given as an IPv4-mapped IPv6 prefix */
+    if (option->prefix_length > 128 ||
+        (IN6_IS_ADDR_V4MAPPED (&option->ip) && option->prefix_length < 96))
+    {
+        return MALFORMED_OPTION;
+    }
+    if (options->num_filters == MAX_FILTER_OPTIONS)
+    {
+        return EXCESSIVE_REMOTE_PEERS;
+    }
+    options->num_filters++;
+    return SUCCESS;
+}
+
+static unsigned char *
+encode_filter (unsigned char *buffer, const pcp_option *option)
+{
+    buffer = serialize_u_int8_t (buffer, 0);
+    buffer = serialize_u_int8_t (buffer, option->prefix_length);
+    buffer = serialize_u_int16_t (buffer, option->port);
+    return serialize_ip_address (buffer, (struct in6_addr *) &option->ip);
+}
+
+/* Indexed by option code. Codes without a parse function are unknown. */
+static const option_type option_types[256] = {
+    [THIRD_PARTY_OPTION] = {
+        "THIRD_PARTY", THIRD_PARTY_OPTION_LEN,
+        OPCODE_BIT (MAP_OPCODE) | OPCODE_BIT (PEER_OPCODE), false,
+        parse_third_party, encode_third_party,
+    },
+    [PREFER_FAILURE_OPTION] = {
+        "PREFER_FAILURE", PREFER_FAILURE_OPTION_LEN,
+        OPCODE_BIT (MAP_OPCODE), false,
+        parse_prefer_failure, encode_prefer_failure,
+    },
+    [FILTER_OPTION] = {
+        "FILTER", FILTER_OPTION_LEN,
+        OPCODE_BIT (MAP_OPCODE), true,
+        parse_filter, encode_filter,
+    },
+};
+
+/**
+ * @brief pcp_options_parse - Parse and check the options of a request in one
+ *          pass. Unknown options from OPTIONAL_OPTION_MIN up are skipped.
+ * @param options - Where to place the options
+ * @param opcode - Opcode of the request
+ * @param data - The first option, after the opcode-specific information
+ * @param len - Number of bytes from data to the end of the request
+ * @return - SUCCESS, or the result code of the first option that fails
+ */
+result_code
+pcp_options_parse (pcp_options *options, u_int8_t opcode, unsigned char *data, int len)
+{
+    u_int8_t seen[256 / 8] = { 0 };
+    const option_type *type;
+    pcp_option option;
+    u_int16_t length;
+    u_int8_t code;
+    int padded;
+    result_code ret;
+
+    options->count = 0;
+    options->third_party = false;
+    options->prefer_failure = false;
+    options->num_filters = 0;
+
+    if (len > MAX_PAYLOAD_LEN)
+    {
+        return MALFORMED_REQUEST;
+    }
+
+    while (len > 0)
+    {
+        if (len < OPTION_HEADER_LEN)
+        {
+            return MALFORMED_OPTION;
+        }
+        code = data[0];
+        deserialize_u_int16_t (&length, data + 2);
+        padded = (length + 3) & ~3;
+        if (padded > len - OPTION_HEADER_LEN)
+        {
+            return MALFORMED_OPTION;
+        }
+
+        type = &option_types[code];
+        if (type->parse == NULL || opcode >= 8 || !(type->opcodes & OPCODE_BIT (opcode)))
+        {
+            if (code < OPTIONAL_OPTION_MIN)
+            {
+                return UNSUPP_OPTION;
+            }
+        }
+        else
+        {
+            if (length != type->length ||
+                (!type->repeatable && (seen[code / 8] & (1 << (code % 8)))))
+            {
+                return MALFORMED_OPTION;
+            }
+            seen[code / 8] |= 1 << (code % 8);
+
+            memset (&option, 0, sizeof (option));
+            option.code = code;
+            ret = type->parse (options, &option, data + OPTION_HEADER_LEN);
+            if (ret != SUCCESS)
+            {
+                return ret;
+            }
+            if (options->count == MAX_OPTIONS)
+            {
+                return MALFORMED_OPTION;
+            }
+            options->list[options->count++] = option;
+        }
+
+        data += OPTION_HEADER_LEN + padded;
+        len -= OPTION_HEADER_LEN + padded;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief pcp_options_encode - Encode the options of a response. Options that
+ *          do not fit before end are left out.
+ * @param buffer - Where to place the first option
+ * @param end - End of the space for options
+ * @param options - The options
+ * @return - Pointer to the next byte after the encoded options
+ */
+unsigned char *
+pcp_options_encode (unsigned char *buffer, unsigned char *end, const pcp_options *options)
+{
+    const option_type *type;
+    const pcp_option *option;
+    unsigned char *data;
+    int padded;
+    int i;
+
+    for (i = 0; i < options->count; i++)
+    {
+        option = &options->list[i];
+        type = &option_types[option->code];
+        padded = (type->length + 3) & ~3;
+        if (type->encode == NULL || end - buffer < OPTION_HEADER_LEN + padded)
+        {
+            continue;
+        }
+
+        buffer = serialize_u_int8_t (buffer, option->code);
+        buffer = serialize_u_int8_t (buffer, 0);
+        buffer = serialize_u_int16_t (buffer, type->length);
+        data = type->encode (buffer, option);
+        memset (data, 0, buffer + padded - data);
+        buffer += padded;
+    }
+    return buffer;
+}
+
+/**
+ * @brief pcp_option_name - Get the name of an option
+ * @param code - Option code
+ * @return - The name, or "Unknown"
+ */
+const char *
+pcp_option_name (u_int8_t code)
+{
+    return option_types[code].name ? option_types[code].name : "Unknown";
+}
@@ -0,0 +1,107 @@
+/**
+ * @file packets_pcp_options.h
+ *
+ * Parsing and encoding of the options that follow the opcode-specific
+ * information of PCP packets.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PACKETS_PCP_OPTIONS_H
+#define PACKETS_PCP_OPTIONS_H
+
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "packets_pcp.h"
+
+#define THIRD_PARTY_OPTION 1
+#define PREFER_FAILURE_OPTION 2
+#define FILTER_OPTION 3
+
+/* Options with a code below this must be processed, or the request fails.
+ * Unknown options from this code up are ignored. */
+#define OPTIONAL_OPTION_MIN 128
+
+#define OPTION_HEADER_LEN 4
+#define THIRD_PARTY_OPTION_LEN 16
+#define PREFER_FAILURE_OPTION_LEN 0
+#define FILTER_OPTION_LEN 20
+
+/* Most FILTER options accepted in one request. More are refused with
+ * EXCESSIVE_REMOTE_PEERS. */
+#define MAX_FILTER_OPTIONS 16
+
+/* THIRD_PARTY and PREFER_FAILURE may each appear once, so the options of any
+ * accepted request fit */
+#define MAX_OPTIONS (MAX_FILTER_OPTIONS + 2)
+
+/* Define a PCP option
+      0                   1                   2                   3
+      0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |  Option Code  |  Reserved     |       Option Length           |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     :                       (optional) Data                         :
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+* Option Length is the length of the data, which is zero-padded to a
+* multiple of 4 octets.
+
+   The data of a THIRD_PARTY option is the internal IP address (128 bits).
+
+   The data of a FILTER option:
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |    Reserved   | Prefix Length |      Remote Peer Port         |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+     |                                                               |
+     |               Remote Peer IP Address (128 bits)               |
+     |                                                               |
+     |                                                               |
+     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+   PREFER_FAILURE has no data.
+*/
+typedef struct _pcp_option
+{
+    u_int8_t code;
+    u_int8_t prefix_length;     // FILTER
+    u_int16_t port;             // FILTER remote peer port
+    struct in6_addr ip;         // THIRD_PARTY internal IP or FILTER remote peer IP
+} pcp_option;
+
+/* The options of one request, in the order they were received */
+typedef struct _pcp_options
+{
+    int count;
+    pcp_option list[MAX_OPTIONS];
+    bool third_party;
+    struct in6_addr third_party_ip;
+    bool prefer_failure;
+    int num_filters;
+} pcp_options;
+
+result_code pcp_options_parse (pcp_options *options, u_int8_t opcode,
+                               unsigned char *data, int len);
+
+unsigned char *pcp_options_encode (unsigned char *buffer, unsigned char *end,
+                                   const pcp_options *options);
+
+const char *pcp_option_name (u_int8_t code);
+
+#endif /* PACKETS_PCP_OPTIONS_H */
@@ -138,6 +138,32 @@ serialize_map_response (unsigned char *buffer, map_response *data)
     return buffer;
 }
 
+/* A PEER packet is a MAP packet followed by the remote peer */
+
+unsigned char *
+serialize_peer_request (unsigned char *buffer, peer_request *data)
+{
+    struct in6_addr remote_peer_ip = data->remote_peer_ip;
+
+    buffer = serialize_map_request (buffer, (map_request *) data);
+    buffer = serialize_u_int16_t (buffer, data->remote_peer_port);
+    buffer = serialize_u_int16_t (buffer, data->reserved_3);
+    buffer = serialize_ip_address (buffer, &remote_peer_ip);
+    return buffer;
+}
+
+unsigned char *
+serialize_peer_response (unsigned char *buffer, peer_response *data)
+{
+    struct in6_addr remote_peer_ip = data->remote_peer_ip;
+
+    buffer = serialize_map_response (buffer, (map_response *) data);
+    buffer = serialize_u_int16_t (buffer, data->remote_peer_port);
+    buffer = serialize_u_int16_t (buffer, data->reserved_3);
+    buffer = serialize_ip_address (buffer, &remote_peer_ip);
+    return buffer;
+}
+
 /*
  * The following deserialize value functions deserialize a byte string and place
  * the result value to dest. Returns a pointer to the end of the decoded data
@@ -187,7 +213,6 @@ deserialize_u_int32_t_array3 (u_int32_t dest[3], unsigned char *data)
  * The following deserialize packet functions deserialize a longer byte string and place
  * the resulting packet to the destination. Returns a pointer to the end of the decoded data
  * in the data buffer.
- * TODO: Handle malloc returning NULL.
  */
 
 unsigned char *
@@ -214,10 +239,9 @@ deserialize_response_header (pcp_response_header *hdr, unsigned char *data)
     return data;
 }
 
-map_request *
-deserialize_map_request (unsigned char *data)
+unsigned char *
+deserialize_map_request_into (map_request *map_req, unsigned char *data)
 {
-    map_request *map_req = malloc (sizeof (map_request));
     data = deserialize_request_header (&map_req->header, data);
     data = deserialize_u_int32_t_array3 (map_req->mapping_nonce, data);
     data = deserialize_u_int8_t (&map_req->protocol, data);
@@ -226,13 +250,12 @@ deserialize_map_request (unsigned char *data)
     data = deserialize_u_int16_t (&map_req->internal_port, data);
     data = deserialize_u_int16_t (&map_req->suggested_external_port, data);
     data = deserialize_ip_address (&map_req->suggested_external_ip, data);
-    return map_req;
+    return data;
 }
 
-map_response *
-deserialize_map_response (unsigned char *data)
+unsigned char *
+deserialize_map_response_into (map_response *map_resp, unsigned char *data)
 {
-    map_response *map_resp = malloc (sizeof (map_response));
     data = deserialize_response_header (&map_resp->header, data);
     data = deserialize_u_int32_t_array3 (map_resp->mapping_nonce, data);
     data = deserialize_u_int8_t (&map_resp->protocol, data);
@@ -241,5 +264,90 @@ deserialize_map_response (unsigned char *data)
     data = deserialize_u_int16_t (&map_resp->internal_port, data);
     data = deserialize_u_int16_t (&map_resp->assigned_external_port, data);
     data = deserialize_ip_address (&map_resp->assigned_external_ip, data);
+    return data;
+}
+
+unsigned char *
+deserialize_peer_request_into (peer_request *peer_req, unsigned char *data)
+{
+    u_int16_t remote_peer_port;
+    u_int16_t reserved_3;
+    struct in6_addr remote_peer_ip;
+
+    /* Decode through locals, the packet members may be unaligned */
+    data = deserialize_map_request_into ((map_request *) peer_req, data);
+    data = deserialize_u_int16_t (&remote_peer_port, data);
+    data = deserialize_u_int16_t (&reserved_3, data);
+    data = deserialize_ip_address (&remote_peer_ip, data);
+    peer_req->remote_peer_port = remote_peer_port;
+    peer_req->reserved_3 = reserved_3;
+    peer_req->remote_peer_ip = remote_peer_ip;
+    return data;
+}
+
+unsigned char *
+deserialize_peer_response_into (peer_response *peer_resp, unsigned char *data)
+{
+    u_int16_t remote_peer_port;
+    u_int16_t reserved_3;
+    struct in6_addr remote_peer_ip;
+
+    /* Decode through locals, the packet members may be unaligned */
+    data = deserialize_map_response_into ((map_response *) peer_resp, data);
+    data = deserialize_u_int16_t (&remote_peer_port, data);
+    data = deserialize_u_int16_t (&reserved_3, data);
+    data = deserialize_ip_address (&remote_peer_ip, data);
+    peer_resp->remote_peer_port = remote_peer_port;
+    peer_resp->reserved_3 = reserved_3;
+    peer_resp->remote_peer_ip = remote_peer_ip;
+    return data;
+}
+
+/*
+ * The following deserialize packet functions return a newly allocated packet, or
+ * NULL if out of memory. The caller frees it.
+ */
+
+map_request *
+deserialize_map_request (unsigned char *data)
+{
+    map_request *map_req = malloc (sizeof (map_request));
+    if (map_req)
+    {
+        deserialize_map_request_into (map_req, data);
+    }
+    return map_req;
+}
+
+map_response *
+deserialize_map_response (unsigned char *data)
+{
+    map_response *map_resp = malloc (sizeof (map_response));
+    if (map_resp)
+    {
+        deserialize_map_response_into (map_resp, data);
+    }
     return map_resp;
 }
+
+peer_request *
+deserialize_peer_request (unsigned char *data)
+{
+    peer_request *peer_req = malloc (sizeof (peer_request));
+    if (peer_req)
+    {
+        deserialize_peer_request_into (peer_req, data);
+    }
+    return peer_req;
+}
+
+peer_response *
+deserialize_peer_response (unsigned char *data)
+{
+    peer_response *peer_resp = malloc (sizeof (peer_response));
+    if (peer_resp)
+    {
+        deserialize_peer_response_into (peer_resp, data);
+    }
+    return peer_resp;
+}
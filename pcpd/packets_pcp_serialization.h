@@ -57,13 +57,31 @@ unsigned char *serialize_map_request (unsigned char *buffer, map_request *data);
 
 unsigned char *serialize_map_response (unsigned char *buffer, map_response *data);
 
-// Deserialize a packet and return the result.
+unsigned char *serialize_peer_request (unsigned char *buffer, peer_request *data);
+
+unsigned char *serialize_peer_response (unsigned char *buffer, peer_response *data);
+
+// Deserialize a packet into caller storage.
 unsigned char *deserialize_request_header (pcp_request_header *hdr, unsigned char *data);
 
 unsigned char *deserialize_response_header (pcp_response_header *hdr, unsigned char *data);
 
+unsigned char *deserialize_map_request_into (map_request *map_req, unsigned char *data);
+
+unsigned char *deserialize_map_response_into (map_response *map_resp, unsigned char *data);
+
+unsigned char *deserialize_peer_request_into (peer_request *peer_req, unsigned char *data);
+
+unsigned char *deserialize_peer_response_into (peer_response *peer_resp, unsigned char *data);
+
+// Deserialize a packet and return the result.
+
 map_request *deserialize_map_request (unsigned char *data);
 
 map_response *deserialize_map_response (unsigned char *data);
 
+peer_request *deserialize_peer_request (unsigned char *data);
+
+peer_response *deserialize_peer_response (unsigned char *data);
+
 #endif /* PACKETS_PCP_SERIALIZATION_H */
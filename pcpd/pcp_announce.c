@@ -0,0 +1,298 @@
+/**
+ * @file pcp_announce.c
+ *
+ * Unsolicited ANNOUNCE responses sent after pcpd restarts.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "packets_pcp.h"
+#include "packets_pcp_serialization.h"
+#include "pcp_announce.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+/* The all-nodes groups. 224.0.0.1 is held as an IPv4-mapped address. */
+static const struct in6_addr all_nodes_ipv4 =
+    { { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 224, 0, 0, 1 } } };
+static const struct in6_addr all_nodes_ipv6 =
+    { { { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 } } };
+
+/* The burst being sent by the announce thread */
+typedef struct _announce_burst
+{
+    int sock;
+    struct in6_addr *clients;
+    int num_clients;
+    u_int32_t rate;
+    u_int32_t startup_time;
+} announce_burst;
+
+static announce_burst burst;
+static pthread_t announce_thread;
+static bool announce_running = false;
+
+static u_int64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+sleep_until (u_int64_t deadline)
+{
+    struct timespec ts = { deadline / NSEC_PER_SEC, deadline % NSEC_PER_SEC };
+
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+static int
+compare_ip (const void *a, const void *b)
+{
+    return memcmp (a, b, sizeof (struct in6_addr));
+}
+
+/**
+ * @brief pcp_announce_interval - Get the time between two rounds of the burst
+ * @param round - The earlier round, starting from 0
+ * @return - Milliseconds from the start of the round to the start of the next
+ */
+u_int32_t
+pcp_announce_interval (int round)
+{
+    if (round < 0)
+    {
+        round = 0;
+    }
+    else if (round >= PCP_ANNOUNCE_ROUNDS)
+    {
+        round = PCP_ANNOUNCE_ROUNDS - 1;
+    }
+    return PCP_ANNOUNCE_FIRST_INTERVAL_MS << round;
+}
+
+/**
+ * @brief pcp_announce_unique - Sort addresses and remove duplicates, so a
+ *          client with many mappings is sent one response per round
+ * @param ips - The addresses, updated in place
+ * @param count - Number of addresses
+ * @return - Number of unique addresses left at the start of ips
+ */
+int
+pcp_announce_unique (struct in6_addr *ips, int count)
+{
+    int i, n = 0;
+
+    if (count <= 0)
+    {
+        return 0;
+    }
+
+    qsort (ips, count, sizeof (struct in6_addr), compare_ip);
+    for (i = 1; i < count; i++)
+    {
+        if (memcmp (&ips[i], &ips[n], sizeof (struct in6_addr)) != 0)
+        {
+            ips[++n] = ips[i];
+        }
+    }
+    return n + 1;
+}
+
+/**
+ * @brief pcp_announce_send - Send one unsolicited ANNOUNCE response
+ * @param sock - Server socket, so the response comes from the PCP server port
+ * @param ip - Destination. IPv4 addresses are IPv4-mapped.
+ * @param port - Destination port
+ * @param epoch_time - The server's epoch time
+ * @return - True if the response was sent
+ */
+bool
+pcp_announce_send (int sock, const struct in6_addr *ip, u_int16_t port,
+                   u_int32_t epoch_time)
+{
+    unsigned char pkt_buf[MIN_ANNOUNCE_PKT_LEN];
+    pcp_response_header announce_resp;
+    struct sockaddr_storage local;
+    struct sockaddr_storage to;
+    struct sockaddr_in *to4 = (struct sockaddr_in *) &to;
+    struct sockaddr_in6 *to6 = (struct sockaddr_in6 *) &to;
+    socklen_t len = sizeof (local);
+    socklen_t to_len;
+
+    if (getsockname (sock, (struct sockaddr *) &local, &len) < 0)
+    {
+        return false;
+    }
+
+    memset (&to, 0, sizeof (to));
+    if (local.ss_family == AF_INET6)
+    {
+        to6->sin6_family = AF_INET6;
+        to6->sin6_addr = *ip;
+        to6->sin6_port = htons (port);
+        to_len = sizeof (*to6);
+    }
+    else if (IN6_IS_ADDR_V4MAPPED (ip))
+    {
+        to4->sin_family = AF_INET;
+        memcpy (&to4->sin_addr, &ip->s6_addr[12], sizeof (to4->sin_addr));
+        to4->sin_port = htons (port);
+        to_len = sizeof (*to4);
+    }
+    else
+    {
+        /* An IPv4-only socket cannot reach an IPv6 client */
+        return false;
+    }
+
+    init_pcp_announce_response (&announce_resp, epoch_time);
+    serialize_response_header (pkt_buf, &announce_resp);
+
+    return sendto (sock, pkt_buf, sizeof (pkt_buf), 0, (struct sockaddr *) &to,
+                   to_len) == sizeof (pkt_buf);
+}
+
+/**
+ * Thread that sends the burst. Unicast responses are spaced 1/rate apart, and
+ * after falling behind the spacing restarts from now rather than catching up
+ * all at once.
+ */
+static void *
+announce_loop (void *arg)
+{
+    u_int64_t round_start;
+    u_int64_t next_send;
+    u_int64_t gap = burst.rate ? NSEC_PER_SEC / burst.rate : 0;
+    u_int64_t now;
+    u_int32_t epoch_time;
+    int sent = 0;
+    int round, i;
+
+    round_start = next_send = monotonic_ns ();
+    for (round = 0; round < PCP_ANNOUNCE_ROUNDS; round++)
+    {
+        now = time (NULL);
+        epoch_time = now > burst.startup_time ? now - burst.startup_time : 0;
+
+        sent += pcp_announce_send (burst.sock, &all_nodes_ipv4, PCP_CLIENT_PORT, epoch_time);
+        sent += pcp_announce_send (burst.sock, &all_nodes_ipv6, PCP_CLIENT_PORT, epoch_time);
+
+        for (i = 0; i < burst.num_clients; i++)
+        {
+            sleep_until (next_send);
+            now = monotonic_ns ();
+            next_send = (next_send > now ? next_send : now) + gap;
+            sent += pcp_announce_send (burst.sock, &burst.clients[i], PCP_CLIENT_PORT,
+                                       epoch_time);
+        }
+
+        round_start += pcp_announce_interval (round) * NSEC_PER_MSEC;
+        if (round < PCP_ANNOUNCE_ROUNDS - 1)
+        {
+            sleep_until (round_start);
+        }
+    }
+
+    syslog (LOG_INFO, "Sent %d unsolicited ANNOUNCE responses to %d clients", sent,
+            burst.num_clients);
+    return NULL;
+}
+
+/**
+ * @brief pcp_announce_start - Start sending unsolicited ANNOUNCE responses
+ * @param sock - Server socket to send from
+ * @param clients - Addresses of the clients that held mappings, which are
+ *          freed when the burst is stopped. May be NULL.
+ * @param num_clients - Number of client addresses. Duplicates are sent to once.
+ * @param rate - Maximum unicast responses per second, or 0 to send to the
+ *          all-nodes groups only
+ * @param startup_time - When pcpd started, from which the epoch time counts
+ * @return - True if the burst was started
+ */
+bool
+pcp_announce_start (int sock, struct in6_addr *clients, int num_clients,
+                    u_int32_t rate, u_int32_t startup_time)
+{
+    if (announce_running || rate > PCP_ANNOUNCE_MAX_RATE)
+    {
+        free (clients);
+        return false;
+    }
+    if (rate == 0)
+    {
+        free (clients);
+        clients = NULL;
+    }
+
+    burst.sock = sock;
+    burst.clients = clients;
+    burst.num_clients = clients ? pcp_announce_unique (clients, num_clients) : 0;
+    burst.rate = rate;
+    burst.startup_time = startup_time;
+
+    if (pthread_create (&announce_thread, NULL, announce_loop, NULL) != 0)
+    {
+        syslog (LOG_ERR, "Failed to create announce thread");
+        free (burst.clients);
+        burst.clients = NULL;
+        return false;
+    }
+    announce_running = true;
+    return true;
+}
+
+/**
+ * @brief pcp_announce_stop - Stop the burst if it is still being sent
+ */
+void
+pcp_announce_stop (void)
+{
+    if (!announce_running)
+    {
+        return;
+    }
+    pthread_cancel (announce_thread);
+    pthread_join (announce_thread, NULL);
+    announce_running = false;
+
+    free (burst.clients);
+    burst.clients = NULL;
+    burst.num_clients = 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file pcp_announce.h
+ *
+ * Unsolicited ANNOUNCE responses sent after pcpd restarts.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PCP_ANNOUNCE_H
+#define PCP_ANNOUNCE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/* After a restart the epoch time in pcpd's responses starts again from 0,
+ * which tells clients that their mappings may have been lost (RFC 6887
+ * section 14.1.3). The burst sends that epoch time to the all-nodes groups
+ * and to every client that held a mapping, so that they recreate their
+ * mappings straight away rather than at their next renewal.
+ *
+ * The burst is sent in rounds, each round PCP_ANNOUNCE_FIRST_INTERVAL_MS
+ * times 2^round after the one before so that a lost datagram is soon made
+ * up for. Unicast responses are paced to a maximum rate so that the clients'
+ * requests do not all arrive at once. */
+#define PCP_CLIENT_PORT 5350
+#define PCP_ANNOUNCE_ROUNDS 10
+#define PCP_ANNOUNCE_FIRST_INTERVAL_MS 250
+#define PCP_ANNOUNCE_DEFAULT_RATE 1000      // Unicast responses per second
+#define PCP_ANNOUNCE_MAX_RATE 1000000
+
+u_int32_t pcp_announce_interval (int round);
+
+int pcp_announce_unique (struct in6_addr *ips, int count);
+
+bool pcp_announce_send (int sock, const struct in6_addr *ip, u_int16_t port,
+                        u_int32_t epoch_time);
+
+bool pcp_announce_start (int sock, struct in6_addr *clients, int num_clients,
+                         u_int32_t rate, u_int32_t startup_time);
+
+void pcp_announce_stop (void);
+
+#endif /* PCP_ANNOUNCE_H */
@@ -0,0 +1,583 @@
+/**
+ * @file pcp_control.c
+ *
+ * Local control socket for querying a running pcpd. Commands are answered
+ * from pcpd's in-memory mapping table, so they need no Apteryx round trips
+ * and do not write a full state dump. Connections are served one at a time
+ * on a thread of their own, away from the request workers.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "pcp_control.h"
+#include "pcp_export.h"
+
+/* A client that sends nothing for this long is disconnected so that the
+ * next one can be served */
+#define CONTROL_IDLE_TIMEOUT 10
+
+#define CONTROL_TOKEN_DELIMITERS " \t\r\n"
+
+static int listen_sock = -1;
+static char *socket_path = NULL;
+static const pcp_control_ops *control_ops = NULL;
+static pthread_t control_thread;
+static bool control_running = false;
+
+/* control_lock guards the socket of the client being served and the stop
+ * request, so pcp_control_stop can wake the control thread */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static int client_sock = -1;
+static bool control_stopping = false;
+
+/* Parse an IPv6 address, or an IPv4 address as an IPv4-mapped IPv6 address */
+static bool
+parse_ip (const char *str, struct in6_addr *ip)
+{
+    struct in_addr ipv4;
+
+    if (str == NULL)
+    {
+        return false;
+    }
+    if (inet_pton (AF_INET, str, &ipv4) == 1)
+    {
+        memset (ip, 0, sizeof (*ip));
+        ip->s6_addr[10] = 0xff;
+        ip->s6_addr[11] = 0xff;
+        memcpy (&ip->s6_addr[12], &ipv4, sizeof (ipv4));
+        return true;
+    }
+    return inet_pton (AF_INET6, str, ip) == 1;
+}
+
+static bool
+parse_int (const char *str, long min, long max, long *value)
+{
+    char *end;
+
+    if (str == NULL)
+    {
+        return false;
+    }
+    errno = 0;
+    *value = strtol (str, &end, 10);
+    return errno == 0 && end != str && *end == '\0' && *value >= min && *value <= max;
+}
+
+static bool
+parse_protocol (const char *str, int *protocol)
+{
+    long value;
+
+    if (str && strcmp (str, "tcp") == 0)
+    {
+        *protocol = IPPROTO_TCP;
+        return true;
+    }
+    if (str && strcmp (str, "udp") == 0)
+    {
+        *protocol = IPPROTO_UDP;
+        return true;
+    }
+    if (!parse_int (str, 0, 255, &value))
+    {
+        return false;
+    }
+    *protocol = value;
+    return true;
+}
+
+/**
+ * @brief pcp_control_filter_match - Check a mapping against a list filter. The
+ *          after field is not checked, as the table is walked from that ID.
+ * @param filter - The filter
+ * @param mapping - The mapping
+ * @return - True if the mapping matches
+ */
+bool
+pcp_control_filter_match (const pcp_control_filter *filter, pcp_mapping mapping)
+{
+    if (filter->match_internal_ip &&
+        memcmp (&filter->internal_ip, &mapping->internal_ip, sizeof (struct in6_addr)) != 0)
+    {
+        return false;
+    }
+    if (filter->match_external_ip &&
+        memcmp (&filter->external_ip, &mapping->external_ip, sizeof (struct in6_addr)) != 0)
+    {
+        return false;
+    }
+    return filter->protocol < 0 || filter->protocol == mapping->protocol;
+}
+
+static int
+control_error (FILE *out, const char *reason)
+{
+    return fprintf (out, "ERROR %s\n", reason);
+}
+
+static int
+control_help (FILE *out)
+{
+    return fprintf (out,
+                    "show\n"
+                    "lookup internal|external IP PORT PROTOCOL\n"
+                    "list [internal-ip IP] [external-ip IP] [protocol PROTOCOL] [after ID] "
+                    "[limit N]\n"
+                    "expire ID\n"
+                    "OK\n");
+}
+
+static int
+control_show (const pcp_control_ops *ops, char **saveptr, FILE *out)
+{
+    if (strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr) != NULL)
+    {
+        return control_error (out, "usage: show");
+    }
+    if (ops->show (out) < 0)
+    {
+        return -1;
+    }
+    return fprintf (out, "OK\n");
+}
+
+static int
+control_lookup (const pcp_control_ops *ops, char **saveptr, FILE *out)
+{
+    struct pcp_mapping_s mapping;
+    struct in6_addr ip;
+    char *side, *ip_str, *port_str, *protocol_str;
+    long port;
+    int protocol;
+    int n;
+
+    side = strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr);
+    ip_str = strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr);
+    port_str = strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr);
+    protocol_str = strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr);
+
+    if (side == NULL || (strcmp (side, "internal") != 0 && strcmp (side, "external") != 0) ||
+        strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr) != NULL)
+    {
+        return control_error (out, "usage: lookup internal|external IP PORT PROTOCOL");
+    }
+    if (!parse_ip (ip_str, &ip))
+    {
+        return control_error (out, "invalid IP address");
+    }
+    if (!parse_int (port_str, 0, 65535, &port))
+    {
+        return control_error (out, "invalid port");
+    }
+    if (!parse_protocol (protocol_str, &protocol))
+    {
+        return control_error (out, "invalid protocol");
+    }
+
+    if (!ops->lookup (strcmp (side, "external") == 0, &ip, port, protocol, &mapping))
+    {
+        return control_error (out, "no such mapping");
+    }
+    n = pcp_export_write_mapping (out, PCP_EXPORT_JSON, &mapping);
+    if (n < 0)
+    {
+        return n;
+    }
+    return fprintf (out, "OK\n");
+}
+
+static int
+control_list (const pcp_control_ops *ops, char **saveptr, FILE *out)
+{
+    pcp_control_filter filter;
+    struct pcp_mapping_s *found;
+    char *option, *value;
+    long limit = PCP_CONTROL_DEFAULT_LIMIT;
+    long after;
+    int count;
+    int n = 0;
+    int i;
+
+    memset (&filter, 0, sizeof (filter));
+    filter.protocol = -1;
+
+    while ((option = strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr)) != NULL)
+    {
+        value = strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr);
+        if (strcmp (option, "internal-ip") == 0)
+        {
+            filter.match_internal_ip = parse_ip (value, &filter.internal_ip);
+            if (!filter.match_internal_ip)
+            {
+                return control_error (out, "invalid IP address");
+            }
+        }
+        else if (strcmp (option, "external-ip") == 0)
+        {
+            filter.match_external_ip = parse_ip (value, &filter.external_ip);
+            if (!filter.match_external_ip)
+            {
+                return control_error (out, "invalid IP address");
+            }
+        }
+        else if (strcmp (option, "protocol") == 0)
+        {
+            if (!parse_protocol (value, &filter.protocol))
+            {
+                return control_error (out, "invalid protocol");
+            }
+        }
+        else if (strcmp (option, "after") == 0)
+        {
+            if (!parse_int (value, 0, INT_MAX - 1, &after))
+            {
+                return control_error (out, "invalid mapping ID");
+            }
+            filter.after = after;
+        }
+        else if (strcmp (option, "limit") == 0)
+        {
+            if (!parse_int (value, 1, PCP_CONTROL_MAX_LIMIT, &limit))
+            {
+                return control_error (out, "invalid limit");
+            }
+        }
+        else
+        {
+            return control_error (out, "usage: list [internal-ip IP] [external-ip IP] "
+                                  "[protocol PROTOCOL] [after ID] [limit N]");
+        }
+    }
+
+    /* Ask for one more than the limit to learn whether there is another page */
+    found = malloc ((limit + 1) * sizeof (struct pcp_mapping_s));
+    if (found == NULL)
+    {
+        return control_error (out, "out of memory");
+    }
+    count = ops->list (&filter, found, limit + 1);
+
+    for (i = 0; i < count && i < limit && n >= 0; i++)
+    {
+        n = pcp_export_write_mapping (out, PCP_EXPORT_JSON, &found[i]);
+    }
+    if (n >= 0 && count > limit)
+    {
+        n = fprintf (out, "{\"type\":\"next\",\"after\":%d}\n", found[limit - 1].index);
+    }
+    free (found);
+
+    if (n < 0)
+    {
+        return n;
+    }
+    return fprintf (out, "OK\n");
+}
+
+static int
+control_expire (const pcp_control_ops *ops, char **saveptr, FILE *out)
+{
+    long index;
+
+    if (!parse_int (strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr), 0, INT_MAX, &index) ||
+        strtok_r (NULL, CONTROL_TOKEN_DELIMITERS, saveptr) != NULL)
+    {
+        return control_error (out, "usage: expire ID");
+    }
+    if (!ops->expire (index))
+    {
+        return control_error (out, "no such mapping, or it could not be removed");
+    }
+    return fprintf (out, "OK\n");
+}
+
+/**
+ * @brief pcp_control_execute - Run one control command
+ * @param ops - The queries answered by pcpd
+ * @param line - The command. It is modified while it is parsed.
+ * @param out - Where to write the response
+ * @return - Negative number if the response could not be written
+ */
+int
+pcp_control_execute (const pcp_control_ops *ops, char *line, FILE *out)
+{
+    char *saveptr = NULL;
+    char *command;
+
+    command = strtok_r (line, CONTROL_TOKEN_DELIMITERS, &saveptr);
+    if (command == NULL)
+    {
+        return control_error (out, "empty command");
+    }
+    if (strcmp (command, "show") == 0)
+    {
+        return control_show (ops, &saveptr, out);
+    }
+    if (strcmp (command, "lookup") == 0)
+    {
+        return control_lookup (ops, &saveptr, out);
+    }
+    if (strcmp (command, "list") == 0)
+    {
+        return control_list (ops, &saveptr, out);
+    }
+    if (strcmp (command, "expire") == 0)
+    {
+        return control_expire (ops, &saveptr, out);
+    }
+    if (strcmp (command, "help") == 0)
+    {
+        return control_help (out);
+    }
+    return control_error (out, "unknown command, try help");
+}
+
+/* Send a whole response. MSG_NOSIGNAL keeps a client that has gone away
+ * from raising SIGPIPE. */
+static bool
+send_response (int sock, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = send (sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief serve_client - Answer commands from one client until it disconnects
+ * @param sock - The client's socket
+ */
+static void
+serve_client (int sock)
+{
+    char line[PCP_CONTROL_MAX_LINE];
+    size_t used = 0;
+    char *newline;
+    char *response;
+    size_t response_len;
+    FILE *out;
+    ssize_t n;
+    bool ok = true;
+
+    while (ok)
+    {
+        newline = memchr (line, '\n', used);
+        if (newline == NULL)
+        {
+            if (used == sizeof (line))
+            {
+                send_response (sock, "ERROR command too long\n", 23);
+                return;
+            }
+            n = recv (sock, line + used, sizeof (line) - used, 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return;
+            }
+            used += n;
+            continue;
+        }
+        *newline = '\0';
+
+        response = NULL;
+        response_len = 0;
+        out = open_memstream (&response, &response_len);
+        if (out == NULL)
+        {
+            return;
+        }
+        pcp_control_execute (control_ops, line, out);
+        fclose (out);
+        ok = send_response (sock, response, response_len);
+        free (response);
+
+        used -= newline + 1 - line;
+        memmove (line, newline + 1, used);
+    }
+}
+
+static void *
+control_loop (void *arg)
+{
+    struct timeval timeout = { CONTROL_IDLE_TIMEOUT, 0 };
+    int sock;
+
+    while (1)
+    {
+        sock = accept (listen_sock, NULL, NULL);
+
+        pthread_mutex_lock (&control_lock);
+        if (control_stopping)
+        {
+            pthread_mutex_unlock (&control_lock);
+            if (sock >= 0)
+            {
+                close (sock);
+            }
+            break;
+        }
+        client_sock = sock;
+        pthread_mutex_unlock (&control_lock);
+
+        if (sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            syslog (LOG_ERR, "Control socket accept failed: %m");
+            break;
+        }
+        setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+        setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+        serve_client (sock);
+
+        pthread_mutex_lock (&control_lock);
+        client_sock = -1;
+        pthread_mutex_unlock (&control_lock);
+        close (sock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief pcp_control_start - Listen for control commands
+ * @param path - Path of the Unix domain socket. Any existing file is replaced.
+ * @param ops - The queries answered by pcpd
+ * @return - True if the socket is listening
+ */
+bool
+pcp_control_start (const char *path, const pcp_control_ops *ops)
+{
+    struct sockaddr_un addr;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+    {
+        syslog (LOG_ERR, "Control socket path is too long");
+        return false;
+    }
+
+    listen_sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_sock < 0)
+    {
+        syslog (LOG_ERR, "Failed to open control socket: %m");
+        return false;
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+    unlink (path);
+
+    /* Only root may query or expire mappings */
+    if (bind (listen_sock, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+        chmod (path, S_IRUSR | S_IWUSR) < 0 ||
+        listen (listen_sock, SOMAXCONN) < 0)
+    {
+        syslog (LOG_ERR, "Failed to set up control socket %s: %m", path);
+        close (listen_sock);
+        listen_sock = -1;
+        return false;
+    }
+
+    socket_path = strdup (path);
+    control_ops = ops;
+    control_stopping = false;
+    if (pthread_create (&control_thread, NULL, control_loop, NULL) != 0)
+    {
+        syslog (LOG_ERR, "Failed to create control socket thread");
+        pcp_control_stop ();
+        return false;
+    }
+    control_running = true;
+    return true;
+}
+
+/**
+ * @brief pcp_control_stop - Stop listening, wait for the control thread to
+ *          finish any command it is running and remove the socket
+ */
+void
+pcp_control_stop (void)
+{
+    if (control_running)
+    {
+        /* Shutting the sockets down wakes the thread from accept or recv */
+        pthread_mutex_lock (&control_lock);
+        control_stopping = true;
+        shutdown (listen_sock, SHUT_RDWR);
+        if (client_sock >= 0)
+        {
+            shutdown (client_sock, SHUT_RDWR);
+        }
+        pthread_mutex_unlock (&control_lock);
+
+        pthread_join (control_thread, NULL);
+        control_running = false;
+    }
+    if (listen_sock >= 0)
+    {
+        close (listen_sock);
+        listen_sock = -1;
+    }
+    if (socket_path)
+    {
+        unlink (socket_path);
+        free (socket_path);
+        socket_path = NULL;
+    }
+}
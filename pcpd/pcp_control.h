@@ -0,0 +1,89 @@
+/**
+ * @file pcp_control.h
+ *
+ * Local control socket for querying a running pcpd.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PCP_CONTROL_H
+#define PCP_CONTROL_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "libpcp.h"
+
+/* Clients send one command per line and may send several per connection:
+ *
+ *   show
+ *   lookup internal|external IP PORT PROTOCOL
+ *   list [internal-ip IP] [external-ip IP] [protocol PROTOCOL] [after ID] [limit N]
+ *   expire ID
+ *   help
+ *
+ * IP is an IPv4 or IPv6 address and PROTOCOL a number, "tcp" or "udp".
+ * Mappings are returned one per line in the JSON format of the state output.
+ * When list stops at the limit it adds {"type":"next","after":ID}; send the
+ * same command with that "after" for the next page. Every response ends
+ * with a line of "OK" or "ERROR" followed by a reason. */
+#define PCP_CONTROL_SOCKET_PATH "/var/run/pcpd.sock"
+#define PCP_CONTROL_MAX_LINE 256
+#define PCP_CONTROL_DEFAULT_LIMIT 100
+#define PCP_CONTROL_MAX_LIMIT 1000
+
+/* Which mappings a list command returns */
+typedef struct _pcp_control_filter
+{
+    bool match_internal_ip;
+    struct in6_addr internal_ip;
+    bool match_external_ip;
+    struct in6_addr external_ip;
+    int protocol;               // -1 for any protocol
+    int after;                  // Only mappings with a higher ID
+} pcp_control_filter;
+
+/* Queries answered by pcpd. Mappings are copied out, so no lock is held
+ * while the response is written. */
+typedef struct _pcp_control_ops
+{
+    /** Write the config and counters */
+    int (*show) (FILE *out);
+
+    /** Copy the mapping using an internal or external endpoint */
+    bool (*lookup) (bool external, struct in6_addr *ip, u_int16_t port, u_int8_t protocol,
+                    struct pcp_mapping_s *mapping);
+
+    /** Copy up to max mappings that match filter, in ID order, and return how many */
+    int (*list) (const pcp_control_filter *filter, struct pcp_mapping_s *mappings, int max);
+
+    /** Remove a mapping now, as if its lifetime had run out */
+    bool (*expire) (int index);
+} pcp_control_ops;
+
+bool pcp_control_filter_match (const pcp_control_filter *filter, pcp_mapping mapping);
+
+int pcp_control_execute (const pcp_control_ops *ops, char *line, FILE *out);
+
+bool pcp_control_start (const char *path, const pcp_control_ops *ops);
+
+void pcp_control_stop (void);
+
+#endif /* PCP_CONTROL_H */
@@ -0,0 +1,181 @@
+/**
+ * @file pcp_export.c
+ *
+ * Machine-readable state output for tools that read large mapping tables.
+ * Each mapping is written straight to the stream with raw epoch times and
+ * no allocation, so the cost per mapping is one formatted or binary write.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include "packets_pcp.h"
+#include "packets_pcp_serialization.h"
+#include "pcp_export.h"
+
+static const char *format_names[] = {
+    [PCP_EXPORT_TEXT] = "text",
+    [PCP_EXPORT_JSON] = "json",
+    [PCP_EXPORT_BINARY] = "binary",
+};
+
+/**
+ * @brief pcp_export_format_parse - Look up an output format by name
+ * @param name - "text", "json" or "binary"
+ * @param format - Where to place the format
+ * @return - True if the name is known
+ */
+bool
+pcp_export_format_parse (const char *name, pcp_export_format *format)
+{
+    int i;
+
+    for (i = 0; i < sizeof (format_names) / sizeof (format_names[0]); i++)
+    {
+        if (strcmp (name, format_names[i]) == 0)
+        {
+            *format = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *
+pcp_export_format_name (pcp_export_format format)
+{
+    return format <= PCP_EXPORT_BINARY ? format_names[format] : "unknown";
+}
+
+/**
+ * @brief pcp_export_write_header - Write what comes before the mappings
+ * @param target - File to write to
+ * @param format - PCP_EXPORT_JSON or PCP_EXPORT_BINARY
+ * @param header - Description of the table
+ * @return - Negative number on error
+ */
+int
+pcp_export_write_header (FILE *target, pcp_export_format format,
+                         const pcp_export_header *header)
+{
+    unsigned char buf[PCP_EXPORT_HEADER_SIZE];
+    unsigned char *ptr = buf;
+
+    switch (format)
+    {
+    case PCP_EXPORT_JSON:
+        return fprintf (target,
+                        "{\"type\":\"header\",\"version\":%d,\"time\":%u,"
+                        "\"startup_time\":%u,\"mappings\":%u}\n",
+                        PCP_EXPORT_VERSION, header->now, header->startup_time,
+                        header->num_mappings);
+    case PCP_EXPORT_BINARY:
+        ptr = serialize_u_int32_t (ptr, PCP_EXPORT_MAGIC);
+        ptr = serialize_u_int16_t (ptr, PCP_EXPORT_VERSION);
+        ptr = serialize_u_int16_t (ptr, PCP_EXPORT_RECORD_SIZE);
+        ptr = serialize_u_int32_t (ptr, header->now);
+        ptr = serialize_u_int32_t (ptr, header->startup_time);
+        ptr = serialize_u_int32_t (ptr, header->num_mappings);
+        ptr = serialize_u_int32_t (ptr, 0);
+        return fwrite (buf, ptr - buf, 1, target) == 1 ? ptr - buf : -1;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief pcp_export_write_mapping - Write one mapping
+ * @param target - File to write to
+ * @param format - PCP_EXPORT_JSON or PCP_EXPORT_BINARY
+ * @param mapping - The mapping
+ * @return - Negative number on error
+ */
+int
+pcp_export_write_mapping (FILE *target, pcp_export_format format, pcp_mapping mapping)
+{
+    char internal_ip_str[INET6_ADDRSTRLEN];
+    char external_ip_str[INET6_ADDRSTRLEN];
+    unsigned char buf[PCP_EXPORT_RECORD_SIZE];
+    unsigned char *ptr = buf;
+    int n, ret;
+
+    switch (format)
+    {
+    case PCP_EXPORT_JSON:
+        inet_ntop (AF_INET6, &mapping->internal_ip, internal_ip_str, INET6_ADDRSTRLEN);
+        inet_ntop (AF_INET6, &mapping->external_ip, external_ip_str, INET6_ADDRSTRLEN);
+        n = fprintf (target,
+                     "{\"type\":\"mapping\",\"id\":%d,\"opcode\":\"%s\","
+                     "\"nonce\":[%u,%u,%u],\"protocol\":%u,"
+                     "\"internal_ip\":\"%s\",\"internal_port\":%u,"
+                     "\"external_ip\":\"%s\",\"external_port\":%u,"
+                     "\"lifetime\":%u,\"start_of_life\":%u,\"end_of_life\":%u",
+                     mapping->index, mapping->opcode == MAP_OPCODE ? "MAP" : "PEER",
+                     mapping->mapping_nonce[0], mapping->mapping_nonce[1],
+                     mapping->mapping_nonce[2], mapping->protocol,
+                     internal_ip_str, mapping->internal_port,
+                     external_ip_str, mapping->external_port,
+                     mapping->lifetime, mapping->start_of_life, mapping->end_of_life);
+        if (n < 0)
+            return -1;
+        if (mapping->opcode == PEER_OPCODE)
+        {
+            inet_ntop (AF_INET6, &mapping->remote_peer_ip, external_ip_str, INET6_ADDRSTRLEN);
+            ret = fprintf (target, ",\"remote_peer_ip\":\"%s\",\"remote_peer_port\":%u",
+                           external_ip_str, mapping->remote_peer_port);
+            if (ret < 0)
+                return -1;
+            n += ret;
+        }
+        ret = fprintf (target, "}\n");
+        return ret < 0 ? -1 : n + ret;
+    case PCP_EXPORT_BINARY:
+        ptr = serialize_u_int32_t (ptr, mapping->index);
+        ptr = serialize_u_int32_t_array3 (ptr, mapping->mapping_nonce);
+        ptr = serialize_ip_address (ptr, &mapping->internal_ip);
+        ptr = serialize_ip_address (ptr, &mapping->external_ip);
+        ptr = serialize_u_int16_t (ptr, mapping->internal_port);
+        ptr = serialize_u_int16_t (ptr, mapping->external_port);
+        ptr = serialize_u_int32_t (ptr, mapping->lifetime);
+        ptr = serialize_u_int32_t (ptr, mapping->start_of_life);
+        ptr = serialize_u_int32_t (ptr, mapping->end_of_life);
+        ptr = serialize_u_int8_t (ptr, mapping->opcode);
+        ptr = serialize_u_int8_t (ptr, mapping->protocol);
+        ptr = serialize_u_int16_t (ptr, 0);
+        if (mapping->opcode == PEER_OPCODE)
+        {
+            ptr = serialize_ip_address (ptr, &mapping->remote_peer_ip);
+            ptr = serialize_u_int16_t (ptr, mapping->remote_peer_port);
+        }
+        else
+        {
+            memset (ptr, 0, 18);
+            ptr += 18;
+        }
+        ptr = serialize_u_int16_t (ptr, 0);
+        return fwrite (buf, ptr - buf, 1, target) == 1 ? ptr - buf : -1;
+    default:
+        return -1;
+    }
+}
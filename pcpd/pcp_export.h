@@ -0,0 +1,93 @@
+/**
+ * @file pcp_export.h
+ *
+ * Machine-readable state output. Mappings are streamed as newline-delimited
+ * JSON or as fixed-size binary records.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PCP_EXPORT_H
+#define PCP_EXPORT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "libpcp.h"
+
+/* Binary output is one header followed by one record per mapping. All
+ * fields are in network byte order.
+ *
+ * Header (PCP_EXPORT_HEADER_SIZE bytes):
+ *   0  magic          u32  PCP_EXPORT_MAGIC
+ *   4  version        u16  PCP_EXPORT_VERSION
+ *   6  record size    u16  PCP_EXPORT_RECORD_SIZE
+ *   8  time           u32  Epoch time the state was copied
+ *  12  startup time   u32  Epoch time pcpd started
+ *  16  mappings       u32  Number of records that follow
+ *  20  reserved       u32
+ *
+ * Record (PCP_EXPORT_RECORD_SIZE bytes):
+ *   0  mapping ID     u32
+ *   4  mapping nonce  u32[3]
+ *  16  internal IP    16 bytes
+ *  32  external IP    16 bytes
+ *  48  internal port  u16
+ *  50  external port  u16
+ *  52  lifetime       u32
+ *  56  start of life  u32  Epoch time
+ *  60  end of life    u32  Epoch time
+ *  64  opcode         u8
+ *  65  protocol       u8
+ *  66  reserved       u16
+ *  68  remote peer IP 16 bytes  Zero unless the opcode is PEER
+ *  84  remote port    u16       Zero unless the opcode is PEER
+ *  86  reserved       u16
+ */
+#define PCP_EXPORT_MAGIC 0x50435053     // "PCPS"
+#define PCP_EXPORT_VERSION 2
+#define PCP_EXPORT_HEADER_SIZE 24
+#define PCP_EXPORT_RECORD_SIZE 88
+
+typedef enum
+{
+    PCP_EXPORT_TEXT,
+    PCP_EXPORT_JSON,
+    PCP_EXPORT_BINARY,
+} pcp_export_format;
+
+/* What the output says about the whole table */
+typedef struct _pcp_export_header
+{
+    u_int32_t now;
+    u_int32_t startup_time;
+    u_int32_t num_mappings;
+} pcp_export_header;
+
+bool pcp_export_format_parse (const char *name, pcp_export_format *format);
+
+const char *pcp_export_format_name (pcp_export_format format);
+
+int pcp_export_write_header (FILE *target, pcp_export_format format,
+                             const pcp_export_header *header);
+
+int pcp_export_write_mapping (FILE *target, pcp_export_format format, pcp_mapping mapping);
+
+#endif /* PCP_EXPORT_H */
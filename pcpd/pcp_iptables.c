@@ -1,7 +1,10 @@
 /**
  * @file pcp_iptables.c
  *
- * Functions to manage PCP mappings on iptables.
+ * Functions to manage PCP mappings on iptables. The forwarding backend is
+ * pluggable; the backend here runs iptables commands and is the fallback when
+ * no in-process backend is available. IPv6 mappings use the same chains in
+ * the ip6tables tables.
  *
  * Copyright 2015 Allied Telesis Labs, New Zealand
  *
@@ -22,32 +25,33 @@
  *
  */
 
+#include <errno.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <syslog.h>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
 #include "pcp_iptables.h"
+#include "pcp_metrics.h"
 
-/* Note: ip6tables is not supported yet */
 #define IP4TABLES_CMD "iptables"
 #define IP6TABLES_CMD "ip6tables"
 
-#define PCP_PREROUTING_CHAIN "PCP_NAT_PREROUTE_RULES"
-#define PCP_POSTROUTING_CHAIN "PCP_NAT_POSTROUTE_RULES"
-#define PCP_MANGLE_CHAIN "PCP_MANGLE_RULES"
+/* Succeeds when ip6tables can program NAT, which the IPv6 mappings need */
+#define IP6TABLES_NAT_CHECK_CMD IP6TABLES_CMD " -t nat -n -L PREROUTING > /dev/null 2>&1"
 
-#define PCP_PREROUTING_RULE_FORMAT "PCP_NAT_PREROUTE_RULE_%d"
-#define PCP_POSTROUTING_RULE_FORMAT "PCP_NAT_POSTROUTE_RULE_%d"
-#define PCP_MANGLE_RULE_FORMAT "PCP_MANGLE_RULE_%d"
+#define IPT_CMD_SIZE (IPT_BUF_SIZE + sizeof (IP6TABLES_CMD))
 
-#define IPT_BUF_SIZE 256
+extern char **environ;
 
 typedef enum
 {
@@ -56,68 +60,131 @@ typedef enum
     IPV4_AND_IPV6,
 } PCP_CMD_TYPE;
 
+/* Families the command backend programs. IPv6 is added by iptables_cmd_init
+ * if ip6tables is usable. */
+static PCP_CMD_TYPE cmd_families = IPV4_ONLY;
+
+/**
+ * @brief start_iptables_cmd - Start an iptables or ip6tables command without
+ *          waiting for it to finish
+ * @param iptables - IP4TABLES_CMD or IP6TABLES_CMD
+ * @param cmd - The command excluding the iptables/ip6tables at the start
+ * @return - Process ID of the command, or -1 if it could not be started
+ */
+static pid_t
+start_iptables_cmd (const char *iptables, const char *cmd)
+{
+    char tmp[IPT_CMD_SIZE] = { '\0' };
+    char *argv[] = { "sh", "-c", tmp, NULL };
+    pid_t pid;
+
+    if (snprintf (tmp, IPT_CMD_SIZE, "%s %s", iptables, cmd) >= IPT_CMD_SIZE)
+    {
+        return -1;
+    }
+    if (posix_spawn (&pid, "/bin/sh", NULL, NULL, argv, environ) != 0)
+    {
+        syslog (LOG_ERR, "Could not run command [%s]", tmp);
+        return -1;
+    }
+    syslog (LOG_DEBUG, "Sent cmd: %s\n", tmp);
+    return pid;
+}
+
 /**
- * @brief send_iptables_cmd - Send an iptables command for IPv4 and/or IPv6
+ * @brief finish_iptables_cmd - Wait for a command started by start_iptables_cmd
+ * @param pid - Process ID of the command
+ * @param iptables - IP4TABLES_CMD or IP6TABLES_CMD
+ * @param cmd - The command excluding the iptables/ip6tables at the start
+ * @return - True if the command succeeded
+ */
+static bool
+finish_iptables_cmd (pid_t pid, const char *iptables, const char *cmd)
+{
+    int status = -1;
+
+    if (pid < 0)
+    {
+        return false;
+    }
+    while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+        syslog (LOG_ERR, "Command [%s %s] failed", iptables, cmd);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief send_iptables_cmd - Send an iptables command for IPv4 and/or IPv6.
+ *          For both families the iptables and ip6tables commands run at the
+ *          same time, as they program separate tables.
  * @param cmd - The command excluding the iptables/ip6tables at the start
  * @param family - Whether command is for IPv4, IPv6, or both
- * @return - True on success, false if a command failed or out of memory
+ * @return - True on success, false if a command failed or could not be run
  */
 bool
 send_iptables_cmd (const char *cmd, PCP_CMD_TYPE family)
 {
-    char tmp[IPT_BUF_SIZE] = { '\0' };
+    pid_t ip6_pid = -1;
+    pid_t ip4_pid = -1;
     bool ret = true;
 
     if (family != IPV4_ONLY)
     {
-        if (snprintf (tmp, IPT_BUF_SIZE, "%s %s", IP6TABLES_CMD, cmd) <= 0)
-        {
-            return false;
-        }
-        if (system (tmp))
-        {
-            syslog (LOG_ERR, "Command [%s %s] failed", IP6TABLES_CMD, cmd);
-            ret = false;
-        }
-        syslog (LOG_DEBUG, "Sent cmd: %s\n", tmp);
+        ip6_pid = start_iptables_cmd (IP6TABLES_CMD, cmd);
     }
     if (family != IPV6_ONLY)
     {
-        if (snprintf (tmp, IPT_BUF_SIZE, "%s %s", IP4TABLES_CMD, cmd) <= 0)
-        {
-            return false;
-        }
-        if (system (tmp))
-        {
-            syslog (LOG_ERR, "Command [%s %s] failed", IP4TABLES_CMD, cmd);
-            ret = false;
-        }
-        syslog (LOG_DEBUG, "Sent cmd: %s\n", tmp);
+        ip4_pid = start_iptables_cmd (IP4TABLES_CMD, cmd);
+    }
+
+    if (family != IPV4_ONLY && !finish_iptables_cmd (ip6_pid, IP6TABLES_CMD, cmd))
+    {
+        ret = false;
+    }
+    if (family != IPV6_ONLY && !finish_iptables_cmd (ip4_pid, IP4TABLES_CMD, cmd))
+    {
+        ret = false;
     }
     return ret;
 }
 
 /**
- * @brief pcp_iptables_init - Create new iptables chains for PCP and append
- *          them to the correct places
+ * @brief iptables_cmd_init - Create new iptables chains for PCP and append
+ *          them to the correct places, in ip6tables too if it supports NAT
+ * @return - True, the chains may already exist
  */
-void
-pcp_iptables_init (void)
+static bool
+iptables_cmd_init (void)
 {
     char *cmd_preroute;
     char *cmd_postroute;
     char *cmd_mangle;
 
+    if (system (IP6TABLES_NAT_CHECK_CMD) == 0)
+    {
+        cmd_families = IPV4_AND_IPV6;
+    }
+    else
+    {
+        syslog (LOG_WARNING, "ip6tables NAT is unavailable, IPv6 mappings are disabled");
+        cmd_families = IPV4_ONLY;
+    }
+
     /* Create new chains for PCP mappings. Return if any one of them already exists */
     cmd_preroute = "-t nat -N " PCP_PREROUTING_CHAIN;
     cmd_postroute = "-t nat -N " PCP_POSTROUTING_CHAIN;
     cmd_mangle = "-t mangle -N " PCP_MANGLE_CHAIN;
 
-    if (!send_iptables_cmd (cmd_preroute, IPV4_ONLY) ||
-        !send_iptables_cmd (cmd_postroute, IPV4_ONLY) ||
-        !send_iptables_cmd (cmd_mangle, IPV4_ONLY))
+    if (!send_iptables_cmd (cmd_preroute, cmd_families) ||
+        !send_iptables_cmd (cmd_postroute, cmd_families) ||
+        !send_iptables_cmd (cmd_mangle, cmd_families))
     {
-        return;
+        return true;
     }
 
     /* Flush the chains */
@@ -125,26 +192,28 @@ pcp_iptables_init (void)
     cmd_postroute = "-t nat -F " PCP_POSTROUTING_CHAIN;
     cmd_mangle = "-t mangle -F " PCP_MANGLE_CHAIN;
 
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, cmd_families);
+    send_iptables_cmd (cmd_postroute, cmd_families);
+    send_iptables_cmd (cmd_mangle, cmd_families);
 
     /* Append the chains to the correct places */
     cmd_preroute = "-t nat -A PREROUTING -j " PCP_PREROUTING_CHAIN;
     cmd_postroute = "-t nat -A POSTROUTING -j " PCP_POSTROUTING_CHAIN;
     cmd_mangle = "-t mangle -A PREROUTING -j " PCP_MANGLE_CHAIN;
 
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, cmd_families);
+    send_iptables_cmd (cmd_postroute, cmd_families);
+    send_iptables_cmd (cmd_mangle, cmd_families);
+
+    return true;
 }
 
 /**
- * @brief pcp_iptables_deinit - Remove the references the the PCP iptables chains
+ * @brief iptables_cmd_deinit - Remove the references the the PCP iptables chains
  *          then remove them
  */
-void
-pcp_iptables_deinit (void)
+static void
+iptables_cmd_deinit (void)
 {
     char *cmd_preroute;
     char *cmd_postroute;
@@ -155,27 +224,27 @@ pcp_iptables_deinit (void)
     cmd_postroute = "-t nat -D POSTROUTING -j " PCP_POSTROUTING_CHAIN;
     cmd_mangle = "-t mangle -D PREROUTING -j " PCP_MANGLE_CHAIN;
 
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, cmd_families);
+    send_iptables_cmd (cmd_postroute, cmd_families);
+    send_iptables_cmd (cmd_mangle, cmd_families);
 
     /* Flush the chains */
     cmd_preroute = "-t nat -F " PCP_PREROUTING_CHAIN;
     cmd_postroute = "-t nat -F " PCP_POSTROUTING_CHAIN;
     cmd_mangle = "-t mangle -F " PCP_MANGLE_CHAIN;
 
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, cmd_families);
+    send_iptables_cmd (cmd_postroute, cmd_families);
+    send_iptables_cmd (cmd_mangle, cmd_families);
 
     /* Delete the chains */
     cmd_preroute = "-t nat -X " PCP_PREROUTING_CHAIN;
     cmd_postroute = "-t nat -X " PCP_POSTROUTING_CHAIN;
     cmd_mangle = "-t mangle -X " PCP_MANGLE_CHAIN;
 
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, cmd_families);
+    send_iptables_cmd (cmd_postroute, cmd_families);
+    send_iptables_cmd (cmd_mangle, cmd_families);
 }
 
 /**
@@ -207,22 +276,20 @@ is_ipv4_mapped_ipv6_addr (struct in6_addr *ip6)
  *          function, check if compatible with is_ipv4_mapped_ipv6_addr or strange things
  *          may happen elsewhere.
  * @param ip6 - The IPv6 address
- * @return - The converted IPv4 address
+ * @return - The converted IPv4 address, in network byte order
  */
 struct in_addr
 convert_ipv6_to_ipv4 (struct in6_addr *ip6)
 {
     struct in_addr result = { 0 };
-    result.s_addr = (ip6->s6_addr[12] << 24) +
-                    (ip6->s6_addr[13] << 16) +
-                    (ip6->s6_addr[14] << 8) +
-                    (ip6->s6_addr[15]);
+    memcpy (&result.s_addr, &ip6->s6_addr[12], sizeof (result.s_addr));
     return result;
 }
 
 /* Create the chains in the correct tables */
 static bool
-create_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain_mangle)
+create_pcp_rule_chains (PCP_CMD_TYPE family,
+                        char *chain_preroute, char *chain_postroute, char *chain_mangle)
 {
     char cmd_preroute[IPT_BUF_SIZE] = { '\0' };
     char cmd_postroute[IPT_BUF_SIZE] = { '\0' };
@@ -234,16 +301,17 @@ create_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain
     {
         return false;
     }
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, family);
+    send_iptables_cmd (cmd_postroute, family);
+    send_iptables_cmd (cmd_mangle, family);
 
     return true;
 }
 
 /* Flush the chains */
 static bool
-flush_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain_mangle)
+flush_pcp_rule_chains (PCP_CMD_TYPE family,
+                       char *chain_preroute, char *chain_postroute, char *chain_mangle)
 {
     char cmd_preroute[IPT_BUF_SIZE] = { '\0' };
     char cmd_postroute[IPT_BUF_SIZE] = { '\0' };
@@ -255,16 +323,17 @@ flush_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain_
     {
         return false;
     }
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, family);
+    send_iptables_cmd (cmd_postroute, family);
+    send_iptables_cmd (cmd_mangle, family);
 
     return true;
 }
 
 /* Delete the chains */
 static bool
-delete_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain_mangle)
+delete_pcp_rule_chains (PCP_CMD_TYPE family,
+                        char *chain_preroute, char *chain_postroute, char *chain_mangle)
 {
     char cmd_preroute[IPT_BUF_SIZE] = { '\0' };
     char cmd_postroute[IPT_BUF_SIZE] = { '\0' };
@@ -276,16 +345,17 @@ delete_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain
     {
         return false;
     }
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, family);
+    send_iptables_cmd (cmd_postroute, family);
+    send_iptables_cmd (cmd_mangle, family);
 
     return true;
 }
 
 /* Add jumps to the chains for the new mapping - assuming PCP is enabled */
 static bool
-append_jump_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain_mangle)
+append_jump_pcp_rule_chains (PCP_CMD_TYPE family,
+                             char *chain_preroute, char *chain_postroute, char *chain_mangle)
 {
     char cmd_preroute[IPT_BUF_SIZE] = { '\0' };
     char cmd_postroute[IPT_BUF_SIZE] = { '\0' };
@@ -303,16 +373,17 @@ append_jump_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *
     {
         return false;
     }
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, family);
+    send_iptables_cmd (cmd_postroute, family);
+    send_iptables_cmd (cmd_mangle, family);
 
     return true;
 }
 
 /* Remove jumps to the chains for a mapping */
 static bool
-remove_jump_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *chain_mangle)
+remove_jump_pcp_rule_chains (PCP_CMD_TYPE family,
+                             char *chain_preroute, char *chain_postroute, char *chain_mangle)
 {
     char cmd_preroute[IPT_BUF_SIZE] = { '\0' };
     char cmd_postroute[IPT_BUF_SIZE] = { '\0' };
@@ -330,15 +401,23 @@ remove_jump_pcp_rule_chains (char *chain_preroute, char *chain_postroute, char *
     {
         return false;
     }
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, family);
+    send_iptables_cmd (cmd_postroute, family);
+    send_iptables_cmd (cmd_mangle, family);
 
     return true;
 }
 
-/* Get the protocol section of the iptables command including the port number if applicable */
-static bool
+/**
+ * @brief get_protocol_port_str - Get the protocol section of an iptables rule
+ *          including the port number if applicable
+ * @param buffer - Buffer of IPT_BUF_SIZE to write to
+ * @param protocol - Protocol
+ * @param port - Port number
+ * @param is_sport - True to match the source port, false for the destination port
+ * @return - True on success
+ */
+bool
 get_protocol_port_str (char *buffer,
                        u_int16_t protocol,
                        u_int16_t port,
@@ -370,7 +449,8 @@ get_protocol_port_str (char *buffer,
 
 /* Create port forwarding from external to internal and mark as allowed */
 static bool
-ext_to_int_pcp_rule (char *chain_preroute,
+ext_to_int_pcp_rule (PCP_CMD_TYPE family,
+                     char *chain_preroute,
                      char *chain_mangle,
                      char *internal_ip_str,
                      char *external_ip_str,
@@ -390,7 +470,9 @@ ext_to_int_pcp_rule (char *chain_preroute,
 
     if (snprintf
             (cmd_preroute, IPT_BUF_SIZE,
-             "-t nat -A %s -d %s %s -j DNAT --to-destination %s:%u",
+             family == IPV6_ONLY ?
+                 "-t nat -A %s -d %s %s -j DNAT --to-destination [%s]:%u" :
+                 "-t nat -A %s -d %s %s -j DNAT --to-destination %s:%u",
              chain_preroute, external_ip_str, protocol_port_str, internal_ip_str, internal_port) <= 0 ||
         snprintf
             (cmd_mangle, IPT_BUF_SIZE,
@@ -399,15 +481,16 @@ ext_to_int_pcp_rule (char *chain_preroute,
     {
         return false;
     }
-    send_iptables_cmd (cmd_preroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_preroute, family);
+    send_iptables_cmd (cmd_mangle, family);
 
     return true;
 }
 
 /* Create port forwarding from internal to external and mark as allowed */
 static bool
-int_to_ext_pcp_rule (char *chain_postroute,
+int_to_ext_pcp_rule (PCP_CMD_TYPE family,
+                     char *chain_postroute,
                      char *chain_mangle,
                      char *internal_ip_str,
                      char *external_ip_str,
@@ -427,7 +510,9 @@ int_to_ext_pcp_rule (char *chain_postroute,
 
     if (snprintf
             (cmd_postroute, IPT_BUF_SIZE,
-             "-t nat -A %s -s %s %s -j SNAT --to-source %s:%u",
+             family == IPV6_ONLY ?
+                 "-t nat -A %s -s %s %s -j SNAT --to-source [%s]:%u" :
+                 "-t nat -A %s -s %s %s -j SNAT --to-source %s:%u",
              chain_postroute, internal_ip_str, protocol_port_str, external_ip_str, external_port) <= 0 ||
         snprintf
             (cmd_mangle, IPT_BUF_SIZE,
@@ -436,42 +521,37 @@ int_to_ext_pcp_rule (char *chain_postroute,
     {
         return false;
     }
-    send_iptables_cmd (cmd_postroute, IPV4_ONLY);
-    send_iptables_cmd (cmd_mangle, IPV4_ONLY);
+    send_iptables_cmd (cmd_postroute, family);
+    send_iptables_cmd (cmd_mangle, family);
 
     return true;
 }
 
 /**
- * Add a chain and rule to the nat table to do port forwarding using specified parameters.
- * TODO: IPv6
- * @param index         The rule ID
- * @param application   The name of the application entity
- * @param from          The name of the source entity
- * @param to            The name of the destination entity
+ * Add chains and rules to the nat and mangle tables of one family to do port
+ * forwarding using specified parameters.
+ * @param index - The rule ID
+ * @param family - IPV4_ONLY or IPV6_ONLY
+ * @param internal_ip_str - Internal address
+ * @param external_ip_str - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
  * @return - True on success, else false
  */
-bool
-write_pcp_port_forwarding_chain (int index,
-                                 struct in_addr *internal_ip,
-                                 struct in_addr *external_ip,
-                                 u_int16_t internal_port,
-                                 u_int16_t external_port,
-                                 u_int16_t protocol)
+static bool
+iptables_cmd_write_family (int index,
+                           PCP_CMD_TYPE family,
+                           char *internal_ip_str,
+                           char *external_ip_str,
+                           u_int16_t internal_port,
+                           u_int16_t external_port,
+                           u_int16_t protocol)
 {
     char chain_preroute[IPT_BUF_SIZE] = { '\0' };
     char chain_postroute[IPT_BUF_SIZE] = { '\0' };
     char chain_mangle[IPT_BUF_SIZE] = { '\0' };
 
-    char internal_ip_str[INET_ADDRSTRLEN] = { '\0' };
-    char external_ip_str[INET_ADDRSTRLEN] = { '\0' };
-
-    if (!inet_ntop (AF_INET, internal_ip, internal_ip_str, INET_ADDRSTRLEN) ||
-        !inet_ntop (AF_INET, external_ip, external_ip_str, INET_ADDRSTRLEN))
-    {
-        return false;
-    }
-
     /* Form the names of the chains */
     if (snprintf (chain_preroute, IPT_BUF_SIZE, PCP_PREROUTING_RULE_FORMAT, index) <= 0 ||
         snprintf (chain_postroute, IPT_BUF_SIZE, PCP_POSTROUTING_RULE_FORMAT, index) <= 0 ||
@@ -481,25 +561,25 @@ write_pcp_port_forwarding_chain (int index,
     }
 
     /* Create the chains in the correct tables */
-    if (!create_pcp_rule_chains (chain_preroute, chain_postroute, chain_mangle))
+    if (!create_pcp_rule_chains (family, chain_preroute, chain_postroute, chain_mangle))
     {
         return false;
     }
 
     /* Flush the chains */
-    if (!flush_pcp_rule_chains (chain_preroute, chain_postroute, chain_mangle))
+    if (!flush_pcp_rule_chains (family, chain_preroute, chain_postroute, chain_mangle))
     {
         return false;
     }
 
     /* Add jumps to the chains for the new mapping - assuming PCP is enabled */
-    if (!append_jump_pcp_rule_chains (chain_preroute, chain_postroute, chain_mangle))
+    if (!append_jump_pcp_rule_chains (family, chain_preroute, chain_postroute, chain_mangle))
     {
         return false;
     }
 
     /* Create port forwarding from external to internal and mark as allowed */
-    if (!ext_to_int_pcp_rule (chain_preroute, chain_mangle,
+    if (!ext_to_int_pcp_rule (family, chain_preroute, chain_mangle,
                               internal_ip_str, external_ip_str,
                               internal_port, external_port, protocol))
     {
@@ -507,7 +587,7 @@ write_pcp_port_forwarding_chain (int index,
     }
 
     /* Create port forwarding from internal to external and mark as allowed */
-    if (!int_to_ext_pcp_rule (chain_postroute, chain_mangle,
+    if (!int_to_ext_pcp_rule (family, chain_postroute, chain_mangle,
                               internal_ip_str, external_ip_str,
                               internal_port, external_port, protocol))
     {
@@ -518,12 +598,14 @@ write_pcp_port_forwarding_chain (int index,
 }
 
 /**
- * Remove the chains for a mapping of the given index from the PCP iptables chains
+ * Remove the chains for a mapping of the given index from the PCP chains of
+ * one family
  * @param index - The rule ID
+ * @param family - IPV4_ONLY or IPV6_ONLY
  * @return - True on success, else false
  */
-bool
-remove_pcp_port_forwarding_chain (int index)
+static bool
+iptables_cmd_remove_family (int index, PCP_CMD_TYPE family)
 {
     char chain_preroute[IPT_BUF_SIZE] = { '\0' };
     char chain_postroute[IPT_BUF_SIZE] = { '\0' };
@@ -538,22 +620,487 @@ remove_pcp_port_forwarding_chain (int index)
     }
 
     /* Remove jumps to the chains for the mapping */
-    if (!remove_jump_pcp_rule_chains (chain_preroute, chain_postroute, chain_mangle))
+    if (!remove_jump_pcp_rule_chains (family, chain_preroute, chain_postroute, chain_mangle))
     {
         return false;
     }
 
     /* Flush the chains */
-    if (!flush_pcp_rule_chains (chain_preroute, chain_postroute, chain_mangle))
+    if (!flush_pcp_rule_chains (family, chain_preroute, chain_postroute, chain_mangle))
     {
         return false;
     }
 
     /* Delete the chains */
-    if (!delete_pcp_rule_chains (chain_preroute, chain_postroute, chain_mangle))
+    if (!delete_pcp_rule_chains (family, chain_preroute, chain_postroute, chain_mangle))
     {
         return false;
     }
 
     return true;
 }
+
+/**
+ * Add a chain and rule to the nat table to do port forwarding using specified parameters.
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, else false
+ */
+static bool
+iptables_cmd_write (int index,
+                    struct in_addr *internal_ip,
+                    struct in_addr *external_ip,
+                    u_int16_t internal_port,
+                    u_int16_t external_port,
+                    u_int16_t protocol)
+{
+    char internal_ip_str[INET_ADDRSTRLEN] = { '\0' };
+    char external_ip_str[INET_ADDRSTRLEN] = { '\0' };
+
+    if (!inet_ntop (AF_INET, internal_ip, internal_ip_str, INET_ADDRSTRLEN) ||
+        !inet_ntop (AF_INET, external_ip, external_ip_str, INET_ADDRSTRLEN))
+    {
+        return false;
+    }
+
+    return iptables_cmd_write_family (index, IPV4_ONLY, internal_ip_str, external_ip_str,
+                                      internal_port, external_port, protocol);
+}
+
+/**
+ * Remove the chains for a mapping of the given index from the PCP iptables chains
+ * @param index - The rule ID
+ * @return - True on success, else false
+ */
+static bool
+iptables_cmd_remove (int index)
+{
+    return iptables_cmd_remove_family (index, IPV4_ONLY);
+}
+
+/**
+ * Add a chain and rule to the ip6tables nat table to do port forwarding using
+ * specified parameters.
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, false on failure or if ip6tables is unavailable
+ */
+static bool
+iptables_cmd_write6 (int index,
+                     struct in6_addr *internal_ip,
+                     struct in6_addr *external_ip,
+                     u_int16_t internal_port,
+                     u_int16_t external_port,
+                     u_int16_t protocol)
+{
+    char internal_ip_str[INET6_ADDRSTRLEN] = { '\0' };
+    char external_ip_str[INET6_ADDRSTRLEN] = { '\0' };
+
+    if (cmd_families != IPV4_AND_IPV6 ||
+        !inet_ntop (AF_INET6, internal_ip, internal_ip_str, INET6_ADDRSTRLEN) ||
+        !inet_ntop (AF_INET6, external_ip, external_ip_str, INET6_ADDRSTRLEN))
+    {
+        return false;
+    }
+
+    return iptables_cmd_write_family (index, IPV6_ONLY, internal_ip_str, external_ip_str,
+                                      internal_port, external_port, protocol);
+}
+
+/**
+ * Remove the chains for a mapping of the given index from the PCP ip6tables chains
+ * @param index - The rule ID
+ * @return - True on success, else false
+ */
+static bool
+iptables_cmd_remove6 (int index)
+{
+    return iptables_cmd_remove_family (index, IPV6_ONLY);
+}
+
+const pcp_fw_backend pcp_iptables_cmd_backend = {
+    .name = "iptables",
+    .init = iptables_cmd_init,
+    .deinit = iptables_cmd_deinit,
+    .write = iptables_cmd_write,
+    .remove = iptables_cmd_remove,
+    .write6 = iptables_cmd_write6,
+    .remove6 = iptables_cmd_remove6,
+};
+
+/* Available backends, most preferred first. The last one is the fallback. */
+static const pcp_fw_backend *backends[] = {
+#ifdef HAVE_LIBNFTABLES
+    &pcp_nftables_backend,
+#endif
+#ifdef HAVE_LIBIPTC
+    &pcp_iptc_backend,
+#endif
+    &pcp_iptables_restore_backend,
+    &pcp_iptables_cmd_backend,
+};
+
+#define NUM_BACKENDS (sizeof (backends) / sizeof (backends[0]))
+
+static const pcp_fw_backend *backend = NULL;
+
+/* A write or remove queued by the calling thread since pcp_fw_defer_begin */
+typedef struct _fw_deferred_call
+{
+    int tag;
+    int index;
+    bool write;
+} fw_deferred_call;
+
+/* The calls queued by this thread, while it defers them */
+static __thread bool fw_deferring = false;
+static __thread int fw_defer_tag = 0;
+static __thread fw_deferred_call *fw_deferred = NULL;
+static __thread bool *fw_deferred_results = NULL;
+static __thread int fw_deferred_count = 0;
+static __thread int fw_deferred_size = 0;
+
+/**
+ * @brief pcp_fw_backend_select - Select a forwarding backend by name
+ * @param name - Name of the backend
+ * @return - True if a backend with that name is available
+ */
+bool
+pcp_fw_backend_select (const char *name)
+{
+    int i;
+
+    for (i = 0; i < NUM_BACKENDS; i++)
+    {
+        if (strcmp (backends[i]->name, name) == 0)
+        {
+            backend = backends[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief pcp_fw_backend_set - Use a custom forwarding backend, e.g. a stub for
+ *          testing. Must be called before pcp_iptables_init.
+ * @param custom - The backend
+ */
+void
+pcp_fw_backend_set (const pcp_fw_backend *custom)
+{
+    backend = custom;
+}
+
+/**
+ * @brief pcp_fw_backend_get - Get the forwarding backend in use
+ * @return - The backend
+ */
+const pcp_fw_backend *
+pcp_fw_backend_get (void)
+{
+    return backend ? backend : backends[0];
+}
+
+/**
+ * @brief pcp_fw_backend_names - Get the names of the available backends
+ * @return - Space separated names, most preferred first
+ */
+const char *
+pcp_fw_backend_names (void)
+{
+    static char names[IPT_BUF_SIZE] = { '\0' };
+    int i;
+
+    if (names[0] == '\0')
+    {
+        for (i = 0; i < NUM_BACKENDS; i++)
+        {
+            if (i > 0)
+            {
+                strcat (names, " ");
+            }
+            strcat (names, backends[i]->name);
+        }
+    }
+    return names;
+}
+
+/**
+ * @brief pcp_fw_backend_ipv6 - Check whether the backend in use can forward
+ *          IPv6 mappings
+ * @return - True if the backend has an IPv6 path
+ */
+bool
+pcp_fw_backend_ipv6 (void)
+{
+    return pcp_fw_backend_get ()->write6 != NULL;
+}
+
+/**
+ * @brief pcp_iptables_init - Initialize the selected forwarding backend, falling
+ *          back to iptables commands if it cannot be used
+ */
+void
+pcp_iptables_init (void)
+{
+    backend = pcp_fw_backend_get ();
+
+    if (!backend->init ())
+    {
+        syslog (LOG_WARNING, "Forwarding backend %s unavailable, falling back to %s",
+                backend->name, pcp_iptables_cmd_backend.name);
+        backend = &pcp_iptables_cmd_backend;
+        backend->init ();
+    }
+    syslog (LOG_INFO, "Using %s forwarding backend", backend->name);
+}
+
+/**
+ * @brief pcp_iptables_deinit - Remove the PCP chains using the backend in use
+ */
+void
+pcp_iptables_deinit (void)
+{
+    pcp_fw_backend_get ()->deinit ();
+}
+
+/* Record a call to the forwarding backend that started at start */
+static void
+fw_call_done (u_int64_t start, bool ok)
+{
+    pcp_metrics_observe (PCP_HISTOGRAM_FW_COMMIT, pcp_metrics_now () - start);
+    pcp_metrics_inc (PCP_METRIC_FW_CALLS);
+    if (!ok)
+    {
+        pcp_metrics_inc (PCP_METRIC_FW_FAILURES);
+    }
+}
+
+/**
+ * @brief fw_defer_reserve - Make room to record one more queued call
+ * @param index - The rule ID of the call
+ * @return - False if out of memory, in which case the call must not be made
+ */
+static bool
+fw_defer_reserve (int index)
+{
+    fw_deferred_call *calls;
+    bool *results;
+    int size;
+
+    if (fw_deferred_count < fw_deferred_size)
+    {
+        return true;
+    }
+    size = fw_deferred_size ? fw_deferred_size * 2 : 64;
+    calls = realloc (fw_deferred, size * sizeof (*fw_deferred));
+    if (calls != NULL)
+    {
+        fw_deferred = calls;
+    }
+    results = realloc (fw_deferred_results, size * sizeof (*fw_deferred_results));
+    if (results != NULL)
+    {
+        fw_deferred_results = results;
+    }
+    if (calls == NULL || results == NULL)
+    {
+        syslog (LOG_ERR, "Out of memory queueing forwarding for mapping %d", index);
+        return false;
+    }
+    fw_deferred_size = size;
+    return true;
+}
+
+/* Record a call that the backend has queued, or count it now if it failed */
+static void
+fw_call_queued (u_int64_t start, bool ok, int index, bool write)
+{
+    if (!ok)
+    {
+        fw_call_done (start, false);
+        return;
+    }
+    fw_deferred[fw_deferred_count].tag = fw_defer_tag;
+    fw_deferred[fw_deferred_count].index = index;
+    fw_deferred[fw_deferred_count].write = write;
+    fw_deferred_count++;
+}
+
+/**
+ * @brief write_pcp_port_forwarding_chain - Install the forwarding for a mapping.
+ *          IPv4 mappings are given as IPv4-mapped IPv6 addresses.
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address, of the same family as internal_ip
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, else false
+ */
+bool
+write_pcp_port_forwarding_chain (int index,
+                                 struct in6_addr *internal_ip,
+                                 struct in6_addr *external_ip,
+                                 u_int16_t internal_port,
+                                 u_int16_t external_port,
+                                 u_int16_t protocol)
+{
+    const pcp_fw_backend *fw = pcp_fw_backend_get ();
+    bool ipv4 = is_ipv4_mapped_ipv6_addr (internal_ip);
+    struct in_addr internal_ip4;
+    struct in_addr external_ip4;
+    u_int64_t start;
+    bool ret;
+
+    if (ipv4 != is_ipv4_mapped_ipv6_addr (external_ip))
+    {
+        syslog (LOG_ERR, "Cannot forward between IPv4 and IPv6 for mapping %d", index);
+        return false;
+    }
+    if (!ipv4 && fw->write6 == NULL)
+    {
+        syslog (LOG_ERR, "Forwarding backend %s does not support IPv6", fw->name);
+        return false;
+    }
+    if (fw_deferring && !fw_defer_reserve (index))
+    {
+        return false;
+    }
+
+    start = pcp_metrics_now ();
+    if (ipv4)
+    {
+        internal_ip4 = convert_ipv6_to_ipv4 (internal_ip);
+        external_ip4 = convert_ipv6_to_ipv4 (external_ip);
+        ret = fw->write (index, &internal_ip4, &external_ip4,
+                         internal_port, external_port, protocol);
+    }
+    else
+    {
+        ret = fw->write6 (index, internal_ip, external_ip,
+                          internal_port, external_port, protocol);
+    }
+    if (fw_deferring)
+    {
+        fw_call_queued (start, ret, index, true);
+    }
+    else
+    {
+        fw_call_done (start, ret);
+    }
+    return ret;
+}
+
+/**
+ * @brief remove_pcp_port_forwarding_chain - Remove the forwarding for a mapping
+ * @param index - The rule ID
+ * @param internal_ip - Internal address of the mapping, which gives its family
+ * @return - True on success, else false
+ */
+bool
+remove_pcp_port_forwarding_chain (int index, struct in6_addr *internal_ip)
+{
+    const pcp_fw_backend *fw = pcp_fw_backend_get ();
+    u_int64_t start;
+    bool ret;
+
+    if (!is_ipv4_mapped_ipv6_addr (internal_ip) && fw->remove6 == NULL)
+    {
+        return false;
+    }
+    if (fw_deferring && !fw_defer_reserve (index))
+    {
+        return false;
+    }
+
+    start = pcp_metrics_now ();
+    if (is_ipv4_mapped_ipv6_addr (internal_ip))
+    {
+        ret = fw->remove (index);
+    }
+    else
+    {
+        ret = fw->remove6 (index);
+    }
+    if (fw_deferring)
+    {
+        fw_call_queued (start, ret, index, false);
+    }
+    else
+    {
+        fw_call_done (start, ret);
+    }
+    return ret;
+}
+
+/**
+ * @brief pcp_fw_defer_begin - Queue the forwarding writes and removes made by
+ *          the calling thread until pcp_fw_defer_end, so the backend can commit
+ *          them together. Does nothing if the backend commits each call in turn.
+ */
+void
+pcp_fw_defer_begin (void)
+{
+    const pcp_fw_backend *fw = pcp_fw_backend_get ();
+
+    if (fw->defer_begin == NULL)
+    {
+        return;
+    }
+    fw_deferring = true;
+    fw_defer_tag = 0;
+    fw_deferred_count = 0;
+    fw->defer_begin ();
+}
+
+/**
+ * @brief pcp_fw_defer_tag - Set the tag recorded with the calls that follow
+ * @param tag - The tag, e.g. the request the calls are made for
+ */
+void
+pcp_fw_defer_tag (int tag)
+{
+    fw_defer_tag = tag;
+}
+
+/**
+ * @brief pcp_fw_defer_end - Commit the calls queued since pcp_fw_defer_begin
+ *          and wait for them
+ * @param failed - Called with the tag and rule ID of each write that failed
+ * @param data - Passed to failed
+ */
+void
+pcp_fw_defer_end (pcp_fw_failed_func failed, void *data)
+{
+    u_int64_t start;
+    int i;
+
+    if (!fw_deferring)
+    {
+        return;
+    }
+    fw_deferring = false;
+
+    start = pcp_metrics_now ();
+    pcp_fw_backend_get ()->defer_end (fw_deferred_results);
+
+    for (i = 0; i < fw_deferred_count; i++)
+    {
+        fw_call_done (start, fw_deferred_results[i]);
+        if (!fw_deferred_results[i] && fw_deferred[i].write && failed)
+        {
+            failed (fw_deferred[i].tag, fw_deferred[i].index, data);
+        }
+    }
+    fw_deferred_count = 0;
+}
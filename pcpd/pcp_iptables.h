@@ -25,21 +25,108 @@
 #ifndef PCP_IPTABLES_H
 #define PCP_IPTABLES_H
 
+/* Chains shared by all iptables based backends */
+#define PCP_PREROUTING_CHAIN "PCP_NAT_PREROUTE_RULES"
+#define PCP_POSTROUTING_CHAIN "PCP_NAT_POSTROUTE_RULES"
+#define PCP_MANGLE_CHAIN "PCP_MANGLE_RULES"
+
+#define PCP_PREROUTING_RULE_FORMAT "PCP_NAT_PREROUTE_RULE_%d"
+#define PCP_POSTROUTING_RULE_FORMAT "PCP_NAT_POSTROUTE_RULE_%d"
+#define PCP_MANGLE_RULE_FORMAT "PCP_MANGLE_RULE_%d"
+
+#define IPT_BUF_SIZE 256
+
+/* A forwarding backend programs the NAT and mangle state for mappings. IPv4
+ * mappings use write and remove, and mappings between IPv6 addresses use
+ * write6 and remove6, which are NULL if the backend only handles IPv4. */
+typedef struct _pcp_fw_backend
+{
+    /** Name used to select the backend on the command line */
+    const char *name;
+
+    /** Create the top level PCP chains. Return false if the backend is unusable */
+    bool (*init) (void);
+
+    /** Remove the top level PCP chains */
+    void (*deinit) (void);
+
+    /** Install the forwarding for a mapping */
+    bool (*write) (int index,
+                   struct in_addr *internal_ip,
+                   struct in_addr *external_ip,
+                   u_int16_t internal_port,
+                   u_int16_t external_port,
+                   u_int16_t protocol);
+
+    /** Remove the forwarding for a mapping */
+    bool (*remove) (int index);
+
+    /** Install the forwarding for an IPv6 mapping */
+    bool (*write6) (int index,
+                    struct in6_addr *internal_ip,
+                    struct in6_addr *external_ip,
+                    u_int16_t internal_port,
+                    u_int16_t external_port,
+                    u_int16_t protocol);
+
+    /** Remove the forwarding for an IPv6 mapping */
+    bool (*remove6) (int index);
+
+    /** Optional. Queue the writes and removes made by the calling thread until
+     *  defer_end, rather than committing each before returning. They return
+     *  true once queued. */
+    void (*defer_begin) (void);
+
+    /** Commit the operations queued since defer_begin and wait for them. Sets
+     *  one result per queued operation, in the order they were made. */
+    void (*defer_end) (bool *results);
+} pcp_fw_backend;
+
+/* Called by pcp_fw_defer_end for each write that could not be committed */
+typedef void (*pcp_fw_failed_func) (int tag, int index, void *data);
+
+extern const pcp_fw_backend pcp_iptables_cmd_backend;
+extern const pcp_fw_backend pcp_iptables_restore_backend;
+#ifdef HAVE_LIBIPTC
+extern const pcp_fw_backend pcp_iptc_backend;
+#endif
+#ifdef HAVE_LIBNFTABLES
+extern const pcp_fw_backend pcp_nftables_backend;
+#endif
+
+bool pcp_fw_backend_select (const char *name);
+
+void pcp_fw_backend_set (const pcp_fw_backend *backend);
+
+const pcp_fw_backend *pcp_fw_backend_get (void);
+
+const char *pcp_fw_backend_names (void);
+
+bool pcp_fw_backend_ipv6 (void);
+
 void pcp_iptables_init (void);
 
 void pcp_iptables_deinit (void);
 
+bool get_protocol_port_str (char *buffer, u_int16_t protocol, u_int16_t port, bool is_sport);
+
 bool is_ipv4_mapped_ipv6_addr (struct in6_addr *ip6);
 
 struct in_addr convert_ipv6_to_ipv4 (struct in6_addr *ip6);
 
 bool write_pcp_port_forwarding_chain (int index,
-                                      struct in_addr *internal_ip,
-                                      struct in_addr *external_ip,
+                                      struct in6_addr *internal_ip,
+                                      struct in6_addr *external_ip,
                                       u_int16_t internal_port,
                                       u_int16_t external_port,
                                       u_int16_t protocol);
 
-bool remove_pcp_port_forwarding_chain (int index);
+bool remove_pcp_port_forwarding_chain (int index, struct in6_addr *internal_ip);
+
+void pcp_fw_defer_begin (void);
+
+void pcp_fw_defer_tag (int tag);
+
+void pcp_fw_defer_end (pcp_fw_failed_func failed, void *data);
 
 #endif /* PCP_IPTABLES_H */
@@ -0,0 +1,700 @@
+/**
+ * @file pcp_iptables_restore.c
+ *
+ * Forwarding backend that batches the rules for many mappings into a single
+ * "iptables-restore --noflush" transaction. Operations are queued for a
+ * commit thread, which submits everything queued while its previous
+ * transaction ran, so a burst of mappings costs one process spawn and one
+ * table swap rather than a command per rule. A caller either waits for each
+ * operation, or defers its operations and waits once for all of them, which
+ * lets a worker queue the mappings for a whole batch of requests before the
+ * first is committed. IPv4 and IPv6 mappings have their own queue and commit
+ * thread, so transactions for the two families are committed concurrently.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+
+#include "pcp_iptables.h"
+
+#define IP4TABLES_RESTORE_CMD "iptables-restore --noflush"
+#define IP6TABLES_RESTORE_CMD "ip6tables-restore --noflush"
+
+/* Largest number of mappings submitted in one transaction */
+#define RESTORE_MAX_BATCH 256
+
+#define RESTORE_OP_SIZE (8 * IPT_BUF_SIZE)
+
+struct _restore_queue;
+
+/* The rules for one mapping, and the result of submitting them */
+typedef struct _restore_op
+{
+    char nat[RESTORE_OP_SIZE];
+    char mangle[RESTORE_OP_SIZE];
+    bool done;
+    bool result;
+    struct _restore_op *next;
+    struct _restore_queue *queue;           // Set for deferred operations
+    struct _restore_op *deferred_next;      // Next operation deferred by the same thread
+} restore_op;
+
+/* Operations waiting to be committed by one restore command. lock guards the
+ * pending queue and the done/result of every op. */
+typedef struct _restore_queue
+{
+    const char *cmd;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t committed;
+    restore_op *pending_head;
+    restore_op *pending_tail;
+    int pending_count;
+    bool running;
+    bool stopping;
+    pthread_t commit_thread;
+} restore_queue;
+
+static restore_queue ipv4_queue = {
+    .cmd = IP4TABLES_RESTORE_CMD,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER,
+};
+
+static restore_queue ipv6_queue = {
+    .cmd = IP6TABLES_RESTORE_CMD,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER,
+};
+
+/* Set by restore_init if ip6tables-restore can be used */
+static bool ipv6_available = false;
+
+/* The operations deferred by this thread, in the order they were made */
+static __thread bool restore_deferring = false;
+static __thread restore_op *deferred_head = NULL;
+static __thread restore_op *deferred_tail = NULL;
+
+/**
+ * @brief run_restore - Submit operations as one restore transaction
+ * @param queue - The queue, which gives the restore command
+ * @param ops - First operation
+ * @param single - Only submit the first operation
+ * @return - True if the transaction was committed
+ */
+static bool
+run_restore (restore_queue *queue, restore_op *ops, bool single)
+{
+    restore_op *op;
+    FILE *restore;
+    int status;
+
+    restore = popen (queue->cmd, "w");
+    if (restore == NULL)
+    {
+        syslog (LOG_ERR, "Could not run %s: %s", queue->cmd, strerror (errno));
+        return false;
+    }
+
+    fputs ("*nat\n", restore);
+    for (op = ops; op; op = single ? NULL : op->next)
+    {
+        fputs (op->nat, restore);
+    }
+    fputs ("COMMIT\n*mangle\n", restore);
+    for (op = ops; op; op = single ? NULL : op->next)
+    {
+        fputs (op->mangle, restore);
+    }
+    fputs ("COMMIT\n", restore);
+
+    status = pclose (restore);
+    return status != -1 && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+/**
+ * @brief commit_batch - Submit a batch and record the result of each operation.
+ *          If the transaction fails, each operation is retried on its own so
+ *          only the failing mappings are reported as failed.
+ * @param queue - The queue the batch came from
+ * @param batch - The operations
+ * @param count - Number of operations
+ */
+static void
+commit_batch (restore_queue *queue, restore_op *batch, int count)
+{
+    restore_op *op;
+    bool result;
+
+    if (run_restore (queue, batch, false))
+    {
+        for (op = batch; op; op = op->next)
+        {
+            op->result = true;
+        }
+        return;
+    }
+
+    if (count > 1)
+    {
+        syslog (LOG_WARNING, "Batch of %d %s operations failed, "
+                "retrying individually", count, queue->cmd);
+    }
+    for (op = batch; op; op = op->next)
+    {
+        result = count > 1 ? run_restore (queue, op, true) : false;
+        if (!result)
+        {
+            syslog (LOG_ERR, "%s failed for:\n%s%s", queue->cmd, op->nat, op->mangle);
+        }
+        op->result = result;
+    }
+}
+
+/**
+ * Background thread which submits the operations queued on one queue. Those
+ * queued while a transaction runs are submitted together by the next one.
+ */
+static void *
+restore_commit_loop (void *arg)
+{
+    restore_queue *queue = arg;
+    restore_op *batch;
+    restore_op *last;
+    restore_op *op;
+    int count;
+
+    pthread_mutex_lock (&queue->lock);
+    while (1)
+    {
+        while (queue->pending_head == NULL && !queue->stopping)
+        {
+            pthread_cond_wait (&queue->queued, &queue->lock);
+        }
+        if (queue->pending_head == NULL)
+        {
+            break;
+        }
+
+        /* Take up to a full batch, leaving the rest for the next transaction */
+        batch = queue->pending_head;
+        last = batch;
+        for (count = 1; count < RESTORE_MAX_BATCH && last->next; count++)
+        {
+            last = last->next;
+        }
+        queue->pending_head = last->next;
+        if (queue->pending_head == NULL)
+        {
+            queue->pending_tail = NULL;
+        }
+        queue->pending_count -= count;
+        last->next = NULL;
+        pthread_mutex_unlock (&queue->lock);
+
+        commit_batch (queue, batch, count);
+
+        pthread_mutex_lock (&queue->lock);
+        for (op = batch; op; op = op->next)
+        {
+            op->done = true;
+        }
+        pthread_cond_broadcast (&queue->committed);
+    }
+    pthread_mutex_unlock (&queue->lock);
+
+    return NULL;
+}
+
+/* Add an operation to the pending queue. Must be called with the queue locked. */
+static void
+restore_enqueue (restore_queue *queue, restore_op *op)
+{
+    op->done = false;
+    op->result = false;
+    op->next = NULL;
+
+    if (queue->pending_tail)
+    {
+        queue->pending_tail->next = op;
+    }
+    else
+    {
+        queue->pending_head = op;
+    }
+    queue->pending_tail = op;
+    queue->pending_count++;
+}
+
+/**
+ * @brief restore_defer - Queue a copy of an operation without waiting for it.
+ *          The commit thread is woken by restore_defer_end.
+ * @param queue - The queue for the family of the operation
+ * @param op - The operation
+ * @return - False if out of memory
+ */
+static bool
+restore_defer (restore_queue *queue, restore_op *op)
+{
+    restore_op *deferred = malloc (sizeof (*deferred));
+
+    if (deferred == NULL)
+    {
+        syslog (LOG_ERR, "Out of memory queueing %s operation", queue->cmd);
+        return false;
+    }
+    memcpy (deferred->nat, op->nat, sizeof (deferred->nat));
+    memcpy (deferred->mangle, op->mangle, sizeof (deferred->mangle));
+    deferred->queue = queue;
+    deferred->deferred_next = NULL;
+
+    pthread_mutex_lock (&queue->lock);
+    if (queue->running)
+    {
+        restore_enqueue (queue, deferred);
+        pthread_mutex_unlock (&queue->lock);
+    }
+    else
+    {
+        pthread_mutex_unlock (&queue->lock);
+        deferred->result = run_restore (queue, deferred, true);
+        deferred->done = true;
+    }
+
+    if (deferred_tail)
+    {
+        deferred_tail->deferred_next = deferred;
+    }
+    else
+    {
+        deferred_head = deferred;
+    }
+    deferred_tail = deferred;
+    return true;
+}
+
+/**
+ * @brief restore_submit - Queue an operation and wait for it to be committed,
+ *          or only queue it if this thread is deferring its operations
+ * @param queue - The queue for the family of the operation
+ * @param op - The operation
+ * @return - True if the operation was committed or deferred
+ */
+static bool
+restore_submit (restore_queue *queue, restore_op *op)
+{
+    if (restore_deferring)
+    {
+        return restore_defer (queue, op);
+    }
+
+    pthread_mutex_lock (&queue->lock);
+    if (!queue->running)
+    {
+        pthread_mutex_unlock (&queue->lock);
+        return run_restore (queue, op, true);
+    }
+
+    restore_enqueue (queue, op);
+    pthread_cond_signal (&queue->queued);
+
+    while (!op->done)
+    {
+        pthread_cond_wait (&queue->committed, &queue->lock);
+    }
+    pthread_mutex_unlock (&queue->lock);
+
+    return op->result;
+}
+
+/**
+ * @brief restore_defer_begin - Queue this thread's operations until
+ *          restore_defer_end rather than waiting for each
+ */
+static void
+restore_defer_begin (void)
+{
+    restore_deferring = true;
+}
+
+/**
+ * @brief restore_defer_end - Wake the commit threads and wait for the
+ *          operations deferred by this thread
+ * @param results - Set to the result of each operation, in the order they
+ *          were made
+ */
+static void
+restore_defer_end (bool *results)
+{
+    restore_queue *queues[] = { &ipv4_queue, &ipv6_queue };
+    restore_op *op;
+    int i;
+
+    restore_deferring = false;
+    if (deferred_head == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < sizeof (queues) / sizeof (queues[0]); i++)
+    {
+        pthread_mutex_lock (&queues[i]->lock);
+        if (queues[i]->pending_head)
+        {
+            pthread_cond_signal (&queues[i]->queued);
+        }
+        pthread_mutex_unlock (&queues[i]->lock);
+    }
+
+    for (i = 0; (op = deferred_head) != NULL; i++)
+    {
+        pthread_mutex_lock (&op->queue->lock);
+        while (!op->done)
+        {
+            pthread_cond_wait (&op->queue->committed, &op->queue->lock);
+        }
+        pthread_mutex_unlock (&op->queue->lock);
+
+        results[i] = op->result;
+        deferred_head = op->deferred_next;
+        free (op);
+    }
+    deferred_tail = NULL;
+}
+
+/**
+ * @brief restore_queue_start - Start the commit thread for a queue
+ * @param queue - The queue
+ */
+static void
+restore_queue_start (restore_queue *queue)
+{
+    pthread_mutex_lock (&queue->lock);
+    queue->stopping = false;
+    if (pthread_create (&queue->commit_thread, NULL, restore_commit_loop, queue) != 0)
+    {
+        syslog (LOG_ERR, "Failed to create %s commit thread", queue->cmd);
+    }
+    else
+    {
+        queue->running = true;
+    }
+    pthread_mutex_unlock (&queue->lock);
+}
+
+/**
+ * @brief restore_queue_stop - Commit any queued operations and stop the commit
+ *          thread for a queue
+ * @param queue - The queue
+ */
+static void
+restore_queue_stop (restore_queue *queue)
+{
+    bool was_running;
+
+    pthread_mutex_lock (&queue->lock);
+    was_running = queue->running;
+    queue->stopping = true;
+    queue->running = false;
+    pthread_cond_signal (&queue->queued);
+    pthread_mutex_unlock (&queue->lock);
+
+    if (was_running)
+    {
+        pthread_join (queue->commit_thread, NULL);
+    }
+}
+
+/**
+ * @brief restore_init - Create the top level PCP chains and start the commit
+ *          threads
+ * @return - False if iptables-restore cannot be run
+ */
+static bool
+restore_init (void)
+{
+    restore_op empty = { { '\0' }, { '\0' }, false, false, NULL, NULL, NULL };
+
+    /* An empty transaction checks iptables-restore is usable */
+    if (!run_restore (&ipv4_queue, &empty, true))
+    {
+        return false;
+    }
+
+    /* Set up happens once, so the command backend does it */
+    if (!pcp_iptables_cmd_backend.init ())
+    {
+        return false;
+    }
+
+    /* IPv6 mappings are only refused if ip6tables-restore is unusable */
+    ipv6_available = run_restore (&ipv6_queue, &empty, true);
+    if (!ipv6_available)
+    {
+        syslog (LOG_WARNING, "%s is unavailable, IPv6 mappings are disabled",
+                IP6TABLES_RESTORE_CMD);
+    }
+
+    restore_queue_start (&ipv4_queue);
+    if (ipv6_available)
+    {
+        restore_queue_start (&ipv6_queue);
+    }
+
+    return true;
+}
+
+/**
+ * @brief restore_deinit - Commit any queued operations, stop the commit threads
+ *          and remove the top level PCP chains
+ */
+static void
+restore_deinit (void)
+{
+    restore_queue_stop (&ipv4_queue);
+    restore_queue_stop (&ipv6_queue);
+
+    pcp_iptables_cmd_backend.deinit ();
+}
+
+/**
+ * @brief format_write_op - Format the chains and rules for a mapping
+ * @param op - The operation to fill in
+ * @param index - The rule ID
+ * @param ipv6 - True if the addresses are IPv6
+ * @param internal_ip_str - Internal address
+ * @param external_ip_str - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, false if the rules do not fit
+ */
+static bool
+format_write_op (restore_op *op,
+                 int index,
+                 bool ipv6,
+                 const char *internal_ip_str,
+                 const char *external_ip_str,
+                 u_int16_t internal_port,
+                 u_int16_t external_port,
+                 u_int16_t protocol)
+{
+    char dport_str[IPT_BUF_SIZE] = { '\0' };
+    char sport_str[IPT_BUF_SIZE] = { '\0' };
+
+    if (!get_protocol_port_str (dport_str, protocol, external_port, false) ||
+        !get_protocol_port_str (sport_str, protocol, internal_port, true))
+    {
+        return false;
+    }
+
+    /* Declaring a chain creates it, or flushes it if it already exists. NAT
+     * targets put IPv6 addresses in brackets to separate them from the port. */
+    if (snprintf (op->nat, RESTORE_OP_SIZE,
+                  ipv6 ?
+                  ":" PCP_PREROUTING_RULE_FORMAT " - [0:0]\n"
+                  ":" PCP_POSTROUTING_RULE_FORMAT " - [0:0]\n"
+                  "-A " PCP_PREROUTING_CHAIN " -m connmark --mark 1/0x7 -j "
+                  PCP_PREROUTING_RULE_FORMAT "\n"
+                  "-A " PCP_POSTROUTING_CHAIN " -m connmark --mark 1/0x7 -j "
+                  PCP_POSTROUTING_RULE_FORMAT "\n"
+                  "-A " PCP_PREROUTING_RULE_FORMAT " -d %s %s -j DNAT --to-destination [%s]:%u\n"
+                  "-A " PCP_POSTROUTING_RULE_FORMAT " -s %s %s -j SNAT --to-source [%s]:%u\n" :
+                  ":" PCP_PREROUTING_RULE_FORMAT " - [0:0]\n"
+                  ":" PCP_POSTROUTING_RULE_FORMAT " - [0:0]\n"
+                  "-A " PCP_PREROUTING_CHAIN " -m connmark --mark 1/0x7 -j "
+                  PCP_PREROUTING_RULE_FORMAT "\n"
+                  "-A " PCP_POSTROUTING_CHAIN " -m connmark --mark 1/0x7 -j "
+                  PCP_POSTROUTING_RULE_FORMAT "\n"
+                  "-A " PCP_PREROUTING_RULE_FORMAT " -d %s %s -j DNAT --to-destination %s:%u\n"
+                  "-A " PCP_POSTROUTING_RULE_FORMAT " -s %s %s -j SNAT --to-source %s:%u\n",
+                  index, index, index, index,
+                  index, external_ip_str, dport_str, internal_ip_str, internal_port,
+                  index, internal_ip_str, sport_str, external_ip_str, external_port)
+            >= RESTORE_OP_SIZE ||
+        snprintf (op->mangle, RESTORE_OP_SIZE,
+                  ":" PCP_MANGLE_RULE_FORMAT " - [0:0]\n"
+                  "-A " PCP_MANGLE_CHAIN " -m connmark --mark 0/0x7 -j "
+                  PCP_MANGLE_RULE_FORMAT "\n"
+                  "-A " PCP_MANGLE_RULE_FORMAT " -d %s %s -j CONNMARK --set-mark 1/0x7\n"
+                  "-A " PCP_MANGLE_RULE_FORMAT " -s %s %s -j CONNMARK --set-mark 1/0x7\n",
+                  index, index,
+                  index, external_ip_str, dport_str,
+                  index, internal_ip_str, sport_str)
+            >= RESTORE_OP_SIZE)
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief format_remove_op - Format the removal of the chains for a mapping
+ * @param op - The operation to fill in
+ * @param index - The rule ID
+ * @return - True on success, false if the rules do not fit
+ */
+static bool
+format_remove_op (restore_op *op, int index)
+{
+    return snprintf (op->nat, RESTORE_OP_SIZE,
+                     "-D " PCP_PREROUTING_CHAIN " -m connmark --mark 1/0x7 -j "
+                     PCP_PREROUTING_RULE_FORMAT "\n"
+                     "-D " PCP_POSTROUTING_CHAIN " -m connmark --mark 1/0x7 -j "
+                     PCP_POSTROUTING_RULE_FORMAT "\n"
+                     ":" PCP_PREROUTING_RULE_FORMAT " - [0:0]\n"
+                     ":" PCP_POSTROUTING_RULE_FORMAT " - [0:0]\n"
+                     "-X " PCP_PREROUTING_RULE_FORMAT "\n"
+                     "-X " PCP_POSTROUTING_RULE_FORMAT "\n",
+                     index, index, index, index, index, index) < RESTORE_OP_SIZE &&
+           snprintf (op->mangle, RESTORE_OP_SIZE,
+                     "-D " PCP_MANGLE_CHAIN " -m connmark --mark 0/0x7 -j "
+                     PCP_MANGLE_RULE_FORMAT "\n"
+                     ":" PCP_MANGLE_RULE_FORMAT " - [0:0]\n"
+                     "-X " PCP_MANGLE_RULE_FORMAT "\n",
+                     index, index, index) < RESTORE_OP_SIZE;
+}
+
+/**
+ * @brief restore_write - Install the chains and rules for a mapping
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, else false
+ */
+static bool
+restore_write (int index,
+               struct in_addr *internal_ip,
+               struct in_addr *external_ip,
+               u_int16_t internal_port,
+               u_int16_t external_port,
+               u_int16_t protocol)
+{
+    char internal_ip_str[INET_ADDRSTRLEN] = { '\0' };
+    char external_ip_str[INET_ADDRSTRLEN] = { '\0' };
+    restore_op op;
+
+    if (!inet_ntop (AF_INET, internal_ip, internal_ip_str, INET_ADDRSTRLEN) ||
+        !inet_ntop (AF_INET, external_ip, external_ip_str, INET_ADDRSTRLEN) ||
+        !format_write_op (&op, index, false, internal_ip_str, external_ip_str,
+                          internal_port, external_port, protocol))
+    {
+        return false;
+    }
+
+    return restore_submit (&ipv4_queue, &op);
+}
+
+/**
+ * @brief restore_remove - Remove the chains for a mapping
+ * @param index - The rule ID
+ * @return - True on success, else false
+ */
+static bool
+restore_remove (int index)
+{
+    restore_op op;
+
+    if (!format_remove_op (&op, index))
+    {
+        return false;
+    }
+
+    return restore_submit (&ipv4_queue, &op);
+}
+
+/**
+ * @brief restore_write6 - Install the ip6tables chains and rules for a mapping
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, false on failure or if ip6tables-restore is unusable
+ */
+static bool
+restore_write6 (int index,
+                struct in6_addr *internal_ip,
+                struct in6_addr *external_ip,
+                u_int16_t internal_port,
+                u_int16_t external_port,
+                u_int16_t protocol)
+{
+    char internal_ip_str[INET6_ADDRSTRLEN] = { '\0' };
+    char external_ip_str[INET6_ADDRSTRLEN] = { '\0' };
+    restore_op op;
+
+    if (!ipv6_available ||
+        !inet_ntop (AF_INET6, internal_ip, internal_ip_str, INET6_ADDRSTRLEN) ||
+        !inet_ntop (AF_INET6, external_ip, external_ip_str, INET6_ADDRSTRLEN) ||
+        !format_write_op (&op, index, true, internal_ip_str, external_ip_str,
+                          internal_port, external_port, protocol))
+    {
+        return false;
+    }
+
+    return restore_submit (&ipv6_queue, &op);
+}
+
+/**
+ * @brief restore_remove6 - Remove the ip6tables chains for a mapping
+ * @param index - The rule ID
+ * @return - True on success, else false
+ */
+static bool
+restore_remove6 (int index)
+{
+    restore_op op;
+
+    if (!ipv6_available || !format_remove_op (&op, index))
+    {
+        return false;
+    }
+
+    return restore_submit (&ipv6_queue, &op);
+}
+
+const pcp_fw_backend pcp_iptables_restore_backend = {
+    .name = "iptables-restore",
+    .init = restore_init,
+    .deinit = restore_deinit,
+    .write = restore_write,
+    .remove = restore_remove,
+    .write6 = restore_write6,
+    .remove6 = restore_remove6,
+    .defer_begin = restore_defer_begin,
+    .defer_end = restore_defer_end,
+};
@@ -0,0 +1,513 @@
+/**
+ * @file pcp_iptc.c
+ *
+ * Forwarding backend that programs the PCP iptables chains in-process using
+ * libiptc. It keeps the same chain layout as the iptables command backend,
+ * but installs or removes a mapping with one commit per table instead of a
+ * fork and exec per rule.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_LIBIPTC
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <libiptc/libiptc.h>
+#include <linux/netfilter/nf_nat.h>
+#include <linux/netfilter/xt_connmark.h>
+#include <linux/netfilter/xt_tcpudp.h>
+
+#include "pcp_iptables.h"
+
+#define IPTC_CHAIN_SIZE 32
+#define IPTC_RULE_SIZE 512
+
+#define PCP_CONNMARK_MASK 0x7
+#define PCP_CONNMARK_NEW 0
+#define PCP_CONNMARK_ALLOWED 1
+
+/* A rule under construction. Matches and the target are appended in order. */
+typedef struct _iptc_rule
+{
+    union
+    {
+        struct ipt_entry entry;
+        unsigned char buf[IPTC_RULE_SIZE];
+    } u;
+    size_t len;
+} iptc_rule;
+
+/* libiptc is not thread safe and each commit replaces the whole table, so
+ * every operation is serialized */
+static pthread_mutex_t iptc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+rule_init (iptc_rule *rule, struct in_addr *src, struct in_addr *dst, u_int16_t protocol)
+{
+    memset (rule, 0, sizeof (iptc_rule));
+    if (src)
+    {
+        rule->u.entry.ip.src = *src;
+        rule->u.entry.ip.smsk.s_addr = INADDR_NONE;
+    }
+    if (dst)
+    {
+        rule->u.entry.ip.dst = *dst;
+        rule->u.entry.ip.dmsk.s_addr = INADDR_NONE;
+    }
+    rule->u.entry.ip.proto = protocol;
+    rule->len = XT_ALIGN (sizeof (struct ipt_entry));
+}
+
+static void *
+rule_add_match (iptc_rule *rule, const char *name, u_int8_t revision, size_t size)
+{
+    struct xt_entry_match *match = (struct xt_entry_match *) (rule->u.buf + rule->len);
+    size_t match_size = XT_ALIGN (sizeof (struct xt_entry_match)) + XT_ALIGN (size);
+
+    match->u.match_size = match_size;
+    strncpy (match->u.user.name, name, sizeof (match->u.user.name) - 1);
+    match->u.user.revision = revision;
+    rule->len += match_size;
+    return match->data;
+}
+
+static void *
+rule_set_target (iptc_rule *rule, const char *name, u_int8_t revision, size_t size)
+{
+    struct xt_entry_target *target = (struct xt_entry_target *) (rule->u.buf + rule->len);
+    size_t target_size = XT_ALIGN (sizeof (struct xt_entry_target)) + XT_ALIGN (size);
+
+    rule->u.entry.target_offset = rule->len;
+    target->u.target_size = target_size;
+    strncpy (target->u.user.name, name, sizeof (target->u.user.name) - 1);
+    target->u.user.revision = revision;
+    rule->len += target_size;
+    rule->u.entry.next_offset = rule->len;
+    return target->data;
+}
+
+/* Equivalent of "-p tcp|udp --sport|--dport port". Other protocols have no port. */
+static void
+rule_add_port_match (iptc_rule *rule, u_int16_t protocol, u_int16_t port, bool is_sport)
+{
+    struct xt_tcp *tcp;
+    struct xt_udp *udp;
+
+    switch (protocol)
+    {
+    case IPPROTO_TCP:
+        tcp = rule_add_match (rule, "tcp", 0, sizeof (struct xt_tcp));
+        tcp->spts[0] = is_sport ? port : 0;
+        tcp->spts[1] = is_sport ? port : 0xFFFF;
+        tcp->dpts[0] = is_sport ? 0 : port;
+        tcp->dpts[1] = is_sport ? 0xFFFF : port;
+        break;
+    case IPPROTO_UDP:
+        udp = rule_add_match (rule, "udp", 0, sizeof (struct xt_udp));
+        udp->spts[0] = is_sport ? port : 0;
+        udp->spts[1] = is_sport ? port : 0xFFFF;
+        udp->dpts[0] = is_sport ? 0 : port;
+        udp->dpts[1] = is_sport ? 0xFFFF : port;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Equivalent of "-m connmark --mark mark/0x7" */
+static void
+rule_add_connmark_match (iptc_rule *rule, u_int32_t mark)
+{
+    struct xt_connmark_mtinfo1 *info;
+
+    info = rule_add_match (rule, "connmark", 1, sizeof (struct xt_connmark_mtinfo1));
+    info->mark = mark;
+    info->mask = PCP_CONNMARK_MASK;
+}
+
+/* Equivalent of "-j chain" */
+static void
+rule_set_jump (iptc_rule *rule, const char *chain)
+{
+    rule_set_target (rule, chain, 0, sizeof (int));
+}
+
+/* Equivalent of "-j CONNMARK --set-mark 1/0x7" */
+static void
+rule_set_connmark_allowed (iptc_rule *rule)
+{
+    struct xt_connmark_tginfo1 *info;
+
+    info = rule_set_target (rule, "CONNMARK", 1, sizeof (struct xt_connmark_tginfo1));
+    info->ctmark = PCP_CONNMARK_ALLOWED;
+    info->ctmask = PCP_CONNMARK_MASK | PCP_CONNMARK_ALLOWED;
+    info->nfmask = 0;
+    info->mode = XT_CONNMARK_SET;
+}
+
+/* Equivalent of "-j DNAT --to-destination ip:port" or "-j SNAT --to-source ip:port" */
+static void
+rule_set_nat (iptc_rule *rule, const char *name, struct in_addr *ip,
+              u_int16_t protocol, u_int16_t port)
+{
+    struct nf_nat_ipv4_multi_range_compat *info;
+
+    info = rule_set_target (rule, name, 0, sizeof (struct nf_nat_ipv4_multi_range_compat));
+    info->rangesize = 1;
+    info->range[0].flags = NF_NAT_RANGE_MAP_IPS;
+    info->range[0].min_ip = ip->s_addr;
+    info->range[0].max_ip = ip->s_addr;
+    if (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP)
+    {
+        info->range[0].flags |= NF_NAT_RANGE_PROTO_SPECIFIED;
+        info->range[0].min.all = htons (port);
+        info->range[0].max.all = htons (port);
+    }
+}
+
+/* Create a chain, or flush it if it already exists */
+static bool
+create_or_flush_chain (struct xtc_handle *handle, const char *chain)
+{
+    if (iptc_is_chain (chain, handle))
+    {
+        return iptc_flush_entries (chain, handle);
+    }
+    return iptc_create_chain (chain, handle);
+}
+
+/* Delete every rule in parent that jumps to target */
+static bool
+delete_jumps (struct xtc_handle *handle, const char *parent, const char *target)
+{
+    const struct ipt_entry *entry;
+    unsigned int num = 0;
+
+    entry = iptc_first_rule (parent, handle);
+    while (entry)
+    {
+        if (strcmp (iptc_get_target (entry, handle), target) == 0)
+        {
+            if (!iptc_delete_num_entry (parent, num, handle))
+            {
+                return false;
+            }
+            /* Deleting invalidates the iteration, so start again */
+            entry = iptc_first_rule (parent, handle);
+            num = 0;
+            continue;
+        }
+        entry = iptc_next_rule (entry, handle);
+        num++;
+    }
+    return true;
+}
+
+/* Remove the jumps to a chain, then flush and delete it if it exists */
+static bool
+delete_chain (struct xtc_handle *handle, const char *parent, const char *chain)
+{
+    if (!delete_jumps (handle, parent, chain))
+    {
+        return false;
+    }
+    if (!iptc_is_chain (chain, handle))
+    {
+        return true;
+    }
+    return iptc_flush_entries (chain, handle) && iptc_delete_chain (chain, handle);
+}
+
+/* Append a jump from parent to chain, optionally matching a connmark */
+static bool
+append_jump (struct xtc_handle *handle, const char *parent, const char *chain,
+             bool match_mark, u_int32_t mark)
+{
+    iptc_rule rule;
+
+    rule_init (&rule, NULL, NULL, 0);
+    if (match_mark)
+    {
+        rule_add_connmark_match (&rule, mark);
+    }
+    rule_set_jump (&rule, chain);
+    return iptc_append_entry (parent, &rule.u.entry, handle);
+}
+
+/* Commit and free a handle, logging any failure */
+static bool
+commit_table (struct xtc_handle *handle, const char *table, bool ok)
+{
+    if (ok && !iptc_commit (handle))
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        syslog (LOG_ERR, "libiptc %s table update failed: %s", table, iptc_strerror (errno));
+    }
+    iptc_free (handle);
+    return ok;
+}
+
+/**
+ * @brief pcp_iptc_init - Create the top level PCP chains and jump to them
+ * @return - False if the tables cannot be accessed through libiptc
+ */
+static bool
+pcp_iptc_init (void)
+{
+    struct xtc_handle *nat;
+    struct xtc_handle *mangle;
+    bool ok;
+
+    pthread_mutex_lock (&iptc_lock);
+
+    nat = iptc_init ("nat");
+    mangle = nat ? iptc_init ("mangle") : NULL;
+    if (!nat || !mangle)
+    {
+        syslog (LOG_ERR, "libiptc init failed: %s", iptc_strerror (errno));
+        if (nat)
+        {
+            iptc_free (nat);
+        }
+        pthread_mutex_unlock (&iptc_lock);
+        return false;
+    }
+
+    ok = delete_jumps (nat, "PREROUTING", PCP_PREROUTING_CHAIN) &&
+         delete_jumps (nat, "POSTROUTING", PCP_POSTROUTING_CHAIN) &&
+         create_or_flush_chain (nat, PCP_PREROUTING_CHAIN) &&
+         create_or_flush_chain (nat, PCP_POSTROUTING_CHAIN) &&
+         append_jump (nat, "PREROUTING", PCP_PREROUTING_CHAIN, false, 0) &&
+         append_jump (nat, "POSTROUTING", PCP_POSTROUTING_CHAIN, false, 0);
+    ok = commit_table (nat, "nat", ok);
+
+    ok = commit_table (mangle, "mangle", ok &&
+                       delete_jumps (mangle, "PREROUTING", PCP_MANGLE_CHAIN) &&
+                       create_or_flush_chain (mangle, PCP_MANGLE_CHAIN) &&
+                       append_jump (mangle, "PREROUTING", PCP_MANGLE_CHAIN, false, 0));
+
+    pthread_mutex_unlock (&iptc_lock);
+    return ok;
+}
+
+/**
+ * @brief pcp_iptc_deinit - Remove the jumps to the top level PCP chains then
+ *          remove them
+ */
+static void
+pcp_iptc_deinit (void)
+{
+    struct xtc_handle *handle;
+
+    pthread_mutex_lock (&iptc_lock);
+
+    if ((handle = iptc_init ("nat")) != NULL)
+    {
+        commit_table (handle, "nat",
+                      delete_chain (handle, "PREROUTING", PCP_PREROUTING_CHAIN) &&
+                      delete_chain (handle, "POSTROUTING", PCP_POSTROUTING_CHAIN));
+    }
+    if ((handle = iptc_init ("mangle")) != NULL)
+    {
+        commit_table (handle, "mangle",
+                      delete_chain (handle, "PREROUTING", PCP_MANGLE_CHAIN));
+    }
+
+    pthread_mutex_unlock (&iptc_lock);
+}
+
+/* Remove the nat chains of a mapping. The caller holds iptc_lock. */
+static bool
+remove_nat_chains (const char *chain_preroute, const char *chain_postroute)
+{
+    struct xtc_handle *handle;
+
+    if ((handle = iptc_init ("nat")) == NULL)
+    {
+        return false;
+    }
+    return commit_table (handle, "nat",
+                         delete_chain (handle, PCP_PREROUTING_CHAIN, chain_preroute) &&
+                         delete_chain (handle, PCP_POSTROUTING_CHAIN, chain_postroute));
+}
+
+/**
+ * @brief pcp_iptc_write - Install the chains and rules for a mapping
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, else false
+ */
+static bool
+pcp_iptc_write (int index,
+                struct in_addr *internal_ip,
+                struct in_addr *external_ip,
+                u_int16_t internal_port,
+                u_int16_t external_port,
+                u_int16_t protocol)
+{
+    char chain_preroute[IPTC_CHAIN_SIZE] = { '\0' };
+    char chain_postroute[IPTC_CHAIN_SIZE] = { '\0' };
+    char chain_mangle[IPTC_CHAIN_SIZE] = { '\0' };
+    struct xtc_handle *handle;
+    iptc_rule rule;
+    bool ok;
+
+    /* Form the names of the chains */
+    if (snprintf (chain_preroute, IPTC_CHAIN_SIZE, PCP_PREROUTING_RULE_FORMAT, index) <= 0 ||
+        snprintf (chain_postroute, IPTC_CHAIN_SIZE, PCP_POSTROUTING_RULE_FORMAT, index) <= 0 ||
+        snprintf (chain_mangle, IPTC_CHAIN_SIZE, PCP_MANGLE_RULE_FORMAT, index) <= 0)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock (&iptc_lock);
+
+    /* Port forwarding from external to internal and back */
+    if ((handle = iptc_init ("nat")) == NULL)
+    {
+        pthread_mutex_unlock (&iptc_lock);
+        return false;
+    }
+    ok = create_or_flush_chain (handle, chain_preroute) &&
+         create_or_flush_chain (handle, chain_postroute) &&
+         append_jump (handle, PCP_PREROUTING_CHAIN, chain_preroute,
+                      true, PCP_CONNMARK_ALLOWED) &&
+         append_jump (handle, PCP_POSTROUTING_CHAIN, chain_postroute,
+                      true, PCP_CONNMARK_ALLOWED);
+    if (ok)
+    {
+        rule_init (&rule, NULL, external_ip, protocol);
+        rule_add_port_match (&rule, protocol, external_port, false);
+        rule_set_nat (&rule, "DNAT", internal_ip, protocol, internal_port);
+        ok = iptc_append_entry (chain_preroute, &rule.u.entry, handle);
+    }
+    if (ok)
+    {
+        rule_init (&rule, internal_ip, NULL, protocol);
+        rule_add_port_match (&rule, protocol, internal_port, true);
+        rule_set_nat (&rule, "SNAT", external_ip, protocol, external_port);
+        ok = iptc_append_entry (chain_postroute, &rule.u.entry, handle);
+    }
+    if (!commit_table (handle, "nat", ok))
+    {
+        pthread_mutex_unlock (&iptc_lock);
+        return false;
+    }
+
+    /* Mark connections in both directions as allowed */
+    if ((handle = iptc_init ("mangle")) != NULL)
+    {
+        ok = create_or_flush_chain (handle, chain_mangle) &&
+             append_jump (handle, PCP_MANGLE_CHAIN, chain_mangle,
+                          true, PCP_CONNMARK_NEW);
+        if (ok)
+        {
+            rule_init (&rule, NULL, external_ip, protocol);
+            rule_add_port_match (&rule, protocol, external_port, false);
+            rule_set_connmark_allowed (&rule);
+            ok = iptc_append_entry (chain_mangle, &rule.u.entry, handle);
+        }
+        if (ok)
+        {
+            rule_init (&rule, internal_ip, NULL, protocol);
+            rule_add_port_match (&rule, protocol, internal_port, true);
+            rule_set_connmark_allowed (&rule);
+            ok = iptc_append_entry (chain_mangle, &rule.u.entry, handle);
+        }
+        ok = commit_table (handle, "mangle", ok);
+    }
+    else
+    {
+        ok = false;
+    }
+
+    /* The nat table is committed on its own, so take its chains out again
+     * rather than leave a half-written mapping */
+    if (!ok)
+    {
+        remove_nat_chains (chain_preroute, chain_postroute);
+    }
+
+    pthread_mutex_unlock (&iptc_lock);
+    return ok;
+}
+
+/**
+ * @brief pcp_iptc_remove - Remove the chains for a mapping
+ * @param index - The rule ID
+ * @return - True on success, else false
+ */
+static bool
+pcp_iptc_remove (int index)
+{
+    char chain_preroute[IPTC_CHAIN_SIZE] = { '\0' };
+    char chain_postroute[IPTC_CHAIN_SIZE] = { '\0' };
+    char chain_mangle[IPTC_CHAIN_SIZE] = { '\0' };
+    struct xtc_handle *handle;
+    bool ok = false;
+
+    /* Form the names of the chains */
+    if (snprintf (chain_preroute, IPTC_CHAIN_SIZE, PCP_PREROUTING_RULE_FORMAT, index) <= 0 ||
+        snprintf (chain_postroute, IPTC_CHAIN_SIZE, PCP_POSTROUTING_RULE_FORMAT, index) <= 0 ||
+        snprintf (chain_mangle, IPTC_CHAIN_SIZE, PCP_MANGLE_RULE_FORMAT, index) <= 0)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock (&iptc_lock);
+
+    ok = remove_nat_chains (chain_preroute, chain_postroute);
+    if (ok && (handle = iptc_init ("mangle")) != NULL)
+    {
+        ok = commit_table (handle, "mangle",
+                           delete_chain (handle, PCP_MANGLE_CHAIN, chain_mangle));
+    }
+
+    pthread_mutex_unlock (&iptc_lock);
+    return ok;
+}
+
+/* libiptc only programs the IPv4 tables, so there is no IPv6 path */
+const pcp_fw_backend pcp_iptc_backend = {
+    .name = "iptc",
+    .init = pcp_iptc_init,
+    .deinit = pcp_iptc_deinit,
+    .write = pcp_iptc_write,
+    .remove = pcp_iptc_remove,
+};
+
+#endif /* HAVE_LIBIPTC */
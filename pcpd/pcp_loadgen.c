@@ -0,0 +1,914 @@
+/**
+ * @file pcp_loadgen.c
+ *
+ * Synthetic PCP client for capacity testing pcpd. It sends a mix of MAP
+ * create, renew and delete requests at a fixed rate on behalf of many
+ * simulated clients, and reports latency percentiles, loss and the
+ * distribution of result codes.
+ *
+ * Each simulated client has its own IPv4 address in the request header and
+ * a number of mappings, each with its own nonce and internal port. A
+ * mapping has at most one request outstanding, so a response can be matched
+ * to its request by nonce.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "packets_pcp.h"
+#include "packets_pcp_serialization.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+#define DEFAULT_RATE 1000
+#define DEFAULT_DURATION 10
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_MAPPINGS 10
+#define DEFAULT_LIFETIME 3600
+#define DEFAULT_TIMEOUT_MS 1000
+#define DEFAULT_MIX "20:70:10"
+#define DEFAULT_SERVER "127.0.0.1"
+#define DEFAULT_CLIENT_BASE "10.0.0.1"
+#define DEFAULT_EXTERNAL_IP "0.0.0.0"
+#define FIRST_INTERNAL_PORT 1024
+#define MAX_MAPPINGS_PER_CLIENT (65536 - FIRST_INTERNAL_PORT)
+#define MAX_SEND_BURST 64
+#define MAX_PICK_ATTEMPTS 8
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* Request types */
+typedef enum
+{
+    OP_CREATE,
+    OP_RENEW,
+    OP_DELETE,
+    OP_MAX
+} loadgen_op;
+
+static const char *op_names[OP_MAX] = { "create", "renew", "delete" };
+
+static const char *result_names[RESULT_CODE_MAX] = {
+    "SUCCESS", "UNSUPP_VERSION", "NOT_AUTHORIZED", "MALFORMED_REQUEST",
+    "UNSUPP_OPCODE", "UNSUPP_OPTION", "MALFORMED_OPTION", "NETWORK_FAILURE",
+    "NO_RESOURCES", "UNSUPP_PROTOCOL", "USER_EX_QUOTA", "CANNOT_PROVIDE_EXTERNAL",
+    "ADDRESS_MISMATCH", "EXCESSIVE_REMOTE_PEERS",
+};
+
+/* One simulated mapping */
+typedef struct _loadgen_slot
+{
+    map_request req;            // Request in host order
+    bool pending;               // A request is outstanding
+    loadgen_op op;              // Type of the outstanding request
+    u_int32_t seq;              // Sequence number of the latest request
+    u_int64_t sent_ns;          // When the latest request was sent
+} loadgen_slot;
+
+/* A sent request, kept in send order so timed out requests are found quickly */
+typedef struct _inflight
+{
+    int slot;
+    u_int32_t seq;
+} inflight;
+
+/* Load generator configuration */
+typedef struct _loadgen_config
+{
+    struct sockaddr_in server;
+    struct sockaddr_in source;
+    bool bind_source;
+    struct in_addr client_base;
+    struct in_addr external_ip;
+    unsigned int rate;
+    unsigned int duration;
+    unsigned int clients;
+    unsigned int mappings;
+    u_int32_t lifetime;
+    u_int64_t timeout_ns;
+    unsigned int weights[OP_MAX];
+    u_int8_t protocol;
+    bool quiet;
+} loadgen_config;
+
+/* Results */
+typedef struct _loadgen_stats
+{
+    u_int64_t sent[OP_MAX];
+    u_int64_t received;
+    u_int64_t lost;
+    u_int64_t late;
+    u_int64_t unmatched;
+    u_int64_t send_errors;
+    u_int64_t skipped;
+    u_int64_t results[RESULT_CODE_MAX + 1];
+    u_int32_t *latencies_us;
+    size_t num_latencies;
+    size_t max_latencies;
+} loadgen_stats;
+
+static loadgen_config config;
+static loadgen_stats stats;
+
+static loadgen_slot *slots;
+static int num_slots;
+/* Slots ordered so that the first num_mapped are mapped in pcpd */
+static int *order;
+static int *position;
+static int num_mapped;
+
+static inflight *ring;
+static size_t ring_size;
+static size_t ring_head;
+static size_t ring_count;
+
+static u_int32_t run_id;
+
+static struct option long_options[] = {
+    { "server", required_argument, NULL, 't' },
+    { "port", required_argument, NULL, 'p' },
+    { "source", required_argument, NULL, 's' },
+    { "rate", required_argument, NULL, 'r' },
+    { "duration", required_argument, NULL, 'd' },
+    { "clients", required_argument, NULL, 'c' },
+    { "mappings", required_argument, NULL, 'm' },
+    { "mix", required_argument, NULL, 'x' },
+    { "lifetime", required_argument, NULL, 'l' },
+    { "timeout", required_argument, NULL, 'T' },
+    { "client-base", required_argument, NULL, 'b' },
+    { "external", required_argument, NULL, 'e' },
+    { "udp", no_argument, NULL, 'u' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+/**
+ * @brief usage - Print usage
+ */
+static void
+usage (void)
+{
+    fprintf (stdout, "pcp-loadgen, a synthetic PCP client for capacity testing pcpd\n\n"
+             "usage:\tpcp-loadgen [-t SERVER] [-p PORT] [-s SOURCE] [-r RATE] [-d SECONDS]\n"
+             "\t\t[-c CLIENTS] [-m MAPPINGS] [-x CREATE:RENEW:DELETE] [-l LIFETIME]\n"
+             "\t\t[-T TIMEOUT_MS] [-b CLIENT_BASE] [-e EXTERNAL_IP] [-u] [-q]\n\n"
+             "Sends RATE MAP requests per second (default %d) to SERVER:PORT\n"
+             "(default %s:%d) for SECONDS (default %d), optionally from the\n"
+             "local address SOURCE.\n"
+             "CLIENTS simulated clients (default %d) use consecutive addresses from\n"
+             "CLIENT_BASE (default %s) and each has MAPPINGS mappings (default %d).\n"
+             "The mix gives the relative weight of requests that create, renew and\n"
+             "delete a mapping (default %s). Created and renewed mappings request\n"
+             "LIFETIME seconds (default %d) at EXTERNAL_IP (default %s) over TCP,\n"
+             "or UDP with -u.\n"
+             "A request without a response after TIMEOUT_MS (default %d) is lost.\n"
+             "To test over a network namespace, run it with `ip netns exec`.\n"
+             "-q prints only the final report.\n\n",
+             DEFAULT_RATE, DEFAULT_SERVER, PCP_SERVER_LISTENING_PORT, DEFAULT_DURATION,
+             DEFAULT_CLIENTS, DEFAULT_CLIENT_BASE, DEFAULT_MAPPINGS, DEFAULT_MIX,
+             DEFAULT_LIFETIME, DEFAULT_EXTERNAL_IP, DEFAULT_TIMEOUT_MS);
+}
+
+/**
+ * @brief now_ns - Get the monotonic time
+ * @return - The time in nanoseconds
+ */
+static u_int64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief parse_uint - Parse a positive integer option or exit
+ * @param arg - The option argument
+ * @param name - Name of the option for the error message
+ * @param max - Largest value allowed
+ * @return - The value
+ */
+static unsigned int
+parse_uint (const char *arg, const char *name, unsigned long max)
+{
+    char *end;
+    unsigned long value;
+
+    errno = 0;
+    value = strtoul (arg, &end, 10);
+    if (errno != 0 || *end != '\0' || value < 1 || value > max)
+    {
+        fprintf (stderr, "%s must be between 1 and %lu\n", name, max);
+        exit (EXIT_FAILURE);
+    }
+    return value;
+}
+
+/**
+ * @brief parse_ipv4 - Parse an IPv4 address option or exit
+ * @param arg - The option argument
+ * @param name - Name of the option for the error message
+ * @param addr - Where to place the address
+ */
+static void
+parse_ipv4 (const char *arg, const char *name, struct in_addr *addr)
+{
+    if (inet_pton (AF_INET, arg, addr) != 1)
+    {
+        fprintf (stderr, "%s must be an IPv4 address\n", name);
+        exit (EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief parse_mix - Parse the create:renew:delete weights or exit
+ * @param arg - The option argument
+ */
+static void
+parse_mix (const char *arg)
+{
+    unsigned int w[OP_MAX];
+
+    if (sscanf (arg, "%u:%u:%u", &w[OP_CREATE], &w[OP_RENEW], &w[OP_DELETE]) != OP_MAX ||
+        w[OP_CREATE] + w[OP_RENEW] + w[OP_DELETE] == 0)
+    {
+        fprintf (stderr, "Mix must be CREATE:RENEW:DELETE weights, e.g. %s\n", DEFAULT_MIX);
+        exit (EXIT_FAILURE);
+    }
+    memcpy (config.weights, w, sizeof (w));
+}
+
+/**
+ * @brief process_arguments - Process command line arguments
+ * @param argc - argc from main()
+ * @param argv - argv from main()
+ */
+static void
+process_arguments (int argc, char *argv[])
+{
+    int opt;
+
+    memset (&config, 0, sizeof (config));
+    config.server.sin_family = AF_INET;
+    config.server.sin_port = htons (PCP_SERVER_LISTENING_PORT);
+    parse_ipv4 (DEFAULT_SERVER, "Server", &config.server.sin_addr);
+    config.source.sin_family = AF_INET;
+    parse_ipv4 (DEFAULT_CLIENT_BASE, "Client base", &config.client_base);
+    parse_ipv4 (DEFAULT_EXTERNAL_IP, "External IP", &config.external_ip);
+    config.rate = DEFAULT_RATE;
+    config.duration = DEFAULT_DURATION;
+    config.clients = DEFAULT_CLIENTS;
+    config.mappings = DEFAULT_MAPPINGS;
+    config.lifetime = DEFAULT_LIFETIME;
+    config.timeout_ns = DEFAULT_TIMEOUT_MS * NSEC_PER_MSEC;
+    config.protocol = IPPROTO_TCP;
+    parse_mix (DEFAULT_MIX);
+
+    while ((opt = getopt_long (argc, argv, "t:p:s:r:d:c:m:x:l:T:b:e:uqh",
+                               long_options, NULL)) != EOF)
+    {
+        switch (opt)
+        {
+        case 't':
+            parse_ipv4 (optarg, "Server", &config.server.sin_addr);
+            break;
+        case 'p':
+            config.server.sin_port = htons (parse_uint (optarg, "Port", 65535));
+            break;
+        case 's':
+            parse_ipv4 (optarg, "Source", &config.source.sin_addr);
+            config.bind_source = true;
+            break;
+        case 'r':
+            config.rate = parse_uint (optarg, "Rate", 10000000);
+            break;
+        case 'd':
+            config.duration = parse_uint (optarg, "Duration", 86400);
+            break;
+        case 'c':
+            config.clients = parse_uint (optarg, "Clients", 1 << 24);
+            break;
+        case 'm':
+            config.mappings = parse_uint (optarg, "Mappings", MAX_MAPPINGS_PER_CLIENT);
+            break;
+        case 'x':
+            parse_mix (optarg);
+            break;
+        case 'l':
+            config.lifetime = parse_uint (optarg, "Lifetime", UINT32_MAX);
+            break;
+        case 'T':
+            config.timeout_ns = parse_uint (optarg, "Timeout", 3600000) * NSEC_PER_MSEC;
+            break;
+        case 'b':
+            parse_ipv4 (optarg, "Client base", &config.client_base);
+            break;
+        case 'e':
+            parse_ipv4 (optarg, "External IP", &config.external_ip);
+            break;
+        case 'u':
+            config.protocol = IPPROTO_UDP;
+            break;
+        case 'q':
+            config.quiet = true;
+            break;
+        case 'h':
+            usage ();
+            exit (EXIT_SUCCESS);
+        default:   /* '?' */
+            fprintf (stderr, "Try `pcp-loadgen --help' for more information.\n");
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    if ((u_int64_t) config.clients * config.mappings > (1 << 24))
+    {
+        fprintf (stderr, "Clients * mappings must be at most %d\n", 1 << 24);
+        exit (EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief init_slots - Create the simulated mappings using the client side
+ *          MAP request builder
+ * @return - True if successful
+ */
+static bool
+init_slots (void)
+{
+    char client_str[INET6_ADDRSTRLEN];
+    char external_str[INET6_ADDRSTRLEN];
+    struct in_addr client;
+    map_request *map_req;
+    unsigned int c, m;
+    int i;
+
+    num_slots = config.clients * config.mappings;
+    slots = calloc (num_slots, sizeof (*slots));
+    order = calloc (num_slots, sizeof (*order));
+    position = calloc (num_slots, sizeof (*position));
+    if (!slots || !order || !position)
+    {
+        return false;
+    }
+
+    snprintf (external_str, sizeof (external_str), "::ffff:%s",
+              inet_ntoa (config.external_ip));
+
+    i = 0;
+    for (c = 0; c < config.clients; c++)
+    {
+        client.s_addr = htonl (ntohl (config.client_base.s_addr) + c);
+        snprintf (client_str, sizeof (client_str), "::ffff:%s", inet_ntoa (client));
+        for (m = 0; m < config.mappings; m++, i++)
+        {
+            map_req = new_pcp_map_request (config.lifetime, client_str);
+            if (!map_req)
+            {
+                return false;
+            }
+            /* The nonce identifies the slot, and this run so that late
+             * responses to an earlier run are not counted */
+            map_req->mapping_nonce[0] = i;
+            map_req->mapping_nonce[1] = run_id;
+            map_req->mapping_nonce[2] = c;
+            map_req->protocol = config.protocol;
+            map_req->internal_port = FIRST_INTERNAL_PORT + m;
+            map_req->suggested_external_port = FIRST_INTERNAL_PORT + m;
+            inet_pton (AF_INET6, external_str, &map_req->suggested_external_ip);
+            slots[i].req = *map_req;
+            free (map_req);
+
+            order[i] = i;
+            position[i] = i;
+        }
+    }
+    num_mapped = 0;
+
+    ring_size = 1024;
+    ring = malloc (ring_size * sizeof (*ring));
+    return ring != NULL;
+}
+
+/**
+ * @brief set_mapped - Record whether a slot is mapped in pcpd
+ * @param slot - The slot
+ * @param mapped - True if it is now mapped
+ */
+static void
+set_mapped (int slot, bool mapped)
+{
+    int pos = position[slot];
+    int swap_pos;
+    int other;
+
+    if (mapped == (pos < num_mapped))
+    {
+        return;
+    }
+    swap_pos = mapped ? num_mapped : num_mapped - 1;
+    other = order[swap_pos];
+    order[swap_pos] = slot;
+    position[slot] = swap_pos;
+    order[pos] = other;
+    position[other] = pos;
+    num_mapped += mapped ? 1 : -1;
+}
+
+/**
+ * @brief pick_slot - Pick a random slot without an outstanding request
+ * @param mapped - Pick a mapped slot if true, otherwise an unmapped one
+ * @return - The slot, or -1 if none was found
+ */
+static int
+pick_slot (bool mapped)
+{
+    int first = mapped ? 0 : num_mapped;
+    int count = mapped ? num_mapped : num_slots - num_mapped;
+    int i, slot;
+
+    for (i = 0; i < MAX_PICK_ATTEMPTS && count > 0; i++)
+    {
+        slot = order[first + rand () % count];
+        if (!slots[slot].pending)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief pick_op - Pick the type of the next request from the mix
+ * @return - The request type
+ */
+static loadgen_op
+pick_op (void)
+{
+    unsigned int total = config.weights[OP_CREATE] + config.weights[OP_RENEW] +
+                         config.weights[OP_DELETE];
+    unsigned int r = rand () % total;
+
+    if (r < config.weights[OP_CREATE])
+    {
+        return OP_CREATE;
+    }
+    if (r < config.weights[OP_CREATE] + config.weights[OP_RENEW])
+    {
+        return OP_RENEW;
+    }
+    return OP_DELETE;
+}
+
+/**
+ * @brief ring_push - Remember a sent request until it is answered or times out
+ * @param slot - The slot
+ * @param seq - The request's sequence number
+ * @return - True if successful
+ */
+static bool
+ring_push (int slot, u_int32_t seq)
+{
+    inflight *new_ring;
+    size_t i;
+
+    if (ring_count == ring_size)
+    {
+        new_ring = malloc (2 * ring_size * sizeof (*ring));
+        if (!new_ring)
+        {
+            return false;
+        }
+        for (i = 0; i < ring_count; i++)
+        {
+            new_ring[i] = ring[(ring_head + i) % ring_size];
+        }
+        free (ring);
+        ring = new_ring;
+        ring_head = 0;
+        ring_size *= 2;
+    }
+    ring[(ring_head + ring_count) % ring_size] = (inflight) { slot, seq };
+    ring_count++;
+    return true;
+}
+
+/**
+ * @brief send_request - Send the next request in the mix
+ * @param sock - Client socket
+ * @param now - The current time
+ */
+static void
+send_request (int sock, u_int64_t now)
+{
+    unsigned char buf[MAX_PAYLOAD_LEN];
+    unsigned char *end;
+    loadgen_op op = pick_op ();
+    loadgen_slot *s;
+    int slot;
+
+    /* Fall back to another type of request when no slot suits this one */
+    slot = pick_slot (op != OP_CREATE);
+    if (slot < 0)
+    {
+        op = op == OP_CREATE ? OP_RENEW : OP_CREATE;
+        slot = pick_slot (op != OP_CREATE);
+    }
+    if (slot < 0)
+    {
+        stats.skipped++;
+        return;
+    }
+
+    s = &slots[slot];
+    s->req.header.requested_lifetime = op == OP_DELETE ? 0 : config.lifetime;
+    end = serialize_map_request (buf, &s->req);
+
+    if (send (sock, buf, end - buf, 0) < 0)
+    {
+        stats.send_errors++;
+        return;
+    }
+
+    s->pending = true;
+    s->op = op;
+    s->seq++;
+    s->sent_ns = now;
+    stats.sent[op]++;
+    if (!ring_push (slot, s->seq))
+    {
+        fprintf (stderr, "Out of memory\n");
+        exit (EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief record_latency - Record the latency of an answered request
+ * @param latency_ns - The latency
+ */
+static void
+record_latency (u_int64_t latency_ns)
+{
+    u_int32_t *new_latencies;
+    u_int64_t latency_us = latency_ns / NSEC_PER_USEC;
+
+    if (stats.num_latencies == stats.max_latencies)
+    {
+        stats.max_latencies = stats.max_latencies ? 2 * stats.max_latencies : 65536;
+        new_latencies = realloc (stats.latencies_us,
+                                 stats.max_latencies * sizeof (*stats.latencies_us));
+        if (!new_latencies)
+        {
+            fprintf (stderr, "Out of memory\n");
+            exit (EXIT_FAILURE);
+        }
+        stats.latencies_us = new_latencies;
+    }
+    stats.latencies_us[stats.num_latencies++] = latency_us > UINT32_MAX ?
+                                                UINT32_MAX : latency_us;
+}
+
+/**
+ * @brief process_response - Match a response to its request and record the result
+ * @param buf - The response
+ * @param n - Length of the response
+ * @param now - The time it was received
+ */
+static void
+process_response (unsigned char *buf, int n, u_int64_t now)
+{
+    pcp_response_header header;
+    map_response map_resp;
+    loadgen_slot *s;
+    u_int32_t slot;
+
+    if (n < sizeof (pcp_response_header))
+    {
+        stats.unmatched++;
+        return;
+    }
+    deserialize_response_header (&header, buf);
+    stats.received++;
+    stats.results[header.result_code < RESULT_CODE_MAX ?
+                  header.result_code : RESULT_CODE_MAX]++;
+
+    /* Error responses for malformed requests have no nonce to match */
+    if (n < MIN_MAP_PKT_LEN || header.r_opcode != R_RESPONSE (MAP_OPCODE))
+    {
+        stats.unmatched++;
+        return;
+    }
+    deserialize_map_response_into (&map_resp, buf);
+    slot = map_resp.mapping_nonce[0];
+    if (map_resp.mapping_nonce[1] != run_id || slot >= num_slots)
+    {
+        stats.unmatched++;
+        return;
+    }
+
+    s = &slots[slot];
+    if (!s->pending)
+    {
+        /* Already counted as lost */
+        stats.late++;
+        return;
+    }
+    s->pending = false;
+    record_latency (now - s->sent_ns);
+
+    if (header.result_code == SUCCESS)
+    {
+        set_mapped (slot, s->op != OP_DELETE);
+    }
+}
+
+/**
+ * @brief receive_responses - Receive every waiting response
+ * @param sock - Client socket
+ */
+static void
+receive_responses (int sock)
+{
+    unsigned char buf[MAX_PAYLOAD_LEN + 1];
+    int n;
+
+    while ((n = recv (sock, buf, sizeof (buf), MSG_DONTWAIT)) >= 0)
+    {
+        process_response (buf, n, now_ns ());
+    }
+}
+
+/**
+ * @brief expire_requests - Count requests without a response in time as lost
+ * @param now - The current time
+ */
+static void
+expire_requests (u_int64_t now)
+{
+    inflight *f;
+    loadgen_slot *s;
+
+    while (ring_count > 0)
+    {
+        f = &ring[ring_head];
+        s = &slots[f->slot];
+        if (s->pending && s->seq == f->seq)
+        {
+            if (now - s->sent_ns < config.timeout_ns)
+            {
+                break;
+            }
+            s->pending = false;
+            stats.lost++;
+        }
+        ring_head = (ring_head + 1) % ring_size;
+        ring_count--;
+    }
+}
+
+static int
+compare_u32 (const void *a, const void *b)
+{
+    u_int32_t x = *(const u_int32_t *) a;
+    u_int32_t y = *(const u_int32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief percentile - Get a percentile of the sorted latencies
+ * @param p - The percentile, from 0 to 100
+ * @return - The latency in microseconds
+ */
+static u_int32_t
+percentile (double p)
+{
+    size_t i;
+
+    if (stats.num_latencies == 0)
+    {
+        return 0;
+    }
+    i = (size_t) (p / 100.0 * (stats.num_latencies - 1) + 0.5);
+    return stats.latencies_us[i];
+}
+
+/**
+ * @brief print_report - Print the results
+ * @param elapsed_ns - How long requests were sent for
+ */
+static void
+print_report (u_int64_t elapsed_ns)
+{
+    u_int64_t total_sent = 0;
+    u_int64_t answered;
+    int i;
+
+    for (i = 0; i < OP_MAX; i++)
+    {
+        total_sent += stats.sent[i];
+    }
+    answered = stats.num_latencies;
+
+    qsort (stats.latencies_us, stats.num_latencies, sizeof (*stats.latencies_us),
+           compare_u32);
+
+    printf ("Requests sent:   %llu (", (unsigned long long) total_sent);
+    for (i = 0; i < OP_MAX; i++)
+    {
+        printf ("%s%s %llu", i ? ", " : "", op_names[i], (unsigned long long) stats.sent[i]);
+    }
+    printf (")\n");
+    printf ("Send rate:       %.0f requests/sec\n",
+            elapsed_ns ? total_sent * (double) NSEC_PER_SEC / elapsed_ns : 0);
+    printf ("Answered:        %llu\n", (unsigned long long) answered);
+    printf ("Lost:            %llu (%.3f%%)\n", (unsigned long long) stats.lost,
+            total_sent ? 100.0 * stats.lost / total_sent : 0);
+    printf ("Late:            %llu\n", (unsigned long long) stats.late);
+    printf ("Unmatched:       %llu\n", (unsigned long long) stats.unmatched);
+    printf ("Send errors:     %llu\n", (unsigned long long) stats.send_errors);
+    printf ("Skipped:         %llu\n", (unsigned long long) stats.skipped);
+    printf ("Mapped at end:   %d of %d\n", num_mapped, num_slots);
+    printf ("Latency (us):    min %u  p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+            percentile (0), percentile (50), percentile (90), percentile (99),
+            percentile (99.9), percentile (100));
+    printf ("Result codes:\n");
+    for (i = 0; i <= RESULT_CODE_MAX; i++)
+    {
+        if (stats.results[i])
+        {
+            printf ("  %-24s %llu\n", i < RESULT_CODE_MAX ? result_names[i] : "(invalid)",
+                    (unsigned long long) stats.results[i]);
+        }
+    }
+}
+
+/**
+ * @brief open_client_socket - Open a UDP socket connected to the server
+ * @return - The socket, or -1 on error
+ */
+static int
+open_client_socket (void)
+{
+    int size = SOCKET_BUFFER_SIZE;
+    int sock;
+
+    sock = socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        perror ("socket");
+        return -1;
+    }
+    /* Best effort, so bursts are not dropped by the client */
+    setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+    setsockopt (sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+
+    if (config.bind_source &&
+        bind (sock, (struct sockaddr *) &config.source, sizeof (config.source)) < 0)
+    {
+        perror ("bind");
+        close (sock);
+        return -1;
+    }
+    if (connect (sock, (struct sockaddr *) &config.server, sizeof (config.server)) < 0)
+    {
+        perror ("connect");
+        close (sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * @brief run - Send requests at the configured rate and collect the responses
+ * @param sock - Client socket
+ * @return - How long requests were sent for
+ */
+static u_int64_t
+run (int sock)
+{
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    struct timespec wait;
+    u_int64_t start, now, stop, next_send, next_progress, wait_ns;
+    u_int64_t sent = 0;
+    u_int64_t last_received = 0;
+    int burst;
+
+    start = now_ns ();
+    stop = start + config.duration * NSEC_PER_SEC;
+    next_progress = start + NSEC_PER_SEC;
+
+    while (1)
+    {
+        now = now_ns ();
+        if (now < stop)
+        {
+            /* Catch up with the schedule, a bounded burst at a time */
+            for (burst = 0; burst < MAX_SEND_BURST &&
+                 sent < (now - start) * config.rate / NSEC_PER_SEC; burst++, sent++)
+            {
+                send_request (sock, now);
+            }
+        }
+        else if (ring_count == 0 || now - stop > config.timeout_ns)
+        {
+            break;
+        }
+
+        receive_responses (sock);
+        now = now_ns ();
+        expire_requests (now);
+
+        if (!config.quiet && now >= next_progress)
+        {
+            fprintf (stderr, "%3llus: %llu responses/sec, %llu lost, %d mapped\n",
+                     (unsigned long long) ((now - start) / NSEC_PER_SEC),
+                     (unsigned long long) (stats.received - last_received),
+                     (unsigned long long) stats.lost, num_mapped);
+            last_received = stats.received;
+            next_progress += NSEC_PER_SEC;
+        }
+
+        /* Sleep until the next request is due or a response arrives */
+        next_send = start + (sent + 1) * NSEC_PER_SEC / config.rate;
+        wait_ns = now < stop && next_send > now ? next_send - now : 0;
+        if (now >= stop)
+        {
+            wait_ns = NSEC_PER_MSEC;
+        }
+        if (wait_ns > NSEC_PER_MSEC)
+        {
+            wait_ns = NSEC_PER_MSEC;
+        }
+        wait.tv_sec = 0;
+        wait.tv_nsec = wait_ns;
+        ppoll (&pfd, 1, &wait, NULL);
+    }
+
+    return (stop < now ? stop : now) - start;
+}
+
+int
+main (int argc, char *argv[])
+{
+    u_int64_t elapsed;
+    int sock;
+
+    process_arguments (argc, argv);
+
+    run_id = time (NULL) ^ (getpid () << 16);
+    srand (run_id);
+
+    if (!init_slots ())
+    {
+        fprintf (stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    sock = open_client_socket ();
+    if (sock < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    elapsed = run (sock);
+    print_report (elapsed);
+
+    close (sock);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,363 @@
+/**
+ * @file pcp_metrics.c
+ *
+ * Runtime counters and latency histograms for pcpd. Each thread adds to its
+ * own shard of a shared memory segment with relaxed atomic adds, so the hot
+ * path takes no locks and workers do not share cache lines. Readers map the
+ * segment read-only and sum the shards.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pcp_metrics.h"
+
+/* Used until pcp_metrics_init maps the shared segment, and if it cannot */
+static pcp_metrics_segment local_segment;
+
+pcp_metrics_segment *pcp_metrics = &local_segment;
+__thread int pcp_metrics_thread_shard = 0;
+__thread unsigned int pcp_metrics_sample_count = 0;
+
+static const char *metric_names[PCP_METRIC_RESPONSES] = {
+    "Packets received",
+    "Packets dropped",
+    "Mappings created",
+    "Mappings extended",
+    "Mappings deleted",
+    "Mappings expired",
+    "Forwarding backend calls",
+    "Forwarding backend failures",
+    "Apteryx round trips",
+};
+
+static const char *result_names[RESULT_CODE_MAX] = {
+    "Responses SUCCESS",
+    "Responses UNSUPP_VERSION",
+    "Responses NOT_AUTHORIZED",
+    "Responses MALFORMED_REQUEST",
+    "Responses UNSUPP_OPCODE",
+    "Responses UNSUPP_OPTION",
+    "Responses MALFORMED_OPTION",
+    "Responses NETWORK_FAILURE",
+    "Responses NO_RESOURCES",
+    "Responses UNSUPP_PROTOCOL",
+    "Responses USER_EX_QUOTA",
+    "Responses CANNOT_PROVIDE_EXTERNAL",
+    "Responses ADDRESS_MISMATCH",
+    "Responses EXCESSIVE_REMOTE_PEERS",
+};
+
+static const char *histogram_names[PCP_HISTOGRAM_MAX] = {
+    "Request processing",
+    "Forwarding commit",
+    "Expiry sweep",
+};
+
+static void
+segment_init (pcp_metrics_segment *segment)
+{
+    memset (segment, 0, sizeof (*segment));
+    segment->version = PCP_METRICS_VERSION;
+    segment->size = sizeof (*segment);
+    segment->num_shards = PCP_METRICS_SHARDS;
+    segment->start_time = time (NULL);
+    /* Readers check the magic, so set it once the rest is valid */
+    __atomic_store_n (&segment->magic, PCP_METRICS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief pcp_metrics_init - Start collecting metrics. Must be called before any
+ *          thread that records metrics is started.
+ * @param shared - Place the metrics in shared memory so other processes can read them
+ * @return - False if the shared memory segment could not be created, in which
+ *           case metrics are still collected in private memory
+ */
+bool
+pcp_metrics_init (bool shared)
+{
+    pcp_metrics_segment *segment;
+    int fd;
+
+    segment_init (&local_segment);
+    pcp_metrics = &local_segment;
+    if (!shared)
+    {
+        return true;
+    }
+
+    fd = shm_open (PCP_METRICS_SHM_NAME, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0)
+    {
+        syslog (LOG_ERR, "Failed to open metrics shared memory: %m");
+        return false;
+    }
+    if (ftruncate (fd, sizeof (pcp_metrics_segment)) < 0)
+    {
+        syslog (LOG_ERR, "Failed to size metrics shared memory: %m");
+        close (fd);
+        return false;
+    }
+    segment = mmap (NULL, sizeof (pcp_metrics_segment), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    close (fd);
+    if (segment == MAP_FAILED)
+    {
+        syslog (LOG_ERR, "Failed to map metrics shared memory: %m");
+        return false;
+    }
+
+    /* Clear anything left by an earlier pcpd */
+    segment_init (segment);
+    pcp_metrics = segment;
+    return true;
+}
+
+/**
+ * @brief pcp_metrics_deinit - Remove the shared memory segment
+ */
+void
+pcp_metrics_deinit (void)
+{
+    if (pcp_metrics != &local_segment)
+    {
+        munmap (pcp_metrics, sizeof (pcp_metrics_segment));
+        shm_unlink (PCP_METRICS_SHM_NAME);
+        pcp_metrics = &local_segment;
+    }
+}
+
+/**
+ * @brief pcp_metrics_thread_init - Give the calling thread its own shard
+ * @param shard - The shard, from 1 to PCP_METRICS_SHARDS - 1. Other values
+ *          select the shared shard.
+ */
+void
+pcp_metrics_thread_init (int shard)
+{
+    pcp_metrics_thread_shard = (shard > 0 && shard < PCP_METRICS_SHARDS) ? shard : 0;
+}
+
+/**
+ * @brief pcp_metrics_now - Get the time for measuring a latency
+ * @return - Monotonic time in nanoseconds
+ */
+u_int64_t
+pcp_metrics_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief pcp_metrics_attach - Map a running pcpd's metrics for reading
+ * @return - The segment, or NULL if pcpd is not running or is incompatible
+ */
+const pcp_metrics_segment *
+pcp_metrics_attach (void)
+{
+    pcp_metrics_segment *segment;
+    struct stat st;
+    int fd;
+
+    fd = shm_open (PCP_METRICS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat (fd, &st) < 0 || st.st_size != sizeof (pcp_metrics_segment))
+    {
+        close (fd);
+        return NULL;
+    }
+    segment = mmap (NULL, sizeof (pcp_metrics_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (segment == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (__atomic_load_n (&segment->magic, __ATOMIC_ACQUIRE) != PCP_METRICS_MAGIC ||
+        segment->version != PCP_METRICS_VERSION ||
+        segment->size != sizeof (pcp_metrics_segment) ||
+        segment->num_shards != PCP_METRICS_SHARDS)
+    {
+        munmap (segment, sizeof (pcp_metrics_segment));
+        return NULL;
+    }
+    return segment;
+}
+
+/**
+ * @brief pcp_metrics_detach - Unmap a segment mapped by pcp_metrics_attach
+ * @param segment - The segment
+ */
+void
+pcp_metrics_detach (const pcp_metrics_segment *segment)
+{
+    if (segment)
+    {
+        munmap ((void *) segment, sizeof (pcp_metrics_segment));
+    }
+}
+
+/**
+ * @brief pcp_metrics_snapshot - Sum the shards of a segment. Counters are read
+ *          one at a time, so the totals are not an atomic snapshot.
+ * @param segment - The segment, or NULL for this process's metrics
+ * @param totals - Where to place the sums
+ */
+void
+pcp_metrics_snapshot (const pcp_metrics_segment *segment, pcp_metrics_totals *totals)
+{
+    const pcp_metrics_shard *shard;
+    pcp_histogram *h;
+    int s, i, b;
+
+    if (segment == NULL)
+    {
+        segment = pcp_metrics;
+    }
+
+    memset (totals, 0, sizeof (*totals));
+    totals->start_time = segment->start_time;
+    for (s = 0; s < PCP_METRICS_SHARDS; s++)
+    {
+        shard = &segment->shards[s];
+        for (i = 0; i < PCP_METRIC_MAX; i++)
+        {
+            totals->counters[i] += __atomic_load_n (&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < PCP_HISTOGRAM_MAX; i++)
+        {
+            h = &totals->histograms[i];
+            h->count += __atomic_load_n (&shard->histograms[i].count, __ATOMIC_RELAXED);
+            h->sum_ns += __atomic_load_n (&shard->histograms[i].sum_ns, __ATOMIC_RELAXED);
+            for (b = 0; b < PCP_HISTOGRAM_BUCKETS; b++)
+            {
+                h->buckets[b] += __atomic_load_n (&shard->histograms[i].buckets[b],
+                                                  __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/**
+ * @brief pcp_histogram_percentile - Estimate a percentile of a histogram
+ * @param histogram - The histogram
+ * @param percentile - The percentile, from 0 to 100
+ * @return - The upper bound of the bucket holding the percentile in
+ *           nanoseconds, or 0 if the histogram is empty
+ */
+u_int64_t
+pcp_histogram_percentile (const pcp_histogram *histogram, double percentile)
+{
+    u_int64_t total = 0;
+    u_int64_t seen = 0;
+    int b;
+
+    for (b = 0; b < PCP_HISTOGRAM_BUCKETS; b++)
+    {
+        total += histogram->buckets[b];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    for (b = 0; b < PCP_HISTOGRAM_BUCKETS - 1; b++)
+    {
+        seen += histogram->buckets[b];
+        if (seen >= percentile / 100.0 * total)
+        {
+            break;
+        }
+    }
+    return b == 0 ? 0 : (1ULL << b) - 1;
+}
+
+const char *
+pcp_metric_name (pcp_metric metric)
+{
+    if (metric < PCP_METRIC_RESPONSES)
+    {
+        return metric_names[metric];
+    }
+    if (metric < PCP_METRIC_MAX)
+    {
+        return result_names[metric - PCP_METRIC_RESPONSES];
+    }
+    return "Unknown";
+}
+
+const char *
+pcp_histogram_name (pcp_histogram_id id)
+{
+    return id < PCP_HISTOGRAM_MAX ? histogram_names[id] : "Unknown";
+}
+
+/**
+ * @brief pcp_metrics_print - Write metrics in the style of the state output
+ * @param target - File to write to
+ * @param totals - The metrics
+ * @return - Negative number on error
+ */
+int
+pcp_metrics_print (FILE *target, const pcp_metrics_totals *totals)
+{
+    const pcp_histogram *h;
+    char label[64];
+    int n;
+    int i;
+
+    n = fprintf (target, "PCP Metrics:\n");
+    for (i = 0; i < PCP_METRIC_MAX && n >= 0; i++)
+    {
+        /* Skip the result codes that have never been sent */
+        if (i > PCP_METRIC_RESPONSES && totals->counters[i] == 0)
+        {
+            continue;
+        }
+        n = fprintf (target, "     %-36.35s: %llu\n", pcp_metric_name (i),
+                     (unsigned long long) totals->counters[i]);
+    }
+    for (i = 0; i < PCP_HISTOGRAM_MAX && n >= 0; i++)
+    {
+        h = &totals->histograms[i];
+        snprintf (label, sizeof (label), "%s (ns)", pcp_histogram_name (i));
+        n = fprintf (target, "     %-36.35s: count %llu, mean %llu, p50 %llu, p99 %llu, "
+                     "p99.9 %llu\n", label, (unsigned long long) h->count,
+                     (unsigned long long) (h->count ? h->sum_ns / h->count : 0),
+                     (unsigned long long) pcp_histogram_percentile (h, 50),
+                     (unsigned long long) pcp_histogram_percentile (h, 99),
+                     (unsigned long long) pcp_histogram_percentile (h, 99.9));
+    }
+    return n;
+}
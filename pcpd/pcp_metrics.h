@@ -0,0 +1,197 @@
+/**
+ * @file pcp_metrics.h
+ *
+ * Runtime counters and latency histograms for pcpd, kept in a shared memory
+ * segment that other processes can read without stopping pcpd.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PCP_METRICS_H
+#define PCP_METRICS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "packets_pcp.h"
+
+#define PCP_METRICS_SHM_NAME "/pcpd-metrics"
+#define PCP_METRICS_MAGIC 0x50435044    // "PCPD"
+#define PCP_METRICS_VERSION 1
+
+/* Shard 0 is shared by every thread without a shard of its own, such as the
+ * expiry thread and the Apteryx callbacks. Each request worker has its own. */
+#define PCP_METRICS_SHARDS 65
+
+/* Bucket 0 counts latencies of 0ns and bucket i latencies in [2^(i-1), 2^i) ns */
+#define PCP_HISTOGRAM_BUCKETS 64
+
+/* Request latency is measured for one request in this many per thread */
+#define PCP_METRICS_SAMPLE_INTERVAL 16
+
+/* Counters */
+typedef enum
+{
+    PCP_METRIC_PACKETS_RECEIVED,
+    PCP_METRIC_PACKETS_DROPPED,         // Received without a response being sent
+    PCP_METRIC_MAPPINGS_CREATED,
+    PCP_METRIC_MAPPINGS_EXTENDED,
+    PCP_METRIC_MAPPINGS_DELETED,        // Deleted by a client
+    PCP_METRIC_MAPPINGS_EXPIRED,
+    PCP_METRIC_FW_CALLS,
+    PCP_METRIC_FW_FAILURES,
+    PCP_METRIC_APTERYX_CALLS,           // Mapping store calls made through libpcp
+    PCP_METRIC_RESPONSES,               // Responses with result code 0, followed by
+                                        // one counter per other result code
+    PCP_METRIC_MAX = PCP_METRIC_RESPONSES + RESULT_CODE_MAX
+} pcp_metric;
+
+/* Latency histograms */
+typedef enum
+{
+    PCP_HISTOGRAM_REQUEST,              // Processing of a received datagram
+    PCP_HISTOGRAM_FW_COMMIT,            // Installing or removing a mapping's forwarding
+    PCP_HISTOGRAM_EXPIRY_SWEEP,         // Removing the mappings due at one wakeup
+    PCP_HISTOGRAM_MAX
+} pcp_histogram_id;
+
+typedef struct _pcp_histogram
+{
+    u_int64_t count;
+    u_int64_t sum_ns;
+    u_int64_t buckets[PCP_HISTOGRAM_BUCKETS];
+} pcp_histogram;
+
+/* The metrics written by one thread, aligned so that threads do not share
+ * cache lines */
+typedef struct _pcp_metrics_shard
+{
+    u_int64_t counters[PCP_METRIC_MAX];
+    pcp_histogram histograms[PCP_HISTOGRAM_MAX];
+} __attribute__ ((aligned (64))) pcp_metrics_shard;
+
+/* Layout of the shared memory segment. Readers sum the shards. */
+typedef struct _pcp_metrics_segment
+{
+    u_int32_t magic;
+    u_int32_t version;
+    u_int32_t size;                     // sizeof (pcp_metrics_segment)
+    u_int32_t num_shards;
+    u_int64_t start_time;               // time (NULL) when pcpd started
+    pcp_metrics_shard shards[PCP_METRICS_SHARDS];
+} pcp_metrics_segment;
+
+/* The sum of all the shards */
+typedef struct _pcp_metrics_totals
+{
+    u_int64_t start_time;
+    u_int64_t counters[PCP_METRIC_MAX];
+    pcp_histogram histograms[PCP_HISTOGRAM_MAX];
+} pcp_metrics_totals;
+
+extern pcp_metrics_segment *pcp_metrics;
+extern __thread int pcp_metrics_thread_shard;
+extern __thread unsigned int pcp_metrics_sample_count;
+
+bool pcp_metrics_init (bool shared);
+
+void pcp_metrics_deinit (void);
+
+void pcp_metrics_thread_init (int shard);
+
+u_int64_t pcp_metrics_now (void);
+
+const pcp_metrics_segment *pcp_metrics_attach (void);
+
+void pcp_metrics_detach (const pcp_metrics_segment *segment);
+
+void pcp_metrics_snapshot (const pcp_metrics_segment *segment, pcp_metrics_totals *totals);
+
+u_int64_t pcp_histogram_percentile (const pcp_histogram *histogram, double percentile);
+
+const char *pcp_metric_name (pcp_metric metric);
+
+const char *pcp_histogram_name (pcp_histogram_id id);
+
+int pcp_metrics_print (FILE *target, const pcp_metrics_totals *totals);
+
+/**
+ * @brief pcp_metrics_add - Add to a counter. Only the calling thread's shard
+ *          is written, so this does not contend with other workers.
+ * @param metric - The counter
+ * @param value - Amount to add
+ */
+static inline void
+pcp_metrics_add (pcp_metric metric, u_int64_t value)
+{
+    __atomic_fetch_add (&pcp_metrics->shards[pcp_metrics_thread_shard].counters[metric], value,
+                        __ATOMIC_RELAXED);
+}
+
+static inline void
+pcp_metrics_inc (pcp_metric metric)
+{
+    pcp_metrics_add (metric, 1);
+}
+
+/**
+ * @brief pcp_metrics_sub - Take back an amount added to a counter by the same
+ *          thread, e.g. for a response changed after it was counted
+ * @param metric - The counter
+ * @param value - Amount to subtract
+ */
+static inline void
+pcp_metrics_sub (pcp_metric metric, u_int64_t value)
+{
+    __atomic_fetch_sub (&pcp_metrics->shards[pcp_metrics_thread_shard].counters[metric], value,
+                        __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief pcp_metrics_observe - Record a latency in a histogram
+ * @param id - The histogram
+ * @param ns - The latency in nanoseconds
+ */
+static inline void
+pcp_metrics_observe (pcp_histogram_id id, u_int64_t ns)
+{
+    pcp_histogram *h = &pcp_metrics->shards[pcp_metrics_thread_shard].histograms[id];
+    int bucket = ns ? 64 - __builtin_clzll (ns) : 0;
+
+    if (bucket >= PCP_HISTOGRAM_BUCKETS)
+    {
+        bucket = PCP_HISTOGRAM_BUCKETS - 1;
+    }
+    __atomic_fetch_add (&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief pcp_metrics_sample - Decide whether to measure this request's latency
+ * @return - True for one call in PCP_METRICS_SAMPLE_INTERVAL on each thread
+ */
+static inline bool
+pcp_metrics_sample (void)
+{
+    return (pcp_metrics_sample_count++ % PCP_METRICS_SAMPLE_INTERVAL) == 0;
+}
+
+#endif /* PCP_METRICS_H */
@@ -0,0 +1,422 @@
+/**
+ * @file pcp_nftables.c
+ *
+ * Forwarding backend that stores mappings as elements of nftables maps and
+ * sets in a table of its own. The kernel finds the mapping for a packet with
+ * one map lookup instead of walking a chain per mapping, and adding or
+ * removing a mapping is a single transaction of element updates. IPv6
+ * mappings live in an ip6 table with the same layout.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_LIBNFTABLES
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <glib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <nftables/libnftables.h>
+
+#include "pcp_iptables.h"
+
+#define NFT_CMD_SIZE 1024
+
+/* TCP and UDP mappings are keyed on address, protocol and port. Mappings for
+ * other protocols have no port and are keyed on address and protocol only.
+ * The sets mark connections to and from mapped endpoints with connmark 1/0x7
+ * and only connections with that mark are translated, like the iptables
+ * backends do. The mangle chain runs first, at a lower priority than NAT.
+ * The table is declared once per family; ADDR is the address type and IP the
+ * payload expression for that family. */
+#define PCP_NFT_TABLE "ip pcp"
+#define PCP_NFT_TABLE6 "ip6 pcp"
+#define PCP_NFT_RULESET(TABLE, ADDR, IP) \
+    "table " TABLE " {\n" \
+    "  map dnat_tp { type " ADDR " . inet_proto . inet_service : " ADDR " . inet_service; }\n" \
+    "  map snat_tp { type " ADDR " . inet_proto . inet_service : " ADDR " . inet_service; }\n" \
+    "  map dnat_proto { type " ADDR " . inet_proto : " ADDR "; }\n" \
+    "  map snat_proto { type " ADDR " . inet_proto : " ADDR "; }\n" \
+    "  set ext_tp { type " ADDR " . inet_proto . inet_service; }\n" \
+    "  set int_tp { type " ADDR " . inet_proto . inet_service; }\n" \
+    "  set ext_proto { type " ADDR " . inet_proto; }\n" \
+    "  set int_proto { type " ADDR " . inet_proto; }\n" \
+    "  chain prerouting {\n" \
+    "    type nat hook prerouting priority dstnat; policy accept;\n" \
+    "    ct mark and 0x7 == 0x1 meta l4proto { tcp, udp } dnat " IP " addr . port to " IP " daddr . meta l4proto . th dport map @dnat_tp\n" \
+    "    ct mark and 0x7 == 0x1 dnat " IP " to " IP " daddr . meta l4proto map @dnat_proto\n" \
+    "  }\n" \
+    "  chain postrouting {\n" \
+    "    type nat hook postrouting priority srcnat; policy accept;\n" \
+    "    ct mark and 0x7 == 0x1 meta l4proto { tcp, udp } snat " IP " addr . port to " IP " saddr . meta l4proto . th sport map @snat_tp\n" \
+    "    ct mark and 0x7 == 0x1 snat " IP " to " IP " saddr . meta l4proto map @snat_proto\n" \
+    "  }\n" \
+    "  chain mangle {\n" \
+    "    type filter hook prerouting priority mangle; policy accept;\n" \
+    "    ct mark and 0x7 != 0 return\n" \
+    "    meta l4proto { tcp, udp } " IP " daddr . meta l4proto . th dport @ext_tp ct mark set ct mark and 0xfffffff8 or 0x1\n" \
+    "    meta l4proto { tcp, udp } " IP " saddr . meta l4proto . th sport @int_tp ct mark set ct mark and 0xfffffff8 or 0x1\n" \
+    "    " IP " daddr . meta l4proto @ext_proto ct mark set ct mark and 0xfffffff8 or 0x1\n" \
+    "    " IP " saddr . meta l4proto @int_proto ct mark set ct mark and 0xfffffff8 or 0x1\n" \
+    "  }\n" \
+    "}\n"
+
+/* What was installed for a mapping, needed to delete its elements again */
+typedef struct _nft_mapping
+{
+    const char *table;
+    char internal_ip[INET6_ADDRSTRLEN];
+    char external_ip[INET6_ADDRSTRLEN];
+    u_int16_t internal_port;
+    u_int16_t external_port;
+    u_int16_t protocol;
+} nft_mapping;
+
+/* nft_lock guards the context, which is not thread safe, and the installed
+ * mappings */
+static pthread_mutex_t nft_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nft_ctx *nft = NULL;
+static GHashTable *installed = NULL;    // index -> nft_mapping
+static GHashTable *installed6 = NULL;   // index -> nft_mapping, for IPv6
+
+/**
+ * @brief run_nft - Run nft commands as one transaction
+ * @param cmd - The commands
+ * @return - True if the transaction was committed
+ */
+static bool
+run_nft (const char *cmd)
+{
+    if (nft_run_cmd_from_buffer (nft, cmd) != 0)
+    {
+        syslog (LOG_ERR, "nft command failed: %s", nft_ctx_get_error_buffer (nft));
+        return false;
+    }
+    return true;
+}
+
+/* Format the element updates for a mapping. verb is "add" or "delete". */
+static bool
+format_elements (char *cmd, const char *verb, nft_mapping *mapping)
+{
+    int n;
+
+    if (mapping->protocol == IPPROTO_TCP || mapping->protocol == IPPROTO_UDP)
+    {
+        n = snprintf (cmd, NFT_CMD_SIZE,
+                      "%s element %s dnat_tp { %s . %u . %u : %s . %u }\n"
+                      "%s element %s snat_tp { %s . %u . %u : %s . %u }\n"
+                      "%s element %s ext_tp { %s . %u . %u }\n"
+                      "%s element %s int_tp { %s . %u . %u }\n",
+                      verb, mapping->table, mapping->external_ip, mapping->protocol,
+                      mapping->external_port, mapping->internal_ip, mapping->internal_port,
+                      verb, mapping->table, mapping->internal_ip, mapping->protocol,
+                      mapping->internal_port, mapping->external_ip, mapping->external_port,
+                      verb, mapping->table, mapping->external_ip, mapping->protocol,
+                      mapping->external_port,
+                      verb, mapping->table, mapping->internal_ip, mapping->protocol,
+                      mapping->internal_port);
+    }
+    else
+    {
+        n = snprintf (cmd, NFT_CMD_SIZE,
+                      "%s element %s dnat_proto { %s . %u : %s }\n"
+                      "%s element %s snat_proto { %s . %u : %s }\n"
+                      "%s element %s ext_proto { %s . %u }\n"
+                      "%s element %s int_proto { %s . %u }\n",
+                      verb, mapping->table, mapping->external_ip, mapping->protocol,
+                      mapping->internal_ip,
+                      verb, mapping->table, mapping->internal_ip, mapping->protocol,
+                      mapping->external_ip,
+                      verb, mapping->table, mapping->external_ip, mapping->protocol,
+                      verb, mapping->table, mapping->internal_ip, mapping->protocol);
+    }
+    return n > 0 && n < NFT_CMD_SIZE;
+}
+
+/**
+ * @brief nftables_init - Create the PCP tables, replacing any left over from
+ *          a previous run
+ * @return - False if nftables cannot be used
+ */
+static bool
+nftables_init (void)
+{
+    bool ok;
+
+    pthread_mutex_lock (&nft_lock);
+
+    nft = nft_ctx_new (NFT_CTX_DEFAULT);
+    if (nft == NULL)
+    {
+        syslog (LOG_ERR, "Could not create nftables context");
+        pthread_mutex_unlock (&nft_lock);
+        return false;
+    }
+    nft_ctx_buffer_output (nft);
+    nft_ctx_buffer_error (nft);
+
+    /* Adding first means the delete succeeds whether or not the table exists */
+    ok = run_nft ("add table " PCP_NFT_TABLE "\n"
+                  "delete table " PCP_NFT_TABLE "\n"
+                  PCP_NFT_RULESET (PCP_NFT_TABLE, "ipv4_addr", "ip"));
+    if (!ok)
+    {
+        nft_ctx_free (nft);
+        nft = NULL;
+    }
+    else
+    {
+        installed = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+
+        /* IPv4 mappings still work if the kernel has no IPv6 NAT */
+        if (run_nft ("add table " PCP_NFT_TABLE6 "\n"
+                     "delete table " PCP_NFT_TABLE6 "\n"
+                     PCP_NFT_RULESET (PCP_NFT_TABLE6, "ipv6_addr", "ip6")))
+        {
+            installed6 = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, free);
+        }
+        else
+        {
+            syslog (LOG_WARNING, "nftables IPv6 NAT is unavailable, IPv6 mappings are disabled");
+        }
+    }
+
+    pthread_mutex_unlock (&nft_lock);
+    return ok;
+}
+
+/**
+ * @brief nftables_deinit - Remove the PCP tables
+ */
+static void
+nftables_deinit (void)
+{
+    pthread_mutex_lock (&nft_lock);
+
+    if (nft)
+    {
+        run_nft ("delete table " PCP_NFT_TABLE "\n");
+        if (installed6)
+        {
+            run_nft ("delete table " PCP_NFT_TABLE6 "\n");
+        }
+        nft_ctx_free (nft);
+        nft = NULL;
+    }
+    if (installed)
+    {
+        g_hash_table_destroy (installed);
+        installed = NULL;
+    }
+    if (installed6)
+    {
+        g_hash_table_destroy (installed6);
+        installed6 = NULL;
+    }
+
+    pthread_mutex_unlock (&nft_lock);
+}
+
+/**
+ * @brief nftables_add - Add the elements for a mapping and remember them
+ * @param index - The rule ID
+ * @param mapping - The mapping, which is freed on failure
+ * @param ipv6 - True to add to the IPv6 table
+ * @return - True on success, else false
+ */
+static bool
+nftables_add (int index, nft_mapping *mapping, bool ipv6)
+{
+    char cmd[NFT_CMD_SIZE] = { '\0' };
+    GHashTable *table;
+    bool ok = false;
+
+    if (format_elements (cmd, "add", mapping))
+    {
+        pthread_mutex_lock (&nft_lock);
+        table = ipv6 ? installed6 : installed;
+        if (nft && table && run_nft (cmd))
+        {
+            g_hash_table_replace (table, GINT_TO_POINTER (index), mapping);
+            ok = true;
+        }
+        pthread_mutex_unlock (&nft_lock);
+    }
+
+    if (!ok)
+    {
+        free (mapping);
+    }
+    return ok;
+}
+
+/**
+ * @brief nftables_delete - Delete the elements remembered for a mapping
+ * @param index - The rule ID
+ * @param ipv6 - True to delete from the IPv6 table
+ * @return - True on success, else false
+ */
+static bool
+nftables_delete (int index, bool ipv6)
+{
+    char cmd[NFT_CMD_SIZE] = { '\0' };
+    nft_mapping *mapping;
+    GHashTable *table;
+    bool ok = false;
+
+    pthread_mutex_lock (&nft_lock);
+
+    table = ipv6 ? installed6 : installed;
+    mapping = table ? g_hash_table_lookup (table, GINT_TO_POINTER (index)) : NULL;
+    if (mapping == NULL)
+    {
+        /* Nothing was installed, e.g. the mapping predates the table */
+        ok = true;
+    }
+    else if (format_elements (cmd, "delete", mapping) && run_nft (cmd))
+    {
+        g_hash_table_remove (table, GINT_TO_POINTER (index));
+        ok = true;
+    }
+
+    pthread_mutex_unlock (&nft_lock);
+    return ok;
+}
+
+/**
+ * @brief nftables_write - Add the map and set elements for a mapping
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, else false
+ */
+static bool
+nftables_write (int index,
+                struct in_addr *internal_ip,
+                struct in_addr *external_ip,
+                u_int16_t internal_port,
+                u_int16_t external_port,
+                u_int16_t protocol)
+{
+    nft_mapping *mapping;
+
+    mapping = calloc (1, sizeof (nft_mapping));
+    if (mapping == NULL)
+    {
+        return false;
+    }
+    mapping->table = PCP_NFT_TABLE;
+    mapping->internal_port = internal_port;
+    mapping->external_port = external_port;
+    mapping->protocol = protocol;
+
+    if (!inet_ntop (AF_INET, internal_ip, mapping->internal_ip, INET6_ADDRSTRLEN) ||
+        !inet_ntop (AF_INET, external_ip, mapping->external_ip, INET6_ADDRSTRLEN))
+    {
+        free (mapping);
+        return false;
+    }
+
+    return nftables_add (index, mapping, false);
+}
+
+/**
+ * @brief nftables_remove - Delete the map and set elements for a mapping
+ * @param index - The rule ID
+ * @return - True on success, else false
+ */
+static bool
+nftables_remove (int index)
+{
+    return nftables_delete (index, false);
+}
+
+/**
+ * @brief nftables_write6 - Add the map and set elements for an IPv6 mapping
+ * @param index - The rule ID
+ * @param internal_ip - Internal address
+ * @param external_ip - External address
+ * @param internal_port - Internal port
+ * @param external_port - External port
+ * @param protocol - Protocol
+ * @return - True on success, false on failure or if there is no IPv6 table
+ */
+static bool
+nftables_write6 (int index,
+                 struct in6_addr *internal_ip,
+                 struct in6_addr *external_ip,
+                 u_int16_t internal_port,
+                 u_int16_t external_port,
+                 u_int16_t protocol)
+{
+    nft_mapping *mapping;
+
+    mapping = calloc (1, sizeof (nft_mapping));
+    if (mapping == NULL)
+    {
+        return false;
+    }
+    mapping->table = PCP_NFT_TABLE6;
+    mapping->internal_port = internal_port;
+    mapping->external_port = external_port;
+    mapping->protocol = protocol;
+
+    if (!inet_ntop (AF_INET6, internal_ip, mapping->internal_ip, INET6_ADDRSTRLEN) ||
+        !inet_ntop (AF_INET6, external_ip, mapping->external_ip, INET6_ADDRSTRLEN))
+    {
+        free (mapping);
+        return false;
+    }
+
+    return nftables_add (index, mapping, true);
+}
+
+/**
+ * @brief nftables_remove6 - Delete the map and set elements for an IPv6 mapping
+ * @param index - The rule ID
+ * @return - True on success, else false
+ */
+static bool
+nftables_remove6 (int index)
+{
+    return nftables_delete (index, true);
+}
+
+const pcp_fw_backend pcp_nftables_backend = {
+    .name = "nftables",
+    .init = nftables_init,
+    .deinit = nftables_deinit,
+    .write = nftables_write,
+    .remove = nftables_remove,
+    .write6 = nftables_write6,
+    .remove6 = nftables_remove6,
+};
+
+#endif /* HAVE_LIBNFTABLES */
@@ -0,0 +1,76 @@
+/**
+ * @file pcp_stats.c
+ *
+ * Print the metrics of a running pcpd. They are read from pcpd's shared
+ * memory segment, so pcpd is not interrupted.
+ *
+ * usage: pcp-stats [-i SECONDS]
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pcp_metrics.h"
+
+int
+main (int argc, char *argv[])
+{
+    const pcp_metrics_segment *segment;
+    pcp_metrics_totals totals;
+    int interval = 0;
+    int opt;
+
+    while ((opt = getopt (argc, argv, "i:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "usage: pcp-stats [-i SECONDS]\n\n"
+                     "Print the metrics of the running pcpd, every SECONDS if given.\n");
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    segment = pcp_metrics_attach ();
+    if (segment == NULL)
+    {
+        fprintf (stderr, "pcpd is not running or its metrics are a different version\n");
+        return EXIT_FAILURE;
+    }
+
+    do
+    {
+        pcp_metrics_snapshot (segment, &totals);
+        if (pcp_metrics_print (stdout, &totals) < 0)
+        {
+            break;
+        }
+        fflush (stdout);
+    }
+    while (interval > 0 && sleep (interval) == 0);
+
+    pcp_metrics_detach (segment);
+    return EXIT_SUCCESS;
+}
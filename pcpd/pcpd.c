@@ -22,17 +22,22 @@
  *
  */
 
+#include <errno.h>
 #include <getopt.h>
 #include <glib.h>
+#include <limits.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <netinet/in.h>
@@ -40,17 +45,52 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include "expiry_heap.h"
+#include "external_port_pool.h"
 #include "libpcp.h"
+#include "mapping_id_pool.h"
+#include "mapping_table.h"
 #include "packets_pcp.h"
+#include "packets_pcp_options.h"
 #include "packets_pcp_serialization.h"
+#include "pcp_announce.h"
+#include "pcp_control.h"
+#include "pcp_export.h"
 #include "pcp_iptables.h"
+#include "pcp_metrics.h"
+#include "pcpd.h"
 
 
 #define PCPD_PID_PATH "/var/run/pcpd.pid"
 #define OUTPUT_BUF_SIZE 2048
 #define SMALL_BUF_SIZE 32
 
+/* Buffer used when writing the state output to a file */
+#define STATE_OUTPUT_BUF_SIZE (64 * 1024)
+
+/* Number of datagrams drained per wakeup in batched I/O mode. A batch
+ * size of 1 uses the original recvfrom/sendto loop. */
+#define DEFAULT_BATCH_SIZE 1
+#define MAX_BATCH_SIZE 256
+
+/* Number of request-path workers, each owning its own SO_REUSEPORT socket */
+#define DEFAULT_WORKERS 1
+#define MAX_WORKERS 64
+
+/* Requests for the same internal endpoint are serialized on one of these
+ * locks so concurrent workers cannot create duplicate mappings */
+#define REQUEST_LOCK_STRIPES 64
+
+/* Mapping IDs are handed out in steps of this size */
+#define MAPPING_ID_STEP 10
+#define MAXIMUM_MAPPING_ID INT_MAX
+
+/* The saved mapping ID high-water mark is kept this far ahead of the IDs
+ * handed out, so it only needs writing to Apteryx once per this many IDs */
+#define MAPPING_ID_SAVE_AHEAD (1024 * MAPPING_ID_STEP)
+
 /* Short lifetime errors use a 30-second lifetime and
  * long lifetime errors use a 30-minute lifetime. */
 #define SHORT_LIFETIME_ERROR 30
@@ -65,13 +105,26 @@ typedef enum
     EXTEND_MAPPING_SUCCESS,
     EXTEND_MAPPING_FAILED,
     INVALID_MAPPING_REQUEST,
-    IPV6_UNSUPPORTED,       // TODO: Remove once implemented
-    // TODO: Other cases e.g. no resources, excessive peers, network failure, etc.
+    ADDRESS_FAMILY_UNSUPPORTED, // IPv4 to IPv6 or no IPv6 forwarding available
+    NONCE_MISMATCH,             // The connection has a PEER mapping with another nonce
+    EXTERNAL_PORT_UNAVAILABLE,  // PREFER_FAILURE was given and the suggested port is taken
+    NO_EXTERNAL_PORTS,          // Every external port of the address is in use
+    NO_MAPPING_IDS,             // Every mapping ID is in use
+    ADD_MAPPING_FAILED,         // The port forwarding or the mapping could not be stored
+    // TODO: Other cases e.g. excessive peers, etc.
 } create_mapping_result;
 
 /* Long version of argument options */
 static struct option long_options[] = {
     { "output", required_argument, NULL, 'o' },
+    { "batch-size", required_argument, NULL, 'b' },
+    { "workers", required_argument, NULL, 'w' },
+    { "affinity", no_argument, NULL, 'a' },
+    { "backend", required_argument, NULL, 'f' },
+    { "format", required_argument, NULL, 'F' },
+    { "control", required_argument, NULL, 'c' },
+    { "announce-rate", required_argument, NULL, 'A' },
+    { "port-range", required_argument, NULL, 'r' },
     { "help", no_argument, NULL, 'h' },
     { NULL, 0, NULL, 0 }
 };
@@ -80,6 +133,14 @@ static struct option long_options[] = {
 typedef struct _pcp_config
 {
     char *output_path;
+    char *control_path;
+    pcp_export_format output_format;
+    int batch_size;
+    int workers;
+    bool affinity;
+    u_int32_t announce_rate;
+    u_int16_t min_external_port;
+    u_int16_t max_external_port;
     bool pcp_enabled;
     bool map_support;
     bool peer_support;
@@ -93,32 +154,134 @@ typedef struct _pcp_config
 } pcp_config;
 
 
-/* Global config struct */
-pcp_config config;
+/* Batched receive statistics, used to report the average batch fill. Each
+ * worker updates its own and the state dump reads them, so all accesses are
+ * relaxed atomics. */
+typedef struct _batch_stats
+{
+    u_int64_t batches;          // Number of recvmmsg calls that returned data
+    u_int64_t packets;          // Number of datagrams received by those calls
+    u_int64_t responses;        // Number of responses flushed with sendmmsg
+} batch_stats;
+
+/* Per-slot storage for batched datagram I/O */
+typedef struct _pkt_batch
+{
+    int size;
+    unsigned char (*bufs)[MAX_PAYLOAD_LEN + 1];
+    struct sockaddr_storage *addrs;
+    struct iovec *recv_iov;
+    struct iovec *send_iov;
+    struct mmsghdr *recv_msgs;
+    struct mmsghdr *send_msgs;
+} pkt_batch;
+
+/* A request-path worker servicing its own socket */
+typedef struct _pcpd_worker
+{
+    int id;
+    int sock;
+    int cpu;                    // CPU the worker is pinned to, or -1
+    pthread_t thread;
+    pkt_batch *batch;
+    batch_stats stats;
+} pcpd_worker;
+
+/* Everything the state output shows, copied so that it can be written out
+ * without holding any locks */
+typedef struct _pcp_state_snapshot
+{
+    pcp_config config;
+    u_int32_t now;
+    int num_workers;
+    u_int64_t batches;
+    u_int64_t packets;
+    int num_mappings;
+    struct pcp_mapping_s *mappings;
+    pcp_metrics_totals metrics;
+} pcp_state_snapshot;
+
+
+/* Global config struct. The external port range is set here as well as
+ * being an option, so it is valid without process_arguments. */
+pcp_config config = {
+    .min_external_port = DEFAULT_MIN_EXTERNAL_PORT,
+    .max_external_port = DEFAULT_MAX_EXTERNAL_PORT,
+};
+
+/* Request-path workers */
+pcpd_worker workers[MAX_WORKERS];
+int num_workers = 0;
 
-/* Global list of all current mappings */
-GList *mappings = NULL;
+/* Global table of all current mappings */
+mapping_table *mappings = NULL;
 
 /* Thread variables */
 pthread_t mapping_thread;
-static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t state_dump_thread;
+
+/* Posted by the SIGUSR1 handler to wake the state dump thread */
+static sem_t state_dump_sem;
+
+/* Posted by the SIGINT and SIGTERM handler to wake the main thread, which
+ * stops the other threads before tearing down */
+static sem_t shutdown_sem;
 
+/* Set by the main thread to tell the other threads to finish */
+static bool pcpd_stopping = false;
+
+/* mapping_lock guards the mappings table and the mappings in it. Workers only
+ * take it for reading; the Apteryx callbacks take it for writing. */
+static pthread_rwlock_t mapping_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t request_locks[REQUEST_LOCK_STRIPES];
+
+/* mapping_id_lock guards the mapping ID pool and the saved high-water mark */
+static mapping_id_pool *mapping_ids = NULL;
+static int saved_mapping_id_high_water = 0;
+static pthread_mutex_t mapping_id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* external_port_lock guards the external port pool. It may be taken while
+ * holding mapping_lock, but not the other way around. */
+static external_port_pool *external_ports = NULL;
+static pthread_mutex_t external_port_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* expiry_lock guards the expiry heap. expiry_cond is signalled when the earliest
+ * deadline moves so the expiry thread can recompute how long to sleep. It is
+ * never held while taking mapping_lock. */
+static expiry_heap *expiry = NULL;
+static pthread_mutex_t expiry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expiry_cond = PTHREAD_COND_INITIALIZER;
+
+/* Mark the ID of a mapping written by someone else as in use */
+static bool
+claim_mapping_id (pcp_mapping mapping, void *data)
+{
+    pthread_mutex_lock (&mapping_id_lock);
+    mapping_id_pool_claim (mapping_ids, mapping->index);
+    pthread_mutex_unlock (&mapping_id_lock);
+    return true;
+}
+
+static bool
+print_mapping (pcp_mapping mapping, void *data)
+{
+    pcp_mapping_print (mapping);
+    return true;
+}
 
 /** TODO: Remove */
 void
 print_mappings_debug (void)
 {
     puts("\n printing all mappings from apteryx");
-    GList *apteryx_mappings = pcp_mapping_getall ();
-    pcp_mapping_printall (apteryx_mappings);
-    g_list_free_full (apteryx_mappings, (GDestroyNotify) pcp_mapping_destroy);
+    pcp_mapping_foreach (print_mapping, NULL);
     puts(" end printing all mappings from apteryx\n");
 
-    pthread_mutex_lock (&mapping_lock);
+    pthread_rwlock_rdlock (&mapping_lock);
     puts("\n printing all mappings from local list");
-    pcp_mapping_printall (mappings);
+    mapping_table_foreach (mappings, print_mapping, NULL);
     puts(" end printing all mappings from local list\n");
-    pthread_mutex_unlock (&mapping_lock);
+    pthread_rwlock_unlock (&mapping_lock);
 }
 
 /**
@@ -128,11 +291,32 @@ void
 usage (void)
 {
     fprintf (stdout, "pcpd, a port control protocol daemon\n\n"
-             "usage:\tpcpd [-o OUTPUT_FILE]\n\n"
+             "usage:\tpcpd [-o OUTPUT_FILE] [-F FORMAT] [-b BATCH_SIZE] [-w WORKERS] [-a]\n"
+             "\t[-f BACKEND] [-c CONTROL_SOCKET] [-A ANNOUNCE_RATE] [-r MIN-MAX]\n\n"
              "(Below text not updated)\n\n"
              "Without a specified config file, configuration\n"
              "will be locked to default.\n"
-             "Output file is where to dump current pcpd information.\n\n");
+             "Output file is where to dump current pcpd information.\n"
+             "Format is text (the default), or json or binary for tools\n"
+             "that read large mapping tables.\n"
+             "Control socket is the Unix socket that answers queries\n"
+             "(default %s).\n"
+             "Batch size is the number of datagrams received and sent per\n"
+             "system call (1-%d, default %d).\n"
+             "Workers is the number of request threads, each with its own\n"
+             "SO_REUSEPORT socket (1-%d, default %d). With -a each worker\n"
+             "is pinned to its own CPU.\n"
+             "Backend is how port forwarding is programmed, one of: %s\n"
+             "(default %s).\n"
+             "Announce rate is the most unsolicited ANNOUNCE responses sent\n"
+             "per second to clients with mappings after startup (0-%d,\n"
+             "default %d). 0 sends them to the all-nodes groups only.\n"
+             "MIN-MAX is the range of external ports given to mappings\n"
+             "(default %d-%d). A suggested port outside it is not used.\n\n",
+             PCP_CONTROL_SOCKET_PATH, MAX_BATCH_SIZE, DEFAULT_BATCH_SIZE, MAX_WORKERS, DEFAULT_WORKERS,
+             pcp_fw_backend_names (), pcp_fw_backend_get ()->name,
+             PCP_ANNOUNCE_MAX_RATE, PCP_ANNOUNCE_DEFAULT_RATE,
+             DEFAULT_MIN_EXTERNAL_PORT, DEFAULT_MAX_EXTERNAL_PORT);
 }
 
 /**
@@ -150,7 +334,7 @@ check_error (int n, const char *msg)
 }
 
 static int
-write_mapping (pcp_mapping mapping, FILE *target)
+write_mapping (pcp_mapping mapping, u_int32_t now, FILE *target)
 {
     int n = -1;
 
@@ -163,12 +347,13 @@ write_mapping (pcp_mapping mapping, FILE *target)
 
         time_t start_of_life_time_t = (time_t) mapping->start_of_life;
         time_t end_of_life_time_t = (time_t) mapping->end_of_life;
+        struct tm tm;
 
-        struct tm *start_of_life_tm = localtime (&start_of_life_time_t);
-        strftime (start_of_life_str, TIME_BUF_SIZE, DATE_TIME_FORMAT, start_of_life_tm);
+        localtime_r (&start_of_life_time_t, &tm);
+        strftime (start_of_life_str, TIME_BUF_SIZE, DATE_TIME_FORMAT, &tm);
 
-        struct tm *end_of_life_tm = localtime (&end_of_life_time_t);
-        strftime (end_of_life_str, TIME_BUF_SIZE, DATE_TIME_FORMAT, end_of_life_tm);
+        localtime_r (&end_of_life_time_t, &tm);
+        strftime (end_of_life_str, TIME_BUF_SIZE, DATE_TIME_FORMAT, &tm);
 
         inet_ntop (AF_INET6, &(mapping->internal_ip.s6_addr), internal_ip_str, INET6_ADDRSTRLEN);
         inet_ntop (AF_INET6, &(mapping->external_ip.s6_addr), external_ip_str, INET6_ADDRSTRLEN);
@@ -182,7 +367,7 @@ write_mapping (pcp_mapping mapping, FILE *target)
                      "       %-19.18s: %u\n"
                      "       %-19.18s: %s\n"
                      "       %-19.18s: %s\n"
-                     "       %-19.18s: %u\n\n",
+                     "       %-19.18s: %u\n",
                      (mapping->opcode == MAP_OPCODE) ? "MAP mapping ID" : "PEER mapping ID",
                      mapping->index,
                      "Mapping nonce",
@@ -198,40 +383,129 @@ write_mapping (pcp_mapping mapping, FILE *target)
                       "Lifetime",
                       mapping->lifetime,
                       "Lifetime remaining",
-                      pcp_mapping_remaining_lifetime_get (mapping),
+                      mapping->end_of_life > now ? mapping->end_of_life - now : 0,
                       "First requested",
                       start_of_life_str,
                      "Expiry date/time",
                       end_of_life_str,
                       "Protocol",
                       mapping->protocol);
+        if (n >= 0 && mapping->opcode == PEER_OPCODE)
+        {
+            inet_ntop (AF_INET6, &(mapping->remote_peer_ip.s6_addr), external_ip_str,
+                       INET6_ADDRSTRLEN);
+            n += fprintf (target, "       %-19.18s: [%s]:%u\n",
+                          "Remote peer IP:port", external_ip_str, mapping->remote_peer_port);
+        }
+        if (n >= 0)
+        {
+            n += fprintf (target, "\n");
+        }
     }
     return n;
 }
 
+static bool
+copy_mapping_cb (pcp_mapping mapping, void *data)
+{
+    pcp_state_snapshot *snapshot = (pcp_state_snapshot *) data;
+    struct pcp_mapping_s *copy = &snapshot->mappings[snapshot->num_mappings++];
+
+    *copy = *mapping;
+    copy->path = NULL;
+    return true;
+}
+
 /**
- * @brief write_pcp_state_to_file - Write PCP state to target file.
+ * @brief take_state_snapshot - Copy the state shown by the state output. The
+ *          mapping table is copied in one pass under mapping_lock, so the
+ *          mappings are consistent with each other.
  * @param config - PCP config struct.
+ * @param with_mappings - Copy the mappings, not just count them
+ * @return - The snapshot, to be freed with free_state_snapshot, or NULL if out of memory
+ */
+static pcp_state_snapshot *
+take_state_snapshot (pcp_config *config, bool with_mappings)
+{
+    pcp_state_snapshot *snapshot;
+    int i;
+
+    snapshot = calloc (1, sizeof (pcp_state_snapshot));
+    if (snapshot == NULL)
+        return NULL;
+
+    snapshot->config = *config;
+    snapshot->num_workers = num_workers;
+    for (i = 0; i < num_workers; i++)
+    {
+        snapshot->batches += __atomic_load_n (&workers[i].stats.batches, __ATOMIC_RELAXED);
+        snapshot->packets += __atomic_load_n (&workers[i].stats.packets, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    snapshot->now = time (NULL);
+    if (!with_mappings)
+    {
+        snapshot->num_mappings = mapping_table_size (mappings);
+    }
+    else
+    {
+        snapshot->mappings = malloc ((mapping_table_size (mappings) + 1) *
+                                     sizeof (struct pcp_mapping_s));
+        if (snapshot->mappings != NULL)
+        {
+            mapping_table_foreach (mappings, copy_mapping_cb, snapshot);
+        }
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+
+    if (with_mappings && snapshot->mappings == NULL)
+    {
+        free (snapshot);
+        return NULL;
+    }
+
+    pcp_metrics_snapshot (NULL, &snapshot->metrics);
+    return snapshot;
+}
+
+static void
+free_state_snapshot (pcp_state_snapshot *snapshot)
+{
+    if (snapshot)
+    {
+        free (snapshot->mappings);
+        free (snapshot);
+    }
+}
+
+/**
+ * @brief write_state_snapshot - Write a state snapshot to target file. If the
+ *          mappings were not copied only their number is written.
+ * @param snapshot - The snapshot.
  * @param target - File to write to.
  * @return - Negative number on error.
  */
-int
-write_pcp_state_to_file (pcp_config *config, FILE *target)
+static int
+write_state_snapshot (pcp_state_snapshot *snapshot, FILE *target)
 {
+    pcp_config *config = &snapshot->config;
     int n;
+    int i;
 
     char startup_time_str[TIME_BUF_SIZE];
     time_t startup_epoch_time_t = (time_t) config->startup_epoch_time;
-    struct tm *startup_time_tm = localtime (&startup_epoch_time_t);
-
-    char *uptime_string;
+    struct tm startup_time_tm;
 
-    GList *elem;
-    pcp_mapping mapping = NULL;
+    char uptime_str[SMALL_BUF_SIZE];
+    u_int32_t uptime = snapshot->now > config->startup_epoch_time ?
+                       snapshot->now - config->startup_epoch_time : 0;
 
-    strftime (startup_time_str, TIME_BUF_SIZE, DATE_TIME_FORMAT, startup_time_tm);
+    localtime_r (&startup_epoch_time_t, &startup_time_tm);
+    strftime (startup_time_str, TIME_BUF_SIZE, DATE_TIME_FORMAT, &startup_time_tm);
 
-    uptime_string = get_uptime_string ();
+    snprintf (uptime_str, sizeof (uptime_str), "%u:%02u:%02u:%02u", uptime / 86400,
+              uptime / 3600 % 24, uptime / 60 % 60, uptime % 60);
 
     n = fprintf (target,
                  "PCP Config:\n"
@@ -270,15 +544,21 @@ write_pcp_state_to_file (pcp_config *config, FILE *target)
                  "PCP Server:\n"
                  "     %-36.35s: %s\n"
                  "     %-36.35s: %s\n"
-                 "     %-36.35s: %s\n",
+                 "     %-36.35s: %s\n"
+                 "     %-36.35s: %d\n"
+                 "     %-36.35s: %d\n"
+                 "     %-36.35s: %.2f\n",
                  "Server IP address", "something",
                  "Server startup time",
                  startup_time_str,
                  "Server uptime",
-                 uptime_string ? uptime_string : "Unknown - Out of memory");
-
-    if (uptime_string)
-        free (uptime_string);
+                 uptime_str,
+                 "Request workers",
+                 snapshot->num_workers,
+                 "Receive batch size",
+                 config->batch_size,
+                 "Average batch fill",
+                 snapshot->batches ? (double) snapshot->packets / snapshot->batches : 0.0);
 
     if (n < 0)
         return n;
@@ -287,25 +567,29 @@ write_pcp_state_to_file (pcp_config *config, FILE *target)
     if (n < 0)
         return n;
 
-    if (mappings)
+    if (snapshot->mappings == NULL)
+    {
+        n = fprintf (target, "     %-36.35s: %d\n", "Current mappings", snapshot->num_mappings);
+    }
+    else if (snapshot->num_mappings > 0)
     {
-        for (elem = mappings; elem; elem = elem->next)
+        for (i = 0; i < snapshot->num_mappings && n >= 0; i++)
         {
-            mapping = (pcp_mapping) elem->data;
-
-            n = write_mapping (mapping, target);
-
-            if (n < 0)
-                return n;
+            n = write_mapping (&snapshot->mappings[i], snapshot->now, target);
         }
     }
     else
     {
         n = fprintf (target, "     There are no current mappings\n");
-        if (n < 0)
-            return n;
     }
 
+    if (n < 0)
+        return n;
+
+    n = pcp_metrics_print (target, &snapshot->metrics);
+    if (n < 0)
+        return n;
+
     // TODO: Probably very similar to standard mappings
     n = fprintf (target,
                  "PCP Static Mappings:\n"
@@ -314,38 +598,163 @@ write_pcp_state_to_file (pcp_config *config, FILE *target)
     return n;
 }
 
+/**
+ * @brief export_state_snapshot - Write the mappings of a state snapshot in a
+ *          machine-readable format.
+ * @param snapshot - The snapshot.
+ * @param target - File to write to.
+ * @return - Negative number on error.
+ */
+static int
+export_state_snapshot (pcp_state_snapshot *snapshot, FILE *target)
+{
+    pcp_export_format format = snapshot->config.output_format;
+    pcp_export_header header;
+    int n;
+    int i;
+
+    header.now = snapshot->now;
+    header.startup_time = snapshot->config.startup_epoch_time;
+    header.num_mappings = snapshot->num_mappings;
+
+    n = pcp_export_write_header (target, format, &header);
+    for (i = 0; i < snapshot->num_mappings && n >= 0; i++)
+    {
+        n = pcp_export_write_mapping (target, format, &snapshot->mappings[i]);
+    }
+    return n;
+}
+
+/**
+ * @brief write_pcp_state_to_file - Write PCP state to target file.
+ * @param config - PCP config struct.
+ * @param target - File to write to.
+ * @return - Negative number on error.
+ */
+int
+write_pcp_state_to_file (pcp_config *config, FILE *target)
+{
+    pcp_state_snapshot *snapshot;
+    int n;
+
+    snapshot = take_state_snapshot (config, true);
+    if (snapshot == NULL)
+        return -1;
+
+    if (config->output_format == PCP_EXPORT_TEXT)
+        n = write_state_snapshot (snapshot, target);
+    else
+        n = export_state_snapshot (snapshot, target);
+    free_state_snapshot (snapshot);
+    return n;
+}
+
 /**
  * @brief write_pcp_state - Write current pcpd information to output file or
- *          stdout if not specified
+ *          stdout if not specified. The output file is written under a
+ *          temporary name and renamed into place, so readers never see a
+ *          partial file.
  * @param config - Current config
  */
 void
 write_pcp_state (pcp_config *config)
 {
-    FILE *target;
+    FILE *target = stdout;
+    char *temp_path = NULL;
+    int fd;
     int n;
 
     if (config->output_path != NULL)
     {
-        target = fopen (config->output_path, "w");
-        if (target == NULL)
+        if (asprintf (&temp_path, "%s.XXXXXX", config->output_path) < 0)
+        {
+            temp_path = NULL;
+        }
+        else if ((fd = mkstemp (temp_path)) < 0)
+        {
+            free (temp_path);
+            temp_path = NULL;
+        }
+        else if ((target = fdopen (fd, "w")) == NULL)
+        {
+            close (fd);
+            unlink (temp_path);
+            free (temp_path);
+            temp_path = NULL;
+        }
+        else
+        {
+            fchmod (fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+            setvbuf (target, NULL, _IOFBF, STATE_OUTPUT_BUF_SIZE);
+        }
+
+        if (temp_path == NULL)
         {
             syslog (LOG_ERR, "Failed to create file for PCP output");
             target = stdout;
         }
     }
-    else
-    {
-        target = stdout;
-    }
 
     n = write_pcp_state_to_file (config, target);
 
     if (n < 0)
         syslog (LOG_ERR, "Failed writing to PCP output file");
 
-    if (target != stdout && target != NULL)
-        fclose (target);
+    if (target == stdout)
+    {
+        fflush (stdout);
+        return;
+    }
+
+    if (fclose (target) != 0 || n < 0 || rename (temp_path, config->output_path) < 0)
+    {
+        syslog (LOG_ERR, "Failed to replace PCP output file");
+        unlink (temp_path);
+    }
+    free (temp_path);
+}
+
+/**
+ * @brief write_pcp_state_loop - Write the state output each time it is requested.
+ *          Requests that arrive during a dump are merged into the next one.
+ * @param arg - Unused
+ */
+static void *
+write_pcp_state_loop (void *arg)
+{
+    while (1)
+    {
+        if (sem_wait (&state_dump_sem) < 0)
+            continue;
+
+        while (sem_trywait (&state_dump_sem) == 0)
+            ;
+
+        if (__atomic_load_n (&pcpd_stopping, __ATOMIC_ACQUIRE))
+            break;
+
+        write_pcp_state (&config);
+    }
+    return NULL;
+}
+
+/**
+ * @brief start_state_dump_thread - Start the thread that writes the state output
+ *          on SIGUSR1. Must be called before the signal handlers are set up.
+ */
+static void
+start_state_dump_thread (void)
+{
+    if (sem_init (&state_dump_sem, 0, 0) < 0)
+    {
+        syslog (LOG_ERR, "Failed to create state dump semaphore");
+        exit (-1);
+    }
+    if (pthread_create (&state_dump_thread, NULL, write_pcp_state_loop, NULL) != 0)
+    {
+        syslog (LOG_ERR, "Failed to create state dump thread");
+        exit (-1);
+    }
 }
 
 /**
@@ -370,46 +779,26 @@ create_pcpd_pid_file (void)
     }
 }
 
-static void
-exit_pcpd (void)
-{
-    GList *elem;
-    pcp_mapping mapping = NULL;
-
-    pthread_cancel (mapping_thread);
-
-    /* Deregister callback (perform callback delete functions manually to avoid possibly
-     * exiting pcpd before callbacks successfully execute) */
-    pcp_register_cb (NULL);
-
-    for (elem = mappings; elem; elem = elem->next)
-    {
-        mapping = (pcp_mapping) elem->data;
-        remove_pcp_port_forwarding_chain (mapping->index);
-    }
-
-    pcp_iptables_deinit ();
-    g_list_free_full (mappings, (GDestroyNotify) pcp_mapping_destroy);
-    pcp_deinit ();
-
-    exit (EXIT_SUCCESS);
-}
-
 /**
- * @brief signal_handler - Signal handler that reloads the configuration or writes show output.
+ * @brief signal_handler - Signal handler that writes show output or stops pcpd.
  * @param signal - The received signal
  */
 static void
 signal_handler (int signal)
 {
+    int saved_errno = errno;
+
+    /* Only async-signal-safe calls here. The state dump thread and the main
+     * thread do the work. */
     if (signal == SIGUSR1)
     {
-        write_pcp_state (&config);
+        sem_post (&state_dump_sem);
     }
     if (signal == SIGINT || signal == SIGTERM)
     {
-        exit_pcpd ();
+        sem_post (&shutdown_sem);
     }
+    errno = saved_errno;
 }
 
 /**
@@ -420,6 +809,12 @@ setup_signal_handlers (void)
 {
     struct sigaction sigact;
 
+    if (sem_init (&shutdown_sem, 0, 0) < 0)
+    {
+        syslog (LOG_ERR, "Failed to create shutdown semaphore");
+        exit (-1);
+    }
+
     sigact.sa_handler = signal_handler;
     sigact.sa_flags = SA_RESTART;
     sigfillset (&sigact.sa_mask);
@@ -450,20 +845,83 @@ void
 process_arguments (int argc, char *argv[])
 {
     char *p, *cmdname;
-    int opt;
+    int opt, n, min_port, max_port, end;
 
     cmdname = *argv;
     if ((p = strrchr (cmdname, '/')) != NULL)
         cmdname = p + 1;
 
     config.output_path = NULL;
-    while ((opt = getopt_long (argc, argv, "o:h", long_options, NULL)) != EOF)
+    config.control_path = PCP_CONTROL_SOCKET_PATH;
+    config.output_format = PCP_EXPORT_TEXT;
+    config.batch_size = DEFAULT_BATCH_SIZE;
+    config.workers = DEFAULT_WORKERS;
+    config.affinity = false;
+    config.announce_rate = PCP_ANNOUNCE_DEFAULT_RATE;
+    while ((opt = getopt_long (argc, argv, "o:F:c:A:r:b:w:af:h", long_options, NULL)) != EOF)
     {
         switch (opt)
         {
         case 'o':
             config.output_path = optarg;
             break;
+        case 'F':
+            if (!pcp_export_format_parse (optarg, &config.output_format))
+            {
+                fprintf (stderr, "Format must be one of: text json binary\n");
+                exit (EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            config.control_path = optarg;
+            break;
+        case 'A':
+            n = atoi (optarg);
+            if (n < 0 || n > PCP_ANNOUNCE_MAX_RATE)
+            {
+                fprintf (stderr, "Announce rate must be between 0 and %d\n",
+                         PCP_ANNOUNCE_MAX_RATE);
+                exit (EXIT_FAILURE);
+            }
+            config.announce_rate = n;
+            break;
+        case 'r':
+            end = 0;
+            if (sscanf (optarg, "%d-%d%n", &min_port, &max_port, &end) != 2 ||
+                optarg[end] != '\0' || min_port < 1 || min_port > max_port || max_port > 65535)
+            {
+                fprintf (stderr, "Port range must be MIN-MAX with 1 <= MIN <= MAX <= 65535\n");
+                exit (EXIT_FAILURE);
+            }
+            config.min_external_port = min_port;
+            config.max_external_port = max_port;
+            break;
+        case 'b':
+            config.batch_size = atoi (optarg);
+            if (config.batch_size < 1 || config.batch_size > MAX_BATCH_SIZE)
+            {
+                fprintf (stderr, "Batch size must be between 1 and %d\n", MAX_BATCH_SIZE);
+                exit (EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            config.workers = atoi (optarg);
+            if (config.workers < 1 || config.workers > MAX_WORKERS)
+            {
+                fprintf (stderr, "Workers must be between 1 and %d\n", MAX_WORKERS);
+                exit (EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            config.affinity = true;
+            break;
+        case 'f':
+            if (!pcp_fw_backend_select (optarg))
+            {
+                fprintf (stderr, "Backend must be one of: %s\n", pcp_fw_backend_names ());
+                exit (EXIT_FAILURE);
+            }
+            break;
         case 'h':
             usage ();
             exit (EXIT_SUCCESS);
@@ -475,85 +933,503 @@ process_arguments (int argc, char *argv[])
 }
 
 /**
- * @brief setup_pcpd - Set up the PCP daemon.
+ * @brief open_server_socket - Open and bind a PCP server socket. The socket is
+ *          dual-stack, so IPv4 clients arrive with IPv4-mapped addresses,
+ *          unless the kernel has no IPv6 in which case it is IPv4 only.
+ * @param reuseport - Set SO_REUSEPORT so several workers can bind the same port
  * @return - Socket value for the server
  */
 int
-setup_pcpd (void)
+open_server_socket (bool reuseport)
 {
-    int length, n, sock;
+    int n, sock;
+    int one = 1;
+    int zero = 0;
+    bool ipv6 = true;
+    struct sockaddr_in6 server6;
     struct sockaddr_in server;
 
-    create_pcpd_pid_file ();
+    sock = socket (AF_INET6, SOCK_DGRAM, 0);
+    if (sock < 0 && errno == EAFNOSUPPORT)
+    {
+        syslog (LOG_WARNING, "IPv6 is unavailable, listening on IPv4 only");
+        ipv6 = false;
+        sock = socket (AF_INET, SOCK_DGRAM, 0);
+    }
 
-    setup_signal_handlers ();
+    check_error (sock, "Opening socket");
 
-    sock = socket (AF_INET, SOCK_DGRAM, 0);
+    if (reuseport)
+    {
+        n = setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one));
+        check_error (n, "SO_REUSEPORT");
+    }
 
-    check_error (sock, "Opening socket");
+    if (ipv6)
+    {
+        /* Accept IPv4 on the same socket whatever the system default */
+        n = setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof (zero));
+        check_error (n, "IPV6_V6ONLY");
 
-    length = sizeof (server);
-    memset (&server, 0, length);
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons (PCP_SERVER_LISTENING_PORT);
+        memset (&server6, 0, sizeof (server6));
+        server6.sin6_family = AF_INET6;
+        server6.sin6_addr = in6addr_any;
+        server6.sin6_port = htons (PCP_SERVER_LISTENING_PORT);
 
-    n = bind (sock, (struct sockaddr *) &server, length);
-    check_error (n, "binding");
+        n = bind (sock, (struct sockaddr *) &server6, sizeof (server6));
+    }
+    else
+    {
+        memset (&server, 0, sizeof (server));
+        server.sin_family = AF_INET;
+        server.sin_addr.s_addr = INADDR_ANY;
+        server.sin_port = htons (PCP_SERVER_LISTENING_PORT);
 
-    pcp_iptables_init ();
+        n = bind (sock, (struct sockaddr *) &server, sizeof (server));
+    }
+    check_error (n, "binding");
 
     return sock;
 }
 
-static bool
-compare_mapping_nonces (u_int32_t nonce1[MAPPING_NONCE_SIZE],
-                        u_int32_t nonce2[MAPPING_NONCE_SIZE])
+/**
+ * @brief setup_pcpd - Set up the PCP daemon and open one socket per worker.
+ */
+void
+setup_pcpd (void)
 {
     int i;
-    for (i = 0; i < MAPPING_NONCE_SIZE; i++)
+
+    create_pcpd_pid_file ();
+
+    start_state_dump_thread ();
+
+    setup_signal_handlers ();
+
+    num_workers = config.workers;
+    for (i = 0; i < num_workers; i++)
     {
-        if (nonce1[i] != nonce2[i])
-        {
-            return false;
-        }
+        workers[i].id = i;
+        workers[i].sock = open_server_socket (num_workers > 1);
+        workers[i].cpu = -1;
+        workers[i].batch = NULL;
+        memset (&workers[i].stats, 0, sizeof (batch_stats));
     }
-    return true;
-}
-
-static bool
-compare_ipv6_addresses (struct in6_addr *ip1, struct in6_addr *ip2)
-{
-    return memcmp (ip1, ip2, sizeof (struct in6_addr)) == 0;
-}
 
-static bool
-compare_map_request_to_mapping (map_request *map_req, pcp_mapping mapping)
-{
-    return compare_mapping_nonces (map_req->mapping_nonce, mapping->mapping_nonce) &&
-            compare_ipv6_addresses (&(map_req->header.client_ip), &(mapping->internal_ip)) &&
-            map_req->internal_port == mapping->internal_port &&
-            map_req->protocol == mapping->protocol;
+    pcp_iptables_init ();
 }
 
-pcp_mapping
-find_mapping_by_request (map_request *map_req)
+/**
+ * @brief find_mapping_by_request - Find the mapping matching a MAP request
+ * @param map_req - The MAP request
+ * @param result - Where to copy the mapping if found
+ * @return - True if a matching mapping was found
+ */
+bool
+find_mapping_by_request (map_request *map_req, pcp_mapping result)
 {
-    GList *elem;
     pcp_mapping mapping = NULL;
+    bool found = false;
 
-    for (elem = mappings; elem; elem = elem->next)
+    pthread_rwlock_rdlock (&mapping_lock);
+    mapping = mapping_table_find_request (mappings, map_req->mapping_nonce,
+                                          &map_req->header.client_ip,
+                                          map_req->internal_port, map_req->protocol);
+    if (mapping)
     {
-        mapping = (pcp_mapping) elem->data;
-        if (compare_map_request_to_mapping (map_req, mapping))
-        {
-            return mapping;
-        }
+        *result = *mapping;
+        result->path = NULL;
+        found = true;
     }
-    return NULL;
+    pthread_rwlock_unlock (&mapping_lock);
+    return found;
 }
 
-create_mapping_result
+/**
+ * @brief find_peer_mapping - Find the mapping for the connection of a PEER request
+ * @param peer_req - The PEER request
+ * @param result - Where to copy the mapping if found
+ * @return - True if a matching mapping was found
+ */
+static bool
+find_peer_mapping (peer_request *peer_req, pcp_mapping result)
+{
+    struct in6_addr internal_ip = peer_req->header.client_ip;
+    struct in6_addr remote_peer_ip = peer_req->remote_peer_ip;
+    pcp_mapping mapping = NULL;
+    bool found = false;
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    mapping = mapping_table_find_peer (mappings, &internal_ip,
+                                       peer_req->internal_port, &remote_peer_ip,
+                                       peer_req->remote_peer_port, peer_req->protocol);
+    if (mapping)
+    {
+        *result = *mapping;
+        result->path = NULL;
+        found = true;
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+    return found;
+}
+
+/**
+ * @brief find_mapping_by_internal - Find a mapping of an internal endpoint
+ * @param internal_ip - Internal IP address
+ * @param internal_port - Internal port
+ * @param protocol - Protocol
+ * @param result - Where to copy the mapping if found
+ * @return - True if a mapping was found
+ */
+static bool
+find_mapping_by_internal (struct in6_addr *internal_ip, u_int16_t internal_port,
+                          u_int8_t protocol, pcp_mapping result)
+{
+    pcp_mapping mapping = NULL;
+    bool found = false;
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    mapping = mapping_table_find_internal (mappings, internal_ip, internal_port, protocol);
+    if (mapping)
+    {
+        *result = *mapping;
+        result->path = NULL;
+        found = true;
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+    return found;
+}
+
+/**
+ * @brief request_lock_get - Get the lock serializing requests for an internal endpoint
+ * @param map_req - The MAP request
+ * @return - The lock for the request's internal IP, port and protocol
+ */
+static pthread_mutex_t *
+request_lock_get (map_request *map_req)
+{
+    u_int32_t hash = map_req->internal_port ^ (map_req->protocol << 16);
+    int i;
+
+    for (i = 0; i < sizeof (struct in6_addr); i++)
+    {
+        hash = hash * 31 + map_req->header.client_ip.s6_addr[i];
+    }
+    return &request_locks[hash % REQUEST_LOCK_STRIPES];
+}
+
+/**
+ * @brief init_pcpd_state - Create the local mapping state shared by the workers.
+ *          Must be called before the Apteryx callbacks are registered.
+ */
+void
+init_pcpd_state (void)
+{
+    int i;
+
+    mappings = mapping_table_new ((GDestroyNotify) pcp_mapping_destroy);
+    expiry = expiry_heap_new ();
+
+    external_ports = external_port_pool_new (config.min_external_port,
+                                             config.max_external_port);
+    if (external_ports == NULL)
+    {
+        syslog (LOG_ERR, "Could not create external port pool");
+        exit (EXIT_FAILURE);
+    }
+
+    for (i = 0; i < REQUEST_LOCK_STRIPES; i++)
+    {
+        pthread_mutex_init (&request_locks[i], NULL);
+    }
+}
+
+/**
+ * @brief init_mapping_ids - Create the mapping ID pool. IDs up to the
+ *          high-water mark saved by a previous run are reused, except those
+ *          of mappings still in Apteryx.
+ */
+void
+init_mapping_ids (void)
+{
+    mapping_ids = mapping_id_pool_new (MAPPING_ID_STEP, MAXIMUM_MAPPING_ID);
+    if (mapping_ids == NULL)
+    {
+        syslog (LOG_ERR, "Could not create mapping ID pool");
+        exit (EXIT_FAILURE);
+    }
+
+    saved_mapping_id_high_water = mapping_id_high_water_get ();
+    pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
+    if (saved_mapping_id_high_water > 0 &&
+        !mapping_id_pool_restore (mapping_ids, saved_mapping_id_high_water))
+    {
+        syslog (LOG_ERR, "Ignoring invalid mapping ID high-water mark %d",
+                saved_mapping_id_high_water);
+    }
+    pcp_mapping_foreach (claim_mapping_id, NULL);
+    pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
+}
+
+/**
+ * @brief reserve_mapping_id - Reserve a new mapping ID. The ID stays reserved
+ *          until it is released, so concurrent workers never receive the same
+ *          ID.
+ * @return - The reserved ID or -1 if none are available
+ */
+static int
+reserve_mapping_id (void)
+{
+    int index;
+
+    pthread_mutex_lock (&mapping_id_lock);
+    index = mapping_id_pool_alloc (mapping_ids);
+
+    /* Save the high-water mark before handing out an ID above it */
+    if (index > saved_mapping_id_high_water)
+    {
+        int high_water = index < MAXIMUM_MAPPING_ID - MAPPING_ID_SAVE_AHEAD ?
+                         index + MAPPING_ID_SAVE_AHEAD : MAXIMUM_MAPPING_ID;
+
+        high_water -= high_water % MAPPING_ID_STEP;
+        pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
+        if (mapping_id_high_water_set (high_water))
+        {
+            saved_mapping_id_high_water = high_water;
+        }
+        else
+        {
+            syslog (LOG_ERR, "Could not save mapping ID high-water mark %d", high_water);
+        }
+    }
+    pthread_mutex_unlock (&mapping_id_lock);
+    return index;
+}
+
+/**
+ * @brief release_mapping_id - Return a mapping ID so it can be reused
+ * @param index - The ID
+ */
+static void
+release_mapping_id (int index)
+{
+    pthread_mutex_lock (&mapping_id_lock);
+    mapping_id_pool_release (mapping_ids, index);
+    pthread_mutex_unlock (&mapping_id_lock);
+}
+
+/**
+ * @brief schedule_mapping_expiry - Schedule or reschedule the expiry of a mapping
+ * @param index - Index of the mapping
+ * @param end_of_life - Time the mapping expires
+ */
+static void
+schedule_mapping_expiry (int index, u_int32_t end_of_life)
+{
+    int first = -1;
+
+    pthread_mutex_lock (&expiry_lock);
+    if (!expiry_heap_schedule (expiry, index, end_of_life))
+    {
+        syslog (LOG_ERR, "Could not schedule expiry of mapping with ID %d", index);
+    }
+    /* Wake the expiry thread if this mapping is now the next to expire */
+    expiry_heap_peek (expiry, &first, NULL);
+    if (first == index)
+    {
+        pthread_cond_signal (&expiry_cond);
+    }
+    pthread_mutex_unlock (&expiry_lock);
+}
+
+/**
+ * @brief cancel_mapping_expiry - Stop tracking the expiry of a mapping
+ * @param index - Index of the mapping
+ */
+static void
+cancel_mapping_expiry (int index)
+{
+    pthread_mutex_lock (&expiry_lock);
+    expiry_heap_cancel (expiry, index);
+    pthread_mutex_unlock (&expiry_lock);
+}
+
+/**
+ * @brief update_mapping_lifetime - Update the lifetime of the local copy of a mapping
+ * @param index - Index of the mapping
+ * @param lifetime - The new lifetime
+ * @param end_of_life - The new end of life
+ */
+static void
+update_mapping_lifetime (int index, u_int32_t lifetime, u_int32_t end_of_life)
+{
+    pcp_mapping mapping;
+
+    schedule_mapping_expiry (index, end_of_life);
+
+    pthread_rwlock_wrlock (&mapping_lock);
+    mapping = mapping_table_find_index (mappings, index);
+    if (mapping)
+    {
+        mapping->lifetime = lifetime;
+        mapping->end_of_life = end_of_life;
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+}
+
+/**
+ * @brief reserve_external_port - Choose the external port of a new mapping and
+ *          mark it in use. The suggested port is used if it is free, or the
+ *          internal port if there is no suggestion.
+ * @param mapping - The mapping, holding the suggested external port. It is
+ *          replaced by the port chosen.
+ * @param prefer_failure - Fail rather than choose a port other than suggested
+ * @return - CREATE_MAPPING_SUCCESS, EXTERNAL_PORT_UNAVAILABLE or NO_EXTERNAL_PORTS
+ */
+static create_mapping_result
+reserve_external_port (pcp_mapping mapping, bool prefer_failure)
+{
+    u_int16_t suggested = mapping->external_port;
+    int port;
+
+    if (suggested == 0)
+    {
+        suggested = mapping->internal_port;
+        prefer_failure = false;
+    }
+
+    pthread_mutex_lock (&external_port_lock);
+    port = external_port_pool_alloc (external_ports, &mapping->external_ip, mapping->protocol,
+                                     suggested, prefer_failure);
+    pthread_mutex_unlock (&external_port_lock);
+
+    if (port < 0)
+    {
+        return prefer_failure ? EXTERNAL_PORT_UNAVAILABLE : NO_EXTERNAL_PORTS;
+    }
+    mapping->external_port = port;
+    return CREATE_MAPPING_SUCCESS;
+}
+
+/* Mark the external port of a mapping as in use. Mappings added by pcpd
+ * already hold their port. */
+static void
+claim_external_port (pcp_mapping mapping)
+{
+    pthread_mutex_lock (&external_port_lock);
+    external_port_pool_claim (external_ports, &mapping->external_ip, mapping->protocol,
+                              mapping->external_port);
+    pthread_mutex_unlock (&external_port_lock);
+}
+
+/* Return the external port of a mapping to the pool unless a mapping in the
+ * table still uses it. Must be called with mapping_lock held for writing. */
+static void
+release_external_port (pcp_mapping mapping)
+{
+    if (mapping_table_external_users (mappings, &mapping->external_ip, mapping->external_port,
+                                      mapping->protocol) > 0)
+    {
+        return;
+    }
+    pthread_mutex_lock (&external_port_lock);
+    external_port_pool_release (external_ports, &mapping->external_ip, mapping->protocol,
+                                mapping->external_port);
+    pthread_mutex_unlock (&external_port_lock);
+}
+
+/* Return the external port reserved for a mapping that could not be added */
+static void
+unreserve_external_port (pcp_mapping mapping)
+{
+    pthread_rwlock_wrlock (&mapping_lock);
+    release_external_port (mapping);
+    pthread_rwlock_unlock (&mapping_lock);
+}
+
+/**
+ * @brief store_local_mapping - Add or replace the local copy of a mapping and
+ *          schedule its expiry
+ * @param mapping - The mapping, which the mapping table takes ownership of
+ */
+static void
+store_local_mapping (pcp_mapping mapping)
+{
+    int index = mapping->index;
+    u_int32_t end_of_life = mapping->end_of_life;
+    struct pcp_mapping_s replaced;
+    pcp_mapping existing;
+    bool replacing;
+
+    /* Mappings added by pcpd already hold their ID */
+    claim_mapping_id (mapping, NULL);
+
+    /* A mapping that already exists has been refreshed, so it is replaced */
+    pthread_rwlock_wrlock (&mapping_lock);
+
+    existing = mapping_table_find_index (mappings, index);
+    replacing = existing != NULL;
+    if (replacing)
+    {
+        replaced = *existing;
+        replaced.path = NULL;
+    }
+    mapping_table_insert (mappings, mapping);
+    claim_external_port (mapping);
+
+    /* An update may have moved the mapping to another external port */
+    if (replacing &&
+        (replaced.external_port != mapping->external_port ||
+         replaced.protocol != mapping->protocol ||
+         !IN6_ARE_ADDR_EQUAL (&replaced.external_ip, &mapping->external_ip)))
+    {
+        release_external_port (&replaced);
+    }
+
+    pthread_rwlock_unlock (&mapping_lock);
+
+    schedule_mapping_expiry (index, end_of_life);
+}
+
+/**
+ * @brief remove_local_mapping - Remove the local copy of a mapping and its port
+ *          forwarding, and release its ID. Does nothing if there is no local
+ *          copy, so the request path and the Apteryx callback can both call it.
+ * @param index - Index of the mapping
+ */
+static void
+remove_local_mapping (int index)
+{
+    pcp_mapping mapping;
+
+    pthread_rwlock_wrlock (&mapping_lock);
+
+    mapping = mapping_table_steal (mappings, index);
+    if (mapping)
+    {
+        release_external_port (mapping);
+    }
+
+    pthread_rwlock_unlock (&mapping_lock);
+
+    if (mapping == NULL)
+    {
+        return;
+    }
+
+    if (!remove_pcp_port_forwarding_chain (index, &mapping->internal_ip))
+    {
+        syslog (LOG_ERR, "Removing mapping of index %d failed", index);
+    }
+    pcp_mapping_destroy (mapping);
+
+    cancel_mapping_expiry (index);
+
+    /* Only now is nothing left that uses the ID */
+    release_mapping_id (index);
+}
+
+create_mapping_result
 process_existing_mapping (pcp_mapping mapping, map_response *map_resp)
 {
     u_int32_t new_lifetime;
@@ -564,10 +1440,13 @@ process_existing_mapping (pcp_mapping mapping, map_response *map_resp)
     new_lifetime = map_resp->header.lifetime;
     new_end_of_life = time (NULL) + new_lifetime;
 
+    pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
     if (new_lifetime == 0)
     {
         if (pcp_mapping_delete (mapping->index))
         {
+            remove_local_mapping (mapping->index);
+            pcp_metrics_inc (PCP_METRIC_MAPPINGS_DELETED);
             ret = DELETE_MAPPING_SUCCESS;
         }
         else
@@ -578,8 +1457,8 @@ process_existing_mapping (pcp_mapping mapping, map_response *map_resp)
     }
     else if (pcp_mapping_refresh_lifetime (mapping->index, new_lifetime, new_end_of_life))
     {
-        mapping->lifetime = new_lifetime;
-        mapping->end_of_life = new_end_of_life;
+        update_mapping_lifetime (mapping->index, new_lifetime, new_end_of_life);
+        pcp_metrics_inc (PCP_METRIC_MAPPINGS_EXTENDED);
 
         // Put the existing mapping's external IP:port into the response
         map_resp->assigned_external_ip = mapping->external_ip;
@@ -591,95 +1470,246 @@ process_existing_mapping (pcp_mapping mapping, map_response *map_resp)
         ret = EXTEND_MAPPING_FAILED;
     }
 
-    usleep (25 * 1000);         // Give apteryx and callbacks time to run
-    puts("MAPPING EXISTS");     // TODO: remove
-    print_mappings_debug ();    // TODO: remove
-
     return ret;
 }
 
+/**
+ * @brief add_new_mapping - Choose the external port of a new mapping, write
+ *          its port forwarding and store it
+ * @param mapping - The mapping. Its index and start and end of life are set here.
+ * @param reserve_port - Choose the external port, starting from the one in
+ *          mapping. Otherwise the mapping shares the external endpoint of an
+ *          existing mapping.
+ * @param prefer_failure - Fail rather than choose another external port
+ * @return - ADDRESS_FAMILY_UNSUPPORTED if the mapping cannot be forwarded, the
+ *           result of reserve_external_port if no port could be chosen,
+ *           NO_MAPPING_IDS if every mapping ID is in use, ADD_MAPPING_FAILED
+ *           if the port forwarding or the mapping could not be stored,
+ *           otherwise CREATE_MAPPING_SUCCESS
+ */
+static create_mapping_result
+add_new_mapping (pcp_mapping mapping, bool reserve_port, bool prefer_failure)
+{
+    pcp_mapping new_mapping;
+    create_mapping_result ret;
+    bool ipv4 = is_ipv4_mapped_ipv6_addr (&mapping->internal_ip);
+    bool stored;
+
+    if (ipv4 != is_ipv4_mapped_ipv6_addr (&mapping->external_ip) ||
+        (!ipv4 && !pcp_fw_backend_ipv6 ()))
+    {
+        return ADDRESS_FAMILY_UNSUPPORTED;
+    }
+
+    /* A mapping of all ports has no external port to choose */
+    reserve_port = reserve_port && mapping->internal_port != 0;
+    if (reserve_port &&
+        (ret = reserve_external_port (mapping, prefer_failure)) != CREATE_MAPPING_SUCCESS)
+    {
+        return ret;
+    }
+
+    mapping->index = reserve_mapping_id ();
+
+    /* TODO: Move writing chain to callback function */
+    if (mapping->index < 0)
+    {
+        syslog (LOG_ERR, "No mapping IDs available");
+        if (reserve_port)
+        {
+            unreserve_external_port (mapping);
+        }
+        return NO_MAPPING_IDS;
+    }
+    if (!write_pcp_port_forwarding_chain (mapping->index, &mapping->internal_ip,
+                                          &mapping->external_ip, mapping->internal_port,
+                                          mapping->external_port, mapping->protocol))
+    {
+        release_mapping_id (mapping->index);
+        if (reserve_port)
+        {
+            unreserve_external_port (mapping);
+        }
+        syslog (LOG_ERR, "Could not add new mapping with nonce [%u %u %u]",
+                mapping->mapping_nonce[0], mapping->mapping_nonce[1],
+                mapping->mapping_nonce[2]);
+        return ADD_MAPPING_FAILED;
+    }
+
+    // Store the new mapping
+    pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
+    if (mapping->opcode == PEER_OPCODE)
+    {
+        stored = pcp_mapping_add_peer (mapping->index, mapping->mapping_nonce,
+                                       &mapping->internal_ip, mapping->internal_port,
+                                       &mapping->external_ip, mapping->external_port,
+                                       &mapping->remote_peer_ip, mapping->remote_peer_port,
+                                       mapping->lifetime, mapping->protocol);
+    }
+    else
+    {
+        stored = pcp_mapping_add (mapping->index, mapping->mapping_nonce,
+                                  &mapping->internal_ip, mapping->internal_port,
+                                  &mapping->external_ip, mapping->external_port,
+                                  mapping->lifetime, mapping->opcode, mapping->protocol);
+    }
+
+    if (!stored)
+    {
+        syslog (LOG_ERR, "Could not store mapping with ID %d", mapping->index);
+        remove_pcp_port_forwarding_chain (mapping->index, &mapping->internal_ip);
+        release_mapping_id (mapping->index);
+        if (reserve_port)
+        {
+            unreserve_external_port (mapping);
+        }
+        return ADD_MAPPING_FAILED;
+    }
+
+    if ((new_mapping = malloc (sizeof (*new_mapping))) != NULL)
+    {
+        /* Renewals find the mapping straight away rather than once the
+         * Apteryx callback has run */
+        *new_mapping = *mapping;
+        new_mapping->path = NULL;
+        new_mapping->start_of_life = time (NULL);
+        new_mapping->end_of_life = new_mapping->start_of_life + new_mapping->lifetime;
+        store_local_mapping (new_mapping);
+        pcp_metrics_inc (PCP_METRIC_MAPPINGS_CREATED);
+    }
+    return CREATE_MAPPING_SUCCESS;
+}
+
+/**
+ * @brief create_mapping - Create, refresh or delete the mapping of a MAP request
+ * @param map_resp - The MAP response, holding the validated lifetime. The
+ *          assigned external IP address and port are set here.
+ * @param map_req - The MAP request
+ * @param prefer_failure - The request has a PREFER_FAILURE option
+ * @return - The result
+ */
 create_mapping_result
-create_mapping (map_response *map_resp, map_request *map_req)
+create_mapping (map_response *map_resp, map_request *map_req, bool prefer_failure)
 {
-    pcp_mapping mapping;
+    struct pcp_mapping_s mapping;
     create_mapping_result ret = CREATE_MAPPING_SUCCESS;
-    int index;
+    pthread_mutex_t *request_lock = request_lock_get (map_req);
 
-    mapping = find_mapping_by_request (map_req);
-    if (mapping)
+    pthread_mutex_lock (request_lock);
+
+    if (find_mapping_by_request (map_req, &mapping))
     {
-        ret = process_existing_mapping (mapping, map_resp);
+        ret = process_existing_mapping (&mapping, map_resp);
     }
     else
     {
-        /* TODO:
-         * - Make mapping using values from the struct
-         * - Get info of mapping if successful, like assigned lifetime, ext port and ext ip address
-         *    (may be different to requested values)
-         * - Set result_code based on result
-         * Below are temporary values for these variables
-         */
-//        map_resp->header.lifetime = 9001;       // Lifetime of mapping or expected lifetime of resulting error
-//        map_resp->header.lifetime = 10;         // Short lifetime to test the lifetime check thread
-//        map_resp->assigned_external_port = 4321;
-//        struct in6_addr temp_ip = { { { 0x80, 0xfe, 0, 0, 0, 0, 0, 0,
-//                                        0x20, 0x20, 0xff, 0x3b, 0x2e, 0xef, 0x38, 0x29 } } };
-//        map_resp->assigned_external_ip = temp_ip;
-
-        struct in_addr temp_int_ip = { 0 };
-        struct in_addr temp_ext_ip = { 0 };
-
-        if (is_ipv4_mapped_ipv6_addr (&(map_req->header.client_ip)) &&
-                is_ipv4_mapped_ipv6_addr (&(map_resp->assigned_external_ip)))
+        /* Without NAT66 an IPv6 mapping is a pinhole to the client's own address,
+         * used when the client has no preference */
+        if (!is_ipv4_mapped_ipv6_addr (&(map_req->header.client_ip)) &&
+            IN6_IS_ADDR_UNSPECIFIED (&(map_resp->assigned_external_ip)))
+        {
+            map_resp->assigned_external_ip = map_req->header.client_ip;
+        }
+
+        memset (&mapping, 0, sizeof (mapping));
+        memcpy (mapping.mapping_nonce, map_resp->mapping_nonce, sizeof (mapping.mapping_nonce));
+        mapping.internal_ip = map_req->header.client_ip;
+        mapping.internal_port = map_resp->internal_port;
+        mapping.external_ip = map_resp->assigned_external_ip;
+        mapping.external_port = map_resp->assigned_external_port;
+        mapping.lifetime = map_resp->header.lifetime;
+        mapping.opcode = OPCODE (map_resp->header.r_opcode);
+        mapping.protocol = map_resp->protocol;
+        ret = add_new_mapping (&mapping, true, prefer_failure);
+        if (ret == CREATE_MAPPING_SUCCESS)
+        {
+            map_resp->assigned_external_port = mapping.external_port;
+        }
+    }
+
+    pthread_mutex_unlock (request_lock);
+
+    return ret;
+}
+
+/**
+ * @brief create_peer_mapping - Create, refresh or delete the mapping for the
+ *          connection of a PEER request. A refresh only changes the lifetime,
+ *          so the port forwarding is left alone.
+ * @param peer_resp - The PEER response, holding the validated lifetime
+ * @param peer_req - The PEER request
+ * @return - The result
+ */
+static create_mapping_result
+create_peer_mapping (peer_response *peer_resp, peer_request *peer_req)
+{
+    struct pcp_mapping_s mapping;
+    create_mapping_result ret = CREATE_MAPPING_SUCCESS;
+    pthread_mutex_t *request_lock = request_lock_get ((map_request *) peer_req);
+    bool shared;
+
+    pthread_mutex_lock (request_lock);
+
+    if (find_peer_mapping (peer_req, &mapping))
+    {
+        if (memcmp (mapping.mapping_nonce, peer_req->mapping_nonce,
+                    sizeof (mapping.mapping_nonce)) != 0)
         {
-                temp_int_ip = convert_ipv6_to_ipv4 (&(map_req->header.client_ip));
-                temp_ext_ip = convert_ipv6_to_ipv4 (&(map_resp->assigned_external_ip));
-
-                index = next_mapping_id ();
-
-                /* TODO: Move writing chain to callback function. Probably easier to do
-                 * once ip6tables is implemented (Only call add function then do
-                 * IPv6 to IPv4 conversion only if required in the write chain function) */
-                if (write_pcp_port_forwarding_chain (index,
-                                                     &temp_int_ip,
-                                                     &temp_ext_ip,
-                                                     map_req->internal_port,
-                                                     map_resp->assigned_external_port,
-                                                     map_resp->protocol))
-                {
-                    // Store the new mapping
-                    pcp_mapping_add (index,
-                                     map_resp->mapping_nonce,
-                                     &(map_req->header.client_ip),
-                                     map_resp->internal_port,
-                                     &(map_resp->assigned_external_ip),
-                                     map_resp->assigned_external_port,
-                                     map_resp->header.lifetime,
-                                     OPCODE (map_resp->header.r_opcode),
-                                     map_resp->protocol);
-
-                    print_mappings_debug (); // TODO: remove
-                }
-                else
-                {
-                    syslog (LOG_ERR,
-                            "Could not add new mapping with nonce [%u %u %u]",
-                            map_resp->mapping_nonce[0],
-                            map_resp->mapping_nonce[1],
-                            map_resp->mapping_nonce[2]);
-                }
+            ret = NONCE_MISMATCH;
         }
         else
         {
-            ret = IPV6_UNSUPPORTED;
+            /* A PEER response starts with the fields of a MAP response */
+            ret = process_existing_mapping (&mapping, (map_response *) peer_resp);
+        }
+    }
+    else if (peer_resp->header.lifetime > 0)
+    {
+        struct in6_addr client_ip = peer_req->header.client_ip;
+        struct in6_addr assigned_external_ip = peer_resp->assigned_external_ip;
+
+        /* The connection uses the external endpoint of any existing mapping
+         * of its internal endpoint */
+        shared = find_mapping_by_internal (&client_ip,
+                                           peer_req->internal_port, peer_req->protocol,
+                                           &mapping);
+        if (shared)
+        {
+            peer_resp->assigned_external_ip = mapping.external_ip;
+            peer_resp->assigned_external_port = mapping.external_port;
+        }
+        else if (!is_ipv4_mapped_ipv6_addr (&client_ip) &&
+                 IN6_IS_ADDR_UNSPECIFIED (&assigned_external_ip))
+        {
+            peer_resp->assigned_external_ip = peer_req->header.client_ip;
+        }
+
+        memset (&mapping, 0, sizeof (mapping));
+        memcpy (mapping.mapping_nonce, peer_resp->mapping_nonce, sizeof (mapping.mapping_nonce));
+        mapping.internal_ip = peer_req->header.client_ip;
+        mapping.internal_port = peer_resp->internal_port;
+        mapping.external_ip = peer_resp->assigned_external_ip;
+        mapping.external_port = peer_resp->assigned_external_port;
+        mapping.remote_peer_ip = peer_resp->remote_peer_ip;
+        mapping.remote_peer_port = peer_resp->remote_peer_port;
+        mapping.lifetime = peer_resp->header.lifetime;
+        mapping.opcode = PEER_OPCODE;
+        mapping.protocol = peer_resp->protocol;
+        ret = add_new_mapping (&mapping, !shared, false);
+        if (ret == CREATE_MAPPING_SUCCESS)
+        {
+            peer_resp->assigned_external_port = mapping.external_port;
         }
     }
+
+    pthread_mutex_unlock (request_lock);
+
     return ret;
 }
 
 /**
  * @brief get_error_lifetime - Get the lifetime of a result code error. Does not
- *          process SUCCESS or CANNOT_PROVIDE_EXTERNAL result codes.
+ *          process the SUCCESS result code.
  * @param result - Constant value for either a short or long lifetime error, or
  *          0 if not supported
  * @return - The error lifetime
@@ -694,6 +1724,7 @@ get_error_lifetime (result_code result)
     case NETWORK_FAILURE:
     case NO_RESOURCES:
     case USER_EX_QUOTA:
+    case CANNOT_PROVIDE_EXTERNAL:
         ret = SHORT_LIFETIME_ERROR;
         break;
 
@@ -739,52 +1770,211 @@ get_valid_lifetime (u_int32_t lifetime)
 }
 
 /**
- * @brief process_map_request - Process a MAP request and create MAP response
- * @param pkt_buf - Serialized MAP request buffer
- * @return - Serialized MAP response
+ * @brief get_epoch_time - Get the epoch time sent in responses, which counts
+ *          from when pcpd started. A client that sees it go backwards knows
+ *          that its mappings may have been lost.
+ * @return - Seconds since pcpd started
  */
-unsigned char *
-process_map_request (unsigned char *pkt_buf)
+static u_int32_t
+get_epoch_time (void)
 {
-    // TODO: New parameter to get the sender's IP address to compare with client IP in packet
-    unsigned char *ptr;
-    map_request *map_req;
-    map_response *map_resp;
-    create_mapping_result mapping_result;
+    u_int32_t now = time (NULL);
 
-    map_req = deserialize_map_request (pkt_buf);
-
-    map_resp = new_pcp_map_response (map_req);
-
-    map_resp->header.lifetime = get_valid_lifetime (map_resp->header.lifetime);
-    mapping_result = create_mapping (map_resp, map_req);
+    return now > config.startup_epoch_time ? now - config.startup_epoch_time : 0;
+}
 
+/**
+ * @brief set_mapping_error - Set the result code and lifetime of a response
+ *          after a failed mapping request
+ * @param header - Response header
+ * @param mapping_result - The result of the mapping request
+ */
+static void
+set_mapping_error (pcp_response_header *header, create_mapping_result mapping_result)
+{
     if (mapping_result == EXTEND_MAPPING_FAILED ||
         mapping_result == DELETE_MAPPING_FAILED)
     {
-        map_resp->header.result_code = NO_RESOURCES;
-        map_resp->header.lifetime = get_error_lifetime (map_resp->header.result_code);
+        header->result_code = NO_RESOURCES;
+        header->lifetime = get_error_lifetime (header->result_code);
     }
     else if (mapping_result == INVALID_MAPPING_REQUEST)
     {
-        map_resp->header.lifetime = get_error_lifetime (map_resp->header.result_code);
+        header->lifetime = get_error_lifetime (header->result_code);
+    }
+    else if (mapping_result == ADDRESS_FAMILY_UNSUPPORTED)
+    {
+        /* There is no result code for an unsupported address family, and
+         * translating between families is not supported. */
+        header->result_code = UNSUPP_PROTOCOL;
+        header->lifetime = get_error_lifetime (header->result_code);
+    }
+    else if (mapping_result == NONCE_MISMATCH)
+    {
+        header->result_code = NOT_AUTHORIZED;
+        header->lifetime = get_error_lifetime (header->result_code);
+    }
+    else if (mapping_result == EXTERNAL_PORT_UNAVAILABLE)
+    {
+        header->result_code = CANNOT_PROVIDE_EXTERNAL;
+        header->lifetime = get_error_lifetime (header->result_code);
+    }
+    else if (mapping_result == NO_EXTERNAL_PORTS ||
+             mapping_result == NO_MAPPING_IDS)
+    {
+        header->result_code = NO_RESOURCES;
+        header->lifetime = get_error_lifetime (header->result_code);
     }
-    else if (mapping_result == IPV6_UNSUPPORTED)
+    else if (mapping_result == ADD_MAPPING_FAILED)
     {
-        /* Temporary result code. Actually unsupp IP type since ipv6 unsupported
-         * at this time but this doesn't exist in RFC. */
-        map_resp->header.result_code = UNSUPP_PROTOCOL;
-        map_resp->header.lifetime = get_error_lifetime (map_resp->header.result_code);
+        header->result_code = NETWORK_FAILURE;
+        header->lifetime = get_error_lifetime (header->result_code);
     }
+}
+
+/**
+ * @brief parse_request_options - Parse the options after the opcode-specific
+ *          information of a request and check that pcpd can honour them
+ * @param options - Where to place the options
+ * @param pkt_buf - Serialized request buffer
+ * @param n - Length of the request
+ * @param body_len - Length of the request without options
+ * @return - SUCCESS, or the result code for an error response
+ */
+static result_code
+parse_request_options (pcp_options *options, unsigned char *pkt_buf, int n, int body_len)
+{
+    result_code result;
+
+    result = pcp_options_parse (options, OPCODE (get_r_opcode (pkt_buf)),
+                                pkt_buf + body_len, n - body_len);
+    if (result != SUCCESS)
+    {
+        return result;
+    }
+    if (options->third_party && !config.third_party_support)
+    {
+        return UNSUPP_OPTION;
+    }
+    if (options->num_filters > 0)
+    {
+        /* The forwarding backends cannot limit a mapping to some remote peers */
+        return UNSUPP_OPTION;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief process_map_request - Process a MAP request and create MAP response
+ * @param pkt_buf - Serialized MAP request buffer
+ * @param n - Length of the request, including options
+ * @return - Serialized MAP response
+ */
+unsigned char *
+process_map_request (unsigned char *pkt_buf, int n)
+{
+    // TODO: New parameter to get the sender's IP address to compare with client IP in packet
+    unsigned char *ptr;
+    map_request req;
+    map_response resp;
+    map_request *map_req = &req;
+    map_response *map_resp = &resp;
+    pcp_options options;
+    create_mapping_result mapping_result;
+    result_code result;
+
+    result = parse_request_options (&options, pkt_buf, n, MIN_MAP_PKT_LEN);
+    if (result != SUCCESS)
+    {
+        return process_error (pkt_buf, result);
+    }
+
+    /* Both packets live on the stack so no memory is allocated per request */
+    deserialize_map_request_into (map_req, pkt_buf);
+    if (options.third_party)
+    {
+        /* The mapping is made for the third party's address */
+        map_req->header.client_ip = options.third_party_ip;
+    }
+
+    init_pcp_map_response (map_resp, map_req);
+
+    map_resp->header.lifetime = get_valid_lifetime (map_resp->header.lifetime);
+    mapping_result = create_mapping (map_resp, map_req, options.prefer_failure);
+    set_mapping_error (&map_resp->header, mapping_result);
 
     // Done. Send the response
-    map_resp->header.epoch_time = time (NULL);
+    map_resp->header.epoch_time = get_epoch_time ();
     ptr = serialize_map_response (pkt_buf, map_resp);
 
-    free (map_req);
-    free (map_resp);
+    /* The options that were processed are returned */
+    return pcp_options_encode (ptr, pkt_buf + MAX_PAYLOAD_LEN, &options);
+}
 
-    return ptr;
+/**
+ * @brief process_peer_request - Process a PEER request and create PEER response
+ * @param pkt_buf - Serialized PEER request buffer
+ * @param n - Length of the request, including options
+ * @return - Serialized PEER response
+ */
+unsigned char *
+process_peer_request (unsigned char *pkt_buf, int n)
+{
+    unsigned char *ptr;
+    peer_request peer_req;
+    peer_response peer_resp;
+    pcp_options options;
+    create_mapping_result mapping_result;
+    result_code result;
+
+    result = parse_request_options (&options, pkt_buf, n, MIN_PEER_PKT_LEN);
+    if (result != SUCCESS)
+    {
+        return process_error (pkt_buf, result);
+    }
+
+    deserialize_peer_request_into (&peer_req, pkt_buf);
+    if (options.third_party)
+    {
+        peer_req.header.client_ip = options.third_party_ip;
+    }
+
+    init_pcp_peer_response (&peer_resp, &peer_req);
+
+    peer_resp.header.lifetime = get_valid_lifetime (peer_resp.header.lifetime);
+    mapping_result = create_peer_mapping (&peer_resp, &peer_req);
+    set_mapping_error (&peer_resp.header, mapping_result);
+
+    peer_resp.header.epoch_time = get_epoch_time ();
+    ptr = serialize_peer_response (pkt_buf, &peer_resp);
+
+    return pcp_options_encode (ptr, pkt_buf + MAX_PAYLOAD_LEN, &options);
+}
+
+/**
+ * @brief process_announce_request - Process an ANNOUNCE request. The response
+ *          carries only the epoch time, so a client can check whether pcpd
+ *          has restarted.
+ * @param pkt_buf - Serialized ANNOUNCE request buffer
+ * @param n - Length of the request, including options
+ * @return - Serialized ANNOUNCE response
+ */
+unsigned char *
+process_announce_request (unsigned char *pkt_buf, int n)
+{
+    pcp_response_header announce_resp;
+    pcp_options options;
+    result_code result;
+
+    /* No options are valid for ANNOUNCE, but unknown optional ones are ignored */
+    result = parse_request_options (&options, pkt_buf, n, MIN_ANNOUNCE_PKT_LEN);
+    if (result != SUCCESS)
+    {
+        return process_error (pkt_buf, result);
+    }
+
+    init_pcp_announce_response (&announce_resp, get_epoch_time ());
+    return serialize_response_header (pkt_buf, &announce_resp);
 }
 
 void
@@ -867,12 +2057,6 @@ startup_epoch_time (u_int32_t startup_time)
     config.startup_epoch_time = startup_time;
 }
 
-static int
-mapping_index_cmp (gconstpointer _a, gconstpointer _b)
-{
-    return ((pcp_mapping) _a)->index - ((pcp_mapping) _b)->index;
-}
-
 void
 new_pcp_mapping (int index,
                  u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
@@ -887,7 +2071,7 @@ new_pcp_mapping (int index,
                  u_int8_t protocol)
 {
     pcp_mapping mapping;
-    mapping = malloc (sizeof (*mapping));
+    mapping = calloc (1, sizeof (*mapping));
 
     mapping->path = NULL;
     mapping->index = index;
@@ -904,67 +2088,58 @@ new_pcp_mapping (int index,
     mapping->opcode = opcode;
     mapping->protocol = protocol;
 
-    pthread_mutex_lock (&mapping_lock);
-
-    mappings = g_list_insert_sorted (mappings, mapping, mapping_index_cmp);
-
-    pthread_mutex_unlock (&mapping_lock);
+    store_local_mapping (mapping);
 }
 
-static pcp_mapping
-pcp_mapping_get (int index)
+void
+new_pcp_peer_mapping (int index,
+                      u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                      struct in6_addr internal_ip,
+                      u_int16_t internal_port,
+                      struct in6_addr external_ip,
+                      u_int16_t external_port,
+                      struct in6_addr remote_peer_ip,
+                      u_int16_t remote_peer_port,
+                      u_int32_t lifetime,
+                      u_int32_t start_of_life,
+                      u_int32_t end_of_life,
+                      u_int8_t protocol)
 {
-    pcp_mapping temp_mapping = NULL;
-    pcp_mapping mapping = NULL;
-    GList *elem = NULL;
-
-    temp_mapping = malloc (sizeof (*temp_mapping));
-    temp_mapping->path = NULL;
-
-    temp_mapping->index = index;
-
-    elem = g_list_find_custom (mappings, temp_mapping, mapping_index_cmp);
-
-    if (elem && elem->data)
-    {
-        mapping = (pcp_mapping) elem->data;
-    }
+    pcp_mapping mapping;
+    mapping = calloc (1, sizeof (*mapping));
 
-    pcp_mapping_destroy (temp_mapping);
+    mapping->index = index;
+    memcpy (mapping->mapping_nonce, mapping_nonce, sizeof (mapping->mapping_nonce));
+    mapping->internal_ip = internal_ip;
+    mapping->internal_port = internal_port;
+    mapping->external_ip = external_ip;
+    mapping->external_port = external_port;
+    mapping->remote_peer_ip = remote_peer_ip;
+    mapping->remote_peer_port = remote_peer_port;
+    mapping->lifetime = lifetime;
+    mapping->start_of_life = start_of_life;
+    mapping->end_of_life = end_of_life;
+    mapping->opcode = PEER_OPCODE;
+    mapping->protocol = protocol;
 
-    return mapping;
+    store_local_mapping (mapping);
 }
 
 void
 delete_pcp_mapping (int index)
 {
-    if (!remove_pcp_port_forwarding_chain (index))
-    {
-        syslog (LOG_ERR, "Removing mapping of index %d failed", index);
-    }
-
-    pthread_mutex_lock (&mapping_lock);
-
-    pcp_mapping mapping = pcp_mapping_get (index);
-
-    if (mapping)
-    {
-        mappings = g_list_remove (mappings, mapping);
-
-        pcp_mapping_destroy (mapping);
-    }
-
-    pthread_mutex_unlock (&mapping_lock);
+    remove_local_mapping (index);
 }
 
 /**
  * @brief process_request - Process a valid PCP request
  * @param pkt_buf - Packet buffer
+ * @param n - Length of the request
  * @return - Pointer to the end of the next byte after the serialized response
  *           if successful or NULL if opcode is not supported is or disabled
  */
 unsigned char *
-process_request (unsigned char *pkt_buf)
+process_request (unsigned char *pkt_buf, int n)
 {
     packet_type type = get_packet_type (pkt_buf);
     unsigned char *ptr = NULL;
@@ -973,9 +2148,17 @@ process_request (unsigned char *pkt_buf)
     {
         /* TODO: Pass a parameter so actual IP received from can be compared to
          * internal IP stored in packet header for the ADDRESS_MISMATCH result code */
-        ptr = process_map_request (pkt_buf);
+        ptr = process_map_request (pkt_buf, n);
+    }
+    else if (type == PEER_REQUEST && config.peer_support == true)
+    {
+        ptr = process_peer_request (pkt_buf, n);
+    }
+    else if (type == ANNOUNCE_REQUEST)
+    {
+        /* The ANNOUNCE opcode cannot be disabled */
+        ptr = process_announce_request (pkt_buf, n);
     }
-    // TODO: PEER_REQUEST and ANNOUNCE_REQUEST (ANNOUNCE opcode is non-configurable)
     return ptr;
 }
 
@@ -989,12 +2172,13 @@ unsigned char *
 process_error (unsigned char *pkt_buf, result_code result)
 {
     unsigned char *ptr = NULL;
-    pcp_response_header *error_resp = new_pcp_error_response (
-                get_r_opcode (pkt_buf), result, get_error_lifetime (result));
+    pcp_response_header error_resp;
 
-    ptr = serialize_response_header (pkt_buf, error_resp);
+    init_pcp_error_response (&error_resp, get_r_opcode (pkt_buf), result,
+                             get_error_lifetime (result));
+    error_resp.epoch_time = get_epoch_time ();
 
-    free (error_resp);
+    ptr = serialize_response_header (pkt_buf, &error_resp);
 
     /* If it is desired to append the extra garbage in the error packet, set ptr to be
      * at the end of the packet. Maybe new parameter of pkt_buf size n and
@@ -1004,33 +2188,25 @@ process_error (unsigned char *pkt_buf, result_code result)
 }
 
 /**
- * @brief run_loop - The main loop
- * @param sock - Server socket number
+ * @brief build_response - Validate one received datagram and place the
+ *          response in the same buffer
+ * @param pkt_buf - Packet buffer of at least MAX_PAYLOAD_LEN + 1 bytes
+ * @param n - Number of bytes received
+ * @return - Length of the response in pkt_buf, or 0 if no response is to be sent
  */
-void
-run_loop (int sock)
+static int
+build_response (unsigned char *pkt_buf, int n)
 {
-    int n;
-    struct sockaddr_in from;
-    socklen_t fromlen = sizeof (struct sockaddr_in);
-    unsigned char pkt_buf[MAX_PAYLOAD_LEN + 1];
     unsigned char *ptr = NULL;
     result_code result = SUCCESS;
 
-    // TODO: Handle IPv6
-    /* Receive one more byte than the max size so that the error case of a packet being
-     * too large can be detected */
-    n = recvfrom (sock, pkt_buf, MAX_PAYLOAD_LEN + 1, 0, (struct sockaddr *) &from,
-                  &fromlen);
-    check_error (n, "recvfrom");
-
     result = validate_packet_buffer (pkt_buf, n);
 
     switch (result)
     {
     case RESULT_CODE_MAX:
         // Silently drop the packet
-        return;
+        return 0;
 
     case UNSUPP_VERSION:
         // TODO: Follow Version Negotiation steps in RFC pg29
@@ -1046,84 +2222,478 @@ run_loop (int sock)
 
     default:
         // Validation successful
-        ptr = process_request (pkt_buf);
+        ptr = process_request (pkt_buf, n);
         break;
     }
 
+    if (!ptr)
+    {
+        return 0;
+    }
+
+    // Packet processing was successful and a response was generated in pkt_buf
+    if (ptr - pkt_buf > MAX_PAYLOAD_LEN)
+    {
+        // Packet is longer than the maximum. Move the pointer.
+        ptr = pkt_buf + MAX_PAYLOAD_LEN;
+    }
+    else
+    {
+        ptr = add_zero_padding (pkt_buf, ptr);
+    }
+    return ptr - pkt_buf;
+}
+
+/**
+ * @brief process_packet - Validate and process one received datagram, placing
+ *          any response in the same buffer
+ * @param pkt_buf - Packet buffer of at least MAX_PAYLOAD_LEN + 1 bytes
+ * @param n - Number of bytes received
+ * @return - Length of the response in pkt_buf, or 0 if no response is to be sent
+ */
+int
+process_packet (unsigned char *pkt_buf, int n)
+{
+    u_int64_t start = pcp_metrics_sample () ? pcp_metrics_now () : 0;
+    u_int8_t result;
+    int len;
+
+    len = build_response (pkt_buf, n);
+
+    pcp_metrics_inc (PCP_METRIC_PACKETS_RECEIVED);
+    if (len > 0)
+    {
+        result = pkt_buf[offsetof (pcp_response_header, result_code)];
+        if (result < RESULT_CODE_MAX)
+        {
+            pcp_metrics_inc (PCP_METRIC_RESPONSES + result);
+        }
+    }
+    else
+    {
+        pcp_metrics_inc (PCP_METRIC_PACKETS_DROPPED);
+    }
+    if (start)
+    {
+        pcp_metrics_observe (PCP_HISTOGRAM_REQUEST, pcp_metrics_now () - start);
+    }
+    return len;
+}
+
+/**
+ * @brief run_loop - The main loop
+ * @param sock - Server socket number
+ */
+void
+run_loop (int sock)
+{
+    int n;
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof (from);
+    unsigned char pkt_buf[MAX_PAYLOAD_LEN + 1];
+
+    /* Receive one more byte than the max size so that the error case of a packet being
+     * too large can be detected */
+    n = recvfrom (sock, pkt_buf, MAX_PAYLOAD_LEN + 1, 0, (struct sockaddr *) &from,
+                  &fromlen);
+    check_error (n, "recvfrom");
+
+    /* The socket has been shut down to stop the worker */
+    if (__atomic_load_n (&pcpd_stopping, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    n = process_packet (pkt_buf, n);
+
     // Send the response
-    if (ptr)
+    if (n > 0)
+    {
+        n = sendto (sock, pkt_buf, n, 0, (struct sockaddr *) &from, fromlen);
+        check_error (n, "sendto");
+    }
+}
+
+/**
+ * @brief pkt_batch_free - Free a batch created by pkt_batch_new
+ * @param batch - The batch to free
+ */
+void
+pkt_batch_free (pkt_batch *batch)
+{
+    if (batch != NULL)
+    {
+        free (batch->bufs);
+        free (batch->addrs);
+        free (batch->recv_iov);
+        free (batch->send_iov);
+        free (batch->recv_msgs);
+        free (batch->send_msgs);
+        free (batch);
+    }
+}
+
+/**
+ * @brief pkt_batch_new - Allocate the buffers and message headers for batched I/O
+ * @param size - Maximum number of datagrams per batch
+ * @return - The batch, or NULL if out of memory
+ */
+pkt_batch *
+pkt_batch_new (int size)
+{
+    pkt_batch *batch = calloc (1, sizeof (pkt_batch));
+
+    if (batch == NULL)
+    {
+        return NULL;
+    }
+
+    batch->size = size;
+    batch->bufs = calloc (size, sizeof (*batch->bufs));
+    batch->addrs = calloc (size, sizeof (struct sockaddr_storage));
+    batch->recv_iov = calloc (size, sizeof (struct iovec));
+    batch->send_iov = calloc (size, sizeof (struct iovec));
+    batch->recv_msgs = calloc (size, sizeof (struct mmsghdr));
+    batch->send_msgs = calloc (size, sizeof (struct mmsghdr));
+
+    if (!batch->bufs || !batch->addrs || !batch->recv_iov || !batch->send_iov ||
+        !batch->recv_msgs || !batch->send_msgs)
+    {
+        pkt_batch_free (batch);
+        return NULL;
+    }
+    return batch;
+}
+
+/* The responses built for one batch of requests. The forwarding written for
+ * a request is tagged with the position its response takes in send_iov. */
+typedef struct _batch_responses
+{
+    pkt_batch *batch;
+    int count;
+} batch_responses;
+
+/* Check that a mapping is the one a serialized MAP or PEER response is for */
+static bool
+response_matches_mapping (map_response *resp, pcp_mapping mapping)
+{
+    return memcmp (resp->mapping_nonce, mapping->mapping_nonce,
+                   sizeof (resp->mapping_nonce)) == 0 &&
+           resp->internal_port == mapping->internal_port &&
+           resp->protocol == mapping->protocol;
+}
+
+/**
+ * @brief rollback_mapping - Delete a mapping whose port forwarding could not
+ *          be written, unless it has since been replaced
+ * @param index - Index of the mapping
+ * @param resp - The response to the request that added it
+ */
+static void
+rollback_mapping (int index, map_response *resp)
+{
+    struct pcp_mapping_s mapping;
+    map_request key;
+    pthread_mutex_t *request_lock;
+    pcp_mapping existing;
+    bool found = false;
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    existing = mapping_table_find_index (mappings, index);
+    if (existing && response_matches_mapping (resp, existing))
+    {
+        mapping = *existing;
+        mapping.path = NULL;
+        found = true;
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+    if (!found)
+    {
+        return;
+    }
+
+    /* Serialize with other requests for the mapping, then check it again */
+    memset (&key, 0, sizeof (key));
+    key.header.client_ip = mapping.internal_ip;
+    key.internal_port = mapping.internal_port;
+    key.protocol = mapping.protocol;
+    request_lock = request_lock_get (&key);
+
+    pthread_mutex_lock (request_lock);
+    pthread_rwlock_rdlock (&mapping_lock);
+    existing = mapping_table_find_index (mappings, index);
+    found = existing && response_matches_mapping (resp, existing);
+    pthread_rwlock_unlock (&mapping_lock);
+
+    if (found)
     {
-        // Packet processing was successful and a response was generated in pkt_buf
-        if (ptr - pkt_buf > MAX_PAYLOAD_LEN)
+        syslog (LOG_ERR, "Could not add port forwarding for mapping %d, removing it", index);
+        pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
+        if (!pcp_mapping_delete (index))
         {
-            // Packet is longer than the maximum. Move the pointer.
-            ptr = pkt_buf + MAX_PAYLOAD_LEN;
+            syslog (LOG_ERR, "Could not delete mapping with ID %d", index);
         }
-        else
+        remove_local_mapping (index);
+        pcp_metrics_sub (PCP_METRIC_MAPPINGS_CREATED, 1);
+    }
+    pthread_mutex_unlock (request_lock);
+}
+
+/**
+ * @brief fail_deferred_mapping - Roll back a mapping added by a request in a
+ *          batch whose port forwarding failed once the batch was committed.
+ *          The request's response, and those of any later request in the batch
+ *          that refreshed the mapping, become NETWORK_FAILURE errors.
+ * @param tag - Position of the response in the batch
+ * @param index - Index of the mapping
+ * @param data - The batch_responses
+ */
+static void
+fail_deferred_mapping (int tag, int index, void *data)
+{
+    batch_responses *responses = data;
+    struct pcp_mapping_s added;
+    map_response resp;
+    u_int8_t opcode;
+    int i;
+
+    if (tag >= responses->count)
+    {
+        return;
+    }
+    deserialize_map_response_into (&resp, responses->batch->send_iov[tag].iov_base);
+    memcpy (added.mapping_nonce, resp.mapping_nonce, sizeof (added.mapping_nonce));
+    added.internal_port = resp.internal_port;
+    added.protocol = resp.protocol;
+
+    rollback_mapping (index, &resp);
+
+    for (i = tag; i < responses->count; i++)
+    {
+        deserialize_map_response_into (&resp, responses->batch->send_iov[i].iov_base);
+        opcode = OPCODE (resp.header.r_opcode);
+        if ((opcode != MAP_OPCODE && opcode != PEER_OPCODE) ||
+            resp.header.result_code != SUCCESS || resp.header.lifetime == 0 ||
+            !response_matches_mapping (&resp, &added))
         {
-            ptr = add_zero_padding (pkt_buf, ptr);
+            continue;
         }
-        n = sendto (sock, pkt_buf, ptr - pkt_buf, 0, (struct sockaddr *) &from,
-                    fromlen);
-        check_error (n, "sendto");
+        set_mapping_error (&resp.header, ADD_MAPPING_FAILED);
+        serialize_response_header (responses->batch->send_iov[i].iov_base, &resp.header);
+        pcp_metrics_sub (PCP_METRIC_RESPONSES + SUCCESS, 1);
+        pcp_metrics_inc (PCP_METRIC_RESPONSES + resp.header.result_code);
     }
 }
 
 /**
- * Background thread which periodically iterates through the list of current mappings
- * and removes any expired ones.
+ * @brief run_loop_batched - The main loop for batched I/O. Drains up to
+ *          batch->size datagrams per wakeup with recvmmsg, processes them in
+ *          order, waits for their port forwarding to be committed together and
+ *          flushes every response with sendmmsg.
+ * @param sock - Server socket number
+ * @param batch - Preallocated batch storage
+ * @param stats - Statistics to update
+ */
+void
+run_loop_batched (int sock, pkt_batch *batch, batch_stats *stats)
+{
+    batch_responses responses;
+    int i, n, sent;
+    int count = 0;
+    int len;
+
+    for (i = 0; i < batch->size; i++)
+    {
+        /* Receive one more byte than the max size so that the error case of a packet
+         * being too large can be detected */
+        batch->recv_iov[i].iov_base = batch->bufs[i];
+        batch->recv_iov[i].iov_len = MAX_PAYLOAD_LEN + 1;
+        batch->recv_msgs[i].msg_hdr.msg_iov = &batch->recv_iov[i];
+        batch->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->recv_msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->recv_msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+        batch->recv_msgs[i].msg_hdr.msg_control = NULL;
+        batch->recv_msgs[i].msg_hdr.msg_controllen = 0;
+        batch->recv_msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    /* Block for the first datagram, then take whatever else is already queued */
+    n = recvmmsg (sock, batch->recv_msgs, batch->size, MSG_WAITFORONE, NULL);
+    check_error (n, "recvmmsg");
+
+    /* The socket has been shut down to stop the worker */
+    if (__atomic_load_n (&pcpd_stopping, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    __atomic_fetch_add (&stats->batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&stats->packets, n, __ATOMIC_RELAXED);
+
+    /* The port forwarding for the whole batch is committed at once, before
+     * any response is sent */
+    pcp_fw_defer_begin ();
+    for (i = 0; i < n; i++)
+    {
+        pcp_fw_defer_tag (count);
+        len = process_packet (batch->bufs[i], batch->recv_msgs[i].msg_len);
+        if (len > 0)
+        {
+            batch->send_iov[count].iov_base = batch->bufs[i];
+            batch->send_iov[count].iov_len = len;
+            memset (&batch->send_msgs[count].msg_hdr, 0, sizeof (struct msghdr));
+            batch->send_msgs[count].msg_hdr.msg_iov = &batch->send_iov[count];
+            batch->send_msgs[count].msg_hdr.msg_iovlen = 1;
+            batch->send_msgs[count].msg_hdr.msg_name = &batch->addrs[i];
+            batch->send_msgs[count].msg_hdr.msg_namelen =
+                batch->recv_msgs[i].msg_hdr.msg_namelen;
+            count++;
+        }
+    }
+    responses.batch = batch;
+    responses.count = count;
+    pcp_fw_defer_end (fail_deferred_mapping, &responses);
+
+    // Send the responses. sendmmsg may send fewer than requested so loop until done.
+    for (i = 0; i < count; i += sent)
+    {
+        sent = sendmmsg (sock, batch->send_msgs + i, count - i, 0);
+        check_error (sent, "sendmmsg");
+        if (sent == 0)
+        {
+            break;
+        }
+    }
+    __atomic_fetch_add (&stats->responses, count, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief mapping_expired - Check a mapping is still present and expired
+ * @param index - Index of the mapping
+ * @return - True if the mapping should be deleted
+ */
+static bool
+mapping_expired (int index)
+{
+    pcp_mapping mapping;
+    bool expired = false;
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    mapping = mapping_table_find_index (mappings, index);
+    if (mapping && pcp_mapping_remaining_lifetime_get (mapping) == 0)
+    {
+        expired = true;
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+    return expired;
+}
+
+/**
+ * Background thread which sleeps until the next mapping is due to expire and
+ * removes it. Only mappings that have reached their end of life are visited.
  */
 void *
 check_mapping_lifetimes (void *arg)
 {
     GList *elem;
-    pcp_mapping mapping = NULL;
-    bool deleted = false;   // TODO: remove
-    int count = 0;          // TODO: remove
+    GList *expired = NULL;
+    struct timespec deadline;
+    u_int32_t end_of_life;
+    u_int32_t now;
+    u_int64_t start;
+    int index;
 
     while (1)
     {
-        /* When an expired mapping is found, the delete function from libpcp is called
-         * which changes the value stored in apteryx. This prompts the local function
-         * delete_pcp_mapping to be called but it will block since the mapping lock
-         * is in place. This causes all of the delete_pcp_mapping calls to queue
-         * up in a separate thread and execute after this loop is complete. */
-        pthread_mutex_lock (&mapping_lock);
+        /* Wait until the earliest deadline passes, then collect every due mapping.
+         * The expiry lock is released before deleting, as removing the local
+         * copy of a mapping takes it again to cancel the mapping's expiry. */
+        pthread_mutex_lock (&expiry_lock);
+        while (1)
+        {
+            now = time (NULL);
+            if (__atomic_load_n (&pcpd_stopping, __ATOMIC_ACQUIRE))
+            {
+                pthread_mutex_unlock (&expiry_lock);
+                return NULL;
+            }
+            if (!expiry_heap_peek (expiry, NULL, &end_of_life))
+            {
+                pthread_cond_wait (&expiry_cond, &expiry_lock);
+            }
+            else if (end_of_life > now)
+            {
+                deadline.tv_sec = end_of_life;
+                deadline.tv_nsec = 0;
+                pthread_cond_timedwait (&expiry_cond, &expiry_lock, &deadline);
+            }
+            else
+            {
+                break;
+            }
+        }
+        while (expiry_heap_pop_due (expiry, now, &index))
+        {
+            expired = g_list_prepend (expired, GINT_TO_POINTER (index));
+        }
+        pthread_mutex_unlock (&expiry_lock);
 
-        for (elem = mappings; elem; elem = elem->next)
+        start = pcp_metrics_now ();
+        for (elem = expired; elem; elem = elem->next)
         {
-            mapping = (pcp_mapping) elem->data;
+            index = GPOINTER_TO_INT (elem->data);
 
-            if (pcp_mapping_remaining_lifetime_get (mapping) == 0)
+            /* The lifetime may have been extended since the entry was popped */
+            if (!mapping_expired (index))
+            {
+                continue;
+            }
+            pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
+            if (pcp_mapping_delete (index))
+            {
+                remove_local_mapping (index);
+                pcp_metrics_inc (PCP_METRIC_MAPPINGS_EXPIRED);
+            }
+            else
             {
-                if (pcp_mapping_delete (mapping->index))
-                {
-                    deleted = true; // TODO: remove
-                    count++;        // TODO: remove
-                }
-                else
-                {
-                    syslog (LOG_ERR, "Could not delete mapping with ID %d", mapping->index);
-                }
+                syslog (LOG_ERR, "Could not delete mapping with ID %d", index);
+                /* Try again in a second */
+                schedule_mapping_expiry (index, now + 1);
             }
         }
+        pcp_metrics_observe (PCP_HISTOGRAM_EXPIRY_SWEEP, pcp_metrics_now () - start);
+        g_list_free (expired);
+        expired = NULL;
+    }
 
-        pthread_mutex_unlock (&mapping_lock);
+    return NULL;
+}
 
-        // TODO: Remove if statement, the deleted flag and count
-        if (deleted)
-        {
-            usleep (25 * 1000); // Give apteryx and callbacks time to run
-            printf ("%d mappings deleted at %u - printing now\n", count, (u_int32_t) time (NULL));
+/**
+ * @brief worker_loop - Service one worker's socket until pcpd stops
+ * @param arg - The worker
+ */
+void *
+worker_loop (void *arg)
+{
+    pcpd_worker *worker = (pcpd_worker *) arg;
 
-            print_mappings_debug (); // TODO: remove
+    pcp_metrics_thread_init (worker->id + 1);
 
-            deleted = false;
-            count = 0;
+    if (worker->batch)
+    {
+        while (!__atomic_load_n (&pcpd_stopping, __ATOMIC_RELAXED))
+        {
+            run_loop_batched (worker->sock, worker->batch, &worker->stats);
+        }
+    }
+    else
+    {
+        while (!__atomic_load_n (&pcpd_stopping, __ATOMIC_RELAXED))
+        {
+            run_loop (worker->sock);
         }
-        sleep (1);
     }
-
     return NULL;
 }
 
@@ -1139,22 +2709,302 @@ pcp_callbacks callbacks = {
     .max_mapping_lifetime = max_mapping_lifetime,
     .prefer_failure_req_rate_limit = prefer_failure_req_rate_limit,
     .new_pcp_mapping = new_pcp_mapping,
+    .new_pcp_peer_mapping = new_pcp_peer_mapping,
     .delete_pcp_mapping = delete_pcp_mapping,
     .startup_epoch_time = startup_epoch_time,
 };
 
+#ifndef PCPD_NO_MAIN
+/**
+ * @brief control_show - Write the config and counters for the control socket
+ * @param out - File to write to
+ * @return - Negative number on error
+ */
+static int
+control_show (FILE *out)
+{
+    pcp_state_snapshot *snapshot;
+    int n;
+
+    snapshot = take_state_snapshot (&config, false);
+    if (snapshot == NULL)
+        return fprintf (out, "ERROR out of memory\n");
+
+    n = write_state_snapshot (snapshot, out);
+    free_state_snapshot (snapshot);
+    return n;
+}
+
+static bool
+control_lookup (bool external, struct in6_addr *ip, u_int16_t port, u_int8_t protocol,
+                struct pcp_mapping_s *copy)
+{
+    pcp_mapping mapping;
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    if (external)
+        mapping = mapping_table_find_external (mappings, ip, port, protocol);
+    else
+        mapping = mapping_table_find_internal (mappings, ip, port, protocol);
+    if (mapping)
+    {
+        *copy = *mapping;
+        copy->path = NULL;
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+
+    return mapping != NULL;
+}
+
+struct control_list_data
+{
+    const pcp_control_filter *filter;
+    struct pcp_mapping_s *mappings;
+    int max;
+    int count;
+};
+
+static bool
+control_list_cb (pcp_mapping mapping, void *data)
+{
+    struct control_list_data *list_data = (struct control_list_data *) data;
+    struct pcp_mapping_s *copy;
+
+    if (pcp_control_filter_match (list_data->filter, mapping))
+    {
+        copy = &list_data->mappings[list_data->count++];
+        *copy = *mapping;
+        copy->path = NULL;
+    }
+    return list_data->count < list_data->max;
+}
+
+static int
+control_list (const pcp_control_filter *filter, struct pcp_mapping_s *copies, int max)
+{
+    struct control_list_data list_data = { filter, copies, max, 0 };
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    mapping_table_foreach_from (mappings, filter->after + 1, control_list_cb, &list_data);
+    pthread_rwlock_unlock (&mapping_lock);
+
+    return list_data.count;
+}
+
+/**
+ * @brief control_expire - Remove a mapping in the same way as when its lifetime runs out
+ * @param index - ID of the mapping
+ * @return - True if the mapping was removed
+ */
+static bool
+control_expire (int index)
+{
+    bool found;
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    found = mapping_table_find_index (mappings, index) != NULL;
+    pthread_rwlock_unlock (&mapping_lock);
+
+    if (!found)
+        return false;
+
+    pcp_metrics_inc (PCP_METRIC_APTERYX_CALLS);
+    if (!pcp_mapping_delete (index))
+    {
+        syslog (LOG_ERR, "Could not delete mapping with ID %d", index);
+        return false;
+    }
+    remove_local_mapping (index);
+    pcp_metrics_inc (PCP_METRIC_MAPPINGS_EXPIRED);
+    return true;
+}
+
+static const pcp_control_ops control_ops = {
+    .show = control_show,
+    .lookup = control_lookup,
+    .list = control_list,
+    .expire = control_expire,
+};
+
+/**
+ * @brief start_worker - Allocate a worker's batch, pin it to a CPU if configured
+ *          and start its thread. Workers are pinned before they start, so they
+ *          never receive on the wrong CPU.
+ * @param worker - The worker to start
+ */
+static void
+start_worker (pcpd_worker *worker)
+{
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    long ncpus;
+    int ret;
+
+    if (config.batch_size > 1)
+    {
+        worker->batch = pkt_batch_new (config.batch_size);
+        if (worker->batch == NULL)
+        {
+            syslog (LOG_ERR, "Failed to allocate receive batch, using unbatched I/O");
+        }
+    }
+
+    pthread_attr_init (&attr);
+    if (config.affinity)
+    {
+        ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+        worker->cpu = worker->id % (ncpus > 0 ? ncpus : 1);
+        CPU_ZERO (&cpus);
+        CPU_SET (worker->cpu, &cpus);
+        ret = pthread_attr_setaffinity_np (&attr, sizeof (cpus), &cpus);
+        if (ret != 0)
+        {
+            syslog (LOG_ERR, "Failed to pin worker %d to CPU %d", worker->id, worker->cpu);
+            worker->cpu = -1;
+        }
+    }
+
+    ret = pthread_create (&worker->thread, &attr, &worker_loop, worker);
+    if (ret != 0 && worker->cpu >= 0)
+    {
+        /* The CPU may be outside this process's cpuset. Run unpinned. */
+        syslog (LOG_ERR, "Failed to pin worker %d to CPU %d", worker->id, worker->cpu);
+        worker->cpu = -1;
+        ret = pthread_create (&worker->thread, NULL, &worker_loop, worker);
+    }
+    if (ret != 0)
+    {
+        /* Its socket would take a share of the requests and never answer */
+        syslog (LOG_ERR, "Failed to create worker thread %d\n", worker->id);
+        exit (EXIT_FAILURE);
+    }
+    pthread_attr_destroy (&attr);
+}
+
+struct announce_clients
+{
+    struct in6_addr *ips;
+    int count;
+};
+
+static bool
+collect_client_cb (pcp_mapping mapping, void *data)
+{
+    struct announce_clients *clients = (struct announce_clients *) data;
+
+    clients->ips[clients->count++] = mapping->internal_ip;
+    return true;
+}
+
+/**
+ * @brief start_announce - Tell clients that pcpd has restarted. Every client
+ *          with a mapping loaded from Apteryx is sent unsolicited ANNOUNCE
+ *          responses, as well as the all-nodes groups.
+ * @param startup_time - When pcpd started
+ */
+static void
+start_announce (u_int32_t startup_time)
+{
+    struct announce_clients clients = { NULL, 0 };
+
+    pthread_rwlock_rdlock (&mapping_lock);
+    if (config.announce_rate > 0)
+    {
+        clients.ips = malloc ((mapping_table_size (mappings) + 1) * sizeof (struct in6_addr));
+        if (clients.ips != NULL)
+        {
+            mapping_table_foreach (mappings, collect_client_cb, &clients);
+        }
+    }
+    pthread_rwlock_unlock (&mapping_lock);
+
+    if (config.announce_rate > 0 && clients.ips == NULL)
+    {
+        syslog (LOG_ERR, "Out of memory, only announcing to the all-nodes groups");
+    }
+    pcp_announce_start (workers[0].sock, clients.ips, clients.count, config.announce_rate,
+                        startup_time);
+}
+
+static bool
+remove_mapping_chain (pcp_mapping mapping, void *data)
+{
+    remove_pcp_port_forwarding_chain (mapping->index, &mapping->internal_ip);
+    return true;
+}
+
+/**
+ * @brief exit_pcpd - Stop every thread that uses the mappings, then remove
+ *          the port forwarding and free the state. Runs on the main thread.
+ */
+static void
+exit_pcpd (void)
+{
+    int i;
+
+    __atomic_store_n (&pcpd_stopping, true, __ATOMIC_RELEASE);
+
+    /* Shutting a worker's socket down wakes it from receive. On Linux this
+     * reports ENOTCONN for an unconnected UDP socket but still wakes the
+     * receiver. Each worker finishes the requests it is handling and returns. */
+    for (i = 0; i < num_workers; i++)
+    {
+        shutdown (workers[i].sock, SHUT_RD);
+    }
+    for (i = 0; i < num_workers; i++)
+    {
+        pthread_join (workers[i].thread, NULL);
+    }
+
+    pcp_announce_stop ();
+    pcp_control_stop ();
+
+    pthread_mutex_lock (&expiry_lock);
+    pthread_cond_broadcast (&expiry_cond);
+    pthread_mutex_unlock (&expiry_lock);
+    pthread_join (mapping_thread, NULL);
+
+    sem_post (&state_dump_sem);
+    pthread_join (state_dump_thread, NULL);
+
+    /* Deregister callback (perform callback delete functions manually to avoid possibly
+     * exiting pcpd before callbacks successfully execute). This waits for a
+     * callback that is running, so nothing else uses the mappings after it. */
+    pcp_register_cb (NULL);
+
+    mapping_table_foreach (mappings, remove_mapping_chain, NULL);
+
+    pcp_iptables_deinit ();
+    mapping_table_free (mappings);
+    expiry_heap_free (expiry);
+    mapping_id_pool_free (mapping_ids);
+    pcp_metrics_deinit ();
+    pcp_deinit ();
+
+    exit (EXIT_SUCCESS);
+}
+
 /**
  * The main function
  */
 int
 main (int argc, char *argv[])
 {
-    int sock;
+    u_int32_t startup_time;
+    int i;
 
     process_arguments (argc, argv);
 
+    pcp_metrics_init (true);
+
+    init_pcpd_state ();
+
     pcp_init ();
 
+    /* Watches claim the IDs of the mappings they report, so the pool must
+     * exist before they are registered */
+    init_mapping_ids ();
+
     if (!pcp_register_cb (&callbacks))
     {
         syslog (LOG_ERR, "Could not initialize PCP config");
@@ -1164,27 +3014,39 @@ main (int argc, char *argv[])
     // Apply default config if first time running, otherwise load current config
     pcp_load_config ();
 
-    // Set the startup time
-    startup_epoch_time_set (time (NULL));
+    // Set the startup time. The local copy is set now as responses count from it.
+    startup_time = time (NULL);
+    startup_epoch_time_set (startup_time);
+    startup_epoch_time (startup_time);
 
     print_pcp_apteryx_config (); // TODO: remove
 
-    sock = setup_pcpd ();
+    setup_pcpd ();
+
+    pcp_control_start (config.control_path, &control_ops);
 
     write_pcp_state (&config);
 
     if (pthread_create (&mapping_thread, NULL, &check_mapping_lifetimes, NULL) != 0)
     {
         syslog (LOG_ERR, "Failed to create mapping lifetime check thread\n");
-    }
-    if (pthread_detach (mapping_thread) != 0)
-    {
-        syslog (LOG_ERR, "Failed to detach thread\n");
+        return EXIT_FAILURE;
     }
 
-    while (1)
+    for (i = 0; i < num_workers; i++)
     {
-        run_loop (sock);
+        start_worker (&workers[i]);
     }
+
+    start_announce (startup_time);
+
+    /* The main thread waits for SIGINT or SIGTERM, then stops the others */
+    while (sem_wait (&shutdown_sem) < 0)
+        ;
+
+    exit_pcpd ();
+
     return EXIT_SUCCESS;
 }
+
+#endif /* PCPD_NO_MAIN */
@@ -0,0 +1,59 @@
+/**
+ * @file pcpd.h
+ *
+ * Entry points into the PCP daemon for harnesses that drive the request path
+ * without sockets, such as benchmarks.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PCPD_H
+#define PCPD_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "packets_pcp.h"
+
+void init_pcpd_state (void);
+
+void init_mapping_ids (void);
+
+unsigned char *process_map_request (unsigned char *pkt_buf, int n);
+
+unsigned char *process_peer_request (unsigned char *pkt_buf, int n);
+
+unsigned char *process_announce_request (unsigned char *pkt_buf, int n);
+
+unsigned char *process_error (unsigned char *pkt_buf, result_code result);
+
+int process_packet (unsigned char *pkt_buf, int n);
+
+/* Config callbacks */
+void pcp_enabled (bool enabled);
+
+void map_support (bool enabled);
+
+void peer_support (bool enabled);
+
+void min_mapping_lifetime (u_int32_t lifetime);
+
+void max_mapping_lifetime (u_int32_t lifetime);
+
+#endif /* PCPD_H */
@@ -0,0 +1,148 @@
+/**
+ * @file expiry_heap_unit_tests.c
+ *
+ * Novaprova unit tests for the mapping expiry heap.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/expiry_heap.h"
+#include <stdlib.h>
+
+static expiry_heap *heap = NULL;
+
+int
+set_up (void)
+{
+    heap = expiry_heap_new ();
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    expiry_heap_free (heap);
+    heap = NULL;
+    return 0;
+}
+
+void
+test_empty_heap (void)
+{
+    int index;
+
+    NP_ASSERT_EQUAL (expiry_heap_size (heap), 0);
+    NP_ASSERT_FALSE (expiry_heap_peek (heap, &index, NULL));
+    NP_ASSERT_FALSE (expiry_heap_pop_due (heap, 1000, &index));
+}
+
+void
+test_peek_returns_earliest (void)
+{
+    int index;
+    u_int32_t end_of_life;
+
+    expiry_heap_schedule (heap, 10, 300);
+    expiry_heap_schedule (heap, 20, 100);
+    expiry_heap_schedule (heap, 30, 200);
+
+    NP_ASSERT_TRUE (expiry_heap_peek (heap, &index, &end_of_life));
+    NP_ASSERT_EQUAL (index, 20);
+    NP_ASSERT_EQUAL (end_of_life, 100);
+}
+
+void
+test_pop_due_only_returns_expired (void)
+{
+    int index;
+
+    expiry_heap_schedule (heap, 10, 300);
+    expiry_heap_schedule (heap, 20, 100);
+    expiry_heap_schedule (heap, 30, 200);
+
+    NP_ASSERT_TRUE (expiry_heap_pop_due (heap, 200, &index));
+    NP_ASSERT_EQUAL (index, 20);
+    NP_ASSERT_TRUE (expiry_heap_pop_due (heap, 200, &index));
+    NP_ASSERT_EQUAL (index, 30);
+    NP_ASSERT_FALSE (expiry_heap_pop_due (heap, 200, &index));
+    NP_ASSERT_EQUAL (expiry_heap_size (heap), 1);
+}
+
+void
+test_reschedule_moves_entry (void)
+{
+    int index;
+
+    expiry_heap_schedule (heap, 10, 100);
+    expiry_heap_schedule (heap, 20, 200);
+
+    /* Extending the lifetime of the first mapping moves it behind the second */
+    expiry_heap_schedule (heap, 10, 500);
+    NP_ASSERT_EQUAL (expiry_heap_size (heap), 2);
+    NP_ASSERT_TRUE (expiry_heap_peek (heap, &index, NULL));
+    NP_ASSERT_EQUAL (index, 20);
+
+    /* Shortening it moves it back to the front */
+    expiry_heap_schedule (heap, 10, 50);
+    NP_ASSERT_TRUE (expiry_heap_peek (heap, &index, NULL));
+    NP_ASSERT_EQUAL (index, 10);
+}
+
+void
+test_cancel (void)
+{
+    int index;
+
+    expiry_heap_schedule (heap, 10, 100);
+    expiry_heap_schedule (heap, 20, 200);
+
+    NP_ASSERT_TRUE (expiry_heap_cancel (heap, 10));
+    NP_ASSERT_FALSE (expiry_heap_cancel (heap, 10));
+    NP_ASSERT_TRUE (expiry_heap_pop_due (heap, 1000, &index));
+    NP_ASSERT_EQUAL (index, 20);
+    NP_ASSERT_EQUAL (expiry_heap_size (heap), 0);
+}
+
+void
+test_many_entries_pop_in_order (void)
+{
+    u_int32_t last = 0;
+    u_int32_t end_of_life;
+    int index;
+    int i;
+
+    /* Enough entries to grow the heap, scheduled out of order */
+    for (i = 0; i < 1000; i++)
+    {
+        expiry_heap_schedule (heap, i * 10, (i * 7919) % 1000);
+    }
+    for (i = 0; i < 1000; i += 3)
+    {
+        expiry_heap_cancel (heap, i * 10);
+    }
+
+    while (expiry_heap_peek (heap, NULL, &end_of_life))
+    {
+        NP_ASSERT_TRUE (end_of_life >= last);
+        NP_ASSERT_TRUE (expiry_heap_pop_due (heap, end_of_life, &index));
+        NP_ASSERT_NOT_EQUAL ((index / 10) % 3, 0);
+        last = end_of_life;
+    }
+}
@@ -0,0 +1,198 @@
+/**
+ * @file external_port_pool_unit_tests.c
+ *
+ * Novaprova unit tests for the external port allocator.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/external_port_pool.h"
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#define TCP 6
+#define UDP 17
+
+static external_port_pool *pool = NULL;
+static struct in6_addr ip;
+static struct in6_addr other_ip;
+
+int
+set_up (void)
+{
+    pool = external_port_pool_new (DEFAULT_MIN_EXTERNAL_PORT, DEFAULT_MAX_EXTERNAL_PORT);
+    inet_pton (AF_INET6, "::ffff:10.0.0.1", &ip);
+    inet_pton (AF_INET6, "::ffff:10.0.0.2", &other_ip);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    external_port_pool_free (pool);
+    pool = NULL;
+    return 0;
+}
+
+void
+test_invalid_range (void)
+{
+    NP_ASSERT_NULL (external_port_pool_new (0, 100));
+    NP_ASSERT_NULL (external_port_pool_new (200, 100));
+}
+
+void
+test_suggested_port_is_used (void)
+{
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 8080, false), 8080);
+    NP_ASSERT_TRUE (external_port_pool_in_use (pool, &ip, TCP, 8080));
+    NP_ASSERT_EQUAL (external_port_pool_available (pool, &ip, TCP), 65534);
+
+    /* Each address and protocol has its own ports */
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, UDP, 8080, true), 8080);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &other_ip, TCP, 8080, true), 8080);
+}
+
+void
+test_next_free_port (void)
+{
+    external_port_pool_alloc (pool, &ip, TCP, 8080, false);
+    external_port_pool_alloc (pool, &ip, TCP, 8081, false);
+
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 8080, false), 8082);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 8080, true), -1);
+}
+
+void
+test_without_suggestion (void)
+{
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 0, false), 1);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 0, false), 2);
+    NP_ASSERT_TRUE (external_port_pool_release (pool, &ip, TCP, 1));
+
+    /* Released ports are not reused straight away */
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 0, false), 3);
+}
+
+void
+test_range (void)
+{
+    external_port_pool_free (pool);
+    pool = external_port_pool_new (1024, 1030);
+
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 80, false), 1024);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 80, true), -1);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 1030, false), 1030);
+
+    /* The search wraps around to the start of the range */
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 1030, false), 1025);
+    NP_ASSERT_FALSE (external_port_pool_claim (pool, &ip, TCP, 2000));
+    NP_ASSERT_FALSE (external_port_pool_in_use (pool, &ip, TCP, 2000));
+    NP_ASSERT_EQUAL (external_port_pool_available (pool, &ip, TCP), 4);
+}
+
+void
+test_exhausted (void)
+{
+    int i;
+
+    external_port_pool_free (pool);
+    pool = external_port_pool_new (5000, 5199);
+
+    for (i = 0; i < 200; i++)
+    {
+        NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 5100, false),
+                         5100 + (i < 100 ? i : i - 200));
+    }
+    NP_ASSERT_EQUAL (external_port_pool_available (pool, &ip, TCP), 0);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 0, false), -1);
+
+    NP_ASSERT_TRUE (external_port_pool_release (pool, &ip, TCP, 5123));
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 5001, false), 5123);
+}
+
+void
+test_last_free_port_of_full_address (void)
+{
+    int i;
+
+    for (i = 1; i <= 65535; i++)
+    {
+        NP_ASSERT_TRUE (external_port_pool_claim (pool, &ip, TCP, i));
+    }
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 0, false), -1);
+
+    external_port_pool_release (pool, &ip, TCP, 4095);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 60000, false), 4095);
+    external_port_pool_release (pool, &ip, TCP, 65535);
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 1, false), 65535);
+    NP_ASSERT_EQUAL (external_port_pool_available (pool, &ip, TCP), 0);
+}
+
+void
+test_claim_and_release (void)
+{
+    NP_ASSERT_TRUE (external_port_pool_claim (pool, &ip, TCP, 443));
+    NP_ASSERT_FALSE (external_port_pool_claim (pool, &ip, TCP, 443));
+    NP_ASSERT_EQUAL (external_port_pool_alloc (pool, &ip, TCP, 443, false), 444);
+
+    NP_ASSERT_TRUE (external_port_pool_release (pool, &ip, TCP, 443));
+    NP_ASSERT_FALSE (external_port_pool_release (pool, &ip, TCP, 443));
+    NP_ASSERT_FALSE (external_port_pool_release (pool, &other_ip, TCP, 444));
+    NP_ASSERT_FALSE (external_port_pool_release (pool, &ip, TCP, 0));
+    NP_ASSERT_TRUE (external_port_pool_release (pool, &ip, TCP, 444));
+    NP_ASSERT_EQUAL (external_port_pool_available (pool, &ip, TCP), 65535);
+}
+
+void
+test_random_alloc_and_release (void)
+{
+    static bool used[1025];
+    int in_use = 0;
+    int i, port;
+
+    external_port_pool_free (pool);
+    pool = external_port_pool_new (1, 1024);
+    srand (1);
+
+    for (i = 0; i < 100000; i++)
+    {
+        port = rand () % 1024 + 1;
+        if (rand () % 3 == 0)
+        {
+            NP_ASSERT_EQUAL (external_port_pool_release (pool, &ip, UDP, port), used[port]);
+            in_use -= used[port];
+            used[port] = false;
+            continue;
+        }
+
+        port = external_port_pool_alloc (pool, &ip, UDP, port, false);
+        if (in_use == 1024)
+        {
+            NP_ASSERT_EQUAL (port, -1);
+            continue;
+        }
+        NP_ASSERT_TRUE (port >= 1 && port <= 1024);
+        NP_ASSERT_FALSE (used[port]);
+        used[port] = true;
+        in_use++;
+        NP_ASSERT_EQUAL (external_port_pool_available (pool, &ip, UDP), 1024 - in_use);
+    }
+}
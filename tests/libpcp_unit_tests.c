@@ -29,6 +29,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
@@ -60,7 +62,6 @@ struct pcp_callback_flags
 
 struct pcp_callback_flags cb_flags = { 0 };
 
-#if 0
 int
 set_up (void)
 {
@@ -70,6 +71,206 @@ set_up (void)
     return 0;
 }
 
+/* Helper functions that add mappings to apteryx */
+static void
+add_test_mapping (int index)
+{
+    u_int32_t mapping_nonce[MAPPING_NONCE_SIZE] = {1732282673, 1882683910, 2109096625};
+    struct in6_addr internal_ip;
+    u_int16_t internal_port = 1234;
+    struct in6_addr external_ip;
+    u_int16_t external_port = 9876;
+    u_int32_t lifetime = 8002;
+    u_int8_t opcode = MAP_OPCODE;
+    u_int8_t protocol = 6;
+
+    inet_pton (AF_INET6, "2001:db8:7654:3210:fedc:ba98:7654:3210", &(internal_ip));
+    inet_pton (AF_INET6, "2001:db8:7654:1234:fedc:abab:4554:9875", &(external_ip));
+
+    NP_ASSERT_TRUE (pcp_mapping_add (index, mapping_nonce, &internal_ip,
+                                     internal_port, &external_ip, external_port,
+                                     lifetime, opcode, protocol));
+}
+
+static void
+add_three_test_mappings (int index1, int index2, int index3)
+{
+    add_test_mapping (index1);
+    add_test_mapping (index2);
+    add_test_mapping (index3);
+}
+
+/* Test that PEER mappings keep their remote peer */
+void
+test_pcp_mapping_add_peer_find (void)
+{
+    u_int32_t mapping_nonce[MAPPING_NONCE_SIZE] = {1732282673, 1882683910, 2109096625};
+    struct in6_addr internal_ip;
+    struct in6_addr external_ip;
+    struct in6_addr remote_peer_ip;
+    pcp_mapping mapping;
+
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &(internal_ip));
+    inet_pton (AF_INET6, "::ffff:203.0.113.1", &(external_ip));
+    inet_pton (AF_INET6, "::ffff:198.51.100.1", &(remote_peer_ip));
+
+    NP_ASSERT_TRUE (pcp_mapping_add_peer (60, mapping_nonce, &internal_ip, 1234,
+                                          &external_ip, 9876, &remote_peer_ip, 443,
+                                          8002, 6));
+    NP_ASSERT_TRUE (pcp_mapping_add (70, mapping_nonce, &internal_ip, 1234,
+                                     &external_ip, 9876, 8002, MAP_OPCODE, 6));
+
+    mapping = pcp_mapping_find (60);
+    NP_ASSERT_NOT_NULL (mapping);
+    NP_ASSERT_EQUAL (mapping->opcode, PEER_OPCODE);
+    NP_ASSERT_EQUAL (mapping->internal_port, 1234);
+    NP_ASSERT_EQUAL (mapping->external_port, 9876);
+    NP_ASSERT_EQUAL (mapping->remote_peer_port, 443);
+    NP_ASSERT_TRUE (memcmp (&mapping->remote_peer_ip, &remote_peer_ip,
+                            sizeof (struct in6_addr)) == 0);
+    pcp_mapping_destroy (mapping);
+
+    mapping = pcp_mapping_find (70);
+    NP_ASSERT_NOT_NULL (mapping);
+    NP_ASSERT_EQUAL (mapping->opcode, MAP_OPCODE);
+    NP_ASSERT_EQUAL (mapping->remote_peer_port, 0);
+    NP_ASSERT_TRUE (IN6_IS_ADDR_UNSPECIFIED (&mapping->remote_peer_ip));
+    pcp_mapping_destroy (mapping);
+}
+
+/* Test adding several mappings in one call */
+void
+test_pcp_mapping_add_bulk (void)
+{
+    struct pcp_mapping_s mappings[3];
+    GList *list = NULL;
+    pcp_mapping mapping;
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        memset (&mappings[i], 0, sizeof (mappings[i]));
+        mappings[i].index = 400 + i * 10;
+        mappings[i].mapping_nonce[0] = i;
+        inet_pton (AF_INET6, "::ffff:192.168.1.2", &mappings[i].internal_ip);
+        mappings[i].internal_port = 1000 + i;
+        inet_pton (AF_INET6, "::ffff:10.0.0.1", &mappings[i].external_ip);
+        mappings[i].external_port = 2000 + i;
+        mappings[i].lifetime = 600;
+        mappings[i].opcode = MAP_OPCODE;
+        mappings[i].protocol = 17;
+        list = g_list_append (list, &mappings[i]);
+    }
+
+    NP_ASSERT_TRUE (pcp_mapping_add_bulk (list));
+
+    for (i = 0; i < 3; i++)
+    {
+        mapping = pcp_mapping_find (400 + i * 10);
+        NP_ASSERT_NOT_NULL (mapping);
+        NP_ASSERT_EQUAL (mapping->internal_port, 1000 + i);
+        NP_ASSERT_EQUAL (mapping->external_port, 2000 + i);
+        NP_ASSERT_EQUAL (mapping->end_of_life - mapping->start_of_life, 600);
+        pcp_mapping_destroy (mapping);
+    }
+
+    /* Adding an index that is already in use fails and adds nothing */
+    mappings[0].index = 430;
+    NP_ASSERT_FALSE (pcp_mapping_add_bulk (list));
+    NP_ASSERT_NULL (pcp_mapping_find (430));
+
+    g_list_free (list);
+    pcp_mapping_deleteall ();
+}
+
+static u_int32_t refreshed_lifetime = 0;
+
+static void
+note_refreshed_mapping (int index,
+                        u_int32_t mapping_nonce[MAPPING_NONCE_SIZE],
+                        struct in6_addr internal_ip,
+                        u_int16_t internal_port,
+                        struct in6_addr external_ip,
+                        u_int16_t external_port,
+                        u_int32_t lifetime,
+                        u_int32_t start_of_life,
+                        u_int32_t end_of_life,
+                        u_int8_t opcode,
+                        u_int8_t protocol)
+{
+    refreshed_lifetime = lifetime;
+}
+
+static pcp_callbacks refresh_callbacks = {
+    .new_pcp_mapping = note_refreshed_mapping,
+};
+
+/* Test that the mapping watch is told about a refreshed lifetime */
+void
+test_pcp_mapping_refresh_lifetime_callback (void)
+{
+    u_int32_t mapping_nonce[MAPPING_NONCE_SIZE] = { 0 };
+    struct in6_addr internal_ip = {{{ 0 }}};
+    struct in6_addr external_ip = {{{ 0 }}};
+
+    NP_ASSERT_TRUE (pcp_mapping_add (610, mapping_nonce, &internal_ip, 1234,
+                                     &external_ip, 9876, 600, MAP_OPCODE, 6));
+    NP_ASSERT_TRUE (pcp_register_cb (&refresh_callbacks));
+
+    NP_ASSERT_TRUE (pcp_mapping_refresh_lifetime (610, 900, time (NULL) + 900));
+    usleep (APTERYX_SET_WAIT_TIME);
+    NP_ASSERT_EQUAL (refreshed_lifetime, 900);
+
+    pcp_register_cb (NULL);
+    pcp_mapping_deleteall ();
+}
+
+static bool
+count_mapping (pcp_mapping mapping, void *data)
+{
+    char path[32];
+
+    /* The mapping can be printed, so its path must be set */
+    snprintf (path, sizeof (path), "/pcp/mappings/%d", mapping->index);
+    NP_ASSERT_STR_EQUAL (mapping->path, path);
+    (*(int *) data)++;
+    return true;
+}
+
+/* Test iterating over all mappings at once and a page at a time */
+void
+test_pcp_mapping_foreach (void)
+{
+    GList *indexes;
+    int count = 0;
+
+    add_three_test_mappings (510, 520, 530);
+
+    NP_ASSERT_EQUAL (pcp_mapping_foreach (count_mapping, &count), 3);
+    NP_ASSERT_EQUAL (count, 3);
+
+    count = 0;
+    indexes = pcp_mapping_indexes (515);
+    NP_ASSERT_EQUAL (g_list_length (indexes), 2);
+    g_list_free (indexes);
+
+    indexes = pcp_mapping_indexes (0);
+    indexes = pcp_mapping_foreach_page (indexes, 2, count_mapping, &count);
+    NP_ASSERT_EQUAL (count, 2);
+    NP_ASSERT_EQUAL (g_list_length (indexes), 1);
+    NP_ASSERT_EQUAL (GPOINTER_TO_INT (indexes->data), 530);
+
+    /* A mapping deleted after the indexes were listed is skipped */
+    count = 0;
+    pcp_mapping_delete (530);
+    indexes = pcp_mapping_foreach_page (indexes, 2, count_mapping, &count);
+    NP_ASSERT_EQUAL (count, 0);
+    NP_ASSERT_NULL (indexes);
+
+    pcp_mapping_deleteall ();
+}
+
+#if 0
 /* Test libpcp config setters and getters */
 void
 test_pcp_initialized_set_get (void)
@@ -224,35 +425,6 @@ test_pcp_mapping_destroy (void)
     pcp_mapping_destroy (mapping);
 }
 
-/* Helper functions that add mappings to apteryx */
-static void
-add_test_mapping (int index)
-{
-    u_int32_t mapping_nonce[MAPPING_NONCE_SIZE] = {1732282673, 1882683910, 2109096625};
-    struct in6_addr internal_ip;
-    u_int16_t internal_port = 1234;
-    struct in6_addr external_ip;
-    u_int16_t external_port = 9876;
-    u_int32_t lifetime = 8002;
-    u_int8_t opcode = MAP_OPCODE;
-    u_int8_t protocol = 6;
-
-    inet_pton (AF_INET6, "2001:db8:7654:3210:fedc:ba98:7654:3210", &(internal_ip));
-    inet_pton (AF_INET6, "2001:db8:7654:1234:fedc:abab:4554:9875", &(external_ip));
-
-    NP_ASSERT_TRUE (pcp_mapping_add (index, mapping_nonce, &internal_ip,
-                                     internal_port, &external_ip, external_port,
-                                     lifetime, opcode, protocol));
-}
-
-static void
-add_three_test_mappings (int index1, int index2, int index3)
-{
-    add_test_mapping (index1);
-    add_test_mapping (index2);
-    add_test_mapping (index3);
-}
-
 static void
 add_three_mappings (int index1,
                     int index2,
@@ -601,6 +773,9 @@ test_pcp_mapping_changed_valid_path (void)
     NP_ASSERT_TRUE (pcp_mapping_changed ("/pcp/mappings/1/", NULL, NULL, 0));
     NP_ASSERT_TRUE (pcp_mapping_changed ("/pcp/mappings/32767", NULL, NULL, 0));
     NP_ASSERT_TRUE (pcp_mapping_changed ("/pcp/mappings/32767/", NULL, NULL, 0));
+
+    // Field level changes are accepted but not reported
+    NP_ASSERT_TRUE (pcp_mapping_changed ("/pcp/mappings/1/lifetime", NULL, NULL, 0));
 }
 
 void
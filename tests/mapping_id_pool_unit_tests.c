@@ -0,0 +1,225 @@
+/**
+ * @file mapping_id_pool_unit_tests.c
+ *
+ * Novaprova unit tests for the mapping ID allocator.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/mapping_id_pool.h"
+#include <limits.h>
+#include <stdlib.h>
+
+static mapping_id_pool *pool = NULL;
+
+int
+set_up (void)
+{
+    pool = mapping_id_pool_new (10, 1000);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    mapping_id_pool_free (pool);
+    pool = NULL;
+    return 0;
+}
+
+void
+test_alloc_in_steps (void)
+{
+    NP_ASSERT_EQUAL (mapping_id_pool_high_water (pool), 0);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 10);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 20);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 30);
+    NP_ASSERT_TRUE (mapping_id_pool_in_use (pool, 20));
+    NP_ASSERT_FALSE (mapping_id_pool_in_use (pool, 40));
+    NP_ASSERT_EQUAL (mapping_id_pool_high_water (pool), 30);
+}
+
+void
+test_released_ids_are_reused (void)
+{
+    mapping_id_pool_alloc (pool);
+    mapping_id_pool_alloc (pool);
+    mapping_id_pool_alloc (pool);
+
+    NP_ASSERT_TRUE (mapping_id_pool_release (pool, 20));
+    NP_ASSERT_FALSE (mapping_id_pool_in_use (pool, 20));
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 20);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 40);
+    NP_ASSERT_EQUAL (mapping_id_pool_high_water (pool), 40);
+}
+
+void
+test_release_invalid_ids (void)
+{
+    mapping_id_pool_alloc (pool);
+
+    NP_ASSERT_FALSE (mapping_id_pool_release (pool, 20));
+    NP_ASSERT_FALSE (mapping_id_pool_release (pool, 15));
+    NP_ASSERT_FALSE (mapping_id_pool_release (pool, 0));
+    NP_ASSERT_FALSE (mapping_id_pool_release (pool, -10));
+    NP_ASSERT_TRUE (mapping_id_pool_release (pool, 10));
+    NP_ASSERT_FALSE (mapping_id_pool_release (pool, 10));
+
+    /* A double release must not hand the ID out twice */
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 10);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 20);
+}
+
+void
+test_claimed_ids_are_skipped (void)
+{
+    NP_ASSERT_TRUE (mapping_id_pool_claim (pool, 30));
+    NP_ASSERT_FALSE (mapping_id_pool_claim (pool, 30));
+    NP_ASSERT_EQUAL (mapping_id_pool_high_water (pool), 30);
+
+    /* IDs below a claimed ID are still handed out */
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 10);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 20);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 40);
+}
+
+void
+test_claim_after_release (void)
+{
+    mapping_id_pool_alloc (pool);
+    mapping_id_pool_alloc (pool);
+    mapping_id_pool_release (pool, 10);
+
+    NP_ASSERT_TRUE (mapping_id_pool_claim (pool, 10));
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 30);
+}
+
+void
+test_restore_high_water (void)
+{
+    NP_ASSERT_TRUE (mapping_id_pool_restore (pool, 50));
+    NP_ASSERT_EQUAL (mapping_id_pool_high_water (pool), 50);
+    NP_ASSERT_TRUE (mapping_id_pool_claim (pool, 20));
+
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 10);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 30);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 40);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 50);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 60);
+
+    NP_ASSERT_FALSE (mapping_id_pool_restore (pool, 55));
+    NP_ASSERT_FALSE (mapping_id_pool_restore (pool, 2000));
+}
+
+void
+test_exhausted_pool (void)
+{
+    int i;
+
+    for (i = 1; i <= 100; i++)
+    {
+        NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), i * 10);
+    }
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), -1);
+    NP_ASSERT_FALSE (mapping_id_pool_claim (pool, 1010));
+
+    mapping_id_pool_release (pool, 500);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), 500);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (pool), -1);
+}
+
+void
+test_many_ids (void)
+{
+    mapping_id_pool *big = mapping_id_pool_new (10, 1000000);
+    int i;
+
+    for (i = 1; i <= 10000; i++)
+    {
+        NP_ASSERT_EQUAL (mapping_id_pool_alloc (big), i * 10);
+    }
+    for (i = 1; i <= 10000; i += 2)
+    {
+        NP_ASSERT_TRUE (mapping_id_pool_release (big, i * 10));
+    }
+    for (i = 0; i < 5000; i++)
+    {
+        NP_ASSERT_FALSE (mapping_id_pool_alloc (big) % 20 == 0);
+    }
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (big), 100010);
+    mapping_id_pool_free (big);
+}
+
+void
+test_claim_large_id (void)
+{
+    mapping_id_pool *big = mapping_id_pool_new (10, INT_MAX);
+
+    /* The IDs skipped over are free without each being stored */
+    NP_ASSERT_TRUE (mapping_id_pool_claim (big, 2000000000));
+    NP_ASSERT_EQUAL (mapping_id_pool_high_water (big), 2000000000);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (big), 10);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (big), 20);
+    NP_ASSERT_TRUE (mapping_id_pool_claim (big, 40));
+
+    NP_ASSERT_TRUE (mapping_id_pool_release (big, 10));
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (big), 10);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (big), 30);
+    NP_ASSERT_EQUAL (mapping_id_pool_alloc (big), 50);
+    mapping_id_pool_free (big);
+}
+
+void
+test_random_claim_and_release (void)
+{
+    static bool used[101];
+    int in_use = 0;
+    int i, id;
+
+    srand (1);
+    for (i = 0; i < 100000; i++)
+    {
+        id = (rand () % 100 + 1) * 10;
+        switch (rand () % 3)
+        {
+        case 0:
+            NP_ASSERT_EQUAL (mapping_id_pool_release (pool, id), used[id / 10]);
+            in_use -= used[id / 10];
+            used[id / 10] = false;
+            continue;
+        case 1:
+            NP_ASSERT_EQUAL (mapping_id_pool_claim (pool, id), !used[id / 10]);
+            in_use += !used[id / 10];
+            used[id / 10] = true;
+            continue;
+        }
+
+        id = mapping_id_pool_alloc (pool);
+        if (in_use == 100)
+        {
+            NP_ASSERT_EQUAL (id, -1);
+            continue;
+        }
+        NP_ASSERT_TRUE (id >= 10 && id <= 1000 && id % 10 == 0);
+        NP_ASSERT_FALSE (used[id / 10]);
+        used[id / 10] = true;
+        in_use++;
+    }
+}
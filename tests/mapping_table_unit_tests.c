@@ -0,0 +1,355 @@
+/**
+ * @file mapping_table_unit_tests.c
+ *
+ * Novaprova unit tests for the hash-indexed mapping table.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/mapping_table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+static mapping_table *table = NULL;
+
+int
+set_up (void)
+{
+    table = mapping_table_new (free);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    mapping_table_free (table);
+    table = NULL;
+    return 0;
+}
+
+static pcp_mapping
+make_mapping (int index, u_int32_t nonce, const char *internal_ip,
+              u_int16_t internal_port, u_int16_t external_port, u_int8_t protocol)
+{
+    pcp_mapping mapping = calloc (1, sizeof (*mapping));
+
+    mapping->index = index;
+    mapping->mapping_nonce[0] = nonce;
+    mapping->mapping_nonce[1] = nonce + 1;
+    mapping->mapping_nonce[2] = nonce + 2;
+    inet_pton (AF_INET6, internal_ip, &mapping->internal_ip);
+    mapping->internal_port = internal_port;
+    inet_pton (AF_INET6, "::ffff:10.0.0.1", &mapping->external_ip);
+    mapping->external_port = external_port;
+    mapping->protocol = protocol;
+    return mapping;
+}
+
+static bool
+collect_index (pcp_mapping mapping, void *data)
+{
+    GList **indexes = (GList **) data;
+
+    *indexes = g_list_append (*indexes, GINT_TO_POINTER (mapping->index));
+    return true;
+}
+
+static bool
+count_until_two (pcp_mapping mapping, void *data)
+{
+    int *count = (int *) data;
+
+    (*count)++;
+    return *count < 2;
+}
+
+void
+test_find_index (void)
+{
+    pcp_mapping mapping = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+
+    mapping_table_insert (table, mapping);
+
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_index (table, 10), mapping);
+    NP_ASSERT_NULL (mapping_table_find_index (table, 20));
+    NP_ASSERT_EQUAL (mapping_table_size (table), 1);
+}
+
+void
+test_find_request (void)
+{
+    pcp_mapping mapping = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    u_int32_t nonce[MAPPING_NONCE_SIZE] = { 1, 2, 3 };
+    u_int32_t other_nonce[MAPPING_NONCE_SIZE] = { 1, 2, 4 };
+    struct in6_addr ip;
+
+    mapping_table_insert (table, mapping);
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ip);
+
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_request (table, nonce, &ip, 80, 6), mapping);
+    NP_ASSERT_NULL (mapping_table_find_request (table, other_nonce, &ip, 80, 6));
+    NP_ASSERT_NULL (mapping_table_find_request (table, nonce, &ip, 81, 6));
+    NP_ASSERT_NULL (mapping_table_find_request (table, nonce, &ip, 80, 17));
+}
+
+void
+test_find_external (void)
+{
+    pcp_mapping mapping = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    struct in6_addr ip;
+
+    mapping_table_insert (table, mapping);
+    inet_pton (AF_INET6, "::ffff:10.0.0.1", &ip);
+
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_external (table, &ip, 8080, 6), mapping);
+    NP_ASSERT_NULL (mapping_table_find_external (table, &ip, 8081, 6));
+}
+
+void
+test_external_users (void)
+{
+    struct in6_addr ip;
+
+    inet_pton (AF_INET6, "::ffff:10.0.0.1", &ip);
+
+    mapping_table_insert (table, make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6));
+    mapping_table_insert (table, make_mapping (20, 5, "::ffff:192.168.1.2", 80, 8080, 6));
+    NP_ASSERT_EQUAL (mapping_table_external_users (table, &ip, 8080, 6), 2);
+    NP_ASSERT_EQUAL (mapping_table_external_users (table, &ip, 8080, 17), 0);
+
+    /* Replacing a mapping does not count it twice */
+    mapping_table_insert (table, make_mapping (20, 5, "::ffff:192.168.1.2", 80, 8080, 6));
+    NP_ASSERT_EQUAL (mapping_table_external_users (table, &ip, 8080, 6), 2);
+
+    /* Each mapping removed is counted off */
+    mapping_table_remove (table, 20);
+    NP_ASSERT_EQUAL (mapping_table_external_users (table, &ip, 8080, 6), 1);
+    mapping_table_remove (table, 10);
+    NP_ASSERT_EQUAL (mapping_table_external_users (table, &ip, 8080, 6), 0);
+}
+
+void
+test_find_internal (void)
+{
+    pcp_mapping mapping = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    struct in6_addr ip;
+
+    mapping_table_insert (table, mapping);
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ip);
+
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_internal (table, &ip, 80, 6), mapping);
+    NP_ASSERT_NULL (mapping_table_find_internal (table, &ip, 81, 6));
+    NP_ASSERT_NULL (mapping_table_find_internal (table, &ip, 80, 17));
+
+    mapping_table_remove (table, 10);
+    NP_ASSERT_NULL (mapping_table_find_internal (table, &ip, 80, 6));
+}
+
+void
+test_find_peer (void)
+{
+    pcp_mapping mapping = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    u_int32_t nonce[MAPPING_NONCE_SIZE] = { 1, 2, 3 };
+    struct in6_addr ip;
+    struct in6_addr peer_ip;
+    struct in6_addr other_peer_ip;
+
+    mapping->opcode = PEER_OPCODE;
+    inet_pton (AF_INET6, "::ffff:198.51.100.1", &mapping->remote_peer_ip);
+    mapping->remote_peer_port = 443;
+    mapping_table_insert (table, mapping);
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ip);
+    inet_pton (AF_INET6, "::ffff:198.51.100.1", &peer_ip);
+    inet_pton (AF_INET6, "::ffff:198.51.100.2", &other_peer_ip);
+
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_peer (table, &ip, 80, &peer_ip, 443, 6), mapping);
+    NP_ASSERT_NULL (mapping_table_find_peer (table, &ip, 80, &other_peer_ip, 443, 6));
+    NP_ASSERT_NULL (mapping_table_find_peer (table, &ip, 80, &peer_ip, 80, 6));
+    NP_ASSERT_NULL (mapping_table_find_peer (table, &ip, 80, &peer_ip, 443, 17));
+
+    /* MAP requests with the same nonce and internal endpoint do not find it */
+    NP_ASSERT_NULL (mapping_table_find_request (table, nonce, &ip, 80, 6));
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_internal (table, &ip, 80, 6), mapping);
+
+    mapping_table_remove (table, 10);
+    NP_ASSERT_NULL (mapping_table_find_peer (table, &ip, 80, &peer_ip, 443, 6));
+}
+
+void
+test_peers_of_one_endpoint (void)
+{
+    pcp_mapping map = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    pcp_mapping first = make_mapping (20, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    pcp_mapping second = make_mapping (30, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    u_int32_t nonce[MAPPING_NONCE_SIZE] = { 1, 2, 3 };
+    struct in6_addr ip;
+
+    first->opcode = second->opcode = PEER_OPCODE;
+    inet_pton (AF_INET6, "::ffff:198.51.100.1", &first->remote_peer_ip);
+    inet_pton (AF_INET6, "::ffff:198.51.100.2", &second->remote_peer_ip);
+    first->remote_peer_port = second->remote_peer_port = 443;
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ip);
+
+    mapping_table_insert (table, map);
+    mapping_table_insert (table, first);
+    mapping_table_insert (table, second);
+
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_request (table, nonce, &ip, 80, 6), map);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_peer (table, &ip, 80, &first->remote_peer_ip,
+                                                  443, 6), first);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_peer (table, &ip, 80, &second->remote_peer_ip,
+                                                  443, 6), second);
+
+    mapping_table_remove (table, 20);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_request (table, nonce, &ip, 80, 6), map);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_peer (table, &ip, 80, &second->remote_peer_ip,
+                                                  443, 6), second);
+}
+
+void
+test_endpoints_outlive_shared_peer (void)
+{
+    pcp_mapping map = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    pcp_mapping peer = make_mapping (20, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    struct in6_addr internal_ip;
+    struct in6_addr external_ip;
+
+    peer->opcode = PEER_OPCODE;
+    inet_pton (AF_INET6, "::ffff:198.51.100.1", &peer->remote_peer_ip);
+    peer->remote_peer_port = 443;
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &internal_ip);
+    inet_pton (AF_INET6, "::ffff:10.0.0.1", &external_ip);
+
+    mapping_table_insert (table, map);
+    mapping_table_insert (table, peer);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_internal (table, &internal_ip, 80, 6), peer);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_external (table, &external_ip, 8080, 6), peer);
+
+    /* The MAP mapping is still found by its endpoints once the PEER is gone */
+    mapping_table_remove (table, 20);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_internal (table, &internal_ip, 80, 6), map);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_external (table, &external_ip, 8080, 6), map);
+
+    mapping_table_remove (table, 10);
+    NP_ASSERT_NULL (mapping_table_find_internal (table, &internal_ip, 80, 6));
+    NP_ASSERT_NULL (mapping_table_find_external (table, &external_ip, 8080, 6));
+}
+
+void
+test_remove (void)
+{
+    u_int32_t nonce[MAPPING_NONCE_SIZE] = { 1, 2, 3 };
+    struct in6_addr ip;
+
+    mapping_table_insert (table, make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6));
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ip);
+
+    NP_ASSERT_TRUE (mapping_table_remove (table, 10));
+    NP_ASSERT_FALSE (mapping_table_remove (table, 10));
+    NP_ASSERT_NULL (mapping_table_find_index (table, 10));
+    NP_ASSERT_NULL (mapping_table_find_request (table, nonce, &ip, 80, 6));
+    NP_ASSERT_EQUAL (mapping_table_size (table), 0);
+}
+
+void
+test_insert_replaces_same_index (void)
+{
+    pcp_mapping first = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    pcp_mapping second = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    u_int32_t nonce[MAPPING_NONCE_SIZE] = { 1, 2, 3 };
+    struct in6_addr ip;
+
+    second->lifetime = 600;
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ip);
+
+    mapping_table_insert (table, first);
+    mapping_table_insert (table, second);
+
+    NP_ASSERT_EQUAL (mapping_table_size (table), 1);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_index (table, 10), second);
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_request (table, nonce, &ip, 80, 6), second);
+}
+
+void
+test_remove_keeps_other_mapping_with_same_key (void)
+{
+    pcp_mapping first = make_mapping (10, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    pcp_mapping second = make_mapping (20, 1, "::ffff:192.168.1.2", 80, 8080, 6);
+    u_int32_t nonce[MAPPING_NONCE_SIZE] = { 1, 2, 3 };
+    struct in6_addr ip;
+
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ip);
+
+    mapping_table_insert (table, first);
+    mapping_table_insert (table, second);
+    mapping_table_remove (table, 10);
+
+    NP_ASSERT_PTR_EQUAL (mapping_table_find_request (table, nonce, &ip, 80, 6), second);
+}
+
+void
+test_foreach_in_index_order (void)
+{
+    GList *indexes = NULL;
+    int count = 0;
+
+    mapping_table_insert (table, make_mapping (30, 1, "::ffff:192.168.1.2", 80, 8080, 6));
+    mapping_table_insert (table, make_mapping (10, 2, "::ffff:192.168.1.2", 81, 8081, 6));
+    mapping_table_insert (table, make_mapping (20, 3, "::ffff:192.168.1.2", 82, 8082, 6));
+
+    mapping_table_foreach (table, collect_index, &indexes);
+
+    NP_ASSERT_EQUAL (g_list_length (indexes), 3);
+    NP_ASSERT_EQUAL (GPOINTER_TO_INT (g_list_nth_data (indexes, 0)), 10);
+    NP_ASSERT_EQUAL (GPOINTER_TO_INT (g_list_nth_data (indexes, 1)), 20);
+    NP_ASSERT_EQUAL (GPOINTER_TO_INT (g_list_nth_data (indexes, 2)), 30);
+    g_list_free (indexes);
+
+    mapping_table_foreach (table, count_until_two, &count);
+    NP_ASSERT_EQUAL (count, 2);
+}
+
+void
+test_foreach_from (void)
+{
+    GList *indexes = NULL;
+
+    mapping_table_insert (table, make_mapping (30, 1, "::ffff:192.168.1.2", 80, 8080, 6));
+    mapping_table_insert (table, make_mapping (10, 2, "::ffff:192.168.1.2", 81, 8081, 6));
+    mapping_table_insert (table, make_mapping (20, 3, "::ffff:192.168.1.2", 82, 8082, 6));
+
+    mapping_table_foreach_from (table, 11, collect_index, &indexes);
+
+    NP_ASSERT_EQUAL (g_list_length (indexes), 2);
+    NP_ASSERT_EQUAL (GPOINTER_TO_INT (g_list_nth_data (indexes, 0)), 20);
+    NP_ASSERT_EQUAL (GPOINTER_TO_INT (g_list_nth_data (indexes, 1)), 30);
+    g_list_free (indexes);
+    indexes = NULL;
+
+    mapping_table_foreach_from (table, 20, collect_index, &indexes);
+    NP_ASSERT_EQUAL (g_list_length (indexes), 2);
+    NP_ASSERT_EQUAL (GPOINTER_TO_INT (g_list_nth_data (indexes, 0)), 20);
+    g_list_free (indexes);
+    indexes = NULL;
+
+    mapping_table_foreach_from (table, 31, collect_index, &indexes);
+    NP_ASSERT_NULL (indexes);
+}
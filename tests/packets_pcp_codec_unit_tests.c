@@ -0,0 +1,283 @@
+/**
+ * @file packets_pcp_codec_unit_tests.c
+ *
+ * Novaprova unit tests for the fast PCP packet codec. Every available codec
+ * is checked against the reference serialization functions with random
+ * packets.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/packets_pcp.h"
+#include "../pcpd/packets_pcp_serialization.h"
+#include "../pcpd/packets_pcp_codec.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_ITERATIONS 20000
+#define FUZZ_SEED 6887
+
+static pcp_codec_impl impls[] = { PCP_CODEC_SCALAR, PCP_CODEC_SIMD };
+
+static void
+random_bytes (void *data, size_t len)
+{
+    unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        p[i] = rand () & 0xFF;
+    }
+}
+
+int
+tear_down (void)
+{
+    pcp_codec_set (PCP_CODEC_SCALAR);
+    return 0;
+}
+
+void
+test_codec_names (void)
+{
+    NP_ASSERT_TRUE (pcp_codec_set (PCP_CODEC_SCALAR));
+    NP_ASSERT_STR_EQUAL (pcp_codec_name (), "scalar");
+
+    pcp_codec_init ();
+    NP_ASSERT_NOT_NULL (pcp_codec_name ());
+}
+
+void
+test_codec_decode_known_map_request (void)
+{
+    unsigned char data[MIN_MAP_PKT_LEN] = {
+        2, 1, 0, 0, 0, 0, 0x0E, 0x10,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 192, 168, 1, 2,
+        0x7A, 0xAA, 0xAA, 0xAA, 0x7A, 0xAA, 0xAA, 0xA9, 0x7A, 0xAA, 0xAA, 0xA8,
+        6, 0, 0, 0, 0xCA, 0x05, 0x10, 0xE1,
+        0x20, 0x01, 0x0D, 0xB8, 0x76, 0x54, 0x32, 0x10,
+        0xFE, 0xDC, 0xBA, 0x98, 0x76, 0x54, 0x32, 0x10
+    };
+    map_request map_req;
+    int i;
+
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+        if (!pcp_codec_set (impls[i]))
+        {
+            continue;
+        }
+        memset (&map_req, 0, sizeof (map_req));
+        NP_ASSERT_PTR_EQUAL (pcp_codec_decode_map_request (&map_req, data),
+                             data + MIN_MAP_PKT_LEN);
+        NP_ASSERT_EQUAL (map_req.header.version, PCP_VERSION);
+        NP_ASSERT_EQUAL (map_req.header.r_opcode, MAP_OPCODE);
+        NP_ASSERT_EQUAL (map_req.header.requested_lifetime, 3600);
+        NP_ASSERT_EQUAL (map_req.header.client_ip.s6_addr[12], 192);
+        NP_ASSERT_EQUAL (map_req.mapping_nonce[0], 2058005162);
+        NP_ASSERT_EQUAL (map_req.mapping_nonce[1], 2058005161);
+        NP_ASSERT_EQUAL (map_req.mapping_nonce[2], 2058005160);
+        NP_ASSERT_EQUAL (map_req.protocol, 6);
+        NP_ASSERT_EQUAL (map_req.internal_port, 51717);
+        NP_ASSERT_EQUAL (map_req.suggested_external_port, 4321);
+        NP_ASSERT_EQUAL (map_req.suggested_external_ip.s6_addr[0], 0x20);
+        NP_ASSERT_EQUAL (map_req.suggested_external_ip.s6_addr[15], 0x10);
+    }
+}
+
+void
+test_codec_fuzz_map_request (void)
+{
+    unsigned char data[MIN_MAP_PKT_LEN];
+    unsigned char expected_buf[MIN_MAP_PKT_LEN];
+    unsigned char result_buf[MIN_MAP_PKT_LEN];
+    map_request expected;
+    map_request result;
+    int i, n;
+
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+        if (!pcp_codec_set (impls[i]))
+        {
+            continue;
+        }
+        srand (FUZZ_SEED);
+        for (n = 0; n < FUZZ_ITERATIONS; n++)
+        {
+            random_bytes (data, sizeof (data));
+            deserialize_map_request_into (&expected, data);
+            pcp_codec_decode_map_request (&result, data);
+            NP_ASSERT_TRUE (memcmp (&expected, &result, sizeof (map_request)) == 0);
+
+            random_bytes (&expected, sizeof (expected));
+            serialize_map_request (expected_buf, &expected);
+            NP_ASSERT_PTR_EQUAL (pcp_codec_encode_map_request (result_buf, &expected),
+                                 result_buf + MIN_MAP_PKT_LEN);
+            NP_ASSERT_TRUE (memcmp (expected_buf, result_buf, MIN_MAP_PKT_LEN) == 0);
+        }
+    }
+}
+
+void
+test_codec_fuzz_map_response (void)
+{
+    unsigned char data[MIN_MAP_PKT_LEN];
+    unsigned char expected_buf[MIN_MAP_PKT_LEN];
+    unsigned char result_buf[MIN_MAP_PKT_LEN];
+    map_response expected;
+    map_response result;
+    int i, n;
+
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+        if (!pcp_codec_set (impls[i]))
+        {
+            continue;
+        }
+        srand (FUZZ_SEED);
+        for (n = 0; n < FUZZ_ITERATIONS; n++)
+        {
+            random_bytes (data, sizeof (data));
+            deserialize_map_response_into (&expected, data);
+            NP_ASSERT_PTR_EQUAL (pcp_codec_decode_map_response (&result, data),
+                                 data + MIN_MAP_PKT_LEN);
+            NP_ASSERT_TRUE (memcmp (&expected, &result, sizeof (map_response)) == 0);
+
+            random_bytes (&expected, sizeof (expected));
+            serialize_map_response (expected_buf, &expected);
+            pcp_codec_encode_map_response (result_buf, &expected);
+            NP_ASSERT_TRUE (memcmp (expected_buf, result_buf, MIN_MAP_PKT_LEN) == 0);
+        }
+    }
+}
+
+void
+test_codec_fuzz_peer_request (void)
+{
+    unsigned char data[MIN_PEER_PKT_LEN];
+    peer_request expected;
+    peer_request result;
+    int i, n;
+
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+        if (!pcp_codec_set (impls[i]))
+        {
+            continue;
+        }
+        srand (FUZZ_SEED);
+        for (n = 0; n < FUZZ_ITERATIONS; n++)
+        {
+            random_bytes (data, sizeof (data));
+            deserialize_peer_request_into (&expected, data);
+            NP_ASSERT_PTR_EQUAL (pcp_codec_decode_peer_request (&result, data),
+                                 data + MIN_PEER_PKT_LEN);
+            NP_ASSERT_TRUE (memcmp (&expected, &result, sizeof (peer_request)) == 0);
+        }
+    }
+}
+
+void
+test_codec_fuzz_peer_response (void)
+{
+    unsigned char expected_buf[MIN_PEER_PKT_LEN];
+    unsigned char result_buf[MIN_PEER_PKT_LEN];
+    peer_response expected;
+    int i, n;
+
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+        if (!pcp_codec_set (impls[i]))
+        {
+            continue;
+        }
+        srand (FUZZ_SEED);
+        for (n = 0; n < FUZZ_ITERATIONS; n++)
+        {
+            random_bytes (&expected, sizeof (expected));
+            serialize_peer_response (expected_buf, &expected);
+            NP_ASSERT_PTR_EQUAL (pcp_codec_encode_peer_response (result_buf, &expected),
+                                 result_buf + MIN_PEER_PKT_LEN);
+            NP_ASSERT_TRUE (memcmp (expected_buf, result_buf, MIN_PEER_PKT_LEN) == 0);
+        }
+    }
+}
+
+void
+test_codec_fuzz_response_header (void)
+{
+    unsigned char expected_buf[sizeof (pcp_response_header)];
+    unsigned char result_buf[sizeof (pcp_response_header)];
+    pcp_response_header header;
+    int n;
+
+    srand (FUZZ_SEED);
+    for (n = 0; n < FUZZ_ITERATIONS; n++)
+    {
+        random_bytes (&header, sizeof (header));
+        serialize_response_header (expected_buf, &header);
+        NP_ASSERT_PTR_EQUAL (pcp_codec_encode_response_header (result_buf, &header),
+                             result_buf + sizeof (pcp_response_header));
+        NP_ASSERT_TRUE (memcmp (expected_buf, result_buf, sizeof (pcp_response_header)) == 0);
+    }
+}
+
+void
+test_codec_in_place (void)
+{
+    unsigned char data[MIN_MAP_PKT_LEN];
+    map_request expected;
+    int i;
+
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+        if (!pcp_codec_set (impls[i]))
+        {
+            continue;
+        }
+        srand (FUZZ_SEED);
+        random_bytes (data, sizeof (data));
+        deserialize_map_request_into (&expected, data);
+        pcp_codec_decode_map_request ((map_request *) data, data);
+        NP_ASSERT_TRUE (memcmp (&expected, data, sizeof (map_request)) == 0);
+    }
+}
+
+void
+test_codec_peer_in_place (void)
+{
+    unsigned char data[MIN_PEER_PKT_LEN];
+    peer_request expected;
+    int i;
+
+    for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+        if (!pcp_codec_set (impls[i]))
+        {
+            continue;
+        }
+        srand (FUZZ_SEED);
+        random_bytes (data, sizeof (data));
+        deserialize_peer_request_into (&expected, data);
+        pcp_codec_decode_peer_request ((peer_request *) data, data);
+        NP_ASSERT_TRUE (memcmp (&expected, data, sizeof (peer_request)) == 0);
+    }
+}
@@ -0,0 +1,382 @@
+/**
+ * @file packets_pcp_options_unit_tests.c
+ *
+ * Novaprova unit tests for the PCP option parser and encoder.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/packets_pcp.h"
+#include "../pcpd/packets_pcp_options.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_ITERATIONS 20000
+#define FUZZ_SEED 6887
+
+/* Space for the options of the largest MAP request */
+#define OPTIONS_SPACE (MAX_PAYLOAD_LEN - MIN_MAP_PKT_LEN)
+
+static unsigned char data[OPTIONS_SPACE];
+static pcp_options options;
+static struct in6_addr ipv4_addr;
+static struct in6_addr ipv6_addr;
+
+int
+set_up (void)
+{
+    memset (data, 0, sizeof (data));
+    memset (&options, 0xFF, sizeof (options));
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ipv4_addr);
+    inet_pton (AF_INET6, "2001:db8::2", &ipv6_addr);
+    return 0;
+}
+
+/* Write an option with the given data length and return the end of it */
+static unsigned char *
+add_option (unsigned char *buffer, u_int8_t code, u_int16_t length, const void *value)
+{
+    int padded = (length + 3) & ~3;
+
+    buffer[0] = code;
+    buffer[1] = 0;
+    buffer[2] = length >> 8;
+    buffer[3] = length & 0xFF;
+    memset (buffer + OPTION_HEADER_LEN, 0, padded);
+    if (value)
+    {
+        memcpy (buffer + OPTION_HEADER_LEN, value, length);
+    }
+    return buffer + OPTION_HEADER_LEN + padded;
+}
+
+static unsigned char *
+add_filter (unsigned char *buffer, u_int8_t prefix_length, u_int16_t port,
+            struct in6_addr *ip)
+{
+    unsigned char value[FILTER_OPTION_LEN] = { 0, prefix_length, port >> 8, port & 0xFF };
+
+    memcpy (value + 4, ip, sizeof (*ip));
+    return add_option (buffer, FILTER_OPTION, FILTER_OPTION_LEN, value);
+}
+
+static int
+parse (u_int8_t opcode, unsigned char *end)
+{
+    return pcp_options_parse (&options, opcode, data, end - data);
+}
+
+void
+test_no_options (void)
+{
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, data), SUCCESS);
+    NP_ASSERT_EQUAL (options.count, 0);
+    NP_ASSERT_FALSE (options.third_party);
+    NP_ASSERT_FALSE (options.prefer_failure);
+    NP_ASSERT_EQUAL (options.num_filters, 0);
+}
+
+void
+test_third_party (void)
+{
+    unsigned char *end = add_option (data, THIRD_PARTY_OPTION, THIRD_PARTY_OPTION_LEN,
+                                     &ipv4_addr);
+
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), SUCCESS);
+    NP_ASSERT_EQUAL (options.count, 1);
+    NP_ASSERT_TRUE (options.third_party);
+    NP_ASSERT_EQUAL (memcmp (&options.third_party_ip, &ipv4_addr, sizeof (ipv4_addr)), 0);
+
+    NP_ASSERT_EQUAL (parse (PEER_OPCODE, end), SUCCESS);
+    NP_ASSERT_TRUE (options.third_party);
+    NP_ASSERT_EQUAL (parse (ANNOUNCE_OPCODE, end), UNSUPP_OPTION);
+}
+
+void
+test_prefer_failure (void)
+{
+    unsigned char *end = add_option (data, PREFER_FAILURE_OPTION, 0, NULL);
+
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), SUCCESS);
+    NP_ASSERT_TRUE (options.prefer_failure);
+    NP_ASSERT_FALSE (options.third_party);
+    NP_ASSERT_EQUAL (parse (PEER_OPCODE, end), UNSUPP_OPTION);
+}
+
+void
+test_filters (void)
+{
+    unsigned char *end = data;
+
+    end = add_filter (end, 128, 443, &ipv6_addr);
+    end = add_filter (end, 120, 0, &ipv4_addr);
+    end = add_option (end, PREFER_FAILURE_OPTION, 0, NULL);
+
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), SUCCESS);
+    NP_ASSERT_EQUAL (options.count, 3);
+    NP_ASSERT_EQUAL (options.num_filters, 2);
+    NP_ASSERT_EQUAL (options.list[0].code, FILTER_OPTION);
+    NP_ASSERT_EQUAL (options.list[0].prefix_length, 128);
+    NP_ASSERT_EQUAL (options.list[0].port, 443);
+    NP_ASSERT_EQUAL (memcmp (&options.list[0].ip, &ipv6_addr, sizeof (ipv6_addr)), 0);
+    NP_ASSERT_EQUAL (options.list[1].prefix_length, 120);
+    NP_ASSERT_EQUAL (options.list[2].code, PREFER_FAILURE_OPTION);
+}
+
+void
+test_invalid_filter_prefix (void)
+{
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, add_filter (data, 129, 0, &ipv6_addr)),
+                     MALFORMED_OPTION);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, add_filter (data, 95, 0, &ipv4_addr)),
+                     MALFORMED_OPTION);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, add_filter (data, 0, 0, &ipv6_addr)), SUCCESS);
+}
+
+void
+test_too_many_filters (void)
+{
+    unsigned char *end = data;
+    int i;
+
+    for (i = 0; i < MAX_FILTER_OPTIONS; i++)
+    {
+        end = add_filter (end, 128, i, &ipv6_addr);
+    }
+    end = add_option (end, THIRD_PARTY_OPTION, THIRD_PARTY_OPTION_LEN, &ipv6_addr);
+    end = add_option (end, PREFER_FAILURE_OPTION, 0, NULL);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), SUCCESS);
+    NP_ASSERT_EQUAL (options.count, MAX_OPTIONS);
+
+    end = add_filter (end, 128, i, &ipv6_addr);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), EXCESSIVE_REMOTE_PEERS);
+}
+
+void
+test_repeated_option (void)
+{
+    unsigned char *end = data;
+
+    end = add_option (end, THIRD_PARTY_OPTION, THIRD_PARTY_OPTION_LEN, &ipv4_addr);
+    end = add_option (end, THIRD_PARTY_OPTION, THIRD_PARTY_OPTION_LEN, &ipv6_addr);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), MALFORMED_OPTION);
+
+    end = add_option (data, PREFER_FAILURE_OPTION, 0, NULL);
+    end = add_option (end, PREFER_FAILURE_OPTION, 0, NULL);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), MALFORMED_OPTION);
+}
+
+void
+test_unknown_options (void)
+{
+    unsigned char value[5] = { 1, 2, 3, 4, 5 };
+    unsigned char *end;
+
+    /* Optional options are skipped, including their padding */
+    end = add_option (data, OPTIONAL_OPTION_MIN, 5, value);
+    end = add_option (end, PREFER_FAILURE_OPTION, 0, NULL);
+    NP_ASSERT_EQUAL (end - data, 16);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), SUCCESS);
+    NP_ASSERT_EQUAL (options.count, 1);
+    NP_ASSERT_TRUE (options.prefer_failure);
+
+    end = add_option (data, OPTIONAL_OPTION_MIN - 1, 5, value);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), UNSUPP_OPTION);
+    end = add_option (data, 0, 0, NULL);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), UNSUPP_OPTION);
+}
+
+void
+test_wrong_length (void)
+{
+    unsigned char *end;
+
+    end = add_option (data, THIRD_PARTY_OPTION, 12, &ipv4_addr);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), MALFORMED_OPTION);
+    end = add_option (data, PREFER_FAILURE_OPTION, 4, &ipv4_addr);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), MALFORMED_OPTION);
+}
+
+void
+test_truncated (void)
+{
+    unsigned char *end = add_option (data, THIRD_PARTY_OPTION, THIRD_PARTY_OPTION_LEN,
+                                     &ipv4_addr);
+
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end - 4), MALFORMED_OPTION);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, data + 2), MALFORMED_OPTION);
+
+    /* The length of an unknown option is checked too */
+    data[0] = 200;
+    data[2] = 0xFF;
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), MALFORMED_OPTION);
+
+    NP_ASSERT_EQUAL (pcp_options_parse (&options, MAP_OPCODE, data, MAX_PAYLOAD_LEN + 4),
+                     MALFORMED_REQUEST);
+}
+
+void
+test_encode (void)
+{
+    unsigned char value[8] = { 0 };
+    unsigned char result[OPTIONS_SPACE];
+    unsigned char *end = data;
+    int len;
+
+    end = add_option (end, THIRD_PARTY_OPTION, THIRD_PARTY_OPTION_LEN, &ipv6_addr);
+    end = add_option (end, OPTIONAL_OPTION_MIN, sizeof (value), value);
+    len = end - data;
+    end = add_option (end, PREFER_FAILURE_OPTION, 0, NULL);
+    end = add_filter (end, 112, 8080, &ipv6_addr);
+    NP_ASSERT_EQUAL (parse (MAP_OPCODE, end), SUCCESS);
+
+    /* Everything but the unknown option is returned, in order */
+    memset (result, 0xFF, sizeof (result));
+    NP_ASSERT_PTR_EQUAL (pcp_options_encode (result, result + sizeof (result), &options),
+                         result + (end - data) - (OPTION_HEADER_LEN + sizeof (value)));
+    NP_ASSERT_EQUAL (memcmp (result, data, OPTION_HEADER_LEN + THIRD_PARTY_OPTION_LEN), 0);
+    NP_ASSERT_EQUAL (memcmp (result + OPTION_HEADER_LEN + THIRD_PARTY_OPTION_LEN, data + len,
+                             end - data - len), 0);
+
+    /* Options that do not fit are left out */
+    NP_ASSERT_PTR_EQUAL (pcp_options_encode (result, result + 23, &options),
+                         result + OPTION_HEADER_LEN + THIRD_PARTY_OPTION_LEN);
+    NP_ASSERT_PTR_EQUAL (pcp_options_encode (result, result + 3, &options), result);
+}
+
+void
+test_option_names (void)
+{
+    NP_ASSERT_STR_EQUAL (pcp_option_name (THIRD_PARTY_OPTION), "THIRD_PARTY");
+    NP_ASSERT_STR_EQUAL (pcp_option_name (PREFER_FAILURE_OPTION), "PREFER_FAILURE");
+    NP_ASSERT_STR_EQUAL (pcp_option_name (FILTER_OPTION), "FILTER");
+    NP_ASSERT_STR_EQUAL (pcp_option_name (0), "Unknown");
+    NP_ASSERT_STR_EQUAL (pcp_option_name (255), "Unknown");
+}
+
+static bool
+expected_result (result_code result)
+{
+    return result == SUCCESS || result == UNSUPP_OPTION || result == MALFORMED_OPTION ||
+           result == EXCESSIVE_REMOTE_PEERS;
+}
+
+/* Check a parsed request encodes to options that parse to the same thing */
+static void
+check_round_trip (u_int8_t opcode, int len)
+{
+    unsigned char result[OPTIONS_SPACE];
+    pcp_options reparsed;
+    unsigned char *end;
+
+    NP_ASSERT_TRUE (options.count <= MAX_OPTIONS);
+    end = pcp_options_encode (result, result + sizeof (result), &options);
+    NP_ASSERT_TRUE (end - result <= len);
+    NP_ASSERT_EQUAL (pcp_options_parse (&reparsed, opcode, result, end - result), SUCCESS);
+    NP_ASSERT_EQUAL (reparsed.count, options.count);
+    NP_ASSERT_EQUAL (memcmp (reparsed.list, options.list,
+                             options.count * sizeof (pcp_option)), 0);
+}
+
+void
+test_fuzz_random_bytes (void)
+{
+    u_int8_t opcode;
+    int len, i, n;
+
+    srand (FUZZ_SEED);
+    for (n = 0; n < FUZZ_ITERATIONS; n++)
+    {
+        len = (rand () % (OPTIONS_SPACE / 4 + 1)) * 4;
+        for (i = 0; i < len; i++)
+        {
+            data[i] = rand () & 0xFF;
+        }
+        opcode = 1 + rand () % 3;
+
+        /* The options end exactly at the end of the buffer */
+        memmove (data + OPTIONS_SPACE - len, data, len);
+        NP_ASSERT_TRUE (expected_result (pcp_options_parse (&options, opcode,
+                                                            data + OPTIONS_SPACE - len, len)));
+    }
+}
+
+/* The data length of a known option */
+static u_int16_t
+option_length (u_int8_t code)
+{
+    return code == THIRD_PARTY_OPTION ? THIRD_PARTY_OPTION_LEN :
+           code == FILTER_OPTION ? FILTER_OPTION_LEN : PREFER_FAILURE_OPTION_LEN;
+}
+
+void
+test_fuzz_option_lists (void)
+{
+    static const u_int8_t codes[] = {
+        THIRD_PARTY_OPTION, PREFER_FAILURE_OPTION, FILTER_OPTION, 0, 4, 127, 128, 255,
+    };
+    static const u_int16_t lengths[] = { 0, 1, 3, 16, 20, 64 };
+    unsigned char value[64];
+    unsigned char *end;
+    u_int8_t opcode, code;
+    u_int16_t length;
+    result_code result;
+    int successes = 0;
+    int count, i, j, n;
+
+    srand (FUZZ_SEED);
+    for (n = 0; n < FUZZ_ITERATIONS; n++)
+    {
+        /* Mostly well-formed lists of known options */
+        end = data;
+        count = rand () % 8;
+        for (i = 0; i < count; i++)
+        {
+            code = codes[rand () % 4 == 0 ? rand () % 8 : rand () % 3];
+            if (code <= FILTER_OPTION && code > 0 && rand () % 8 != 0)
+            {
+                length = option_length (code);
+            }
+            else
+            {
+                length = lengths[rand () % 6];
+            }
+            for (j = 0; j < length; j++)
+            {
+                value[j] = rand () & 0xFF;
+            }
+            if (code == FILTER_OPTION && rand () % 2)
+            {
+                value[1] = 128;
+            }
+            end = add_option (end, code, length, value);
+        }
+        opcode = 1 + rand () % 3;
+
+        result = parse (opcode, end);
+        NP_ASSERT_TRUE (expected_result (result));
+        if (result == SUCCESS)
+        {
+            successes++;
+            check_round_trip (opcode, end - data);
+        }
+    }
+    NP_ASSERT_TRUE (successes > FUZZ_ITERATIONS / 20);
+}
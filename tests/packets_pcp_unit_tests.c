@@ -631,6 +631,130 @@ test_deserialize_map_response (void)
     free (result);
 }
 
+void
+test_deserialize_map_request_into (void)
+{
+    map_request map_req = { { 0 } };
+    map_request result;
+    unsigned char buffer[MAX_PAYLOAD_LEN] = { '\0' };
+    unsigned char *end;
+    struct in6_addr client_ip = { { { 0x80, 0xfe, 0, 0, 0, 0, 0, 0,
+                                      0x20, 0x20, 0xff, 0x3b, 0x2e, 0xef, 0x38, 0x29 } } };
+
+    map_req.header.version = PCP_VERSION;
+    map_req.header.r_opcode = R_REQUEST (MAP_OPCODE);
+    map_req.header.requested_lifetime = 3600;
+    map_req.header.client_ip = client_ip;
+    map_req.mapping_nonce[0] = 123456789;
+    map_req.mapping_nonce[1] = 123456787;
+    map_req.mapping_nonce[2] = 123456782;
+    map_req.protocol = 17;
+    map_req.internal_port = 1234;
+    map_req.suggested_external_port = 4321;
+    map_req.suggested_external_ip = client_ip;
+
+    end = serialize_map_request (buffer, &map_req);
+    NP_ASSERT_EQUAL (end - buffer, MIN_MAP_PKT_LEN);
+
+    memset (&result, 0xFF, sizeof (result));
+    NP_ASSERT_PTR_EQUAL (deserialize_map_request_into (&result, buffer), end);
+    NP_ASSERT_TRUE (memcmp (&result, &map_req, sizeof (map_request)) == 0);
+}
+
+void
+test_deserialize_map_response_into (void)
+{
+    map_response map_resp = { { 0 } };
+    map_response result;
+    unsigned char buffer[MAX_PAYLOAD_LEN] = { '\0' };
+    unsigned char *end;
+    struct in6_addr external_ip = { { { 0x80, 0xfe, 0, 0, 0, 0, 0, 0,
+                                        0x20, 0x20, 0xff, 0x3b, 0x2e, 0xef, 0x38, 0x29 } } };
+
+    map_resp.header.version = PCP_VERSION;
+    map_resp.header.r_opcode = R_RESPONSE (MAP_OPCODE);
+    map_resp.header.result_code = NO_RESOURCES;
+    map_resp.header.lifetime = 30;
+    map_resp.header.epoch_time = 1000;
+    map_resp.mapping_nonce[0] = 123456789;
+    map_resp.mapping_nonce[1] = 123456787;
+    map_resp.mapping_nonce[2] = 123456782;
+    map_resp.protocol = 6;
+    map_resp.internal_port = 1234;
+    map_resp.assigned_external_port = 4321;
+    map_resp.assigned_external_ip = external_ip;
+
+    end = serialize_map_response (buffer, &map_resp);
+    NP_ASSERT_EQUAL (end - buffer, MIN_MAP_PKT_LEN);
+
+    memset (&result, 0xFF, sizeof (result));
+    NP_ASSERT_PTR_EQUAL (deserialize_map_response_into (&result, buffer), end);
+    NP_ASSERT_TRUE (memcmp (&result, &map_resp, sizeof (map_response)) == 0);
+}
+
+void
+test_serialize_peer_request (void)
+{
+    peer_request peer_req = { { 0 } };
+    peer_request result;
+    unsigned char buffer[MAX_PAYLOAD_LEN] = { '\0' };
+    unsigned char *end;
+    struct in6_addr remote_peer_ip = { { { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+                                           0, 0, 0, 0, 0, 0, 0, 0x01 } } };
+
+    peer_req.header.version = PCP_VERSION;
+    peer_req.header.r_opcode = R_REQUEST (PEER_OPCODE);
+    peer_req.header.requested_lifetime = 3600;
+    peer_req.mapping_nonce[0] = 123456789;
+    peer_req.protocol = 6;
+    peer_req.internal_port = 1234;
+    peer_req.suggested_external_port = 4321;
+    peer_req.remote_peer_port = 443;
+    peer_req.remote_peer_ip = remote_peer_ip;
+
+    end = serialize_peer_request (buffer, &peer_req);
+    NP_ASSERT_EQUAL (end - buffer, MIN_PEER_PKT_LEN);
+    NP_ASSERT_EQUAL ((buffer[MIN_MAP_PKT_LEN] << 8) + buffer[MIN_MAP_PKT_LEN + 1], 443);
+    NP_ASSERT_EQUAL (buffer[MIN_MAP_PKT_LEN + 4], 0x20);
+    NP_ASSERT_EQUAL (buffer[MIN_PEER_PKT_LEN - 1], 0x01);
+
+    memset (&result, 0xFF, sizeof (result));
+    NP_ASSERT_PTR_EQUAL (deserialize_peer_request_into (&result, buffer), end);
+    NP_ASSERT_TRUE (memcmp (&result, &peer_req, sizeof (peer_request)) == 0);
+}
+
+void
+test_serialize_peer_response (void)
+{
+    peer_response peer_resp = { { 0 } };
+    peer_response *result;
+    unsigned char buffer[MAX_PAYLOAD_LEN] = { '\0' };
+    unsigned char *end;
+    struct in6_addr remote_peer_ip = { { { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+                                           0, 0, 0, 0, 0, 0, 0, 0x01 } } };
+
+    peer_resp.header.version = PCP_VERSION;
+    peer_resp.header.r_opcode = R_RESPONSE (PEER_OPCODE);
+    peer_resp.header.lifetime = 3600;
+    peer_resp.header.epoch_time = 1000;
+    peer_resp.mapping_nonce[2] = 123456782;
+    peer_resp.protocol = 17;
+    peer_resp.internal_port = 1234;
+    peer_resp.assigned_external_port = 4321;
+    peer_resp.remote_peer_port = 53;
+    peer_resp.remote_peer_ip = remote_peer_ip;
+
+    end = serialize_peer_response (buffer, &peer_resp);
+    NP_ASSERT_EQUAL (end - buffer, MIN_PEER_PKT_LEN);
+    NP_ASSERT_EQUAL (buffer[1], R_RESPONSE (PEER_OPCODE));
+    NP_ASSERT_EQUAL ((buffer[MIN_MAP_PKT_LEN] << 8) + buffer[MIN_MAP_PKT_LEN + 1], 53);
+
+    result = deserialize_peer_response (buffer);
+    NP_ASSERT_NOT_NULL (result);
+    NP_ASSERT_TRUE (memcmp (result, &peer_resp, sizeof (peer_response)) == 0);
+    free (result);
+}
+
 void
 test_new_pcp_response_header (void)
 {
@@ -707,6 +831,78 @@ test_new_pcp_map_response (void)
     free (map_resp);
 }
 
+void
+test_init_pcp_map_response (void)
+{
+    map_request map_req = { { 0 } };
+    map_response map_resp;
+    map_response *expected;
+    struct in6_addr temp_ext_ip = { { { 0x80, 0xfe, 0, 0, 0, 0, 0, 0,
+                                        0x20, 0x20, 0xff, 0x3b, 0x2e, 0xef, 0x38, 0x29 } } };
+
+    map_req.header.version = PCP_VERSION;
+    map_req.header.r_opcode = R_REQUEST (MAP_OPCODE);
+    map_req.header.requested_lifetime = 5000;
+    map_req.mapping_nonce[0] = 123456789;
+    map_req.mapping_nonce[1] = 123456787;
+    map_req.mapping_nonce[2] = 123456782;
+    map_req.protocol = 6;
+    map_req.internal_port = 1234;
+    map_req.suggested_external_port = 4321;
+    map_req.suggested_external_ip = temp_ext_ip;
+
+    // Every field must be set, whatever was in the storage before
+    memset (&map_resp, 0xFF, sizeof (map_resp));
+    init_pcp_map_response (&map_resp, &map_req);
+
+    expected = new_pcp_map_response (&map_req);
+    NP_ASSERT_NOT_NULL (expected);
+    NP_ASSERT_TRUE (memcmp (&map_resp, expected, sizeof (map_response)) == 0);
+    NP_ASSERT_EQUAL (map_resp.header.r_opcode, R_RESPONSE (MAP_OPCODE));
+    NP_ASSERT_EQUAL (map_resp.header.lifetime, 5000);
+    NP_ASSERT_EQUAL (map_resp.assigned_external_port, 4321);
+
+    free (expected);
+}
+
+void
+test_init_pcp_peer_response (void)
+{
+    peer_request peer_req = { { 0 } };
+    peer_response peer_resp;
+    peer_response *expected;
+    struct in6_addr remote_peer_ip = { { { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+                                           0, 0, 0, 0, 0, 0, 0, 0x01 } } };
+
+    peer_req.header.version = PCP_VERSION;
+    peer_req.header.r_opcode = R_REQUEST (PEER_OPCODE);
+    peer_req.header.requested_lifetime = 5000;
+    peer_req.mapping_nonce[0] = 123456789;
+    peer_req.protocol = 6;
+    peer_req.internal_port = 1234;
+    peer_req.suggested_external_port = 4321;
+    peer_req.remote_peer_port = 443;
+    peer_req.reserved_3 = 0xFFFF;
+    peer_req.remote_peer_ip = remote_peer_ip;
+
+    // Every field must be set, whatever was in the storage before
+    memset (&peer_resp, 0xFF, sizeof (peer_resp));
+    init_pcp_peer_response (&peer_resp, &peer_req);
+
+    expected = new_pcp_peer_response (&peer_req);
+    NP_ASSERT_NOT_NULL (expected);
+    NP_ASSERT_TRUE (memcmp (&peer_resp, expected, sizeof (peer_response)) == 0);
+    NP_ASSERT_EQUAL (peer_resp.header.r_opcode, R_RESPONSE (PEER_OPCODE));
+    NP_ASSERT_EQUAL (peer_resp.header.lifetime, 5000);
+    NP_ASSERT_EQUAL (peer_resp.assigned_external_port, 4321);
+    NP_ASSERT_EQUAL (peer_resp.remote_peer_port, 443);
+    NP_ASSERT_EQUAL (peer_resp.reserved_3, 0);
+    NP_ASSERT_TRUE (memcmp (&peer_resp.remote_peer_ip, &remote_peer_ip,
+                            sizeof (struct in6_addr)) == 0);
+
+    free (expected);
+}
+
 void
 test_new_pcp_error_response (void)
 {
@@ -729,6 +925,46 @@ test_new_pcp_error_response (void)
     free (resp);
 }
 
+void
+test_init_pcp_error_response (void)
+{
+    pcp_response_header resp;
+
+    memset (&resp, 0xFF, sizeof (resp));
+    init_pcp_error_response (&resp, MAP_OPCODE, UNSUPP_VERSION, 1800);
+
+    // Test may fail if one second passes so check epoch time first to reduce chance of failing
+    NP_ASSERT_EQUAL (resp.epoch_time, (u_int32_t) time (NULL));
+
+    NP_ASSERT_EQUAL (resp.version, PCP_VERSION);
+    NP_ASSERT_EQUAL (resp.r_opcode, R_RESPONSE (MAP_OPCODE));
+    NP_ASSERT_EQUAL (resp.reserved, 0);
+    NP_ASSERT_EQUAL (resp.result_code, UNSUPP_VERSION);
+    NP_ASSERT_EQUAL (resp.lifetime, 1800);
+    NP_ASSERT_EQUAL (resp.reserved_array[0], 0);
+    NP_ASSERT_EQUAL (resp.reserved_array[1], 0);
+    NP_ASSERT_EQUAL (resp.reserved_array[2], 0);
+}
+
+void
+test_init_pcp_announce_response (void)
+{
+    pcp_response_header resp;
+
+    memset (&resp, 0xFF, sizeof (resp));
+    init_pcp_announce_response (&resp, 42);
+
+    NP_ASSERT_EQUAL (resp.version, PCP_VERSION);
+    NP_ASSERT_EQUAL (resp.r_opcode, R_RESPONSE (ANNOUNCE_OPCODE));
+    NP_ASSERT_EQUAL (resp.reserved, 0);
+    NP_ASSERT_EQUAL (resp.result_code, SUCCESS);
+    NP_ASSERT_EQUAL (resp.lifetime, 0);
+    NP_ASSERT_EQUAL (resp.epoch_time, 42);
+    NP_ASSERT_EQUAL (resp.reserved_array[0], 0);
+    NP_ASSERT_EQUAL (resp.reserved_array[1], 0);
+    NP_ASSERT_EQUAL (resp.reserved_array[2], 0);
+}
+
 void
 test_get_version (void)
 {
@@ -0,0 +1,168 @@
+/**
+ * @file pcp_announce_unit_tests.c
+ *
+ * Novaprova unit tests for the unsolicited ANNOUNCE burst.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "../pcpd/packets_pcp.h"
+#include "../pcpd/pcp_announce.h"
+
+/* A client listening on 127.0.0.1 */
+static int client_sock = -1;
+static u_int16_t client_port;
+static struct in6_addr client_ip;
+
+int
+set_up (void)
+{
+    struct timeval timeout = { 1, 0 };
+    struct sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+
+    client_sock = socket (AF_INET, SOCK_DGRAM, 0);
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    bind (client_sock, (struct sockaddr *) &addr, sizeof (addr));
+    getsockname (client_sock, (struct sockaddr *) &addr, &len);
+    setsockopt (client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+    client_port = ntohs (addr.sin_port);
+
+    inet_pton (AF_INET6, "::ffff:127.0.0.1", &client_ip);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    close (client_sock);
+    client_sock = -1;
+    return 0;
+}
+
+/* Open a server socket on any address and port */
+static int
+server_socket (int family)
+{
+    struct sockaddr_storage addr;
+    int zero = 0;
+    int sock = socket (family, SOCK_DGRAM, 0);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.ss_family = family;
+    if (family == AF_INET6)
+    {
+        setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof (zero));
+    }
+    bind (sock, (struct sockaddr *) &addr, sizeof (addr));
+    return sock;
+}
+
+static void
+check_received (u_int32_t epoch_time)
+{
+    unsigned char buf[MAX_PAYLOAD_LEN];
+
+    NP_ASSERT_EQUAL (recv (client_sock, buf, sizeof (buf), 0), MIN_ANNOUNCE_PKT_LEN);
+    NP_ASSERT_EQUAL (buf[0], PCP_VERSION);
+    NP_ASSERT_EQUAL (buf[1], R_RESPONSE (ANNOUNCE_OPCODE));
+    NP_ASSERT_EQUAL (buf[3], SUCCESS);
+    NP_ASSERT_EQUAL ((buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7], 0);
+    NP_ASSERT_EQUAL ((u_int32_t) ((buf[8] << 24) | (buf[9] << 16) | (buf[10] << 8) | buf[11]),
+                     epoch_time);
+}
+
+void
+test_interval_doubles (void)
+{
+    NP_ASSERT_EQUAL (pcp_announce_interval (0), PCP_ANNOUNCE_FIRST_INTERVAL_MS);
+    NP_ASSERT_EQUAL (pcp_announce_interval (1), 2 * PCP_ANNOUNCE_FIRST_INTERVAL_MS);
+    NP_ASSERT_EQUAL (pcp_announce_interval (3), 8 * PCP_ANNOUNCE_FIRST_INTERVAL_MS);
+    NP_ASSERT_EQUAL (pcp_announce_interval (-1), PCP_ANNOUNCE_FIRST_INTERVAL_MS);
+    NP_ASSERT_EQUAL (pcp_announce_interval (PCP_ANNOUNCE_ROUNDS + 5),
+                     pcp_announce_interval (PCP_ANNOUNCE_ROUNDS - 1));
+}
+
+void
+test_unique (void)
+{
+    struct in6_addr ips[5];
+
+    inet_pton (AF_INET6, "2001:db8::2", &ips[0]);
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ips[1]);
+    inet_pton (AF_INET6, "2001:db8::2", &ips[2]);
+    inet_pton (AF_INET6, "::ffff:192.168.1.3", &ips[3]);
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ips[4]);
+
+    NP_ASSERT_EQUAL (pcp_announce_unique (ips, 5), 3);
+    NP_ASSERT_TRUE (memcmp (&ips[0], &ips[1], sizeof (ips[0])) < 0);
+    NP_ASSERT_TRUE (memcmp (&ips[1], &ips[2], sizeof (ips[0])) < 0);
+    NP_ASSERT_EQUAL (pcp_announce_unique (ips, 1), 1);
+    NP_ASSERT_EQUAL (pcp_announce_unique (ips, 0), 0);
+}
+
+void
+test_send_dual_stack (void)
+{
+    int sock = server_socket (AF_INET6);
+
+    NP_ASSERT_TRUE (pcp_announce_send (sock, &client_ip, client_port, 7));
+    check_received (7);
+    close (sock);
+}
+
+void
+test_send_ipv4_only (void)
+{
+    struct in6_addr ipv6_client;
+    int sock = server_socket (AF_INET);
+
+    inet_pton (AF_INET6, "2001:db8::2", &ipv6_client);
+
+    NP_ASSERT_FALSE (pcp_announce_send (sock, &ipv6_client, client_port, 0));
+    NP_ASSERT_TRUE (pcp_announce_send (sock, &client_ip, client_port, 123456));
+    check_received (123456);
+    close (sock);
+}
+
+void
+test_start_stop (void)
+{
+    struct in6_addr *clients = calloc (2, sizeof (struct in6_addr));
+
+    /* Nothing is sent on an invalid socket, but the burst runs */
+    NP_ASSERT_TRUE (pcp_announce_start (-1, clients, 2, 10, 0));
+    NP_ASSERT_FALSE (pcp_announce_start (-1, NULL, 0, 10, 0));
+    pcp_announce_stop ();
+    pcp_announce_stop ();
+
+    NP_ASSERT_FALSE (pcp_announce_start (-1, NULL, 0, PCP_ANNOUNCE_MAX_RATE + 1, 0));
+    NP_ASSERT_TRUE (pcp_announce_start (-1, NULL, 0, 0, 0));
+    pcp_announce_stop ();
+}
@@ -0,0 +1,296 @@
+/**
+ * @file pcp_control_unit_tests.c
+ *
+ * Novaprova unit tests for the control socket commands.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/pcp_control.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_MAPPINGS 5
+
+/* Mappings 10, 20, ... 50. Odd IDs / 10 use UDP and even ones TCP. */
+static struct pcp_mapping_s table[NUM_MAPPINGS];
+static int expired_index;
+static pcp_control_filter last_filter;
+
+static char *output = NULL;
+static size_t size = 0;
+static FILE *out = NULL;
+
+static int
+fake_show (FILE *target)
+{
+    return fprintf (target, "PCP Config:\n");
+}
+
+static bool
+fake_lookup (bool external, struct in6_addr *ip, u_int16_t port, u_int8_t protocol,
+             struct pcp_mapping_s *mapping)
+{
+    int i;
+
+    for (i = 0; i < NUM_MAPPINGS; i++)
+    {
+        if (memcmp (ip, external ? &table[i].external_ip : &table[i].internal_ip,
+                    sizeof (*ip)) == 0 &&
+            port == (external ? table[i].external_port : table[i].internal_port) &&
+            protocol == table[i].protocol)
+        {
+            *mapping = table[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static int
+fake_list (const pcp_control_filter *filter, struct pcp_mapping_s *mappings, int max)
+{
+    int count = 0;
+    int i;
+
+    last_filter = *filter;
+    for (i = 0; i < NUM_MAPPINGS && count < max; i++)
+    {
+        if (table[i].index > filter->after && pcp_control_filter_match (filter, &table[i]))
+        {
+            mappings[count++] = table[i];
+        }
+    }
+    return count;
+}
+
+static bool
+fake_expire (int index)
+{
+    expired_index = index;
+    return index == 10;
+}
+
+static const pcp_control_ops ops = {
+    .show = fake_show,
+    .lookup = fake_lookup,
+    .list = fake_list,
+    .expire = fake_expire,
+};
+
+int
+set_up (void)
+{
+    int i;
+
+    memset (table, 0, sizeof (table));
+    for (i = 0; i < NUM_MAPPINGS; i++)
+    {
+        table[i].index = (i + 1) * 10;
+        inet_pton (AF_INET6, "::ffff:192.168.1.2", &table[i].internal_ip);
+        table[i].internal_port = 1000 + i;
+        inet_pton (AF_INET6, "::ffff:203.0.113.1", &table[i].external_ip);
+        table[i].external_port = 2000 + i;
+        table[i].protocol = (i % 2) ? 6 : 17;
+        table[i].opcode = 1;
+    }
+    inet_pton (AF_INET6, "2001:db8::1", &table[4].internal_ip);
+    expired_index = 0;
+
+    out = open_memstream (&output, &size);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    fclose (out);
+    free (output);
+    output = NULL;
+    return 0;
+}
+
+/* Run a command and return what it wrote */
+static const char *
+run (const char *command)
+{
+    char line[PCP_CONTROL_MAX_LINE];
+
+    strcpy (line, command);
+    rewind (out);
+    pcp_control_execute (&ops, line, out);
+    fputc ('\0', out);
+    fflush (out);
+    return output;
+}
+
+static int
+count_lines (const char *text, const char *prefix)
+{
+    int count = 0;
+
+    while (text && *text)
+    {
+        if (strncmp (text, prefix, strlen (prefix)) == 0)
+        {
+            count++;
+        }
+        text = strchr (text, '\n');
+        if (text)
+        {
+            text++;
+        }
+    }
+    return count;
+}
+
+void
+test_show (void)
+{
+    NP_ASSERT_STR_EQUAL (run ("show"), "PCP Config:\nOK\n");
+    NP_ASSERT_STR_EQUAL (run ("show all"), "ERROR usage: show\n");
+}
+
+void
+test_lookup (void)
+{
+    NP_ASSERT_NOT_NULL (strstr (run ("lookup internal 192.168.1.2 1001 tcp\n"), "\"id\":20,"));
+    NP_ASSERT_NOT_NULL (strstr (output, "\nOK\n"));
+    NP_ASSERT_NOT_NULL (strstr (run ("lookup external ::ffff:203.0.113.1 2000 udp"),
+                                "\"id\":10,"));
+    NP_ASSERT_NOT_NULL (strstr (run ("lookup internal 2001:db8::1 1004 17"), "\"id\":50,"));
+    NP_ASSERT_STR_EQUAL (run ("lookup internal 192.168.1.2 1001 udp"),
+                         "ERROR no such mapping\n");
+}
+
+void
+test_lookup_invalid (void)
+{
+    NP_ASSERT_STR_EQUAL (run ("lookup sideways 192.168.1.2 1001 tcp"),
+                         "ERROR usage: lookup internal|external IP PORT PROTOCOL\n");
+    NP_ASSERT_STR_EQUAL (run ("lookup internal 192.168.1 1001 tcp"),
+                         "ERROR invalid IP address\n");
+    NP_ASSERT_STR_EQUAL (run ("lookup internal 192.168.1.2 65536 tcp"),
+                         "ERROR invalid port\n");
+    NP_ASSERT_STR_EQUAL (run ("lookup internal 192.168.1.2 80x tcp"),
+                         "ERROR invalid port\n");
+    NP_ASSERT_STR_EQUAL (run ("lookup internal 192.168.1.2 1001 sctp"),
+                         "ERROR invalid protocol\n");
+    NP_ASSERT_STR_EQUAL (run ("lookup internal 192.168.1.2 1001"),
+                         "ERROR invalid protocol\n");
+}
+
+void
+test_list_all (void)
+{
+    run ("list");
+
+    NP_ASSERT_EQUAL (count_lines (output, "{\"type\":\"mapping\""), NUM_MAPPINGS);
+    NP_ASSERT_EQUAL (count_lines (output, "{\"type\":\"next\""), 0);
+    NP_ASSERT_EQUAL (count_lines (output, "OK"), 1);
+    NP_ASSERT_EQUAL (last_filter.protocol, -1);
+    NP_ASSERT_EQUAL (last_filter.after, 0);
+    NP_ASSERT_FALSE (last_filter.match_internal_ip);
+    NP_ASSERT_FALSE (last_filter.match_external_ip);
+}
+
+void
+test_list_pages (void)
+{
+    run ("list limit 2");
+    NP_ASSERT_EQUAL (count_lines (output, "{\"type\":\"mapping\""), 2);
+    NP_ASSERT_NOT_NULL (strstr (output, "{\"type\":\"next\",\"after\":20}\nOK\n"));
+
+    run ("list limit 2 after 20");
+    NP_ASSERT_NOT_NULL (strstr (output, "\"id\":30,"));
+    NP_ASSERT_NOT_NULL (strstr (output, "{\"type\":\"next\",\"after\":40}\n"));
+
+    run ("list limit 2 after 40");
+    NP_ASSERT_EQUAL (count_lines (output, "{\"type\":\"mapping\""), 1);
+    NP_ASSERT_EQUAL (count_lines (output, "{\"type\":\"next\""), 0);
+}
+
+void
+test_list_filters (void)
+{
+    run ("list protocol tcp");
+    NP_ASSERT_EQUAL (count_lines (output, "{\"type\":\"mapping\""), 2);
+    NP_ASSERT_EQUAL (last_filter.protocol, 6);
+
+    run ("list internal-ip 192.168.1.2 protocol udp");
+    NP_ASSERT_EQUAL (count_lines (output, "{\"type\":\"mapping\""), 2);
+    NP_ASSERT_TRUE (last_filter.match_internal_ip);
+
+    run ("list external-ip 203.0.113.2");
+    NP_ASSERT_STR_EQUAL (output, "OK\n");
+    NP_ASSERT_TRUE (last_filter.match_external_ip);
+}
+
+void
+test_list_invalid (void)
+{
+    NP_ASSERT_STR_EQUAL (run ("list limit 0"), "ERROR invalid limit\n");
+    NP_ASSERT_STR_EQUAL (run ("list limit 1001"), "ERROR invalid limit\n");
+    NP_ASSERT_STR_EQUAL (run ("list after -1"), "ERROR invalid mapping ID\n");
+    NP_ASSERT_STR_EQUAL (run ("list internal-ip"), "ERROR invalid IP address\n");
+    NP_ASSERT_STR_EQUAL (run ("list protocol"), "ERROR invalid protocol\n");
+    NP_ASSERT_NOT_NULL (strstr (run ("list everything"), "ERROR usage: list"));
+}
+
+void
+test_expire (void)
+{
+    NP_ASSERT_STR_EQUAL (run ("expire 10"), "OK\n");
+    NP_ASSERT_EQUAL (expired_index, 10);
+    NP_ASSERT_STR_EQUAL (run ("expire 15"),
+                         "ERROR no such mapping, or it could not be removed\n");
+    NP_ASSERT_STR_EQUAL (run ("expire"), "ERROR usage: expire ID\n");
+    NP_ASSERT_STR_EQUAL (run ("expire 10 20"), "ERROR usage: expire ID\n");
+}
+
+void
+test_unknown_commands (void)
+{
+    NP_ASSERT_STR_EQUAL (run (""), "ERROR empty command\n");
+    NP_ASSERT_STR_EQUAL (run ("  \r\n"), "ERROR empty command\n");
+    NP_ASSERT_STR_EQUAL (run ("dump"), "ERROR unknown command, try help\n");
+    NP_ASSERT_NOT_NULL (strstr (run ("help"), "expire ID\nOK\n"));
+}
+
+void
+test_filter_match (void)
+{
+    pcp_control_filter filter;
+
+    memset (&filter, 0, sizeof (filter));
+    filter.protocol = -1;
+    NP_ASSERT_TRUE (pcp_control_filter_match (&filter, &table[0]));
+
+    filter.protocol = 6;
+    NP_ASSERT_FALSE (pcp_control_filter_match (&filter, &table[0]));
+    NP_ASSERT_TRUE (pcp_control_filter_match (&filter, &table[1]));
+
+    filter.match_internal_ip = true;
+    inet_pton (AF_INET6, "2001:db8::1", &filter.internal_ip);
+    NP_ASSERT_FALSE (pcp_control_filter_match (&filter, &table[1]));
+    filter.protocol = -1;
+    NP_ASSERT_TRUE (pcp_control_filter_match (&filter, &table[4]));
+}
@@ -0,0 +1,188 @@
+/**
+ * @file pcp_export_unit_tests.c
+ *
+ * Novaprova unit tests for the machine-readable state output.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/pcp_export.h"
+#include "../pcpd/packets_pcp.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct pcp_mapping_s mapping;
+static char *output = NULL;
+static size_t size = 0;
+static FILE *target = NULL;
+
+int
+set_up (void)
+{
+    memset (&mapping, 0, sizeof (mapping));
+    mapping.index = 10;
+    mapping.mapping_nonce[0] = 1;
+    mapping.mapping_nonce[1] = 2;
+    mapping.mapping_nonce[2] = 3;
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &mapping.internal_ip);
+    mapping.internal_port = 5000;
+    inet_pton (AF_INET6, "::ffff:203.0.113.1", &mapping.external_ip);
+    mapping.external_port = 6000;
+    mapping.lifetime = 600;
+    mapping.start_of_life = 1000000;
+    mapping.end_of_life = 1000600;
+    mapping.opcode = MAP_OPCODE;
+    mapping.protocol = 17;
+
+    target = open_memstream (&output, &size);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    if (target)
+        fclose (target);
+    target = NULL;
+    free (output);
+    output = NULL;
+    return 0;
+}
+
+void
+test_format_names (void)
+{
+    pcp_export_format format = PCP_EXPORT_TEXT;
+
+    NP_ASSERT_TRUE (pcp_export_format_parse ("json", &format));
+    NP_ASSERT_EQUAL (format, PCP_EXPORT_JSON);
+    NP_ASSERT_TRUE (pcp_export_format_parse ("binary", &format));
+    NP_ASSERT_EQUAL (format, PCP_EXPORT_BINARY);
+    NP_ASSERT_TRUE (pcp_export_format_parse ("text", &format));
+    NP_ASSERT_EQUAL (format, PCP_EXPORT_TEXT);
+    NP_ASSERT_FALSE (pcp_export_format_parse ("xml", &format));
+    NP_ASSERT_EQUAL (format, PCP_EXPORT_TEXT);
+    NP_ASSERT_STR_EQUAL (pcp_export_format_name (PCP_EXPORT_BINARY), "binary");
+}
+
+void
+test_json (void)
+{
+    pcp_export_header header = { 1000100, 999000, 1 };
+
+    NP_ASSERT_TRUE (pcp_export_write_header (target, PCP_EXPORT_JSON, &header) > 0);
+    NP_ASSERT_TRUE (pcp_export_write_mapping (target, PCP_EXPORT_JSON, &mapping) > 0);
+    fflush (target);
+
+    NP_ASSERT_STR_EQUAL (output,
+                         "{\"type\":\"header\",\"version\":2,\"time\":1000100,"
+                         "\"startup_time\":999000,\"mappings\":1}\n"
+                         "{\"type\":\"mapping\",\"id\":10,\"opcode\":\"MAP\","
+                         "\"nonce\":[1,2,3],\"protocol\":17,"
+                         "\"internal_ip\":\"::ffff:192.168.1.2\",\"internal_port\":5000,"
+                         "\"external_ip\":\"::ffff:203.0.113.1\",\"external_port\":6000,"
+                         "\"lifetime\":600,\"start_of_life\":1000000,\"end_of_life\":1000600}\n");
+}
+
+void
+test_json_peer (void)
+{
+    mapping.opcode = PEER_OPCODE;
+    inet_pton (AF_INET6, "::ffff:198.51.100.1", &mapping.remote_peer_ip);
+    mapping.remote_peer_port = 443;
+
+    NP_ASSERT_TRUE (pcp_export_write_mapping (target, PCP_EXPORT_JSON, &mapping) > 0);
+    fflush (target);
+
+    NP_ASSERT_NOT_NULL (strstr (output, "\"opcode\":\"PEER\""));
+    NP_ASSERT_NOT_NULL (strstr (output, "\"end_of_life\":1000600,"
+                                "\"remote_peer_ip\":\"::ffff:198.51.100.1\","
+                                "\"remote_peer_port\":443}\n"));
+}
+
+void
+test_binary (void)
+{
+    pcp_export_header header = { 1000100, 999000, 2 };
+    unsigned char expected_header[PCP_EXPORT_HEADER_SIZE] = {
+        0x50, 0x43, 0x50, 0x53, 0x00, 0x02, 0x00, PCP_EXPORT_RECORD_SIZE,
+        0x00, 0x0f, 0x42, 0xa4, 0x00, 0x0f, 0x3e, 0x58,
+        0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    };
+    unsigned char zero[20] = { 0 };
+    unsigned char *record;
+
+    NP_ASSERT_EQUAL (pcp_export_write_header (target, PCP_EXPORT_BINARY, &header),
+                     PCP_EXPORT_HEADER_SIZE);
+    NP_ASSERT_EQUAL (pcp_export_write_mapping (target, PCP_EXPORT_BINARY, &mapping),
+                     PCP_EXPORT_RECORD_SIZE);
+    mapping.index = 20;
+    NP_ASSERT_EQUAL (pcp_export_write_mapping (target, PCP_EXPORT_BINARY, &mapping),
+                     PCP_EXPORT_RECORD_SIZE);
+    fflush (target);
+
+    NP_ASSERT_EQUAL (size, PCP_EXPORT_HEADER_SIZE + 2 * PCP_EXPORT_RECORD_SIZE);
+    NP_ASSERT_EQUAL (memcmp (output, expected_header, PCP_EXPORT_HEADER_SIZE), 0);
+
+    record = (unsigned char *) output + PCP_EXPORT_HEADER_SIZE;
+    NP_ASSERT_EQUAL (record[3], 10);
+    NP_ASSERT_EQUAL (record[15], 3);
+    NP_ASSERT_EQUAL (memcmp (record + 16, &mapping.internal_ip, 16), 0);
+    NP_ASSERT_EQUAL (memcmp (record + 32, &mapping.external_ip, 16), 0);
+    NP_ASSERT_EQUAL ((record[48] << 8) | record[49], 5000);
+    NP_ASSERT_EQUAL ((record[50] << 8) | record[51], 6000);
+    NP_ASSERT_EQUAL ((record[54] << 8) | record[55], 600);
+    NP_ASSERT_EQUAL (record[64], MAP_OPCODE);
+    NP_ASSERT_EQUAL (record[65], 17);
+    NP_ASSERT_EQUAL (memcmp (record + 68, zero, 20), 0);
+
+    record += PCP_EXPORT_RECORD_SIZE;
+    NP_ASSERT_EQUAL (record[3], 20);
+}
+
+void
+test_binary_peer (void)
+{
+    unsigned char *record;
+
+    mapping.opcode = PEER_OPCODE;
+    inet_pton (AF_INET6, "::ffff:198.51.100.1", &mapping.remote_peer_ip);
+    mapping.remote_peer_port = 443;
+    NP_ASSERT_EQUAL (pcp_export_write_mapping (target, PCP_EXPORT_BINARY, &mapping),
+                     PCP_EXPORT_RECORD_SIZE);
+    fflush (target);
+
+    NP_ASSERT_EQUAL (size, PCP_EXPORT_RECORD_SIZE);
+    record = (unsigned char *) output;
+    NP_ASSERT_EQUAL (record[64], PEER_OPCODE);
+    NP_ASSERT_EQUAL (memcmp (record + 68, &mapping.remote_peer_ip, 16), 0);
+    NP_ASSERT_EQUAL ((record[84] << 8) | record[85], 443);
+    NP_ASSERT_EQUAL ((record[86] << 8) | record[87], 0);
+}
+
+void
+test_text_is_not_exported (void)
+{
+    pcp_export_header header = { 0, 0, 0 };
+
+    NP_ASSERT_TRUE (pcp_export_write_header (target, PCP_EXPORT_TEXT, &header) < 0);
+    NP_ASSERT_TRUE (pcp_export_write_mapping (target, PCP_EXPORT_TEXT, &mapping) < 0);
+}
@@ -0,0 +1,399 @@
+/**
+ * @file pcp_iptables_unit_tests.c
+ *
+ * Novaprova unit tests for passing mappings of each address family to the
+ * forwarding backend.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include "../pcpd/pcp_iptables.h"
+#include "../pcpd/pcp_metrics.h"
+
+/* The last call made to the fake backend */
+static int writes;
+static int removes;
+static int writes6;
+static int removes6;
+static int last_index;
+static char last_internal[INET6_ADDRSTRLEN];
+static char last_external[INET6_ADDRSTRLEN];
+static u_int16_t last_internal_port;
+static u_int16_t last_external_port;
+
+/* Writes reported as failed by pcp_fw_defer_end */
+static int failed_writes;
+static int failed_tag;
+static int failed_index;
+
+/* Directory holding the fake iptables tools, and the PATH before it was added */
+static char fake_dir[] = "/tmp/pcp_iptables_XXXXXX";
+static char *saved_path;
+
+static struct in6_addr ipv4_internal;
+static struct in6_addr ipv4_external;
+static struct in6_addr ipv6_internal;
+static struct in6_addr ipv6_external;
+
+static bool
+fake_init (void)
+{
+    return true;
+}
+
+static void
+fake_deinit (void)
+{
+}
+
+static bool
+fake_write (int index, struct in_addr *internal_ip, struct in_addr *external_ip,
+            u_int16_t internal_port, u_int16_t external_port, u_int16_t protocol)
+{
+    writes++;
+    last_index = index;
+    inet_ntop (AF_INET, internal_ip, last_internal, sizeof (last_internal));
+    inet_ntop (AF_INET, external_ip, last_external, sizeof (last_external));
+    last_internal_port = internal_port;
+    last_external_port = external_port;
+    return true;
+}
+
+static bool
+fake_remove (int index)
+{
+    removes++;
+    last_index = index;
+    return true;
+}
+
+static bool
+fake_write6 (int index, struct in6_addr *internal_ip, struct in6_addr *external_ip,
+             u_int16_t internal_port, u_int16_t external_port, u_int16_t protocol)
+{
+    writes6++;
+    last_index = index;
+    inet_ntop (AF_INET6, internal_ip, last_internal, sizeof (last_internal));
+    inet_ntop (AF_INET6, external_ip, last_external, sizeof (last_external));
+    last_internal_port = internal_port;
+    last_external_port = external_port;
+    return true;
+}
+
+static bool
+fake_remove6 (int index)
+{
+    removes6++;
+    last_index = index;
+    return true;
+}
+
+static const pcp_fw_backend dual_stack_backend = {
+    .name = "dual-stack",
+    .init = fake_init,
+    .deinit = fake_deinit,
+    .write = fake_write,
+    .remove = fake_remove,
+    .write6 = fake_write6,
+    .remove6 = fake_remove6,
+};
+
+static const pcp_fw_backend ipv4_backend = {
+    .name = "ipv4",
+    .init = fake_init,
+    .deinit = fake_deinit,
+    .write = fake_write,
+    .remove = fake_remove,
+};
+
+int
+set_up (void)
+{
+    writes = removes = writes6 = removes6 = 0;
+    failed_writes = 0;
+    last_index = -1;
+    memset (last_internal, 0, sizeof (last_internal));
+    memset (last_external, 0, sizeof (last_external));
+
+    inet_pton (AF_INET6, "::ffff:192.168.1.2", &ipv4_internal);
+    inet_pton (AF_INET6, "::ffff:203.0.113.1", &ipv4_external);
+    inet_pton (AF_INET6, "2001:db8::2", &ipv6_internal);
+    inet_pton (AF_INET6, "2001:db8:1::2", &ipv6_external);
+
+    pcp_metrics_init (false);
+    pcp_fw_backend_set (&dual_stack_backend);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    pcp_metrics_deinit ();
+    return 0;
+}
+
+void
+test_ipv4_mapping (void)
+{
+    NP_ASSERT_TRUE (write_pcp_port_forwarding_chain (10, &ipv4_internal, &ipv4_external,
+                                                     5000, 6000, 17));
+    NP_ASSERT_EQUAL (writes, 1);
+    NP_ASSERT_EQUAL (writes6, 0);
+    NP_ASSERT_EQUAL (last_index, 10);
+    NP_ASSERT_STR_EQUAL (last_internal, "192.168.1.2");
+    NP_ASSERT_STR_EQUAL (last_external, "203.0.113.1");
+    NP_ASSERT_EQUAL (last_internal_port, 5000);
+    NP_ASSERT_EQUAL (last_external_port, 6000);
+
+    NP_ASSERT_TRUE (remove_pcp_port_forwarding_chain (10, &ipv4_internal));
+    NP_ASSERT_EQUAL (removes, 1);
+    NP_ASSERT_EQUAL (removes6, 0);
+}
+
+void
+test_ipv6_mapping (void)
+{
+    NP_ASSERT_TRUE (pcp_fw_backend_ipv6 ());
+    NP_ASSERT_TRUE (write_pcp_port_forwarding_chain (20, &ipv6_internal, &ipv6_external,
+                                                     5000, 6000, 6));
+    NP_ASSERT_EQUAL (writes, 0);
+    NP_ASSERT_EQUAL (writes6, 1);
+    NP_ASSERT_EQUAL (last_index, 20);
+    NP_ASSERT_STR_EQUAL (last_internal, "2001:db8::2");
+    NP_ASSERT_STR_EQUAL (last_external, "2001:db8:1::2");
+
+    NP_ASSERT_TRUE (remove_pcp_port_forwarding_chain (20, &ipv6_internal));
+    NP_ASSERT_EQUAL (removes, 0);
+    NP_ASSERT_EQUAL (removes6, 1);
+}
+
+void
+test_mixed_families (void)
+{
+    NP_ASSERT_FALSE (write_pcp_port_forwarding_chain (30, &ipv4_internal, &ipv6_external,
+                                                      5000, 6000, 17));
+    NP_ASSERT_FALSE (write_pcp_port_forwarding_chain (30, &ipv6_internal, &ipv4_external,
+                                                      5000, 6000, 17));
+    NP_ASSERT_EQUAL (writes + writes6, 0);
+}
+
+void
+test_ipv4_only_backend (void)
+{
+    pcp_fw_backend_set (&ipv4_backend);
+
+    NP_ASSERT_FALSE (pcp_fw_backend_ipv6 ());
+    NP_ASSERT_FALSE (write_pcp_port_forwarding_chain (40, &ipv6_internal, &ipv6_external,
+                                                      5000, 6000, 17));
+    NP_ASSERT_FALSE (remove_pcp_port_forwarding_chain (40, &ipv6_internal));
+    NP_ASSERT_TRUE (write_pcp_port_forwarding_chain (40, &ipv4_internal, &ipv4_external,
+                                                     5000, 6000, 17));
+    NP_ASSERT_EQUAL (writes, 1);
+}
+
+void
+test_calls_are_counted (void)
+{
+    pcp_metrics_totals totals;
+
+    pcp_metrics_thread_init (0);
+    write_pcp_port_forwarding_chain (50, &ipv4_internal, &ipv4_external, 5000, 6000, 17);
+    write_pcp_port_forwarding_chain (60, &ipv6_internal, &ipv6_external, 5000, 6000, 17);
+    remove_pcp_port_forwarding_chain (60, &ipv6_internal);
+
+    pcp_metrics_snapshot (NULL, &totals);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_FW_CALLS], 3);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_FW_FAILURES], 0);
+}
+
+/* Write a fake tool to the fake tools directory */
+static void
+write_fake_tool (const char *name, const char *script)
+{
+    char path[sizeof (fake_dir) + 32];
+    FILE *file;
+
+    snprintf (path, sizeof (path), "%s/%s", fake_dir, name);
+    file = fopen (path, "w");
+    NP_ASSERT_NOT_NULL (file);
+    fputs (script, file);
+    fclose (file);
+    NP_ASSERT_EQUAL (chmod (path, 0755), 0);
+}
+
+/* Start the iptables-restore backend with fake tools. The fake restore
+ * commands count the transactions and reject any that programs rule 13. */
+static void
+start_fake_restore_backend (void)
+{
+    const char *restore =
+        "#!/bin/sh\n"
+        "rules=$(cat)\n"
+        "echo >> \"$(dirname \"$0\")/transactions\"\n"
+        "case \"$rules\" in *\"PCP_NAT_PREROUTE_RULE_13 \"*) exit 1;; esac\n"
+        "exit 0\n";
+    char path[PATH_MAX];
+
+    NP_ASSERT_NOT_NULL (mkdtemp (fake_dir));
+    write_fake_tool ("iptables", "#!/bin/sh\nexit 0\n");
+    write_fake_tool ("ip6tables", "#!/bin/sh\nexit 0\n");
+    write_fake_tool ("iptables-restore", restore);
+    write_fake_tool ("ip6tables-restore", restore);
+
+    saved_path = strdup (getenv ("PATH"));
+    snprintf (path, sizeof (path), "%s:%s", fake_dir, saved_path);
+    setenv ("PATH", path, 1);
+
+    pcp_fw_backend_set (&pcp_iptables_restore_backend);
+    pcp_iptables_init ();
+    NP_ASSERT_PTR_EQUAL (pcp_fw_backend_get (), &pcp_iptables_restore_backend);
+}
+
+/* Count the transactions since the last call, and reset the count */
+static int
+fake_restore_transactions (void)
+{
+    char path[sizeof (fake_dir) + 32];
+    FILE *file;
+    int count = 0;
+
+    snprintf (path, sizeof (path), "%s/transactions", fake_dir);
+    file = fopen (path, "r");
+    if (file)
+    {
+        while (fgetc (file) == '\n')
+        {
+            count++;
+        }
+        fclose (file);
+        unlink (path);
+    }
+    return count;
+}
+
+static void
+stop_fake_restore_backend (void)
+{
+    const char *tools[] = { "iptables", "ip6tables", "iptables-restore",
+                            "ip6tables-restore", "transactions" };
+    char path[sizeof (fake_dir) + 32];
+    int i;
+
+    pcp_iptables_deinit ();
+    setenv ("PATH", saved_path, 1);
+    free (saved_path);
+
+    for (i = 0; i < sizeof (tools) / sizeof (tools[0]); i++)
+    {
+        snprintf (path, sizeof (path), "%s/%s", fake_dir, tools[i]);
+        unlink (path);
+    }
+    rmdir (fake_dir);
+    strcpy (fake_dir, "/tmp/pcp_iptables_XXXXXX");
+}
+
+static void
+record_failed_write (int tag, int index, void *data)
+{
+    failed_writes++;
+    failed_tag = tag;
+    failed_index = index;
+}
+
+void
+test_deferred_writes_are_one_transaction (void)
+{
+    pcp_metrics_totals totals;
+    int i;
+
+    pcp_metrics_thread_init (0);
+    start_fake_restore_backend ();
+    fake_restore_transactions ();
+
+    pcp_fw_defer_begin ();
+    for (i = 0; i < 100; i++)
+    {
+        pcp_fw_defer_tag (i);
+        NP_ASSERT_TRUE (write_pcp_port_forwarding_chain (100 + i, &ipv4_internal,
+                                                         &ipv4_external, 5000 + i,
+                                                         6000 + i, 17));
+    }
+    pcp_fw_defer_end (record_failed_write, NULL);
+
+    NP_ASSERT_EQUAL (fake_restore_transactions (), 1);
+    NP_ASSERT_EQUAL (failed_writes, 0);
+    pcp_metrics_snapshot (NULL, &totals);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_FW_CALLS], 100);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_FW_FAILURES], 0);
+
+    stop_fake_restore_backend ();
+}
+
+void
+test_failed_transaction_fails_only_bad_write (void)
+{
+    pcp_metrics_totals totals;
+    int i;
+
+    pcp_metrics_thread_init (0);
+    start_fake_restore_backend ();
+    fake_restore_transactions ();
+
+    /* Rule 13 is rejected, so the batch fails and each write is retried */
+    pcp_fw_defer_begin ();
+    for (i = 0; i < 10; i++)
+    {
+        pcp_fw_defer_tag (i);
+        NP_ASSERT_TRUE (write_pcp_port_forwarding_chain (10 + i, &ipv4_internal,
+                                                         &ipv4_external, 5000 + i,
+                                                         6000 + i, 17));
+    }
+    pcp_fw_defer_end (record_failed_write, NULL);
+
+    NP_ASSERT_EQUAL (fake_restore_transactions (), 1 + 10);
+    NP_ASSERT_EQUAL (failed_writes, 1);
+    NP_ASSERT_EQUAL (failed_tag, 3);
+    NP_ASSERT_EQUAL (failed_index, 13);
+    pcp_metrics_snapshot (NULL, &totals);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_FW_CALLS], 10);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_FW_FAILURES], 1);
+
+    stop_fake_restore_backend ();
+}
+
+void
+test_convert_ipv6_to_ipv4 (void)
+{
+    struct in_addr ip = convert_ipv6_to_ipv4 (&ipv4_internal);
+    char ip_str[INET_ADDRSTRLEN];
+
+    NP_ASSERT_TRUE (is_ipv4_mapped_ipv6_addr (&ipv4_internal));
+    NP_ASSERT_FALSE (is_ipv4_mapped_ipv6_addr (&ipv6_internal));
+    NP_ASSERT_STR_EQUAL (inet_ntop (AF_INET, &ip, ip_str, sizeof (ip_str)), "192.168.1.2");
+}
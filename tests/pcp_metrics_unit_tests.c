@@ -0,0 +1,172 @@
+/**
+ * @file pcp_metrics_unit_tests.c
+ *
+ * Novaprova unit tests for the runtime metrics.
+ *
+ * Copyright 2015 Allied Telesis Labs, New Zealand
+ *
+ * This file is part of pcpd.
+ *
+ * pcpd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pcpd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pcpd.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <np.h> /* NovaProva library */
+#include "../pcpd/pcp_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+static pcp_metrics_totals totals;
+
+int
+set_up (void)
+{
+    pcp_metrics_init (false);
+    pcp_metrics_thread_init (0);
+    return 0;
+}
+
+int
+tear_down (void)
+{
+    pcp_metrics_deinit ();
+    return 0;
+}
+
+void
+test_counters_start_at_zero (void)
+{
+    int i;
+
+    pcp_metrics_snapshot (NULL, &totals);
+    for (i = 0; i < PCP_METRIC_MAX; i++)
+    {
+        NP_ASSERT_EQUAL (totals.counters[i], 0);
+    }
+    NP_ASSERT_NOT_EQUAL (totals.start_time, 0);
+}
+
+void
+test_shards_are_summed (void)
+{
+    pcp_metrics_inc (PCP_METRIC_PACKETS_RECEIVED);
+    pcp_metrics_thread_init (1);
+    pcp_metrics_add (PCP_METRIC_PACKETS_RECEIVED, 2);
+    pcp_metrics_thread_init (PCP_METRICS_SHARDS - 1);
+    pcp_metrics_add (PCP_METRIC_PACKETS_RECEIVED, 3);
+    pcp_metrics_inc (PCP_METRIC_RESPONSES + NO_RESOURCES);
+
+    pcp_metrics_snapshot (NULL, &totals);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_PACKETS_RECEIVED], 6);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_RESPONSES + NO_RESOURCES], 1);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_RESPONSES], 0);
+}
+
+void
+test_invalid_shard_uses_shared_shard (void)
+{
+    pcp_metrics_thread_init (PCP_METRICS_SHARDS);
+    pcp_metrics_inc (PCP_METRIC_MAPPINGS_CREATED);
+    pcp_metrics_thread_init (-1);
+    pcp_metrics_inc (PCP_METRIC_MAPPINGS_CREATED);
+
+    NP_ASSERT_EQUAL (pcp_metrics->shards[0].counters[PCP_METRIC_MAPPINGS_CREATED], 2);
+}
+
+void
+test_init_clears_counters (void)
+{
+    pcp_metrics_inc (PCP_METRIC_MAPPINGS_EXPIRED);
+    pcp_metrics_init (false);
+
+    pcp_metrics_snapshot (NULL, &totals);
+    NP_ASSERT_EQUAL (totals.counters[PCP_METRIC_MAPPINGS_EXPIRED], 0);
+}
+
+void
+test_histogram_buckets (void)
+{
+    pcp_histogram *h;
+
+    pcp_metrics_observe (PCP_HISTOGRAM_REQUEST, 0);
+    pcp_metrics_observe (PCP_HISTOGRAM_REQUEST, 1);
+    pcp_metrics_observe (PCP_HISTOGRAM_REQUEST, 1000);
+    pcp_metrics_observe (PCP_HISTOGRAM_REQUEST, 1023);
+    pcp_metrics_observe (PCP_HISTOGRAM_REQUEST, 1024);
+    pcp_metrics_observe (PCP_HISTOGRAM_REQUEST, ~0ULL);
+
+    pcp_metrics_snapshot (NULL, &totals);
+    h = &totals.histograms[PCP_HISTOGRAM_REQUEST];
+    NP_ASSERT_EQUAL (h->count, 6);
+    NP_ASSERT_EQUAL (h->buckets[0], 1);
+    NP_ASSERT_EQUAL (h->buckets[1], 1);
+    NP_ASSERT_EQUAL (h->buckets[10], 2);
+    NP_ASSERT_EQUAL (h->buckets[11], 1);
+    NP_ASSERT_EQUAL (h->buckets[PCP_HISTOGRAM_BUCKETS - 1], 1);
+    NP_ASSERT_EQUAL (totals.histograms[PCP_HISTOGRAM_FW_COMMIT].count, 0);
+}
+
+void
+test_histogram_percentile (void)
+{
+    pcp_histogram *h;
+    int i;
+
+    for (i = 0; i < 99; i++)
+    {
+        pcp_metrics_observe (PCP_HISTOGRAM_FW_COMMIT, 100);
+    }
+    pcp_metrics_observe (PCP_HISTOGRAM_FW_COMMIT, 5000);
+
+    pcp_metrics_snapshot (NULL, &totals);
+    h = &totals.histograms[PCP_HISTOGRAM_FW_COMMIT];
+    NP_ASSERT_EQUAL (h->sum_ns, 99 * 100 + 5000);
+    NP_ASSERT_EQUAL (pcp_histogram_percentile (h, 50), 127);
+    NP_ASSERT_EQUAL (pcp_histogram_percentile (h, 99), 127);
+    NP_ASSERT_EQUAL (pcp_histogram_percentile (h, 100), 8191);
+    NP_ASSERT_EQUAL (pcp_histogram_percentile (&totals.histograms[PCP_HISTOGRAM_EXPIRY_SWEEP],
+                                               50), 0);
+}
+
+void
+test_names (void)
+{
+    NP_ASSERT_STR_EQUAL (pcp_metric_name (PCP_METRIC_PACKETS_RECEIVED), "Packets received");
+    NP_ASSERT_STR_EQUAL (pcp_metric_name (PCP_METRIC_RESPONSES + MALFORMED_REQUEST),
+                         "Responses MALFORMED_REQUEST");
+    NP_ASSERT_STR_EQUAL (pcp_metric_name (PCP_METRIC_MAX), "Unknown");
+    NP_ASSERT_STR_EQUAL (pcp_histogram_name (PCP_HISTOGRAM_EXPIRY_SWEEP), "Expiry sweep");
+}
+
+void
+test_print (void)
+{
+    char *output = NULL;
+    size_t size = 0;
+    FILE *target;
+
+    pcp_metrics_add (PCP_METRIC_PACKETS_RECEIVED, 42);
+    pcp_metrics_inc (PCP_METRIC_RESPONSES + UNSUPP_OPCODE);
+    pcp_metrics_snapshot (NULL, &totals);
+
+    target = open_memstream (&output, &size);
+    NP_ASSERT_TRUE (pcp_metrics_print (target, &totals) >= 0);
+    fclose (target);
+
+    NP_ASSERT_NOT_NULL (strstr (output, "Packets received                    : 42\n"));
+    NP_ASSERT_NOT_NULL (strstr (output, "Responses SUCCESS"));
+    NP_ASSERT_NOT_NULL (strstr (output, "Responses UNSUPP_OPCODE             : 1\n"));
+    NP_ASSERT_NULL (strstr (output, "Responses NO_RESOURCES"));
+    free (output);
+}